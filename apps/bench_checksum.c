@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <crc32c.h>
+#include <disk.h>
+#include <fs.h>
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Size of the file read */
+#define FILE_SIZE (1024 * BLOCK_SIZE)
+/* Size of each read */
+#define READ_SIZE (16 * BLOCK_SIZE)
+/* Number of times the whole file is read in each round */
+#define PASSES 64
+/* Number of rounds with and without checksums, keeping the best of each */
+#define ROUNDS 5
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Read the whole file @passes times, and return the read rate in MB/s */
+static double read_rate(int fd, char *buf, int passes)
+{
+	double start = now();
+	size_t offset;
+	int i, ret;
+
+	for (i = 0; i < passes; i++) {
+		for (offset = 0; offset < FILE_SIZE; offset += READ_SIZE) {
+			ret = fs_pread(fd, buf, READ_SIZE, offset);
+			if (ret != READ_SIZE)
+				die("short read at offset %zu (%d)", offset, ret);
+		}
+	}
+	return (double)passes * FILE_SIZE / (now() - start) / (1024 * 1024);
+}
+
+/*
+ * Measure the read rates of the file with checksums enabled or not, on the
+ * first pass from a fresh mount and on later ones
+ */
+static void measure(const char *diskname, int checksums, char *buf,
+		    double *first, double *steady)
+{
+	double rate;
+	int fd;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	if (fs_checksum(checksums))
+		die("Cannot change checksum setting");
+	if (fs_umount() || fs_mount(diskname))
+		die("Cannot remount diskname");
+
+	fd = fs_open("bench_crc");
+	if (fd < 0)
+		die("Cannot open file 'bench_crc'");
+	rate = read_rate(fd, buf, 1);
+	if (rate > *first)
+		*first = rate;
+	rate = read_rate(fd, buf, PASSES);
+	if (rate > *steady)
+		*steady = rate;
+	fs_close(fd);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+/* Checksum rate of a single block, in MB/s */
+static double crc_rate(const char *buf)
+{
+	double start = now();
+	uint32_t crc = 0;
+	int i;
+
+	for (i = 0; i < PASSES * (FILE_SIZE / BLOCK_SIZE); i++)
+		crc ^= crc32c(0, buf, BLOCK_SIZE);
+	if (crc == 1)
+		printf("\n");
+	return (double)PASSES * FILE_SIZE / (now() - start) / (1024 * 1024);
+}
+
+/*
+ * Compare the fs_pread() throughput of a file with and without block
+ * checksums, on the first read after mounting and on later ones. The file
+ * system is left with checksums disabled.
+ */
+int main(int argc, char **argv)
+{
+	double plain_first = 0, plain = 0, checked_first = 0, checked = 0;
+	char *data, *buf;
+	int fd, i;
+
+	if (argc < 2)
+		die("Usage: %s <diskname>", argv[0]);
+
+	data = malloc(FILE_SIZE);
+	buf = malloc(READ_SIZE);
+	if (!data || !buf)
+		die("out of memory");
+	for (i = 0; i < FILE_SIZE; i++)
+		data[i] = rand();
+
+	if (fs_mount(argv[1]))
+		die("Cannot mount diskname");
+	if (fs_create("bench_crc"))
+		die("Cannot create file 'bench_crc'");
+	fd = fs_open("bench_crc");
+	if (fd < 0)
+		die("Cannot open file 'bench_crc'");
+	if (fs_write(fd, data, FILE_SIZE) != FILE_SIZE)
+		die("Cannot fill file 'bench_crc' (disk too small?)");
+	fs_close(fd);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	/* Alternate between both settings so that both see the same noise */
+	for (i = 0; i < ROUNDS; i++) {
+		measure(argv[1], 0, buf, &plain_first, &plain);
+		measure(argv[1], 1, buf, &checked_first, &checked);
+	}
+
+	printf("crc32c=%s rate=%.1fMB/s\n", crc32c_impl(), crc_rate(data));
+	printf("checksums=off first_read_rate=%.1fMB/s read_rate=%.1fMB/s\n",
+	       plain_first, plain);
+	printf("checksums=on first_read_rate=%.1fMB/s read_rate=%.1fMB/s\n",
+	       checked_first, checked);
+	printf("first_read_overhead=%.1f%% overhead=%.1f%%\n",
+	       (plain_first - checked_first) / plain_first * 100,
+	       (plain - checked) / plain * 100);
+
+	if (fs_mount(argv[1]))
+		die("Cannot mount diskname");
+	fs_delete("bench_crc");
+	if (fs_checksum(0))
+		die("Cannot disable checksums");
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	free(data);
+	free(buf);
+
+	return 0;
+}
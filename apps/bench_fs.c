@@ -0,0 +1,442 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+/* Seed of every pseudo-random sequence, so that runs are reproducible */
+#define SEED 1
+/* Largest file used by the sequential and random workloads */
+#define MAX_FILE_SIZE (8 * 1024 * 1024)
+/* Number of operations of each random workload, at most */
+#define RANDOM_OPS 10000
+/* Number of create/open/delete rounds of the small-file storm */
+#define STORM_ROUNDS 20
+/* Size of each small file */
+#define STORM_FILE_SIZE 200
+/* Size of each log record, and number of records between syncs */
+#define LOG_RECORD_SIZE 128
+#define LOG_SYNC_RECORDS 64
+/* Number of files written before timing mounts, and number of mounts */
+#define MOUNT_FILES 100
+#define MOUNT_CYCLES 50
+/* Size of each write filling the disk */
+#define FILL_IO_SIZE (64 * 1024)
+
+/* I/O sizes of the sequential and random workloads */
+static const size_t io_sizes[] = { 512, 4096, 64 * 1024 };
+
+/* Measurements of one workload */
+struct stats {
+	const char *workload;
+	size_t io_size;
+	size_t ops;
+	size_t bytes;
+	uint64_t busy_ns;
+	uint64_t *latency;
+	size_t max_ops;
+};
+
+static const char *diskname;
+static size_t disk_bytes;
+static char *data;
+static int results;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stats_begin(struct stats *st, const char *workload,
+			size_t io_size, size_t max_ops)
+{
+	memset(st, 0, sizeof(*st));
+	st->workload = workload;
+	st->io_size = io_size;
+	st->max_ops = max_ops;
+	st->latency = malloc(max_ops * sizeof(uint64_t));
+	if (!st->latency)
+		die("out of memory");
+}
+
+static void stats_record(struct stats *st, uint64_t start_ns, size_t bytes)
+{
+	uint64_t ns = now_ns() - start_ns;
+
+	if (st->ops < st->max_ops)
+		st->latency[st->ops++] = ns;
+	st->busy_ns += ns;
+	st->bytes += bytes;
+}
+
+/* Make the workload's writes durable, counting the time but not as an op */
+static void stats_sync(struct stats *st)
+{
+	uint64_t t = now_ns();
+
+	if (fs_sync())
+		die("Cannot sync");
+	st->busy_ns += now_ns() - t;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const struct stats *st, int pct)
+{
+	if (!st->ops)
+		return 0;
+	return st->latency[(st->ops - 1) * pct / 100] / 1e3;
+}
+
+/*
+ * Print the workload's results as one JSON object of the results array. Only
+ * the time spent in file-system calls counts, so that the workloads timed
+ * together are told apart.
+ */
+static void stats_end(struct stats *st)
+{
+	double seconds = st->busy_ns / 1e9;
+
+	qsort(st->latency, st->ops, sizeof(uint64_t), cmp_u64);
+
+	printf("%s\n    {\"workload\": \"%s\", \"io_size\": %zu, "
+	       "\"ops\": %zu, \"bytes\": %zu, \"seconds\": %.6f, "
+	       "\"throughput_mbps\": %.2f, \"ops_per_sec\": %.1f, "
+	       "\"p50_us\": %.2f, \"p99_us\": %.2f}",
+	       results ? "," : "", st->workload, st->io_size, st->ops,
+	       st->bytes, seconds, st->bytes / seconds / (1024 * 1024),
+	       st->ops / seconds,
+	       percentile_us(st, 50), percentile_us(st, 99));
+	fflush(stdout);
+	results++;
+	free(st->latency);
+}
+
+static int open_new(const char *filename)
+{
+	int fd;
+
+	if (fs_create(filename))
+		die("Cannot create file '%s'", filename);
+	fd = fs_open(filename);
+	if (fd < 0)
+		die("Cannot open file '%s'", filename);
+	return fd;
+}
+
+static void close_delete(int fd, const char *filename)
+{
+	if (fs_close(fd) || fs_delete(filename))
+		die("Cannot delete file '%s'", filename);
+}
+
+/* Sequential writes and reads of a whole file, then random ones */
+static void bench_io(void)
+{
+	size_t file_size = disk_bytes / 4;
+	unsigned int seed = SEED;
+	struct stats st;
+	size_t i, n, off, io;
+	uint64_t t;
+	int fd;
+
+	if (file_size > MAX_FILE_SIZE)
+		file_size = MAX_FILE_SIZE;
+	fd = open_new("bench_io");
+
+	for (i = 0; i < ARRAY_SIZE(io_sizes); i++) {
+		io = io_sizes[i];
+		n = file_size / io;
+		if (!n)
+			continue;
+
+		stats_begin(&st, "seq_write", io, n);
+		for (off = 0; off + io <= file_size; off += io) {
+			t = now_ns();
+			if (fs_pwrite(fd, data + off, io, off) != (int)io)
+				die("short write at offset %zu", off);
+			stats_record(&st, t, io);
+		}
+		stats_sync(&st);
+		stats_end(&st);
+
+		stats_begin(&st, "seq_read", io, n);
+		for (off = 0; off + io <= file_size; off += io) {
+			t = now_ns();
+			if (fs_pread(fd, data + off, io, off) != (int)io)
+				die("short read at offset %zu", off);
+			stats_record(&st, t, io);
+		}
+		stats_end(&st);
+
+		n = n < RANDOM_OPS ? n : RANDOM_OPS;
+		stats_begin(&st, "rand_write", io, n);
+		while (st.ops < n) {
+			off = (rand_r(&seed) % (file_size / io)) * io;
+			t = now_ns();
+			if (fs_pwrite(fd, data + off, io, off) != (int)io)
+				die("short write at offset %zu", off);
+			stats_record(&st, t, io);
+		}
+		stats_sync(&st);
+		stats_end(&st);
+
+		stats_begin(&st, "rand_read", io, n);
+		while (st.ops < n) {
+			off = (rand_r(&seed) % (file_size / io)) * io;
+			t = now_ns();
+			if (fs_pread(fd, data + off, io, off) != (int)io)
+				die("short read at offset %zu", off);
+			stats_record(&st, t, io);
+		}
+		stats_end(&st);
+	}
+
+	close_delete(fd, "bench_io");
+}
+
+/* Rounds of small files created, opened and closed, then deleted */
+static void bench_storm(void)
+{
+	char filename[FS_FILENAME_LEN];
+	int files = FS_FILE_MAX_COUNT - 8;
+	struct stats create, open, delete;
+	int round, i, fd;
+	uint64_t t;
+
+	stats_begin(&create, "storm_create", STORM_FILE_SIZE,
+		    STORM_ROUNDS * files);
+	stats_begin(&open, "storm_open", STORM_FILE_SIZE,
+		    STORM_ROUNDS * files);
+	stats_begin(&delete, "storm_delete", STORM_FILE_SIZE,
+		    STORM_ROUNDS * files);
+
+	for (round = 0; round < STORM_ROUNDS; round++) {
+		/* Creating a file includes writing its content */
+		for (i = 0; i < files; i++) {
+			snprintf(filename, sizeof(filename), "storm%d", i);
+			t = now_ns();
+			fd = open_new(filename);
+			if (fs_write(fd, data + i, STORM_FILE_SIZE) !=
+			    STORM_FILE_SIZE)
+				die("Cannot write file '%s'", filename);
+			fs_close(fd);
+			stats_record(&create, t, STORM_FILE_SIZE);
+		}
+		for (i = 0; i < files; i++) {
+			snprintf(filename, sizeof(filename), "storm%d", i);
+			t = now_ns();
+			fd = fs_open(filename);
+			if (fd < 0 || fs_close(fd))
+				die("Cannot open file '%s'", filename);
+			stats_record(&open, t, 0);
+		}
+		for (i = 0; i < files; i++) {
+			snprintf(filename, sizeof(filename), "storm%d", i);
+			t = now_ns();
+			if (fs_delete(filename))
+				die("Cannot delete file '%s'", filename);
+			stats_record(&delete, t, 0);
+		}
+	}
+
+	stats_end(&create);
+	stats_end(&open);
+	stats_end(&delete);
+}
+
+/* Small records appended to a log file, synced every few records */
+static void bench_append(void)
+{
+	size_t records = disk_bytes / 4 / LOG_RECORD_SIZE;
+	struct stats st;
+	size_t i;
+	uint64_t t;
+	int fd;
+
+	if (records > MAX_FILE_SIZE / LOG_RECORD_SIZE)
+		records = MAX_FILE_SIZE / LOG_RECORD_SIZE;
+	fd = open_new("bench_log");
+
+	stats_begin(&st, "append_log", LOG_RECORD_SIZE, records);
+	for (i = 0; i < records; i++) {
+		t = now_ns();
+		if (fs_write(fd, data + i % BLOCK_SIZE, LOG_RECORD_SIZE) !=
+		    LOG_RECORD_SIZE)
+			die("short append of record %zu", i);
+		if ((i + 1) % LOG_SYNC_RECORDS == 0 && fs_sync())
+			die("Cannot sync");
+		stats_record(&st, t, LOG_RECORD_SIZE);
+	}
+	stats_end(&st);
+
+	close_delete(fd, "bench_log");
+}
+
+/* Mount and unmount latency, with half of the disk used by files */
+static void bench_mount(void)
+{
+	char filename[FS_FILENAME_LEN];
+	size_t file_size = disk_bytes / 2 / MOUNT_FILES;
+	struct stats mount, umount;
+	uint64_t t;
+	int i, fd;
+
+	if (file_size > MAX_FILE_SIZE)
+		file_size = MAX_FILE_SIZE;
+	for (i = 0; i < MOUNT_FILES; i++) {
+		snprintf(filename, sizeof(filename), "mount%d", i);
+		fd = open_new(filename);
+		if (fs_write(fd, data, file_size) != (int)file_size)
+			die("Cannot fill file '%s'", filename);
+		fs_close(fd);
+	}
+
+	stats_begin(&mount, "mount", 0, MOUNT_CYCLES);
+	stats_begin(&umount, "umount", 0, MOUNT_CYCLES);
+	for (i = 0; i < MOUNT_CYCLES; i++) {
+		t = now_ns();
+		if (fs_umount())
+			die("Cannot unmount diskname");
+		stats_record(&umount, t, 0);
+		t = now_ns();
+		if (fs_mount(diskname))
+			die("Cannot mount diskname");
+		stats_record(&mount, t, 0);
+	}
+	stats_end(&mount);
+	stats_end(&umount);
+
+	for (i = 0; i < MOUNT_FILES; i++) {
+		snprintf(filename, sizeof(filename), "mount%d", i);
+		if (fs_delete(filename))
+			die("Cannot delete file '%s'", filename);
+	}
+}
+
+/* Writes to a single file until the disk is full */
+static void bench_fill(void)
+{
+	size_t max_ops = disk_bytes / FILL_IO_SIZE + 1;
+	struct stats st;
+	uint64_t t;
+	int fd, ret;
+
+	fd = open_new("bench_fill");
+	stats_begin(&st, "fill", FILL_IO_SIZE, max_ops);
+	do {
+		t = now_ns();
+		ret = fs_write(fd, data + st.ops % 16 * FILL_IO_SIZE,
+			       FILL_IO_SIZE);
+		if (ret < 0)
+			die("Cannot write file 'bench_fill'");
+		stats_record(&st, t, ret);
+	} while (ret == FILL_IO_SIZE && st.ops < max_ops);
+	stats_sync(&st);
+	stats_end(&st);
+
+	close_delete(fd, "bench_fill");
+}
+
+static struct {
+	const char *name;
+	void (*func)(void);
+} workloads[] = {
+	{ "io",		bench_io },
+	{ "storm",	bench_storm },
+	{ "append",	bench_append },
+	{ "mount",	bench_mount },
+	{ "fill",	bench_fill },
+};
+
+static void print_string(const char *s)
+{
+	putchar('"');
+	for (; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			putchar('\\');
+		putchar(*s);
+	}
+	putchar('"');
+}
+
+/*
+ * Run the selected workloads (all of them by default) on a disk, and print
+ * the results as JSON. The disk should be created empty, preferably with the
+ * largest size fs_make.x allows; the files of the workloads are deleted
+ * afterwards.
+ */
+int main(int argc, char **argv)
+{
+	size_t i, j;
+	int selected;
+
+	if (argc < 2)
+		die("Usage: %s <diskname> [io|storm|append|mount|fill...]",
+		    argv[0]);
+	diskname = argv[1];
+
+	for (i = 2; i < (size_t)argc; i++) {
+		for (j = 0; j < ARRAY_SIZE(workloads); j++)
+			if (!strcmp(argv[i], workloads[j].name))
+				break;
+		if (j == ARRAY_SIZE(workloads))
+			die("Unknown workload '%s'", argv[i]);
+	}
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+	disk_bytes = (size_t)block_disk_count() * BLOCK_SIZE;
+
+	/* Pseudo-random content, large enough for any offset of a file */
+	data = malloc(MAX_FILE_SIZE + 16 * FILL_IO_SIZE);
+	if (!data)
+		die("out of memory");
+	srand(SEED);
+	for (i = 0; i < MAX_FILE_SIZE + 16 * FILL_IO_SIZE; i++)
+		data[i] = rand();
+
+	printf("{\n  \"benchmark\": \"bench_fs\",\n  \"disk\": ");
+	print_string(diskname);
+	printf(",\n  \"disk_blocks\": %d,\n  \"block_size\": %d,\n"
+	       "  \"seed\": %d,\n  \"results\": [", block_disk_count(),
+	       BLOCK_SIZE, SEED);
+
+	for (j = 0; j < ARRAY_SIZE(workloads); j++) {
+		selected = argc == 2;
+		for (i = 2; i < (size_t)argc; i++)
+			selected |= !strcmp(argv[i], workloads[j].name);
+		if (selected)
+			workloads[j].func();
+	}
+
+	printf("\n  ]\n}\n");
+
+	free(data);
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	return 0;
+}
@@ -0,0 +1,142 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define bench_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	bench_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Default number of threads of the largest run */
+#define DEFAULT_THREADS 8
+/* Size of each file read by the threads */
+#define FILE_SIZE (256 * BLOCK_SIZE)
+/* Size of each read */
+#define READ_SIZE (4 * BLOCK_SIZE)
+/* Number of reads performed by each thread */
+#define READS_PER_THREAD 20000
+
+struct reader {
+	pthread_t thread;
+	int fd;
+	unsigned int seed;
+	size_t bytes;
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Read random block-aligned parts of the thread's own file */
+static void *reader_main(void *arg)
+{
+	struct reader *r = arg;
+	char *buf = malloc(READ_SIZE);
+	size_t slots = (FILE_SIZE - READ_SIZE) / BLOCK_SIZE + 1;
+	int i, ret;
+
+	if (!buf)
+		die("out of memory");
+
+	for (i = 0; i < READS_PER_THREAD; i++) {
+		size_t offset = (rand_r(&r->seed) % slots) * BLOCK_SIZE;
+
+		ret = fs_pread(r->fd, buf, READ_SIZE, offset);
+		if (ret != READ_SIZE)
+			die("short read on fd %d (%d)", r->fd, ret);
+		r->bytes += ret;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+int main(int argc, char **argv)
+{
+	struct reader readers[FS_OPEN_MAX_COUNT];
+	char filename[FS_FILENAME_LEN];
+	char *data;
+	int max_threads = DEFAULT_THREADS;
+	int nthreads, i;
+	double base = 0;
+
+	if (argc < 2)
+		die("Usage: %s <diskname> [max threads]", argv[0]);
+	if (argc > 2)
+		max_threads = atoi(argv[2]);
+	if (max_threads < 1 || max_threads > FS_OPEN_MAX_COUNT)
+		die("thread count must be between 1 and %d", FS_OPEN_MAX_COUNT);
+
+	if (fs_mount(argv[1]))
+		die("Cannot mount diskname");
+
+	/* One file per thread, so that threads never share a file */
+	data = malloc(FILE_SIZE);
+	if (!data)
+		die("out of memory");
+	memset(data, 'b', FILE_SIZE);
+	for (i = 0; i < max_threads; i++) {
+		snprintf(filename, sizeof(filename), "bench%d", i);
+		if (fs_create(filename))
+			die("Cannot create file '%s'", filename);
+		readers[i].fd = fs_open(filename);
+		if (readers[i].fd < 0)
+			die("Cannot open file '%s'", filename);
+		if (fs_write(readers[i].fd, data, FILE_SIZE) != FILE_SIZE)
+			die("Cannot fill file '%s' (disk too small?)", filename);
+	}
+	free(data);
+
+	for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+		double start, elapsed, rate;
+		size_t bytes = 0;
+
+		start = now();
+		for (i = 0; i < nthreads; i++) {
+			readers[i].seed = i + 1;
+			readers[i].bytes = 0;
+			if (pthread_create(&readers[i].thread, NULL, reader_main,
+					   &readers[i]))
+				die("Cannot create thread");
+		}
+		for (i = 0; i < nthreads; i++) {
+			pthread_join(readers[i].thread, NULL);
+			bytes += readers[i].bytes;
+		}
+		elapsed = now() - start;
+
+		rate = bytes / elapsed / (1024 * 1024);
+		if (nthreads == 1)
+			base = rate;
+		printf("threads=%d reads=%d time=%.3fs rate=%.1fMB/s "
+		       "speedup=%.2f\n", nthreads, nthreads * READS_PER_THREAD,
+		       elapsed, rate, rate / base);
+
+		if (nthreads < max_threads && nthreads * 2 > max_threads)
+			nthreads = max_threads / 2;
+	}
+
+	for (i = 0; i < max_threads; i++) {
+		snprintf(filename, sizeof(filename), "bench%d", i);
+		fs_close(readers[i].fd);
+		fs_delete(filename);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	return 0;
+}
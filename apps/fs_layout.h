@@ -0,0 +1,137 @@
+#ifndef _FS_LAYOUT_H
+#define _FS_LAYOUT_H
+
+#include <stdint.h>
+
+#include <disk.h>
+#include <fs.h>
+
+/*
+ * On-disk layout of a file system, as written by libfs (see libfs/fs.c), for
+ * the tools working on images directly: block 0 is the superblock, followed by
+ * the FAT blocks, the root directory block, and the data blocks. Data blocks
+ * are numbered from 0 in the FAT, and data block 0 is never used. With block
+ * deduplication, the remap table of the deduplication table gives the data
+ * block backing each FAT entry (0 for the data block of the same index), and
+ * the FAT entries past the data area become usable as well.
+ */
+
+/** Signature of the superblock (not NULL-terminated) */
+#define FS_SIGNATURE "ECS150FS"
+
+/** FAT entry values */
+#define FS_FAT_EOC 0xFFFF
+#define FS_FAT_FREE 0
+
+/** Number of FAT entries per FAT block */
+#define FS_FAT_PER_BLOCK (BLOCK_SIZE / sizeof(uint16_t))
+
+/** Largest number of blocks of a disk (block counts are 16-bit) */
+#define FS_MAX_DISK_BLOCKS 0xFFFF
+
+/** Size bounds of the metadata journal (in blocks): journals are sized up to
+ * FS_JOURNAL_MAX_BLOCKS, and grow up to FS_JOURNAL_GROWN_MAX_BLOCKS */
+#define FS_JOURNAL_MIN_BLOCKS 2
+#define FS_JOURNAL_MAX_BLOCKS 64
+#define FS_JOURNAL_GROWN_MAX_BLOCKS 255
+
+/** Journal transaction magic number, and journal record types */
+#define FS_JOURNAL_MAGIC 0x4C4E524A
+#define FS_RECORD_SUPER 1
+#define FS_RECORD_FAT 2
+#define FS_RECORD_DIR 3
+#define FS_RECORD_INLINE 4
+#define FS_RECORD_REMAP 5
+#define FS_RECORD_CHECKSUM 6
+
+/** Leading superblock bytes logged by FS_RECORD_SUPER */
+#define FS_SUPER_LOGGED_BYTES 64
+
+/** Inline small-file area: one slot per root directory entry */
+#define FS_INLINE_MAX 64
+#define FS_INLINE_AREA_BLOCKS (FS_FILE_MAX_COUNT * FS_INLINE_MAX / BLOCK_SIZE)
+
+/** Packed tails: fragments of the fragment blocks shared by several files */
+#define FS_FRAGMENT_SIZE 512
+#define FS_FRAGMENTS_PER_BLOCK (BLOCK_SIZE / FS_FRAGMENT_SIZE)
+
+/** Compressed files: chunks of FS_CHUNK_BLOCKS blocks, and index entry bits */
+#define FS_CHUNK_BLOCKS 4
+#define FS_CHUNK_SIZE (FS_CHUNK_BLOCKS * BLOCK_SIZE)
+#define FS_CHUNK_INDEX_ENTRIES (BLOCK_SIZE / sizeof(uint16_t))
+#define FS_CHUNK_STORED 0x8000
+#define FS_CHUNK_LENGTH_MASK 0x7FFF
+
+/** Remap table value of FAT entries not backed by a data block */
+#define FS_PHYS_NONE 0xFFFF
+
+/** Superblock feature flags */
+#define FS_FEATURE_DEDUP 0x01
+
+/** Root directory entry flags */
+#define FS_ENTRY_INLINE 0x01
+#define FS_ENTRY_TAIL 0x02
+#define FS_ENTRY_COMPRESSED 0x04
+
+/** Superblock */
+struct __attribute__((__packed__)) fs_superblock {
+	char signature[8];		/* FS_SIGNATURE */
+	uint16_t disk_blocks;		/* Number of blocks of the disk */
+	uint16_t root_block;		/* Root directory block */
+	uint16_t data_start;		/* First data block */
+	uint16_t data_blocks;		/* Number of data blocks */
+	uint8_t fat_blocks;		/* Number of FAT blocks */
+	uint16_t inline_index;		/* Inline area chain, or 0 */
+	uint16_t journal_index;		/* Journal chain, or 0 */
+	uint8_t journal_blocks;		/* Number of journal blocks */
+	uint32_t journal_sequence;	/* First journal transaction to replay */
+	uint16_t dedup_index;		/* Deduplication table chain, or 0 */
+	uint8_t dedup_blocks;		/* Number of deduplication table blocks */
+	uint8_t features;		/* Feature flags */
+	uint16_t snapshot_index;	/* Snapshot directory block, or 0 */
+	uint16_t checksum_index;	/* Checksum table chain, or 0 */
+	uint8_t checksum_blocks;	/* Number of checksum table blocks */
+	/* Data blocks of the journal, in order, or 0s to follow its chain */
+	uint16_t journal_map[FS_JOURNAL_GROWN_MAX_BLOCKS];
+	uint8_t padding[3551];
+};
+
+/** Root directory entry */
+struct __attribute__((__packed__)) fs_rootentry {
+	char name[FS_FILENAME_LEN];	/* NULL-terminated, empty if unused */
+	uint32_t size;			/* File size in bytes */
+	uint16_t first_index;		/* First data block, or FS_FAT_EOC */
+	uint8_t flags;
+	uint16_t tail_index;		/* Fragment block of the packed tail */
+	uint8_t tail_fragment;		/* First fragment of the packed tail */
+	uint8_t padding[6];
+};
+
+/** Snapshot directory entry, unused if the name is empty */
+struct __attribute__((__packed__)) fs_snapshotentry {
+	char name[FS_FILENAME_LEN];
+	uint16_t first_index;		/* First block of the snapshot */
+	uint16_t blocks;		/* Number of blocks of the snapshot */
+	uint8_t padding[12];
+};
+
+/** Number of entries of the snapshot directory block */
+#define FS_SNAPSHOT_MAX (BLOCK_SIZE / sizeof(struct fs_snapshotentry))
+
+/** Journal transaction header, followed by its records */
+struct __attribute__((__packed__)) fs_journalheader {
+	uint32_t magic;			/* FS_JOURNAL_MAGIC */
+	uint32_t sequence;		/* Sequence number of the transaction */
+	uint32_t length;		/* Size of the records (in bytes) */
+	uint32_t checksum;		/* FNV-1a checksum of the records */
+};
+
+/** Journal record, followed by @length bytes of data */
+struct __attribute__((__packed__)) fs_journalrecord {
+	uint8_t type;			/* FS_RECORD_* */
+	uint16_t index;			/* First FAT entry, directory entry or
+					 * inline slot */
+	uint16_t length;
+};
+
+#endif /* _FS_LAYOUT_H */
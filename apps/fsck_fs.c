@@ -0,0 +1,1138 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <crc32c.h>
+#include <disk.h>
+#include <fs.h>
+
+#include "fs_layout.h"
+
+/* Exit codes, as fsck(8) */
+#define FSCK_CLEAN 0
+#define FSCK_REPAIRED 1
+#define FSCK_ERRORS 4
+#define FSCK_FAILED 8
+
+#define fsck_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	fsck_error(__VA_ARGS__);	\
+	exit(FSCK_FAILED);			\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(FSCK_FAILED);			\
+} while (0)
+
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+
+/* Largest number of threads */
+#define MAX_THREADS 64
+
+/* FAT entries, or data blocks, per work item of the parallel scans */
+#define SCAN_ITEM_BLOCKS 1024
+
+/* Data blocks read at once by the data scan */
+#define SCAN_READ_BLOCKS 64
+
+/* Owners of the FAT entries: the root directory entries (1 to
+ * FS_FILE_MAX_COUNT), the fragment blocks of the packed tails, the metadata
+ * areas, and the snapshots (OWNER_SNAPSHOT + snapshot directory slot) */
+enum {
+	OWNER_NONE,
+	OWNER_FRAGMENT = FS_FILE_MAX_COUNT + 1,
+	OWNER_INLINE,
+	OWNER_JOURNAL,
+	OWNER_DEDUP,
+	OWNER_CHECKSUM,
+	OWNER_SNAPSHOT_DIR,
+	OWNER_SNAPSHOT,
+};
+
+/* Checking options, from the command line */
+static struct {
+	int scan;
+	int repair;
+	int threads;
+} opts;
+
+/* Image being checked, with its metadata as libfs would mount it */
+static struct {
+	int fd;
+	struct fs_superblock super;
+	uint16_t *fat;
+	struct fs_rootentry root[FS_FILE_MAX_COUNT];
+	char *inline_area;
+	char *dedup_table;
+	uint16_t *remap;		/* Remap table, or NULL */
+	uint32_t *checksums;		/* Checksum table, or NULL */
+	struct fs_snapshotentry snapshots[FS_SNAPSHOT_MAX];
+	long max_entries;		/* FAT entries held by the FAT blocks */
+	long entries;			/* Usable FAT entries */
+	uint32_t sequence;		/* Next journal transaction */
+	int replayed;			/* Journal transactions replayed */
+} img;
+
+/*
+ * A file system to check the files of: the mounted one, or a snapshot, with
+ * its own FAT and remap table. The FAT entries its files use are claimed in
+ * @owner, so that a chain running into an entry already claimed is either
+ * looping or cross-linked.
+ */
+struct view {
+	const char *snapshot;		/* Snapshot name, or NULL */
+	struct fs_rootentry *root;
+	uint16_t *fat;
+	uint16_t *remap;
+	uint16_t *owner;		/* Per FAT entry owner (OWNER_*) */
+	uint8_t *fragments;		/* Per FAT entry fragments used by tails */
+	char *content;			/* Snapshot content, or NULL */
+};
+
+static struct view *views;
+static int view_count;
+
+/* Per data block number of references from files, and from metadata areas */
+static uint32_t *refs;
+static uint8_t *meta;
+
+/* Results, updated atomically or with the report lock held */
+static struct {
+	long problems;			/* Problems, except leaks */
+	long leaked;			/* Leaked FAT entries */
+	long files;
+	long used_blocks;
+	long shared_blocks;
+	long scanned_blocks;
+} results;
+
+static pthread_mutex_t report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Work shared by the threads of run_parallel() */
+static struct {
+	void (*fn)(long item, char *buf);
+	long items;
+	long next;
+	size_t buf_size;
+} work;
+
+static void usage(const char *program)
+{
+	fprintf(stderr,
+		"Usage: %s <diskname> [option...]\n"
+		"Options:\n"
+		"\tscan\t\tread every data block in use, checking its checksum\n"
+		"\t\t\twhen the image keeps checksums\n"
+		"\trepair\t\tfree the leaked FAT entries, if the image has no\n"
+		"\t\t\tother problem\n"
+		"\tthreads=N\tnumber of threads [number of CPUs]\n"
+		"Exit status: %d if the image is clean, %d if it was repaired, %d if\n"
+		"it has problems left, %d if it could not be checked\n",
+		program, FSCK_CLEAN, FSCK_REPAIRED, FSCK_ERRORS, FSCK_FAILED);
+	exit(FSCK_FAILED);
+}
+
+/* Report a problem with @v, or with the image if @v is NULL */
+static void problem(const struct view *v, const char *fmt, ...)
+{
+	va_list ap;
+
+	pthread_mutex_lock(&report_lock);
+	if (v && v->snapshot)
+		printf("snapshot '%.*s': ", FS_FILENAME_LEN, v->snapshot);
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	putchar('\n');
+	results.problems++;
+	pthread_mutex_unlock(&report_lock);
+}
+
+/* Report a problem the image cannot be checked any further with */
+static void fatal(const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+	printf("\nCannot check the image any further\n");
+	exit(FSCK_ERRORS);
+}
+
+static double elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e3 +
+		(now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void *parallel_thread(void *arg)
+{
+	char *buf = NULL;
+	long item;
+
+	if (work.buf_size && !(buf = malloc(work.buf_size)))
+		die("out of memory");
+	while ((item = __atomic_fetch_add(&work.next, 1, __ATOMIC_RELAXED)) <
+	       work.items)
+		work.fn(item, buf);
+	free(buf);
+	return NULL;
+}
+
+/* Call @fn on @items work items spread over the threads, each thread with its
+ * own buffer of @buf_size bytes */
+static void run_parallel(void (*fn)(long item, char *buf), long items,
+			 size_t buf_size)
+{
+	pthread_t threads[MAX_THREADS];
+	int i;
+
+	work.fn = fn;
+	work.items = items;
+	work.next = 0;
+	work.buf_size = buf_size;
+	for (i = 0; i < opts.threads; i++)
+		if (pthread_create(&threads[i], NULL, parallel_thread, NULL))
+			die("cannot create threads");
+	for (i = 0; i < opts.threads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+static int read_blocks(long block, long count, void *buf)
+{
+	ssize_t len = (ssize_t)count * BLOCK_SIZE;
+
+	return pread(img.fd, buf, len, (off_t)block * BLOCK_SIZE) == len ? 0 : -1;
+}
+
+static int write_blocks(long block, long count, const void *buf)
+{
+	ssize_t len = (ssize_t)count * BLOCK_SIZE;
+
+	return pwrite(img.fd, buf, len, (off_t)block * BLOCK_SIZE) == len ?
+		0 : -1;
+}
+
+/* Data block backing FAT entry @entry of @v, or FS_PHYS_NONE */
+static long physical(const struct view *v, long entry)
+{
+	if (v->remap && v->remap[entry])
+		return v->remap[entry];
+	return entry < img.super.data_blocks ? entry : FS_PHYS_NONE;
+}
+
+static int valid_physical(long block)
+{
+	return block > 0 && block < img.super.data_blocks;
+}
+
+/* Read or write the @blocks blocks of @buf from/to the chain from @first of
+ * the mounted file system */
+static int transfer_chain(long first, long blocks, char *buf, int write)
+{
+	long entry = first, block, i;
+
+	for (i = 0; i < blocks; i++) {
+		if (entry == FS_FAT_FREE || entry >= img.entries)
+			return -1;
+		block = physical(&views[0], entry);
+		if (!valid_physical(block))
+			return -1;
+		block += img.super.data_start;
+		if (write ? write_blocks(block, 1, buf + i * BLOCK_SIZE) :
+		    read_blocks(block, 1, buf + i * BLOCK_SIZE))
+			return -1;
+		entry = img.fat[entry];
+	}
+	return 0;
+}
+
+static long dedup_table_blocks(void)
+{
+	size_t remap_bytes = (img.max_entries * sizeof(uint16_t) + 7) & ~7;
+
+	return DIV_ROUND_UP(remap_bytes +
+			    img.super.data_blocks * sizeof(uint64_t), BLOCK_SIZE);
+}
+
+static long checksum_table_blocks(void)
+{
+	return DIV_ROUND_UP(img.super.data_blocks * sizeof(uint32_t), BLOCK_SIZE);
+}
+
+static long snapshot_blocks(void)
+{
+	return DIV_ROUND_UP((1 + FS_INLINE_AREA_BLOCKS) * BLOCK_SIZE +
+			    2 * img.max_entries * sizeof(uint16_t), BLOCK_SIZE);
+}
+
+/* Check the geometry of the superblock against the disk, and the location of
+ * the metadata areas needed to load the rest of the metadata */
+static void check_super(void)
+{
+	struct fs_superblock *sb = &img.super;
+	struct stat st;
+	long i;
+
+	if (fstat(img.fd, &st))
+		die_perror("fstat");
+	if (read_blocks(0, 1, sb))
+		fatal("superblock: cannot be read");
+	if (memcmp(sb->signature, FS_SIGNATURE, sizeof(sb->signature)))
+		fatal("superblock: invalid signature");
+	if (st.st_size % BLOCK_SIZE || st.st_size / BLOCK_SIZE != sb->disk_blocks)
+		fatal("superblock: %d blocks, but the disk is %lld bytes",
+		      sb->disk_blocks, (long long)st.st_size);
+	if (!sb->fat_blocks || sb->root_block != sb->fat_blocks + 1 ||
+	    sb->data_start != sb->fat_blocks + 2 ||
+	    sb->disk_blocks != sb->data_blocks + sb->fat_blocks + 2)
+		fatal("superblock: inconsistent layout (%d FAT blocks, root "
+		      "directory block %d, data blocks %d to %d of %d)",
+		      sb->fat_blocks, sb->root_block, sb->data_start,
+		      sb->data_start + sb->data_blocks - 1, sb->disk_blocks);
+	if (sb->data_blocks > sb->fat_blocks * FS_FAT_PER_BLOCK)
+		fatal("superblock: %d FAT blocks for %d data blocks",
+		      sb->fat_blocks, sb->data_blocks);
+
+	img.max_entries = sb->fat_blocks * FS_FAT_PER_BLOCK;
+	if (img.max_entries > FS_FAT_EOC)
+		img.max_entries = FS_FAT_EOC;
+	img.entries = sb->dedup_index ? img.max_entries : sb->data_blocks;
+
+	if (sb->features & ~FS_FEATURE_DEDUP)
+		problem(NULL, "superblock: unknown features 0x%x", sb->features);
+	if ((sb->features & FS_FEATURE_DEDUP) && !sb->dedup_index)
+		problem(NULL, "superblock: deduplication without a "
+			"deduplication table");
+	if (sb->inline_index >= img.entries || sb->journal_index >= img.entries ||
+	    sb->dedup_index >= img.entries || sb->checksum_index >= img.entries ||
+	    sb->snapshot_index >= img.entries)
+		fatal("superblock: metadata area past the %ld FAT entries",
+		      img.entries);
+	if (sb->journal_index && (sb->journal_blocks < FS_JOURNAL_MIN_BLOCKS ||
+				  sb->journal_blocks > FS_JOURNAL_GROWN_MAX_BLOCKS))
+		fatal("superblock: journal of %d blocks", sb->journal_blocks);
+	for (i = 0; sb->journal_index && sb->journal_map[0] &&
+	     i < sb->journal_blocks; i++)
+		if (!valid_physical(sb->journal_map[i]))
+			fatal("superblock: journal block %ld is data block %d",
+			      i, sb->journal_map[i]);
+	if (sb->dedup_index && sb->dedup_blocks != dedup_table_blocks())
+		fatal("superblock: deduplication table of %d blocks instead "
+		      "of %ld", sb->dedup_blocks, dedup_table_blocks());
+	if (sb->checksum_index && sb->checksum_blocks != checksum_table_blocks())
+		fatal("superblock: checksum table of %d blocks instead of %ld",
+		      sb->checksum_blocks, checksum_table_blocks());
+}
+
+/* Computes the checksum of a journal transaction's records (FNV-1a) */
+static uint32_t journal_checksum(const char *data, size_t length)
+{
+	uint32_t checksum = 2166136261u;
+	size_t i;
+
+	for (i = 0; i < length; i++)
+		checksum = (checksum ^ (uint8_t)data[i]) * 16777619u;
+	return checksum;
+}
+
+/* Apply the records of a journal transaction, as libfs does on mount */
+static void apply_records(const char *records, size_t length)
+{
+	struct fs_journalrecord record;
+	struct fs_superblock journal_fields;
+	size_t offset = 0;
+	const char *data;
+
+	while (offset + sizeof(record) <= length) {
+		memcpy(&record, records + offset, sizeof(record));
+		data = records + offset + sizeof(record);
+		offset += sizeof(record) + record.length;
+		if (offset > length)
+			break;
+
+		switch (record.type) {
+		case FS_RECORD_SUPER:
+			if (record.length != FS_SUPER_LOGGED_BYTES)
+				break;
+			/* The journal fields are only updated by writing the
+			 * superblock */
+			journal_fields = img.super;
+			memcpy(&img.super, data, FS_SUPER_LOGGED_BYTES);
+			img.super.journal_index = journal_fields.journal_index;
+			img.super.journal_blocks = journal_fields.journal_blocks;
+			img.super.journal_sequence =
+				journal_fields.journal_sequence;
+			memcpy(img.super.journal_map, journal_fields.journal_map,
+			       sizeof(img.super.journal_map));
+			break;
+		case FS_RECORD_FAT:
+			if (record.index + record.length / sizeof(uint16_t) <=
+			    img.max_entries)
+				memcpy(&img.fat[record.index], data,
+				       record.length);
+			break;
+		case FS_RECORD_REMAP:
+			if (img.remap && record.index + record.length /
+			    sizeof(uint16_t) <= img.max_entries)
+				memcpy(&img.remap[record.index], data,
+				       record.length);
+			break;
+		case FS_RECORD_CHECKSUM:
+			if (img.checksums && record.index + record.length /
+			    sizeof(uint32_t) <= img.super.data_blocks)
+				memcpy(&img.checksums[record.index], data,
+				       record.length);
+			break;
+		case FS_RECORD_DIR:
+			if (record.index < FS_FILE_MAX_COUNT &&
+			    record.length == sizeof(struct fs_rootentry))
+				memcpy(&img.root[record.index], data,
+				       record.length);
+			break;
+		case FS_RECORD_INLINE:
+			if (record.index < FS_FILE_MAX_COUNT &&
+			    record.length <= FS_INLINE_MAX) {
+				memset(img.inline_area +
+				       record.index * FS_INLINE_MAX, 0,
+				       FS_INLINE_MAX);
+				memcpy(img.inline_area +
+				       record.index * FS_INLINE_MAX, data,
+				       record.length);
+			}
+			break;
+		}
+	}
+}
+
+/* Load the deduplication and checksum tables the superblock names and that
+ * are not loaded yet, and drop a checksum table it no longer names: replaying
+ * the transaction creating or removing a table does so, as libfs does */
+static void load_tables(void)
+{
+	struct fs_superblock *sb = &img.super;
+
+	/* The deduplication table is read without remapping, the others with */
+	if (sb->dedup_index && !img.dedup_table) {
+		img.dedup_table = calloc(sb->dedup_blocks, BLOCK_SIZE);
+		if (!img.dedup_table)
+			die("out of memory");
+		if (transfer_chain(sb->dedup_index, sb->dedup_blocks,
+				   img.dedup_table, 0))
+			fatal("deduplication table: cannot be read");
+		img.remap = (uint16_t *)img.dedup_table;
+		img.entries = img.max_entries;
+		views[0].remap = img.remap;
+	}
+	if (!sb->checksum_index && img.checksums) {
+		free(img.checksums);
+		img.checksums = NULL;
+	}
+	if (sb->checksum_index && !img.checksums) {
+		img.checksums = calloc(sb->checksum_blocks, BLOCK_SIZE);
+		if (!img.checksums)
+			die("out of memory");
+		if (transfer_chain(sb->checksum_index, sb->checksum_blocks,
+				   (char *)img.checksums, 0))
+			fatal("checksum table: cannot be read");
+	}
+}
+
+/* Replay the committed journal transactions that were not checkpointed, so
+ * that the image is checked as libfs would mount it */
+static void replay_journal(void)
+{
+	size_t capacity = img.super.journal_blocks * BLOCK_SIZE;
+	size_t offset = 0;
+	struct fs_journalheader header;
+	const char *records;
+	char *journal;
+	long i;
+
+	img.sequence = img.super.journal_sequence;
+	if (!img.super.journal_index)
+		return;
+	journal = malloc(capacity);
+	if (!journal)
+		die("out of memory");
+	/* Journals written before the superblock listed their blocks are
+	 * found from the FAT */
+	if (!img.super.journal_map[0] &&
+	    transfer_chain(img.super.journal_index, img.super.journal_blocks,
+			   journal, 0))
+		fatal("journal: cannot be read");
+	for (i = 0; img.super.journal_map[0] && i < img.super.journal_blocks;
+	     i++)
+		if (read_blocks(img.super.data_start + img.super.journal_map[i],
+				1, journal + i * BLOCK_SIZE))
+			fatal("journal: cannot be read");
+
+	while (offset + sizeof(header) <= capacity) {
+		memcpy(&header, journal + offset, sizeof(header));
+		records = journal + offset + sizeof(header);
+		/* The first stale or torn transaction ends the journal */
+		if (header.magic != FS_JOURNAL_MAGIC ||
+		    header.sequence != img.sequence ||
+		    header.length > capacity - offset - sizeof(header) ||
+		    header.checksum != journal_checksum(records, header.length))
+			break;
+		apply_records(records, header.length);
+		load_tables();
+		offset += sizeof(header) + header.length;
+		img.sequence++;
+		img.replayed++;
+	}
+	free(journal);
+}
+
+/* Load the metadata of the image, in the order libfs mounts it */
+static void load_image(void)
+{
+	struct fs_superblock *sb = &img.super;
+
+	img.fat = malloc(sb->fat_blocks * BLOCK_SIZE);
+	img.inline_area = calloc(FS_INLINE_AREA_BLOCKS, BLOCK_SIZE);
+	views = calloc(1 + FS_SNAPSHOT_MAX, sizeof(*views));
+	if (!img.fat || !img.inline_area || !views)
+		die("out of memory");
+	if (read_blocks(1, sb->fat_blocks, img.fat))
+		fatal("FAT: cannot be read");
+	if (read_blocks(sb->root_block, 1, img.root))
+		fatal("root directory: cannot be read");
+
+	/* The mounted file system is checked first */
+	view_count = 1;
+	views[0].root = img.root;
+	views[0].fat = img.fat;
+
+	load_tables();
+	if (sb->inline_index &&
+	    transfer_chain(sb->inline_index, FS_INLINE_AREA_BLOCKS,
+			   img.inline_area, 0))
+		fatal("inline area: cannot be read");
+
+	replay_journal();
+
+	if (sb->snapshot_index &&
+	    transfer_chain(sb->snapshot_index, 1, (char *)img.snapshots, 0))
+		fatal("snapshot directory: cannot be read");
+}
+
+/* Name of the owner of a FAT entry of @v, for the problems found */
+static const char *owner_name(const struct view *v, int owner, char *buf,
+			      size_t size)
+{
+	static const char *areas[] = {
+		[OWNER_FRAGMENT] = "a fragment block",
+		[OWNER_INLINE] = "the inline area",
+		[OWNER_JOURNAL] = "the journal",
+		[OWNER_DEDUP] = "the deduplication table",
+		[OWNER_CHECKSUM] = "the checksum table",
+		[OWNER_SNAPSHOT_DIR] = "the snapshot directory",
+	};
+
+	if (owner >= 1 && owner <= FS_FILE_MAX_COUNT)
+		snprintf(buf, size, "file '%.*s'", FS_FILENAME_LEN,
+			 v->root[owner - 1].name);
+	else if (owner >= OWNER_SNAPSHOT)
+		snprintf(buf, size, "snapshot '%.*s'", FS_FILENAME_LEN,
+			 img.snapshots[owner - OWNER_SNAPSHOT].name);
+	else
+		snprintf(buf, size, "%s", areas[owner]);
+	return buf;
+}
+
+/* Count a reference from @owner to the data block backing @entry of @v */
+static void use_block(const struct view *v, int owner, const char *what,
+		      long entry)
+{
+	long block = physical(v, entry);
+
+	if (!valid_physical(block))
+		problem(v, "%s: FAT entry %ld is not backed by a data block",
+			what, entry);
+	else if (owner <= OWNER_FRAGMENT)
+		__atomic_add_fetch(&refs[block], 1, __ATOMIC_RELAXED);
+	else
+		__atomic_add_fetch(&meta[block], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Walk the chain from @first of @v, claiming its FAT entries for @owner, and
+ * keep up to @max of them in @chain if not NULL. Return the number of entries
+ * of the chain, up to where it is broken if @broken gets set.
+ */
+static long walk_chain(struct view *v, int owner, const char *what, long first,
+		       uint16_t *chain, long max, int *broken)
+{
+	long entry = first, length = 0;
+	uint16_t prev;
+	char name[64];
+
+	*broken = 1;
+	while (entry != FS_FAT_EOC) {
+		if (entry == FS_FAT_FREE || entry >= img.entries) {
+			problem(v, "%s: chain runs into invalid FAT entry %ld",
+				what, entry);
+			return length;
+		}
+		prev = OWNER_NONE;
+		if (!__atomic_compare_exchange_n(&v->owner[entry], &prev, owner,
+						 0, __ATOMIC_RELAXED,
+						 __ATOMIC_RELAXED)) {
+			if (prev == owner)
+				problem(v, "%s: chain loops back to FAT entry "
+					"%ld", what, entry);
+			else
+				problem(v, "%s: FAT entry %ld cross-linked with "
+					"%s", what, entry,
+					owner_name(v, prev, name, sizeof(name)));
+			return length;
+		}
+		if (v->fat[entry] == FS_FAT_FREE) {
+			problem(v, "%s: chain runs into free FAT entry %ld",
+				what, entry);
+			return length;
+		}
+		use_block(v, owner, what, entry);
+		if (chain && length < max)
+			chain[length] = entry;
+		length++;
+		entry = v->fat[entry];
+	}
+	*broken = 0;
+	return length;
+}
+
+/* Check a metadata area of @blocks blocks from @first, if the image has it */
+static void check_area(int owner, long first, long blocks)
+{
+	char what[64];
+	int broken;
+	long length;
+
+	if (!first)
+		return;
+	owner_name(&views[0], owner, what, sizeof(what));
+	length = walk_chain(&views[0], owner, what, first, NULL, 0, &broken);
+	if (length > blocks || (length < blocks && !broken))
+		problem(NULL, "%s: chain of %ld blocks instead of %ld", what,
+			length, blocks);
+}
+
+/* Check that the journal blocks listed by the superblock are those of the
+ * journal's chain, which is what keeps them from being allocated */
+static void check_journal_map(void)
+{
+	struct fs_superblock *sb = &img.super;
+	long entry = sb->journal_index, i;
+
+	if (!entry || !sb->journal_map[0])
+		return;
+	for (i = 0; i < sb->journal_blocks; i++) {
+		if (entry == FS_FAT_FREE || entry >= img.entries)
+			return;
+		if (physical(&views[0], entry) != sb->journal_map[i])
+			problem(NULL, "journal: block %ld is data block %ld in "
+				"its chain, %d in the superblock", i,
+				physical(&views[0], entry), sb->journal_map[i]);
+		entry = img.fat[entry];
+	}
+}
+
+/* Check the snapshot directory, and load the snapshots to check their files */
+static void load_snapshots(void)
+{
+	struct fs_snapshotentry *s;
+	struct view *v;
+	char what[64];
+	size_t i, j;
+
+	for (i = 0; i < FS_SNAPSHOT_MAX; i++) {
+		s = &img.snapshots[i];
+		if (!s->name[0])
+			continue;
+		owner_name(&views[0], OWNER_SNAPSHOT + i, what, sizeof(what));
+		if (!memchr(s->name, '\0', FS_FILENAME_LEN))
+			problem(NULL, "%s: name is not NULL-terminated", what);
+		for (j = 0; j < i; j++)
+			if (!strncmp(img.snapshots[j].name, s->name,
+				     FS_FILENAME_LEN))
+				problem(NULL, "%s: name used twice", what);
+		if (s->blocks != snapshot_blocks()) {
+			problem(NULL, "%s: %d blocks instead of %ld", what,
+				s->blocks, snapshot_blocks());
+			continue;
+		}
+		check_area(OWNER_SNAPSHOT + i, s->first_index, s->blocks);
+
+		/* Snapshots of images without deduplication cannot be read */
+		v = &views[view_count];
+		v->content = malloc(s->blocks * BLOCK_SIZE);
+		if (!v->content)
+			die("out of memory");
+		if (!img.remap || transfer_chain(s->first_index, s->blocks,
+						 v->content, 0)) {
+			problem(NULL, "%s: cannot be read", what);
+			free(v->content);
+			continue;
+		}
+		v->snapshot = s->name;
+		v->root = (struct fs_rootentry *)v->content;
+		v->fat = (uint16_t *)(v->content +
+				      (1 + FS_INLINE_AREA_BLOCKS) * BLOCK_SIZE);
+		v->remap = v->fat + img.max_entries;
+		view_count++;
+	}
+}
+
+/* Claim the fragment block of the packed tail of a file of @v */
+static void check_tail(struct view *v, const struct fs_rootentry *e,
+		       const char *what)
+{
+	int count = DIV_ROUND_UP(e->size % BLOCK_SIZE, FS_FRAGMENT_SIZE);
+	long entry = e->tail_index;
+	uint16_t prev = OWNER_NONE;
+	uint8_t mask;
+	char name[64];
+
+	if (!count || e->tail_fragment + count > FS_FRAGMENTS_PER_BLOCK) {
+		problem(v, "%s: packed tail of %d fragments from fragment %d",
+			what, count, e->tail_fragment);
+		return;
+	}
+	if (entry == FS_FAT_FREE || entry >= img.entries) {
+		problem(v, "%s: packed tail in invalid FAT entry %ld", what,
+			entry);
+		return;
+	}
+
+	/* Fragment blocks are shared by several files, and referenced once */
+	if (!__atomic_compare_exchange_n(&v->owner[entry], &prev,
+					 OWNER_FRAGMENT, 0, __ATOMIC_RELAXED,
+					 __ATOMIC_RELAXED) &&
+	    prev != OWNER_FRAGMENT) {
+		problem(v, "%s: fragment block %ld cross-linked with %s", what,
+			entry, owner_name(v, prev, name, sizeof(name)));
+		return;
+	}
+	mask = ((1 << count) - 1) << e->tail_fragment;
+	if (__atomic_fetch_or(&v->fragments[entry], mask, __ATOMIC_RELAXED) &
+	    mask)
+		problem(v, "%s: packed tail overlaps another one in fragment "
+			"block %ld", what, entry);
+	if (prev != OWNER_NONE)
+		return;
+	if (v->fat[entry] != FS_FAT_EOC)
+		problem(v, "%s: fragment block %ld is not a single-block chain",
+			what, entry);
+	use_block(v, OWNER_FRAGMENT, what, entry);
+}
+
+/* Find the number of blocks of a compressed file from its chunk index, or -1
+ * if the index cannot be read */
+static long compressed_blocks(const struct view *v, const struct fs_rootentry *e,
+			      const char *what, const uint16_t *chain,
+			      long length)
+{
+	uint16_t index[FS_CHUNK_INDEX_ENTRIES];
+	long chunks = DIV_ROUND_UP((long)e->size, FS_CHUNK_SIZE);
+	long blocks = DIV_ROUND_UP(chunks, FS_CHUNK_INDEX_ENTRIES);
+	long i, block, extent;
+
+	for (i = 0; i < chunks; i++) {
+		if (i % FS_CHUNK_INDEX_ENTRIES == 0) {
+			block = i / FS_CHUNK_INDEX_ENTRIES;
+			if (block >= length)
+				return -1;
+			block = physical(v, chain[block]);
+			if (!valid_physical(block) ||
+			    read_blocks(img.super.data_start + block, 1, index)) {
+				problem(v, "%s: cannot read the chunk index",
+					what);
+				return -1;
+			}
+		}
+		extent = DIV_ROUND_UP(index[i % FS_CHUNK_INDEX_ENTRIES] &
+				      FS_CHUNK_LENGTH_MASK, BLOCK_SIZE);
+		if (!extent || extent > FS_CHUNK_BLOCKS) {
+			problem(v, "%s: chunk %ld has an extent of %ld blocks",
+				what, i, extent);
+			return -1;
+		}
+		blocks += extent;
+	}
+	return blocks;
+}
+
+/* Check the entry of a file of @v against the chain of its blocks */
+static void check_file(struct view *v, int location)
+{
+	const struct fs_rootentry *e = &v->root[location];
+	uint16_t *chain = NULL;
+	long expected = -1, length;
+	char what[64];
+	int broken;
+
+	if (!e->name[0])
+		return;
+	if (v == &views[0])
+		__atomic_add_fetch(&results.files, 1, __ATOMIC_RELAXED);
+	snprintf(what, sizeof(what), "file '%.*s'", FS_FILENAME_LEN, e->name);
+	if (e->flags & ~(FS_ENTRY_INLINE | FS_ENTRY_TAIL | FS_ENTRY_COMPRESSED))
+		problem(v, "%s: unknown flags 0x%x", what, e->flags);
+
+	if (e->flags & FS_ENTRY_INLINE) {
+		if (e->flags & (FS_ENTRY_TAIL | FS_ENTRY_COMPRESSED))
+			problem(v, "%s: inline file with a packed tail or "
+				"compressed", what);
+		if (e->size > FS_INLINE_MAX)
+			problem(v, "%s: inline file of %u bytes", what, e->size);
+		if (!v->snapshot && !img.super.inline_index)
+			problem(v, "%s: inline file without an inline area",
+				what);
+		if (e->first_index != FS_FAT_EOC)
+			problem(v, "%s: inline file with a chain", what);
+		return;
+	}
+
+	if (e->flags & FS_ENTRY_COMPRESSED) {
+		if (e->flags & FS_ENTRY_TAIL)
+			problem(v, "%s: compressed file with a packed tail",
+				what);
+		chain = malloc(img.entries * sizeof(uint16_t));
+		if (!chain)
+			die("out of memory");
+	} else if (e->flags & FS_ENTRY_TAIL) {
+		check_tail(v, e, what);
+		expected = e->size / BLOCK_SIZE;
+	} else {
+		expected = DIV_ROUND_UP((long)e->size, BLOCK_SIZE);
+	}
+
+	length = walk_chain(v, location + 1, what, e->first_index, chain,
+			    img.entries, &broken);
+	if (chain) {
+		expected = compressed_blocks(v, e, what, chain, length);
+		free(chain);
+		if (expected < 0)
+			return;
+	}
+	if (length > expected)
+		problem(v, "%s: chain of %ld blocks longer than the %ld blocks "
+			"of its %u bytes", what, length, expected, e->size);
+	else if (length < expected && !broken)
+		problem(v, "%s: chain of %ld blocks shorter than the %ld blocks "
+			"of its %u bytes", what, length, expected, e->size);
+}
+
+/* Check the names of the files of @v */
+static void check_names(const struct view *v)
+{
+	const struct fs_rootentry *e;
+	int i, j;
+
+	for (i = 0; i < FS_FILE_MAX_COUNT; i++) {
+		e = &v->root[i];
+		if (!e->name[0])
+			continue;
+		if (!memchr(e->name, '\0', FS_FILENAME_LEN))
+			problem(v, "file '%.*s': name is not NULL-terminated",
+				FS_FILENAME_LEN, e->name);
+		for (j = 0; j < i; j++)
+			if (!strncmp(v->root[j].name, e->name, FS_FILENAME_LEN))
+				problem(v, "file '%.*s': name used twice",
+					FS_FILENAME_LEN, e->name);
+	}
+}
+
+/* Work item of the file checks: one root directory entry of one view */
+static void check_files_item(long item, char *buf)
+{
+	(void)buf;
+	check_file(&views[item / FS_FILE_MAX_COUNT], item % FS_FILE_MAX_COUNT);
+}
+
+/* Report the leaked FAT entries from @first to @last */
+static void report_leak(long first, long last)
+{
+	pthread_mutex_lock(&report_lock);
+	if (first == last)
+		printf("FAT entry %ld: leaked\n", first);
+	else
+		printf("FAT entries %ld-%ld: leaked\n", first, last);
+	results.leaked += last - first + 1;
+	pthread_mutex_unlock(&report_lock);
+}
+
+/* Work item of the block checks: look for leaked FAT entries, and for data
+ * blocks used by a metadata area and anything else, over a range of FAT
+ * entries and data blocks of the mounted file system */
+static void check_blocks_item(long item, char *buf)
+{
+	long first = item * SCAN_ITEM_BLOCKS, last = first + SCAN_ITEM_BLOCKS;
+	long i, leak = -1, used = 0, shared = 0;
+
+	(void)buf;
+	if (last > img.max_entries)
+		last = img.max_entries;
+	for (i = first ? first : 1; i < last; i++) {
+		if (img.fat[i] != FS_FAT_FREE && !views[0].owner[i]) {
+			if (leak < 0)
+				leak = i;
+		} else if (leak >= 0) {
+			report_leak(leak, i - 1);
+			leak = -1;
+		}
+
+		if (i >= img.super.data_blocks)
+			continue;
+		if (meta[i] > 1 || (meta[i] && refs[i]))
+			problem(NULL, "data block %ld: used by a metadata area "
+				"and by %s", i, meta[i] > 1 ?
+				"another one" : "files");
+		used += meta[i] || refs[i];
+		shared += refs[i] > 1;
+	}
+	if (leak >= 0)
+		report_leak(leak, last - 1);
+	__atomic_add_fetch(&results.used_blocks, used, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&results.shared_blocks, shared, __ATOMIC_RELAXED);
+}
+
+/* Read the data blocks from @first to @last - 1, all in use, and check the
+ * checksums of the ones used by files */
+static void scan_run(long first, long last, char *buf)
+{
+	char name[64];
+	long i;
+
+	if (read_blocks(img.super.data_start + first, last - first, buf)) {
+		problem(NULL, "data blocks %ld-%ld: cannot be read", first,
+			last - 1);
+		return;
+	}
+	__atomic_add_fetch(&results.scanned_blocks, last - first,
+			   __ATOMIC_RELAXED);
+	if (!img.checksums)
+		return;
+	for (i = first; i < last; i++) {
+		if (!refs[i] || crc32c(0, buf + (i - first) * BLOCK_SIZE,
+				       BLOCK_SIZE) == img.checksums[i])
+			continue;
+		/* The owner is only known for blocks backing their own entry */
+		if (physical(&views[0], i) == i && views[0].owner[i])
+			problem(NULL, "data block %ld: checksum mismatch in %s",
+				i, owner_name(&views[0], views[0].owner[i], name,
+					      sizeof(name)));
+		else
+			problem(NULL, "data block %ld: checksum mismatch", i);
+	}
+}
+
+/* Work item of the data scan: the data blocks in use of a range, read in runs
+ * of adjacent blocks */
+static void scan_blocks_item(long item, char *buf)
+{
+	long first = item * SCAN_ITEM_BLOCKS, last = first + SCAN_ITEM_BLOCKS;
+	long i, run = -1;
+
+	if (last > img.super.data_blocks)
+		last = img.super.data_blocks;
+	for (i = first ? first : 1; i < last; i++) {
+		if (!refs[i] && !meta[i]) {
+			if (run >= 0)
+				scan_run(run, i, buf);
+			run = -1;
+			continue;
+		}
+		if (run < 0)
+			run = i;
+		if (i + 1 - run == SCAN_READ_BLOCKS) {
+			scan_run(run, i + 1, buf);
+			run = -1;
+		}
+	}
+	if (run >= 0)
+		scan_run(run, last, buf);
+}
+
+/* Free the leaked FAT entries, then write the metadata back as a libfs
+ * checkpoint would, which also ends any journal transaction replayed */
+static void repair(void)
+{
+	struct fs_superblock *sb = &img.super;
+	long i;
+
+	img.fat[0] = FS_FAT_EOC;
+	for (i = 1; i < img.max_entries; i++) {
+		if (img.fat[i] == FS_FAT_FREE || views[0].owner[i])
+			continue;
+		img.fat[i] = FS_FAT_FREE;
+		if (img.remap)
+			img.remap[i] = 0;
+	}
+
+	if (write_blocks(1, sb->fat_blocks, img.fat) ||
+	    write_blocks(sb->root_block, 1, img.root) ||
+	    (sb->inline_index &&
+	     transfer_chain(sb->inline_index, FS_INLINE_AREA_BLOCKS,
+			    img.inline_area, 1)) ||
+	    (sb->dedup_index &&
+	     transfer_chain(sb->dedup_index, sb->dedup_blocks,
+			    img.dedup_table, 1)) ||
+	    (sb->checksum_index &&
+	     transfer_chain(sb->checksum_index, sb->checksum_blocks,
+			    (char *)img.checksums, 1)) ||
+	    fsync(img.fd))
+		die_perror("write");
+	sb->journal_sequence = img.sequence;
+	if (write_blocks(0, 1, sb) || fsync(img.fd))
+		die_perror("write");
+}
+
+static void parse_option(const char *arg)
+{
+	char *end;
+
+	if (!strcmp(arg, "scan")) {
+		opts.scan = 1;
+	} else if (!strcmp(arg, "repair")) {
+		opts.repair = 1;
+	} else if (!strncmp(arg, "threads=", 8)) {
+		opts.threads = strtol(arg + 8, &end, 0);
+		if (end == arg + 8 || *end || opts.threads < 1 ||
+		    opts.threads > MAX_THREADS)
+			die("Threads must be between 1 and %d", MAX_THREADS);
+	} else {
+		die("Unknown option '%s'", arg);
+	}
+}
+
+/*
+ * Check an image as libfs would mount it, after replaying its journal: the
+ * superblock, the metadata areas, then the files of the mounted file system
+ * and of every snapshot, and the FAT entries and data blocks in use, the
+ * independent checks being spread over several threads.
+ */
+int main(int argc, char **argv)
+{
+	struct timespec start;
+	long items, i;
+	int ret, repairable;
+
+	if (argc < 2)
+		usage(argv[0]);
+	for (i = 2; i < argc; i++)
+		parse_option(argv[i]);
+	if (!opts.threads) {
+		opts.threads = sysconf(_SC_NPROCESSORS_ONLN);
+		if (opts.threads < 1)
+			opts.threads = 1;
+		if (opts.threads > MAX_THREADS)
+			opts.threads = MAX_THREADS;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	img.fd = open(argv[1], opts.repair ? O_RDWR : O_RDONLY);
+	if (img.fd < 0)
+		die_perror("open");
+	check_super();
+	load_image();
+
+	refs = calloc(img.super.data_blocks, sizeof(*refs));
+	meta = calloc(img.super.data_blocks, sizeof(*meta));
+	views[0].owner = calloc(img.max_entries, sizeof(uint16_t));
+	views[0].fragments = calloc(img.max_entries, sizeof(uint8_t));
+	if (!refs || !meta || !views[0].owner || !views[0].fragments)
+		die("out of memory");
+
+	if (img.fat[0] != FS_FAT_EOC)
+		problem(NULL, "FAT entry 0: not reserved");
+	check_area(OWNER_INLINE, img.super.inline_index, FS_INLINE_AREA_BLOCKS);
+	check_area(OWNER_JOURNAL, img.super.journal_index,
+		   img.super.journal_blocks);
+	check_journal_map();
+	check_area(OWNER_DEDUP, img.super.dedup_index, img.super.dedup_blocks);
+	check_area(OWNER_CHECKSUM, img.super.checksum_index,
+		   img.super.checksum_blocks);
+	check_area(OWNER_SNAPSHOT_DIR, img.super.snapshot_index, 1);
+	if (img.super.snapshot_index)
+		load_snapshots();
+
+	for (i = 0; i < view_count; i++) {
+		if (i) {
+			views[i].owner = calloc(img.max_entries,
+						sizeof(uint16_t));
+			views[i].fragments = calloc(img.max_entries, 1);
+			if (!views[i].owner || !views[i].fragments)
+				die("out of memory");
+		}
+		check_names(&views[i]);
+	}
+	run_parallel(check_files_item, view_count * FS_FILE_MAX_COUNT, 0);
+
+	items = DIV_ROUND_UP(img.max_entries, SCAN_ITEM_BLOCKS);
+	run_parallel(check_blocks_item, items, 0);
+	if (opts.scan)
+		run_parallel(scan_blocks_item, DIV_ROUND_UP(img.super.data_blocks,
+							    SCAN_ITEM_BLOCKS),
+			     SCAN_READ_BLOCKS * BLOCK_SIZE);
+
+	/* Only leaks are repaired, and only on an image without other problem */
+	ret = results.problems || results.leaked ? FSCK_ERRORS : FSCK_CLEAN;
+	repairable = results.problems == (img.fat[0] != FS_FAT_EOC);
+	if (opts.repair && ret != FSCK_CLEAN) {
+		if (repairable) {
+			repair();
+			ret = FSCK_REPAIRED;
+		} else {
+			printf("Not repaired: problems other than leaks\n");
+		}
+	}
+
+	/* Data block 0 is reserved, as in fs_info() */
+	printf("Checked '%s': %ld files, %d snapshots, %ld/%d data blocks "
+	       "in use (%ld shared)\n", argv[1], results.files, view_count - 1,
+	       results.used_blocks + 1, img.super.data_blocks,
+	       results.shared_blocks);
+	printf("problems=%ld leaked=%ld repaired=%s journal_replayed=%d "
+	       "scanned_blocks=%ld threads=%d time=%.3fms\n", results.problems,
+	       results.leaked, ret == FSCK_REPAIRED ? "yes" : "no",
+	       img.replayed, results.scanned_blocks, opts.threads,
+	       elapsed_ms(&start));
+
+	for (i = 1; i < view_count; i++) {
+		free(views[i].content);
+		free(views[i].owner);
+		free(views[i].fragments);
+	}
+	free(views[0].owner);
+	free(views[0].fragments);
+	free(views);
+	free(refs);
+	free(meta);
+	free(img.fat);
+	free(img.inline_area);
+	free(img.dedup_table);
+	free(img.checksums);
+	close(img.fd);
+
+	return ret;
+}
@@ -0,0 +1,553 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fs.h>
+
+#define loadgen_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	loadgen_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+/* Largest number of threads */
+#define MAX_THREADS 64
+/* Largest number of data files, each kept open during the run */
+#define MAX_FILES FS_OPEN_MAX_COUNT
+/*
+ * Latency histogram: values below 16ns have a bucket each, larger ones 16
+ * buckets per power of two, so that percentiles are within 1/16 of the value
+ */
+#define HIST_SUB 16
+#define HIST_BUCKETS (40 * HIST_SUB)
+
+/* Operations of the mix */
+enum {
+	OP_READ,
+	OP_WRITE,
+	OP_STAT,
+	OP_OPEN,
+	OP_CREATE,
+	OP_SYNC,
+	OP_COUNT,
+};
+
+static const char *op_names[OP_COUNT] = {
+	[OP_READ] = "read",
+	[OP_WRITE] = "write",
+	[OP_STAT] = "stat",
+	[OP_OPEN] = "open",
+	[OP_CREATE] = "create",
+	[OP_SYNC] = "sync",
+};
+
+/* Job description, from the command line */
+static struct {
+	int threads;
+	double duration;
+	double interval;
+	int files;
+	size_t min_size;
+	size_t max_size;
+	size_t bs;
+	int read_pct;
+	int random;
+	/* Weight of each operation; reads and writes share the "io" one */
+	int weight[OP_COUNT];
+	unsigned int seed;
+} job = {
+	.threads = 4,
+	.duration = 10,
+	.interval = 1,
+	.files = 16,
+	.min_size = 1024 * 1024,
+	.max_size = 1024 * 1024,
+	.bs = 4096,
+	.read_pct = 50,
+	.random = 1,
+	.weight = { [OP_READ] = 100 },
+	.seed = 1,
+};
+
+/* Counters of one operation, updated by a single thread */
+struct op_stats {
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t hist[HIST_BUCKETS];
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	unsigned int seed;
+	char *buf;
+	/* Next offset of each file, for the sequential pattern */
+	size_t *next;
+	struct op_stats stats[OP_COUNT];
+};
+
+static struct worker workers[MAX_THREADS];
+static int fds[MAX_FILES];
+static size_t sizes[MAX_FILES];
+static int stopping;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int hist_bucket(uint64_t ns)
+{
+	int shift;
+
+	if (ns < HIST_SUB)
+		return ns;
+	shift = 63 - __builtin_clzll(ns) - 4;
+	if (shift + 1 >= HIST_BUCKETS / HIST_SUB)
+		return HIST_BUCKETS - 1;
+	return (shift + 1) * HIST_SUB + ((ns >> shift) & (HIST_SUB - 1));
+}
+
+/* Smallest value of a bucket */
+static uint64_t hist_value(int bucket)
+{
+	int shift = bucket / HIST_SUB - 1;
+
+	if (bucket < HIST_SUB)
+		return bucket;
+	return (uint64_t)(HIST_SUB + bucket % HIST_SUB) << shift;
+}
+
+static double hist_percentile_us(const uint64_t *hist, uint64_t total,
+				 double pct)
+{
+	uint64_t rank = total * pct / 100, seen = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen > rank)
+			return hist_value(i) / 1e3;
+	}
+	return 0;
+}
+
+/* Count an operation; relaxed atomics let the reporter read while we run */
+static void record(struct op_stats *st, uint64_t start, size_t bytes)
+{
+	int bucket = hist_bucket(now_ns() - start);
+
+	__atomic_store_n(&st->hist[bucket], st->hist[bucket] + 1,
+			 __ATOMIC_RELAXED);
+	__atomic_store_n(&st->bytes, st->bytes + bytes, __ATOMIC_RELAXED);
+	__atomic_store_n(&st->ops, st->ops + 1, __ATOMIC_RELEASE);
+}
+
+/* Sum the counters of an operation over all workers */
+static void collect(int op, struct op_stats *sum)
+{
+	int i, b;
+
+	memset(sum, 0, sizeof(*sum));
+	for (i = 0; i < job.threads; i++) {
+		struct op_stats *st = &workers[i].stats[op];
+
+		sum->ops += __atomic_load_n(&st->ops, __ATOMIC_ACQUIRE);
+		sum->bytes += __atomic_load_n(&st->bytes, __ATOMIC_RELAXED);
+		for (b = 0; b < HIST_BUCKETS; b++)
+			sum->hist[b] += __atomic_load_n(&st->hist[b],
+							__ATOMIC_RELAXED);
+	}
+}
+
+/* Pick an operation following the mix */
+static int pick_op(struct worker *w)
+{
+	int total = 0, r, op;
+
+	for (op = 0; op < OP_COUNT; op++)
+		total += job.weight[op];
+	r = rand_r(&w->seed) % total;
+	for (op = 0; r >= job.weight[op]; op++)
+		r -= job.weight[op];
+
+	if (op == OP_READ && rand_r(&w->seed) % 100 >= job.read_pct)
+		op = OP_WRITE;
+	return op;
+}
+
+static size_t pick_offset(struct worker *w, int file)
+{
+	size_t blocks = sizes[file] / job.bs, offset;
+
+	if (job.random)
+		return (rand_r(&w->seed) % blocks) * job.bs;
+
+	offset = w->next[file];
+	w->next[file] = offset + job.bs <= sizes[file] - job.bs ?
+			offset + job.bs : 0;
+	return offset;
+}
+
+static void run_op(struct worker *w, int op)
+{
+	char filename[FS_FILENAME_LEN];
+	int file = rand_r(&w->seed) % job.files;
+	size_t offset = 0;
+	uint64_t start;
+	int fd, ret = 0;
+
+	if (op == OP_READ || op == OP_WRITE)
+		offset = pick_offset(w, file);
+
+	start = now_ns();
+	switch (op) {
+	case OP_READ:
+		ret = fs_pread(fds[file], w->buf, job.bs, offset);
+		break;
+	case OP_WRITE:
+		ret = fs_pwrite(fds[file], w->buf, job.bs, offset);
+		break;
+	case OP_STAT:
+		ret = fs_stat(fds[file]) < 0 ? -1 : 0;
+		break;
+	case OP_OPEN:
+		snprintf(filename, sizeof(filename), "load%d", file);
+		fd = fs_open(filename);
+		ret = fd < 0 ? -1 : fs_close(fd);
+		break;
+	case OP_CREATE:
+		/* A file of the worker's own, created, written and deleted */
+		snprintf(filename, sizeof(filename), "load_tmp%d", w->id);
+		if (fs_create(filename)) {
+			ret = -1;
+			break;
+		}
+		fd = fs_open(filename);
+		if (fd < 0 || fs_write(fd, w->buf, job.bs) != (int)job.bs)
+			ret = -1;
+		if (fd >= 0)
+			fs_close(fd);
+		if (fs_delete(filename))
+			ret = -1;
+		break;
+	case OP_SYNC:
+		ret = fs_sync();
+		break;
+	}
+
+	if (ret < 0 || ((op == OP_READ || op == OP_WRITE) &&
+			ret != (int)job.bs))
+		die("%s failed on file 'load%d' (%d)", op_names[op], file, ret);
+	record(&w->stats[op], start,
+	       op == OP_READ || op == OP_WRITE || op == OP_CREATE ? job.bs : 0);
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+		run_op(w, pick_op(w));
+	return NULL;
+}
+
+/* Print throughput and latency of each operation since the last report */
+static void report(struct op_stats *last, double seconds, const char *label)
+{
+	static struct op_stats now, delta;
+	int op, b, first = 1;
+
+	printf("%s", label);
+	for (op = 0; op < OP_COUNT; op++) {
+		collect(op, &now);
+		delta.ops = now.ops - last[op].ops;
+		delta.bytes = now.bytes - last[op].bytes;
+		for (b = 0; b < HIST_BUCKETS; b++)
+			delta.hist[b] = now.hist[b] - last[op].hist[b];
+		last[op] = now;
+		if (!delta.ops)
+			continue;
+
+		printf("%s%s %.0f ops/s %.1f MB/s p50=%.1fus p99=%.1fus",
+		       first ? " " : " | ", op_names[op], delta.ops / seconds,
+		       delta.bytes / seconds / (1024 * 1024),
+		       hist_percentile_us(delta.hist, delta.ops, 50),
+		       hist_percentile_us(delta.hist, delta.ops, 99));
+		first = 0;
+	}
+	printf("\n");
+	fflush(stdout);
+}
+
+/* Print the totals of the whole run, one operation per line */
+static void report_final(double seconds)
+{
+	static struct op_stats sum;
+	int op;
+
+	printf("%-8s %10s %12s %10s %10s %10s %10s\n", "op", "ops", "ops/s",
+	       "MB/s", "p50(us)", "p99(us)", "p99.9(us)");
+	for (op = 0; op < OP_COUNT; op++) {
+		collect(op, &sum);
+		if (!sum.ops)
+			continue;
+		printf("%-8s %10lu %12.0f %10.1f %10.1f %10.1f %10.1f\n",
+		       op_names[op], (unsigned long)sum.ops, sum.ops / seconds,
+		       sum.bytes / seconds / (1024 * 1024),
+		       hist_percentile_us(sum.hist, sum.ops, 50),
+		       hist_percentile_us(sum.hist, sum.ops, 99),
+		       hist_percentile_us(sum.hist, sum.ops, 99.9));
+	}
+}
+
+/* Parse a size with an optional k or m suffix */
+static size_t parse_size(const char *s)
+{
+	char *end;
+	size_t size = strtoul(s, &end, 0);
+
+	if (*end == 'k' || *end == 'K')
+		size *= 1024, end++;
+	else if (*end == 'm' || *end == 'M')
+		size *= 1024 * 1024, end++;
+	if (end == s || *end)
+		die("Invalid size '%s'", s);
+	return size;
+}
+
+/* Parse an operation mix such as "io:90,stat:5,open:5" */
+static void parse_mix(char *s)
+{
+	char *item, *colon;
+	int op;
+
+	memset(job.weight, 0, sizeof(job.weight));
+	for (item = strtok(s, ","); item; item = strtok(NULL, ",")) {
+		colon = strchr(item, ':');
+		if (!colon)
+			die("Invalid mix item '%s'", item);
+		*colon = '\0';
+		if (!strcmp(item, "io"))
+			op = OP_READ;
+		else
+			for (op = OP_STAT; op < OP_COUNT; op++)
+				if (!strcmp(item, op_names[op]))
+					break;
+		if (op == OP_COUNT)
+			die("Unknown operation '%s'", item);
+		job.weight[op] = atoi(colon + 1);
+	}
+}
+
+static void parse_option(char *arg)
+{
+	char *value = strchr(arg, '=');
+	char *dash;
+
+	if (!value)
+		die("Invalid option '%s'", arg);
+	*value++ = '\0';
+
+	if (!strcmp(arg, "threads")) {
+		job.threads = atoi(value);
+	} else if (!strcmp(arg, "duration")) {
+		job.duration = atof(value);
+	} else if (!strcmp(arg, "interval")) {
+		job.interval = atof(value);
+	} else if (!strcmp(arg, "files")) {
+		job.files = atoi(value);
+	} else if (!strcmp(arg, "size")) {
+		/* A single size, or a range of uniformly distributed sizes */
+		dash = strchr(value, '-');
+		if (dash)
+			*dash++ = '\0';
+		job.min_size = parse_size(value);
+		job.max_size = dash ? parse_size(dash) : job.min_size;
+	} else if (!strcmp(arg, "bs")) {
+		job.bs = parse_size(value);
+	} else if (!strcmp(arg, "rw")) {
+		job.read_pct = atoi(value);
+	} else if (!strcmp(arg, "pattern")) {
+		if (strcmp(value, "seq") && strcmp(value, "rand"))
+			die("Unknown pattern '%s'", value);
+		job.random = !strcmp(value, "rand");
+	} else if (!strcmp(arg, "mix")) {
+		parse_mix(value);
+	} else if (!strcmp(arg, "seed")) {
+		job.seed = atoi(value);
+	} else {
+		die("Unknown option '%s'", arg);
+	}
+}
+
+static void check_job(void)
+{
+	int op, total = 0;
+
+	for (op = 0; op < OP_COUNT; op++)
+		total += job.weight[op];
+	if (job.threads < 1 || job.threads > MAX_THREADS)
+		die("threads must be between 1 and %d", MAX_THREADS);
+	if (job.files < 1 || job.files > MAX_FILES)
+		die("files must be between 1 and %d", MAX_FILES);
+	/* Open and create ops use a descriptor of their own in each thread */
+	if ((job.weight[OP_OPEN] || job.weight[OP_CREATE]) &&
+	    job.files + job.threads > FS_OPEN_MAX_COUNT)
+		die("files + threads must be at most %d with open or create ops",
+		    FS_OPEN_MAX_COUNT);
+	if (job.bs < 1 || job.min_size < job.bs || job.max_size < job.min_size)
+		die("sizes must be at least bs, and ranges increasing");
+	if (job.read_pct < 0 || job.read_pct > 100)
+		die("rw must be a percentage of reads");
+	if (job.duration <= 0 || job.interval <= 0 || total <= 0)
+		die("duration, interval and mix must be positive");
+}
+
+/* Create the data files, with sizes drawn from the distribution */
+static void setup_files(char *buf)
+{
+	char filename[FS_FILENAME_LEN];
+	unsigned int seed = job.seed;
+	size_t offset, count;
+	int i;
+
+	for (i = 0; i < job.files; i++) {
+		sizes[i] = job.min_size +
+			   (size_t)rand_r(&seed) % (job.max_size - job.min_size + 1);
+		sizes[i] -= sizes[i] % job.bs;
+
+		snprintf(filename, sizeof(filename), "load%d", i);
+		if (fs_create(filename))
+			die("Cannot create file '%s'", filename);
+		fds[i] = fs_open(filename);
+		if (fds[i] < 0)
+			die("Cannot open file '%s'", filename);
+		for (offset = 0; offset < sizes[i]; offset += count) {
+			count = sizes[i] - offset < job.bs ?
+				sizes[i] - offset : job.bs;
+			if (fs_write(fds[i], buf, count) != (int)count)
+				die("Cannot fill file '%s' (disk too small?)",
+				    filename);
+		}
+	}
+	if (fs_sync())
+		die("Cannot sync");
+}
+
+static void cleanup_files(void)
+{
+	char filename[FS_FILENAME_LEN];
+	int i;
+
+	for (i = 0; i < job.files; i++) {
+		snprintf(filename, sizeof(filename), "load%d", i);
+		if (fs_close(fds[i]) || fs_delete(filename))
+			die("Cannot delete file '%s'", filename);
+	}
+}
+
+static void usage(const char *program)
+{
+	fprintf(stderr,
+		"Usage: %s <diskname> [option=value...]\n"
+		"Options (defaults in brackets):\n"
+		"\tthreads=N\tnumber of threads [4]\n"
+		"\tduration=S\trun time in seconds [10]\n"
+		"\tinterval=S\tlive report interval in seconds [1]\n"
+		"\tfiles=N\t\tnumber of data files, at most %d [16]\n"
+		"\tsize=SIZE[-SIZE]\tfile size, or range of sizes [1m]\n"
+		"\tbs=SIZE\t\tread and write size [4k]\n"
+		"\trw=PCT\t\tpercentage of reads among reads and writes [50]\n"
+		"\tpattern=seq|rand\taccess pattern [rand]\n"
+		"\tmix=OP:W,...\tweights of io, stat, open, create and sync "
+		"[io:100]\n"
+		"\tseed=N\t\tseed of the pseudo-random choices [1]\n",
+		program, MAX_FILES);
+	exit(1);
+}
+
+/*
+ * Drive the file system from several threads at once, following a job
+ * description given as option=value arguments, and report the throughput
+ * and latency percentiles of each operation live and at the end.
+ */
+int main(int argc, char **argv)
+{
+	static struct op_stats last[OP_COUNT];
+	double elapsed, next;
+	char label[32];
+	uint64_t start;
+	int i;
+
+	if (argc < 2)
+		usage(argv[0]);
+	for (i = 2; i < argc; i++)
+		parse_option(argv[i]);
+	check_job();
+
+	if (fs_mount(argv[1]))
+		die("Cannot mount diskname");
+
+	for (i = 0; i < job.threads; i++) {
+		workers[i].id = i;
+		workers[i].seed = job.seed + i;
+		workers[i].buf = malloc(job.bs);
+		workers[i].next = calloc(job.files, sizeof(size_t));
+		if (!workers[i].buf || !workers[i].next)
+			die("out of memory");
+		memset(workers[i].buf, 'a' + i % 26, job.bs);
+	}
+	setup_files(workers[0].buf);
+
+	printf("threads=%d duration=%.1fs files=%d size=%zu-%zu bs=%zu "
+	       "rw=%d%% pattern=%s\n", job.threads, job.duration, job.files,
+	       job.min_size, job.max_size, job.bs, job.read_pct,
+	       job.random ? "rand" : "seq");
+
+	start = now_ns();
+	for (i = 0; i < job.threads; i++)
+		if (pthread_create(&workers[i].thread, NULL, worker_main,
+				   &workers[i]))
+			die("Cannot start thread %d", i);
+
+	/* Live reports, until the end of the run */
+	for (next = job.interval; ; next += job.interval) {
+		if (next > job.duration)
+			next = job.duration;
+		elapsed = (now_ns() - start) / 1e9;
+		if (next > elapsed)
+			usleep((next - elapsed) * 1e6);
+		if (next >= job.duration)
+			break;
+		snprintf(label, sizeof(label), "[%6.1fs]", next);
+		report(last, job.interval, label);
+	}
+
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < job.threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	elapsed = (now_ns() - start) / 1e9;
+
+	report_final(elapsed);
+
+	cleanup_files();
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	for (i = 0; i < job.threads; i++) {
+		free(workers[i].buf);
+		free(workers[i].next);
+	}
+
+	return 0;
+}
@@ -0,0 +1,232 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <crc32c.h>
+#include <disk.h>
+#include <fs.h>
+
+#include "fs_layout.h"
+
+#define mkfs_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	mkfs_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Formatting options, from the command line */
+static struct {
+	long data_blocks;
+	long fat_blocks;
+	long journal_blocks;
+	int checksum;
+	int prealloc;
+} opts = {
+	.fat_blocks = -1,
+	.journal_blocks = -1,
+};
+
+static void usage(const char *program)
+{
+	fprintf(stderr,
+		"Usage: %s <diskname> <data block count> [option...]\n"
+		"Options:\n"
+		"\tbs=%d\t\tblock size (fixed at build time)\n"
+		"\tfat=N\t\tFAT blocks, more than needed giving extra FAT\n"
+		"\t\t\tentries to block deduplication [as few as needed]\n"
+		"\tjournal=N\treserved journal blocks, 0 to let libfs allocate\n"
+		"\t\t\tthe journal on first use [as libfs would]\n"
+		"\tchecksum\treserve the checksum table, enabling checksums\n"
+		"\tprealloc\tallocate the image's space instead of leaving it\n"
+		"\t\t\tsparse\n", program, BLOCK_SIZE);
+	exit(1);
+}
+
+static long parse_number(const char *s)
+{
+	char *end;
+	long n = strtol(s, &end, 0);
+
+	if (end == s || *end || n < 0)
+		die("Invalid number '%s'", s);
+	return n;
+}
+
+static void parse_option(const char *arg)
+{
+	if (!strncmp(arg, "bs=", 3)) {
+		if (parse_number(arg + 3) != BLOCK_SIZE)
+			die("Block size must be %d", BLOCK_SIZE);
+	} else if (!strncmp(arg, "fat=", 4)) {
+		opts.fat_blocks = parse_number(arg + 4);
+	} else if (!strncmp(arg, "journal=", 8)) {
+		opts.journal_blocks = parse_number(arg + 8);
+	} else if (!strcmp(arg, "checksum")) {
+		opts.checksum = 1;
+	} else if (!strcmp(arg, "prealloc")) {
+		opts.prealloc = 1;
+	} else {
+		die("Unknown option '%s'", arg);
+	}
+}
+
+/* Chain @count blocks from FAT entry @first, and return the next entry */
+static long reserve_chain(uint16_t *fat, long first, long count)
+{
+	long i;
+
+	for (i = first; i < first + count; i++)
+		fat[i] = i + 1 < first + count ? i + 1 : FS_FAT_EOC;
+	return first + count;
+}
+
+/*
+ * Create an empty file system image. Only the superblock, the FAT and the
+ * reserved areas are written: the rest of the image is left sparse, or
+ * allocated without being written, so that formatting takes about as long
+ * whatever the image size.
+ */
+int main(int argc, char **argv)
+{
+	struct fs_superblock *super;
+	long min_fat, checksum_blocks = 0, next;
+	size_t disk_size;
+	uint16_t *fat;
+	uint32_t *table = NULL, zero_crc;
+	struct timespec start, end;
+	char *zero;
+	int fd, i;
+
+	if (argc < 3)
+		usage(argv[0]);
+	opts.data_blocks = parse_number(argv[2]);
+	for (i = 3; i < argc; i++)
+		parse_option(argv[i]);
+
+	/* Geometry */
+	min_fat = (opts.data_blocks + FS_FAT_PER_BLOCK - 1) / FS_FAT_PER_BLOCK;
+	if (opts.fat_blocks < 0)
+		opts.fat_blocks = min_fat;
+	if (opts.data_blocks < 2)
+		die("At least 2 data blocks are needed");
+	if (opts.fat_blocks < min_fat || opts.fat_blocks > UINT8_MAX)
+		die("FAT blocks must be between %ld and %d", min_fat, UINT8_MAX);
+	if (opts.data_blocks + opts.fat_blocks + 2 > FS_MAX_DISK_BLOCKS)
+		die("At most %ld data blocks fit with %ld FAT blocks",
+		    FS_MAX_DISK_BLOCKS - opts.fat_blocks - 2, opts.fat_blocks);
+
+	/* Reserved areas, sized as libfs would */
+	if (opts.checksum)
+		checksum_blocks = (opts.data_blocks * sizeof(uint32_t) +
+				   BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (opts.journal_blocks < 0) {
+		opts.journal_blocks = opts.data_blocks / 32;
+		if (opts.journal_blocks < FS_JOURNAL_MIN_BLOCKS)
+			opts.journal_blocks = FS_JOURNAL_MIN_BLOCKS;
+		if (opts.journal_blocks > FS_JOURNAL_MAX_BLOCKS)
+			opts.journal_blocks = FS_JOURNAL_MAX_BLOCKS;
+		/* libfs does not let the journal take the files' space */
+		if (opts.data_blocks - 1 - checksum_blocks <
+		    4 * opts.journal_blocks)
+			opts.journal_blocks = 0;
+	}
+	if (opts.journal_blocks && (opts.journal_blocks < FS_JOURNAL_MIN_BLOCKS ||
+				    opts.journal_blocks > FS_JOURNAL_MAX_BLOCKS))
+		die("Journal blocks must be 0, or between %d and %d",
+		    FS_JOURNAL_MIN_BLOCKS, FS_JOURNAL_MAX_BLOCKS);
+	if (1 + opts.journal_blocks + checksum_blocks > opts.data_blocks)
+		die("Reserved areas do not fit in %ld data blocks",
+		    opts.data_blocks);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	super = calloc(1, BLOCK_SIZE);
+	fat = calloc(opts.fat_blocks, BLOCK_SIZE);
+	zero = calloc(1, BLOCK_SIZE);
+	if (!super || !fat || !zero)
+		die("out of memory");
+
+	memcpy(super->signature, FS_SIGNATURE, sizeof(super->signature));
+	super->fat_blocks = opts.fat_blocks;
+	super->root_block = opts.fat_blocks + 1;
+	super->data_start = opts.fat_blocks + 2;
+	super->data_blocks = opts.data_blocks;
+	super->disk_blocks = opts.data_blocks + opts.fat_blocks + 2;
+
+	/* Reserved areas are contiguous at the start of the data area */
+	fat[0] = FS_FAT_EOC;
+	next = 1;
+	if (opts.journal_blocks) {
+		super->journal_index = next;
+		super->journal_blocks = opts.journal_blocks;
+		for (i = 0; i < opts.journal_blocks; i++)
+			super->journal_map[i] = next + i;
+		next = reserve_chain(fat, next, opts.journal_blocks);
+	}
+	if (checksum_blocks) {
+		super->checksum_index = next;
+		super->checksum_blocks = checksum_blocks;
+		table = calloc(checksum_blocks, BLOCK_SIZE);
+		if (!table)
+			die("out of memory");
+		/* The journal is the only area in use, and it is empty */
+		zero_crc = crc32c(0, zero, BLOCK_SIZE);
+		for (i = 0; i < opts.journal_blocks; i++)
+			table[super->journal_index + i] = zero_crc;
+		reserve_chain(fat, next, checksum_blocks);
+	}
+
+	/* Truncating leaves the root directory and the journal empty */
+	fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		die_perror("open");
+	disk_size = (size_t)super->disk_blocks * BLOCK_SIZE;
+	if (opts.prealloc) {
+		if (posix_fallocate(fd, 0, disk_size))
+			die("Cannot allocate %zu bytes", disk_size);
+	} else if (ftruncate(fd, disk_size)) {
+		die_perror("ftruncate");
+	}
+
+	if (pwrite(fd, super, BLOCK_SIZE, 0) != BLOCK_SIZE ||
+	    pwrite(fd, fat, opts.fat_blocks * BLOCK_SIZE, BLOCK_SIZE) !=
+	    opts.fat_blocks * BLOCK_SIZE)
+		die_perror("pwrite");
+	if (table && pwrite(fd, table, checksum_blocks * BLOCK_SIZE,
+			    (super->data_start + super->checksum_index) *
+			    (size_t)BLOCK_SIZE) != checksum_blocks * BLOCK_SIZE)
+		die_perror("pwrite");
+	if (fsync(fd) || close(fd))
+		die_perror("fsync");
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("Created virtual disk '%s' with '%ld' data blocks\n", argv[1],
+	       opts.data_blocks);
+	printf("blocks=%d fat_blocks=%ld journal_blocks=%ld "
+	       "checksum_blocks=%ld size=%.1fMB%s time=%.3fms\n",
+	       super->disk_blocks, opts.fat_blocks, opts.journal_blocks,
+	       checksum_blocks, disk_size / (1024.0 * 1024),
+	       opts.prealloc ? " (preallocated)" : " (sparse)",
+	       (end.tv_sec - start.tv_sec) * 1e3 +
+	       (end.tv_nsec - start.tv_nsec) / 1e6);
+
+	free(super);
+	free(fat);
+	free(zero);
+	free(table);
+
+	return 0;
+}
@@ -0,0 +1,680 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <disk.h>
+#include <fs.h>
+#include <protocol.h>
+
+#define server_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#define die(...)				\
+do {							\
+	server_error(__VA_ARGS__);	\
+	exit(1);					\
+} while (0)
+
+#define die_perror(msg)			\
+do {							\
+	perror(msg);				\
+	exit(1);					\
+} while (0)
+
+/* Largest number of connected clients */
+#define MAX_CLIENTS 256
+/* Free space kept in the receive buffer before reading from the socket */
+#define RECEIVE_CHUNK 65536
+/* Responses of a batch are sent early once they reach this size */
+#define SEND_BUFFER_MAX (256 * 1024)
+
+/* Server options, from the command line */
+static struct {
+	int clients;
+	size_t cache;
+	int shared;
+} opts = {
+	.clients = 64,
+	.cache = 1024,
+	.shared = 1,
+};
+
+/* Bytes buffered from or for a socket */
+struct buffer {
+	char *data;
+	size_t start;	/* First byte not consumed yet */
+	size_t len;	/* End of the buffered bytes */
+	size_t cap;
+};
+
+struct client {
+	int sock;
+	int active;
+	/* File descriptors opened by the client, which only it can use */
+	char fds[FS_OPEN_MAX_COUNT];
+	struct buffer in;
+	struct buffer out;
+};
+
+/* Totals of all the clients */
+static struct {
+	uint64_t clients;
+	uint64_t requests;
+	uint64_t batches;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+	uint64_t bytes_shared;
+} stats;
+
+static struct client clients[MAX_CLIENTS];
+static int active_clients;
+static pthread_mutex_t clients_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t clients_cond = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Read-only descriptor of the virtual disk file, passed to the clients along
+ * with the file generation table
+ */
+static int disk_fd = -1;
+
+static void usage(const char *program)
+{
+	fprintf(stderr,
+		"Usage: %s <diskname> <socket> [option...]\n"
+		"Options:\n"
+		"\tclients=N\tlargest number of connected clients [64]\n"
+		"\tcache=N\t\tblocks of the shared block cache, 0 for none "
+		"[1024]\n"
+		"\tshared=0|1\tlet clients map the disk and read from it "
+		"[1]\n", program);
+	exit(1);
+}
+
+static long parse_number(const char *s)
+{
+	char *end;
+	long n = strtol(s, &end, 0);
+
+	if (end == s || *end || n < 0)
+		die("Invalid number '%s'", s);
+	return n;
+}
+
+static void parse_option(const char *arg)
+{
+	if (!strncmp(arg, "clients=", 8)) {
+		opts.clients = parse_number(arg + 8);
+		if (opts.clients < 1 || opts.clients > MAX_CLIENTS)
+			die("Clients must be between 1 and %d", MAX_CLIENTS);
+	} else if (!strncmp(arg, "cache=", 6)) {
+		opts.cache = parse_number(arg + 6);
+	} else if (!strncmp(arg, "shared=", 7)) {
+		opts.shared = !!parse_number(arg + 7);
+	} else {
+		die("Unknown option '%s'", arg);
+	}
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void add_stat(uint64_t *counter, uint64_t n)
+{
+	__atomic_add_fetch(counter, n, __ATOMIC_RELAXED);
+}
+
+/* Make room for @size more bytes at the end of @b */
+static int buffer_reserve(struct buffer *b, size_t size)
+{
+	size_t cap;
+	char *data;
+
+	if (b->start) {
+		memmove(b->data, b->data + b->start, b->len - b->start);
+		b->len -= b->start;
+		b->start = 0;
+	}
+	if (b->cap - b->len >= size)
+		return 0;
+
+	cap = b->cap ? b->cap : RECEIVE_CHUNK;
+	while (cap - b->len < size)
+		cap *= 2;
+	data = realloc(b->data, cap);
+	if (!data)
+		return -1;
+	b->data = data;
+	b->cap = cap;
+
+	return 0;
+}
+
+/* Send the buffered responses */
+static int send_responses(struct client *cl)
+{
+	ssize_t ret;
+
+	while (cl->out.len > cl->out.start) {
+		ret = send(cl->sock, cl->out.data + cl->out.start,
+			   cl->out.len - cl->out.start, MSG_NOSIGNAL);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return -1;
+		cl->out.start += ret;
+	}
+	cl->out.start = cl->out.len = 0;
+
+	return 0;
+}
+
+/*
+ * Queue a response, whose @length bytes of data were written after the room
+ * left for the response by reserve_response()
+ */
+static void queue_response(struct client *cl, int result, size_t length,
+			   size_t extents)
+{
+	struct fs_response resp = {
+		.result = result,
+		.length = length,
+		.extents = extents,
+	};
+
+	memcpy(cl->out.data + cl->out.len, &resp, sizeof(resp));
+	cl->out.len += sizeof(resp) + length;
+}
+
+/* Make room for a response and @size bytes of data, and return the data's */
+static char *reserve_response(struct client *cl, size_t size)
+{
+	if (buffer_reserve(&cl->out, sizeof(struct fs_response) + size))
+		return NULL;
+	return cl->out.data + cl->out.len + sizeof(struct fs_response);
+}
+
+/*
+ * Greet the client, sending it the virtual disk file and the file generation
+ * table if it asks for them
+ */
+static int hello(struct client *cl, const struct fs_request *req)
+{
+	struct fs_response resp = {
+		.result = req->count == FS_PROTOCOL_VERSION ? 0 : -1,
+	};
+	int fds[2] = { disk_fd, fs_generation_fd() };
+	char control[CMSG_SPACE(sizeof(fds))] = { 0 };
+	struct iovec iov = { &resp, sizeof(resp) };
+	struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1 };
+	struct cmsghdr *cmsg;
+
+	if (send_responses(cl))
+		return -1;
+
+	if (!resp.result && (req->offset & 1) && disk_fd >= 0) {
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+	}
+
+	return sendmsg(cl->sock, &msg, MSG_NOSIGNAL) == sizeof(resp) ? 0 : -1;
+}
+
+/* Whether @p points into the mapping of the virtual disk file */
+static int on_disk(const char *base, size_t disk_size, const void *p)
+{
+	return base && (const char *)p >= base &&
+	       (const char *)p < base + disk_size;
+}
+
+/*
+ * Read with fs_read_view(), answering with the generation of the viewed
+ * content, the extents of the disk holding the data, and the data itself for
+ * the parts that are not on the disk. The view is released before the client
+ * copies the extents: it checks the generation afterwards instead.
+ */
+static int pread_shared(struct client *cl, int fd, size_t count, size_t offset)
+{
+	struct fs_view_stamp stamp = { 0 };
+	struct fs_extent extent;
+	struct iovec *iov;
+	const char *base;
+	size_t disk_size, inline_size = 0, size;
+	char *data;
+	int i, iovcnt, ret, slot;
+
+	ret = fs_generation(fd, &slot, &stamp.generation);
+	stamp.slot = slot;
+	if (!ret)
+		ret = fs_read_view(fd, offset, count, &iov, &iovcnt,
+				   &stamp.generation);
+	if (ret < 0) {
+		/* Compressed files cannot be viewed */
+		data = reserve_response(cl, count);
+		if (!data)
+			return -1;
+		ret = fs_pread(fd, data, count, offset);
+		queue_response(cl, ret, ret > 0 ? ret : 0, 0);
+		if (ret > 0)
+			add_stat(&stats.bytes_read, ret);
+		return 0;
+	}
+
+	/* Without a mapping, none of the data is on the disk */
+	base = block_view(0);
+	disk_size = base ? (size_t)block_disk_count() * BLOCK_SIZE : 0;
+	for (i = 0; i < iovcnt; i++)
+		if (!on_disk(base, disk_size, iov[i].iov_base))
+			inline_size += iov[i].iov_len;
+
+	size = sizeof(stamp) + iovcnt * sizeof(extent);
+	data = reserve_response(cl, size + inline_size);
+	if (!data) {
+		fs_release_view(iov);
+		return -1;
+	}
+	memcpy(data, &stamp, sizeof(stamp));
+	for (i = 0; i < iovcnt; i++) {
+		extent.length = iov[i].iov_len;
+		if (on_disk(base, disk_size, iov[i].iov_base)) {
+			extent.offset = (const char *)iov[i].iov_base - base;
+		} else {
+			extent.offset = FS_EXTENT_INLINE;
+			memcpy(data + size, iov[i].iov_base, iov[i].iov_len);
+			size += iov[i].iov_len;
+		}
+		/* Responses are not aligned in the buffer */
+		memcpy(data + sizeof(stamp) + i * sizeof(extent), &extent,
+		       sizeof(extent));
+	}
+	fs_release_view(iov);
+
+	queue_response(cl, ret, size, iovcnt);
+	add_stat(&stats.bytes_shared, ret - inline_size);
+	add_stat(&stats.bytes_read, inline_size);
+
+	return 0;
+}
+
+/* Run a request, whose names and data are valid, and queue its response */
+static int run_request(struct client *cl, const struct fs_request *req,
+		       const char *name, const char *name2, const char *data)
+{
+	struct fs_wire_dirent *wire;
+	struct fs_dirent entry;
+	struct fs_dir dir;
+	char *buf;
+	int fd = req->fd, ret = -1;
+
+	/* File descriptors of other clients are invalid */
+	if (req->op >= FS_REQ_CLOSE && req->op <= FS_REQ_PREAD_SHARED &&
+	    (fd < 0 || fd >= FS_OPEN_MAX_COUNT || !cl->fds[fd])) {
+		if (!reserve_response(cl, 0))
+			return -1;
+		queue_response(cl, -1, 0, 0);
+		return 0;
+	}
+
+	switch (req->op) {
+	case FS_REQ_READ:
+	case FS_REQ_PREAD:
+		buf = reserve_response(cl, req->count);
+		if (!buf)
+			return -1;
+		if (req->op == FS_REQ_READ)
+			ret = fs_read(fd, buf, req->count);
+		else
+			ret = fs_pread(fd, buf, req->count, req->offset);
+		queue_response(cl, ret, ret > 0 ? ret : 0, 0);
+		if (ret > 0)
+			add_stat(&stats.bytes_read, ret);
+		return 0;
+	case FS_REQ_PREAD_SHARED:
+		return pread_shared(cl, fd, req->count, req->offset);
+	case FS_REQ_READDIR:
+		buf = reserve_response(cl, sizeof(*wire));
+		if (!buf)
+			return -1;
+		dir.pos = req->offset;
+		ret = req->offset <= FS_FILE_MAX_COUNT ?
+		      fs_readdir(&dir, &entry) : 0;
+		if (ret != 1) {
+			queue_response(cl, ret, 0, 0);
+			return 0;
+		}
+		wire = (struct fs_wire_dirent *)buf;
+		memcpy(wire->name, entry.name, FS_FILENAME_LEN);
+		wire->size = entry.size;
+		wire->first_block = entry.first_block;
+		wire->extent_count = entry.extent_count;
+		wire->next = dir.pos;
+		queue_response(cl, ret, sizeof(*wire), 0);
+		return 0;
+	}
+
+	switch (req->op) {
+	case FS_REQ_SYNC:
+		ret = fs_sync();
+		break;
+	case FS_REQ_DEDUP:
+		ret = fs_dedup(req->count);
+		break;
+	case FS_REQ_CHECKSUM:
+		ret = fs_checksum(req->count);
+		break;
+	case FS_REQ_SNAPSHOT:
+		ret = name ? fs_snapshot(name) : -1;
+		break;
+	case FS_REQ_SNAPSHOT_DELETE:
+		ret = name ? fs_snapshot_delete(name) : -1;
+		break;
+	case FS_REQ_CREATE:
+		ret = name ? fs_create(name) : -1;
+		break;
+	case FS_REQ_DELETE:
+		ret = name ? fs_delete(name) : -1;
+		break;
+	case FS_REQ_COPY:
+		ret = name2 ? fs_copy(name, name2, req->count) : -1;
+		break;
+	case FS_REQ_COMPRESS:
+		ret = name ? fs_compress(name, req->count) : -1;
+		break;
+	case FS_REQ_OPEN:
+		ret = name ? fs_open(name) : -1;
+		if (ret >= 0)
+			cl->fds[ret] = 1;
+		break;
+	case FS_REQ_CLOSE:
+		ret = fs_close(fd);
+		if (!ret)
+			cl->fds[fd] = 0;
+		break;
+	case FS_REQ_STAT:
+		ret = fs_stat(fd);
+		break;
+	case FS_REQ_LSEEK:
+		ret = fs_lseek(fd, req->offset);
+		break;
+	case FS_REQ_WRITE:
+	case FS_REQ_PWRITE:
+		if (req->op == FS_REQ_WRITE)
+			ret = fs_write(fd, (void *)data, req->count);
+		else
+			ret = fs_pwrite(fd, (void *)data, req->count,
+					req->offset);
+		if (ret > 0)
+			add_stat(&stats.bytes_written, ret);
+		break;
+	}
+
+	if (!reserve_response(cl, 0))
+		return -1;
+	queue_response(cl, ret, 0, 0);
+
+	return 0;
+}
+
+/*
+ * Run the requests received whole, in order. Return -1 if the client sent an
+ * invalid request.
+ */
+static int run_requests(struct client *cl)
+{
+	struct fs_request req;
+	const char *names, *name, *name2;
+	size_t avail, size;
+
+	for (;;) {
+		avail = cl->in.len - cl->in.start;
+		if (avail < sizeof(req))
+			return 0;
+		memcpy(&req, cl->in.data + cl->in.start, sizeof(req));
+		if (req.op >= FS_REQ_COUNT || req.count > FS_PROTOCOL_MAX_DATA ||
+		    req.name_len > FS_PROTOCOL_MAX_NAMES)
+			return -1;
+		size = sizeof(req) + req.name_len;
+		if (req.op == FS_REQ_WRITE || req.op == FS_REQ_PWRITE)
+			size += req.count;
+		if (avail < size)
+			return 0;
+
+		/* Names are NULL-terminated, the second one being optional */
+		names = cl->in.data + cl->in.start + sizeof(req);
+		name = name2 = NULL;
+		if (req.name_len) {
+			if (names[req.name_len - 1])
+				return -1;
+			name = names;
+			if (strlen(name) + 1 < req.name_len)
+				name2 = name + strlen(name) + 1;
+		}
+
+		if (req.op == FS_REQ_HELLO) {
+			if (hello(cl, &req))
+				return -1;
+		} else if (run_request(cl, &req, name, name2,
+				       names + req.name_len)) {
+			return -1;
+		}
+		cl->in.start += size;
+		add_stat(&stats.requests, 1);
+
+		if (cl->out.len - cl->out.start >= SEND_BUFFER_MAX &&
+		    send_responses(cl))
+			return -1;
+	}
+}
+
+/* Serve a client until it disconnects, one batch of requests at a time */
+static void *serve(void *arg)
+{
+	struct client *cl = arg;
+	ssize_t ret;
+	int fd;
+
+	for (;;) {
+		if (buffer_reserve(&cl->in, RECEIVE_CHUNK))
+			break;
+		ret = recv(cl->sock, cl->in.data + cl->in.len,
+			   cl->in.cap - cl->in.len, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			break;
+		cl->in.len += ret;
+
+		/* All the responses of the batch are sent together */
+		if (run_requests(cl) || send_responses(cl))
+			break;
+		add_stat(&stats.batches, 1);
+	}
+
+	for (fd = 0; fd < FS_OPEN_MAX_COUNT; fd++)
+		if (cl->fds[fd])
+			fs_close(fd);
+	free(cl->in.data);
+	free(cl->out.data);
+
+	/* Closed under the lock, not to be shut down once reused */
+	pthread_mutex_lock(&clients_lock);
+	close(cl->sock);
+	memset(cl, 0, sizeof(*cl));
+	active_clients--;
+	pthread_cond_signal(&clients_cond);
+	pthread_mutex_unlock(&clients_lock);
+
+	return NULL;
+}
+
+static void accept_client(int listen_sock)
+{
+	struct client *cl = NULL;
+	pthread_attr_t attr;
+	pthread_t thread;
+	int i, sock;
+
+	sock = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+	if (sock < 0)
+		return;
+
+	pthread_mutex_lock(&clients_lock);
+	if (active_clients < opts.clients) {
+		for (i = 0; i < MAX_CLIENTS && !cl; i++)
+			if (!clients[i].active)
+				cl = &clients[i];
+	}
+	if (!cl) {
+		pthread_mutex_unlock(&clients_lock);
+		server_error("too many clients, closing connection");
+		close(sock);
+		return;
+	}
+	cl->active = 1;
+	cl->sock = sock;
+	active_clients++;
+	pthread_mutex_unlock(&clients_lock);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, serve, cl)) {
+		server_error("cannot start a thread for the client");
+		close(sock);
+		pthread_mutex_lock(&clients_lock);
+		memset(cl, 0, sizeof(*cl));
+		active_clients--;
+		pthread_mutex_unlock(&clients_lock);
+	} else {
+		add_stat(&stats.clients, 1);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * Mount a file system once and serve it to the clients connecting to a Unix
+ * domain socket, until SIGINT or SIGTERM
+ */
+int main(int argc, char **argv)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct pollfd pfd[2];
+	size_t hits, misses;
+	uint64_t start;
+	sigset_t mask;
+	struct stat st;
+	double elapsed;
+	int i, sock;
+
+	if (argc < 3)
+		usage(argv[0]);
+	for (i = 3; i < argc; i++)
+		parse_option(argv[i]);
+	if (strlen(argv[2]) >= sizeof(addr.sun_path))
+		die("Socket path '%s' is too long", argv[2]);
+	strcpy(addr.sun_path, argv[2]);
+
+	/* Signals are handled by the main thread, through a signalfd */
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &mask, NULL);
+	pfd[1].fd = signalfd(-1, &mask, SFD_CLOEXEC);
+	pfd[1].events = POLLIN;
+	if (pfd[1].fd < 0)
+		die_perror("signalfd");
+
+	block_cache_size(opts.cache);
+	if (fs_mount(argv[1]))
+		die("Cannot mount diskname");
+	/* Clients cannot check the blocks they read without the generations */
+	if (opts.shared && fs_generation_fd() < 0) {
+		server_error("cannot share the file generations, "
+			     "reads go through the socket");
+		opts.shared = 0;
+	}
+	if (opts.shared) {
+		disk_fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+		if (disk_fd < 0)
+			die_perror("open");
+	}
+
+	/* Replace the socket of a previous server */
+	if (!lstat(argv[2], &st) && S_ISSOCK(st.st_mode))
+		unlink(argv[2]);
+	sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		die_perror("socket");
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(sock, SOMAXCONN))
+		die_perror("bind");
+	pfd[0].fd = sock;
+	pfd[0].events = POLLIN;
+
+	printf("Serving '%s' on '%s'\n", argv[1], argv[2]);
+	fflush(stdout);
+	start = now_ns();
+
+	for (;;) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die_perror("poll");
+		}
+		if (pfd[1].revents)
+			break;
+		if (pfd[0].revents)
+			accept_client(sock);
+	}
+
+	/* Disconnect the clients once their current request is done */
+	close(sock);
+	unlink(argv[2]);
+	pthread_mutex_lock(&clients_lock);
+	for (i = 0; i < MAX_CLIENTS; i++)
+		if (clients[i].active)
+			shutdown(clients[i].sock, SHUT_RDWR);
+	while (active_clients)
+		pthread_cond_wait(&clients_cond, &clients_lock);
+	pthread_mutex_unlock(&clients_lock);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	if (disk_fd >= 0)
+		close(disk_fd);
+
+	elapsed = (now_ns() - start) / 1e9;
+	block_cache_stats(&hits, &misses);
+	printf("Served %lu clients: %lu requests in %lu batches "
+	       "(%.1f per batch)\n", (unsigned long)stats.clients,
+	       (unsigned long)stats.requests, (unsigned long)stats.batches,
+	       stats.batches ? (double)stats.requests / stats.batches : 0);
+	printf("read=%.1fMB written=%.1fMB shared=%.1fMB cache_hits=%zu "
+	       "cache_misses=%zu time=%.3fs\n",
+	       stats.bytes_read / (1024.0 * 1024),
+	       stats.bytes_written / (1024.0 * 1024),
+	       stats.bytes_shared / (1024.0 * 1024), hits, misses, elapsed);
+
+	return 0;
+}
@@ -1,15 +1,24 @@
 #include <assert.h>
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <client.h>
 #include <fs.h>
+#include <trace.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -34,239 +43,522 @@ struct thread_arg {
 	char **argv;
 };
 
-void thread_fs_script(void *arg)
+uint64_t monotonic_ns(void)
 {
-	struct thread_arg *t_arg = arg;
-	struct stat st;
-	char *diskname, *script;
-	FILE *fd_script;
-	char *command, *data_source, *data_description, *data, *fs_filename;
-	const int total_command_parts = 4;
-	char *command_args[total_command_parts];
-	int offset;
-	char mounted = 0;
+	struct timespec ts;
 
-	char line_buffer[1024];
-	int command_index = 1;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-	if (t_arg->argc < 2)
-		die("Usage: <diskname> <script filename>");
+/* Largest number of tab-separated fields of a script line */
+#define SCRIPT_MAX_ARGS 6
+/* Largest nesting of REPEAT and LOOP blocks */
+#define SCRIPT_MAX_DEPTH 16
+/* Largest number of TIME sections running at the same time */
+#define SCRIPT_MAX_TIMERS 16
 
-	diskname = t_arg->argv[0];
-	script = t_arg->argv[1];
+/* Script line, split into fields */
+struct script_line {
+	int lineno;
+	int argc;
+	char *argv[SCRIPT_MAX_ARGS];
+	/* Index of the END line of a REPEAT or LOOP line, and conversely */
+	int match;
+	/* Data of a WRITE or READ line, loaded or generated on first use */
+	char *data;
+	size_t data_size;
+};
+
+/* REPEAT or LOOP block being run */
+struct script_block {
+	int start;		/* Index of the REPEAT or LOOP line */
+	long iteration;
+	long count;		/* Iterations of a REPEAT block */
+	uint64_t deadline;	/* End of a LOOP block */
+};
+
+/* Running TIME section */
+struct script_timer {
+	const char *label;
+	uint64_t start;
+	uint64_t ops;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+};
+
+struct script {
+	const char *diskname;
+	struct script_line *lines;
+	int nlines;
+	char mounted;
+	/* File descriptor slots, and the one commands apply to */
+	int fds[FS_OPEN_MAX_COUNT];
+	int cur;
+	struct script_block blocks[SCRIPT_MAX_DEPTH];
+	int depth;
+	struct script_timer timers[SCRIPT_MAX_TIMERS];
+	int ntimers;
+	/* Buffer of READ */
+	char *read_buf;
+	size_t read_buf_size;
+	/* Totals of the file-system commands, for the TIME sections */
+	uint64_t ops;
+	uint64_t bytes_read;
+	uint64_t bytes_written;
+};
+
+/* Report an error on a script line, unmounting the file system first */
+#define script_die(s, l, fmt, ...)					\
+do {									\
+	if ((s)->mounted)						\
+		fs_umount();						\
+	die("line %d: "fmt, (l)->lineno, ##__VA_ARGS__);		\
+} while (0)
+
+/* Parse a size in bytes, with an optional K, M or G suffix */
+size_t script_size(struct script *s, struct script_line *l, const char *arg)
+{
+	char *end;
+	long size;
+
+	if (!arg)
+		script_die(s, l, "missing size");
+	size = strtol(arg, &end, 0);
+	if (*end == 'K' || *end == 'k')
+		size *= 1024, end++;
+	else if (*end == 'M' || *end == 'm')
+		size *= 1024 * 1024, end++;
+	else if (*end == 'G' || *end == 'g')
+		size *= 1024 * 1024 * 1024, end++;
+	if (end == arg || *end || size < 0 || size > INT_MAX)
+		script_die(s, l, "invalid size '%s'", arg);
+	return size;
+}
+
+/* Read a script, matching the REPEAT and LOOP lines with their END line */
+void script_load(struct script *s, const char *path)
+{
+	int stack[SCRIPT_MAX_DEPTH], depth = 0, lineno = 0;
+	char line_buffer[1024], *nl, *copy;
+	struct script_line *l;
+	FILE *fd_script;
 
 	/* Open script on host computer */
-	fd_script = fopen(script, "r");
+	fd_script = fopen(path, "r");
 	if (!fd_script)
 		die_perror("fopen");
 
-	int fs_fd = -1;
+	while (fgets(line_buffer, sizeof(line_buffer), fd_script) != NULL) {
+		lineno++;
 
-	/* Loop through the script and execute the specified commands */
-	while (fgets(line_buffer, 1024, fd_script) != NULL) {
 		/* Remove trailing newline from command line */
-		char *nl = strchr(line_buffer, '\n');
+		nl = strchr(line_buffer, '\n');
 		if (nl)
 			*nl = '\0';
 
+		/* Skip empty lines and comments */
+		if (!line_buffer[0] || line_buffer[0] == '#')
+			continue;
+
+		s->lines = realloc(s->lines, (s->nlines + 1) * sizeof(*l));
+		copy = strdup(line_buffer);
+		if (!s->lines || !copy)
+			die("out of memory");
+		l = &s->lines[s->nlines];
+		memset(l, 0, sizeof(*l));
+		l->lineno = lineno;
+
 		/* Tokenize line */
-		command_args[0] = strtok(line_buffer, "\t");
-		command_index = 1;
-		do {
-			command_args[command_index] = strtok(NULL, "\t");
-		} while (command_index < total_command_parts && command_args[command_index++] != NULL);
-		command = command_args[0];
+		l->argv[0] = strtok(copy, "\t");
+		while (l->argv[l->argc] && ++l->argc < SCRIPT_MAX_ARGS)
+			l->argv[l->argc] = strtok(NULL, "\t");
+		if (!l->argc) {
+			free(copy);
+			continue;
+		}
+
+		if (!strcmp(l->argv[0], "REPEAT") || !strcmp(l->argv[0], "LOOP")) {
+			if (depth == SCRIPT_MAX_DEPTH)
+				die("line %d: blocks nested too deep", lineno);
+			stack[depth++] = s->nlines;
+		} else if (!strcmp(l->argv[0], "END")) {
+			if (!depth)
+				die("line %d: END without REPEAT or LOOP",
+				    lineno);
+			l->match = stack[--depth];
+			s->lines[l->match].match = s->nlines;
+		}
+		s->nlines++;
+	}
+	if (depth)
+		die("line %d: REPEAT or LOOP without END",
+		    s->lines[stack[depth - 1]].lineno);
+
+	fclose(fd_script);
+}
+
+/* Fill @buf with the pseudo-random bytes of seed @seed */
+void script_random(char *buf, size_t size, uint64_t seed)
+{
+	uint64_t x = seed * 0x9E3779B97F4A7C15ULL + 1, r;
+	size_t i, n;
+
+	for (i = 0; i < size; i += sizeof(r)) {
+		/* xorshift64* */
+		x ^= x >> 12;
+		x ^= x << 25;
+		x ^= x >> 27;
+		r = x * 0x2545F4914F6CDD1DULL;
+		n = size - i < sizeof(r) ? size - i : sizeof(r);
+		memcpy(buf + i, &r, n);
+	}
+}
+
+/*
+ * Get the data described by the fields of line @l from field @first on:
+ * "DATA <data>", "FILE <filename>", "RANDOM <size> [<seed>]" or
+ * "PATTERN <size> <pattern>"
+ */
+char *script_data(struct script *s, struct script_line *l, int first,
+		  size_t *size)
+{
+	const char *source = l->argv[first];
+	const char *arg = first + 1 < l->argc ? l->argv[first + 1] : NULL;
+	struct stat st;
+	size_t i, len;
+	int data_fd;
+
+	if (l->data) {
+		*size = l->data_size;
+		return l->data;
+	}
+
+	if (!source || !arg)
+		script_die(s, l, "Invalid data description");
+
+	if (strcmp(source, "DATA") == 0) {
+		l->data_size = strlen(arg);
+		l->data = strdup(arg);
+	} else if (strcmp(source, "FILE") == 0) {
+		data_fd = open(arg, O_RDONLY);
+		if (data_fd < 0) {
+			fs_umount();
+			die_perror("open");
+		}
+		if (fstat(data_fd, &st)) {
+			fs_umount();
+			die_perror("fstat");
+		}
+		if (!S_ISREG(st.st_mode))
+			script_die(s, l, "Not a regular file: %s", arg);
+		l->data_size = st.st_size;
+		l->data = malloc(l->data_size + 1);
+		if (l->data && read(data_fd, l->data, l->data_size) !=
+		    (ssize_t)l->data_size)
+			script_die(s, l, "Cannot read %s", arg);
+		close(data_fd);
+	} else if (strcmp(source, "RANDOM") == 0) {
+		l->data_size = script_size(s, l, arg);
+		l->data = malloc(l->data_size + 1);
+		if (l->data)
+			script_random(l->data, l->data_size,
+				      first + 2 < l->argc ?
+				      strtoull(l->argv[first + 2], NULL, 0) : 1);
+	} else if (strcmp(source, "PATTERN") == 0) {
+		l->data_size = script_size(s, l, arg);
+		if (first + 2 >= l->argc || !(len = strlen(l->argv[first + 2])))
+			script_die(s, l, "missing pattern");
+		l->data = malloc(l->data_size + 1);
+		for (i = 0; l->data && i < l->data_size; i++)
+			l->data[i] = l->argv[first + 2][i % len];
+	} else {
+		script_die(s, l, "Invalid data description");
+	}
 
-		int data_fd;
-		int count, data_size;
+	if (!l->data)
+		script_die(s, l, "Could not find data");
 
-		char *read_buf;
+	*size = l->data_size;
+	return l->data;
+}
+
+/* Expand "$i" in a file name into the iteration of the innermost block */
+const char *script_name(struct script *s, struct script_line *l, int arg,
+			char *buf)
+{
+	const char *name = l->argv[arg], *var;
+	long iteration = s->depth ? s->blocks[s->depth - 1].iteration : 0;
+
+	if (!name)
+		script_die(s, l, "missing file name");
+	var = strstr(name, "$i");
+	if (!var)
+		return name;
+	snprintf(buf, FS_FILENAME_LEN * 2, "%.*s%ld%s", (int)(var - name),
+		 name, iteration, var + 2);
+	return buf;
+}
+
+/* Select file descriptor slot @arg of line @l, if any */
+void script_slot(struct script *s, struct script_line *l, int arg)
+{
+	char *end;
+	long slot;
+
+	if (arg >= l->argc)
+		return;
+	slot = strtol(l->argv[arg], &end, 0);
+	if (end == l->argv[arg] || *end || slot < 0 ||
+	    slot >= FS_OPEN_MAX_COUNT)
+		script_die(s, l, "invalid fd slot '%s'", l->argv[arg]);
+	s->cur = slot;
+}
+
+void script_time(struct script *s, struct script_line *l)
+{
+	struct script_timer *t;
+	double elapsed, mb;
+	int i;
+
+	if (l->argc < 3 || (strcmp(l->argv[1], "START") &&
+			    strcmp(l->argv[1], "STOP")))
+		script_die(s, l, "usage: TIME START|STOP <label>");
 
-		/* End when no command present */
-		if (!command)
+	for (i = 0; i < s->ntimers; i++)
+		if (!strcmp(s->timers[i].label, l->argv[2]))
 			break;
+	t = &s->timers[i];
+
+	if (!strcmp(l->argv[1], "START")) {
+		if (i == s->ntimers) {
+			if (s->ntimers == SCRIPT_MAX_TIMERS)
+				script_die(s, l, "too many TIME sections");
+			s->ntimers++;
+		}
+		t->label = l->argv[2];
+		t->ops = s->ops;
+		t->bytes_read = s->bytes_read;
+		t->bytes_written = s->bytes_written;
+		t->start = monotonic_ns();
+		return;
+	}
+
+	if (i == s->ntimers)
+		script_die(s, l, "TIME STOP without START");
+	elapsed = (monotonic_ns() - t->start) / 1e9;
+	mb = (s->bytes_read - t->bytes_read +
+	      s->bytes_written - t->bytes_written) / (1024.0 * 1024);
+	printf("TIME %s: %.3f ms, %lu ops (%.0f ops/s), read %.1f MB, "
+	       "written %.1f MB (%.1f MB/s)\n", t->label, elapsed * 1e3,
+	       (unsigned long)(s->ops - t->ops),
+	       elapsed > 0 ? (s->ops - t->ops) / elapsed : 0,
+	       (s->bytes_read - t->bytes_read) / (1024.0 * 1024),
+	       (s->bytes_written - t->bytes_written) / (1024.0 * 1024),
+	       elapsed > 0 ? mb / elapsed : 0);
+
+	/* The section is over */
+	*t = s->timers[--s->ntimers];
+}
+
+/* Run line @pc of the script, and return the index of the next line to run */
+int script_run(struct script *s, int pc)
+{
+	struct script_line *l = &s->lines[pc];
+	struct script_block *b;
+	char name_buf[FS_FILENAME_LEN * 2];
+	const char *command = l->argv[0];
+	/* Only the commands outside of blocks report their success */
+	int verbose = !s->depth;
+	size_t data_size, len;
+	int count, offset;
+	char *data;
+
+	if (strcmp(command, "REPEAT") == 0 || strcmp(command, "LOOP") == 0) {
+		b = &s->blocks[s->depth];
+		b->start = pc;
+		b->iteration = 0;
+		if (command[0] == 'R') {
+			b->count = script_size(s, l, l->argv[1]);
+			if (!b->count)
+				return l->match + 1;
+		} else {
+			if (l->argc < 2 || atof(l->argv[1]) <= 0)
+				script_die(s, l, "invalid duration");
+			b->deadline = monotonic_ns() + atof(l->argv[1]) * 1e9;
+		}
+		s->depth++;
+		return pc + 1;
+	}
+
+	if (strcmp(command, "END") == 0) {
+		b = &s->blocks[s->depth - 1];
+		b->iteration++;
+		if (s->lines[b->start].argv[0][0] == 'R' ?
+		    b->iteration < b->count : monotonic_ns() < b->deadline)
+			return b->start + 1;
+		s->depth--;
+		if (!s->depth)
+			printf("%s done, %ld iterations.\n",
+			       s->lines[b->start].argv[0], b->iteration);
+		return pc + 1;
+	}
 
-		if (strcmp(command, "MOUNT") == 0) {
-			if (fs_mount(diskname))
-				die("Cannot mount disk");
-			else {
+	if (strcmp(command, "TIME") == 0) {
+		script_time(s, l);
+		return pc + 1;
+	}
+
+	if (strcmp(command, "USE") == 0) {
+		if (l->argc < 2)
+			script_die(s, l, "missing fd slot");
+		script_slot(s, l, 1);
+		return pc + 1;
+	}
+
+	s->ops++;
+
+	if (strcmp(command, "MOUNT") == 0) {
+		if (fs_mount(s->diskname))
+			die("Cannot mount disk");
+		else {
+			if (verbose)
 				printf("MOUNT successful.\n");
-				mounted = 1;
-			}
+			s->mounted = 1;
+		}
 
-		} else if (strcmp(command, "UMOUNT") == 0) {
-			if (mounted && fs_umount())
-				die("Cannot unmount");
-			else {
+	} else if (strcmp(command, "UMOUNT") == 0) {
+		if (s->mounted && fs_umount())
+			die("Cannot unmount");
+		else {
+			if (verbose)
 				printf("UMOUNT successful.\n");
-				mounted = 0;
-			}
-
-		} else if (strcmp(command, "CREATE") == 0) {
-			fs_filename = command_args[1];
+			s->mounted = 0;
+		}
 
-			if(fs_create(fs_filename)) {
-				fs_umount();
-				die("Cannot create file");
-			}
+	} else if (strcmp(command, "CREATE") == 0) {
+		if (fs_create(script_name(s, l, 1, name_buf)))
+			script_die(s, l, "Cannot create file");
 
+		if (verbose)
 			printf("CREATE successful.\n");
 
-		} else if (strcmp(command, "DELETE") == 0) {
-			fs_filename = command_args[1];
-
-			if(fs_delete(fs_filename)) {
-				fs_umount();
-				die("Cannot delete file");
-			}
+	} else if (strcmp(command, "DELETE") == 0) {
+		if (fs_delete(script_name(s, l, 1, name_buf)))
+			script_die(s, l, "Cannot delete file");
 
+		if (verbose)
 			printf("DELETE successful.\n");
 
-		} else if (strcmp(command, "OPEN") == 0) {
-			fs_filename = command_args[1];
-
-			fs_fd = fs_open(fs_filename);
+	} else if (strcmp(command, "OPEN") == 0) {
+		script_slot(s, l, 2);
+		s->fds[s->cur] = fs_open(script_name(s, l, 1, name_buf));
 
-			if (fs_fd < 0) {
-				fs_umount();
-				die("Cannot open file");
-			}
+		if (s->fds[s->cur] < 0)
+			script_die(s, l, "Cannot open file");
 
+		if (verbose)
 			printf("OPEN successful.\n");
 
-		} else if (strcmp(command, "CLOSE") == 0) {
-			if (fs_close(fs_fd)) {
-				fs_umount();
-				die("Cannot close file");
-			}
+	} else if (strcmp(command, "CLOSE") == 0) {
+		script_slot(s, l, 1);
+		if (fs_close(s->fds[s->cur]))
+			script_die(s, l, "Cannot close file");
+		s->fds[s->cur] = -1;
 
+		if (verbose)
 			printf("CLOSE successful.\n");
 
-		} else if (strcmp(command, "SEEK") == 0) {
-			offset = atoi(command_args[1]);
-
-			if (fs_lseek(fs_fd, offset)) {
-				fs_umount();
-				die("Cannot seek to position");
-			} else {
-				printf("SEEK successful.\n");
-			}
+	} else if (strcmp(command, "SEEK") == 0) {
+		if (l->argc < 2)
+			script_die(s, l, "missing offset");
+		offset = atoi(l->argv[1]);
 
-		} else if (strcmp(command, "WRITE") == 0) {
-			data_source = command_args[1];
-			data_description = command_args[2];
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
-				data_size = st.st_size;
-				data = mmap(NULL, data_size, PROT_READ, MAP_PRIVATE, data_fd, 0);
-			} else {
-				data = NULL;
-				data_size = 0;
-			}
+		if (fs_lseek(s->fds[s->cur], offset))
+			script_die(s, l, "Cannot seek to position");
+		else if (verbose)
+			printf("SEEK successful.\n");
 
-			if (!data) {
-				fs_umount();
-				die_perror("Could not find data to write");
-			}
+	} else if (strcmp(command, "WRITE") == 0) {
+		data = script_data(s, l, 1, &data_size);
 
-			count = fs_write(fs_fd, data, data_size);
-			if (count < 0) {
-				fs_umount();
-				die("write error");
-			}
+		count = fs_write(s->fds[s->cur], data, data_size);
+		if (count < 0)
+			script_die(s, l, "write error");
+		s->bytes_written += count;
+		if (verbose)
 			printf("Wrote %d bytes to file.\n", count);
 
-		} else if (strcmp(command, "READ") == 0) {
-			int read_req_length = atoi(command_args[1]);
-			data_source = command_args[2];
-			data_description = command_args[3];
-
-			char file_loaded = 0;
-
-			if (strcmp(data_source, "DATA") == 0) {
-				data = data_description;
-				data_size = strlen(data);
-			} else if (strcmp(data_source, "FILE") == 0) {
-				data_fd = open(data_description, O_RDONLY);
-				if (data_fd < 0) {
-					fs_umount();
-					die_perror("open");
-				}
-				if (fstat(data_fd, &st)) {
-					fs_umount();
-					die_perror("fstat");
-				}
-				if (!S_ISREG(st.st_mode)) {
-					fs_umount();
-					die("Not a regular file: %s\n", data_description);
-				}
-
-				FILE *data_file = fopen(data_description, "r");
-				data_size = st.st_size;
-				data = calloc(data_size+1, sizeof(char));
-				size_t n = fread (data, sizeof(char), data_size, data_file);
-				assert(n == sizeof(char) * data_size);
-				fclose(data_file);
-				file_loaded = 1;
-			} else {
-				fs_umount();
-				die("Invalid data description");
-			}
+	} else if (strcmp(command, "READ") == 0) {
+		len = script_size(s, l, l->argv[1]);
+		data = l->argc > 2 ? script_data(s, l, 2, &data_size) : NULL;
 
-			if (!data) {
-				fs_umount();
-				die_perror("Could not find data to write");
-			}
+		if (len + 1 > s->read_buf_size) {
+			s->read_buf = realloc(s->read_buf, len + 1);
+			if (!s->read_buf)
+				script_die(s, l, "out of memory");
+			s->read_buf_size = len + 1;
+		}
 
-			if (read_req_length < 0) {
-				fs_umount();
-				die("invalid data read length");
-			}
+		count = fs_read(s->fds[s->cur], s->read_buf, len);
+		if (count < 0)
+			script_die(s, l, "read error");
+		s->bytes_read += count;
+		s->read_buf[count] = '\0';
+
+		if (!data) {
+			if (verbose)
+				printf("Read %d bytes from file.\n", count);
+		} else if ((size_t)count == data_size &&
+			   !memcmp(data, s->read_buf, count)) {
+			if (verbose)
+				printf("Read %d bytes from file. Compared %zu "
+				       "correct.\n", count, data_size);
+		} else if (!strcmp(l->argv[2], "DATA")) {
+			printf("Read unexpected data! %s read vs given %s\n",
+			       s->read_buf, data);
+		} else {
+			printf("Read unexpected data! %d bytes read vs %zu "
+			       "given (line %d)\n", count, data_size,
+			       l->lineno);
+		}
 
-			read_buf = calloc(read_req_length+1, sizeof(char));
-			count = fs_read(fs_fd, read_buf, read_req_length);
+	} else {
+		script_die(s, l, "unknown command '%s'", command);
+	}
 
-			if (count < 0) {
-				fs_umount();
-				die("read error");
-			}
+	return pc + 1;
+}
 
-			// both data and read_buf were allocated with an extra zero byte
-			// +1 here to check for the canaries
-			if (memcmp(data, read_buf, data_size+1) == 0)
-				printf("Read %d bytes from file. Compared %d correct.\n", count, data_size);
-			else
-				printf("Read unexpected data! %s read vs given %s\n", read_buf, data);
+void thread_fs_script(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct script s = { 0 };
+	int i, pc = 0;
 
-			free(read_buf);
-			if(file_loaded){
-				free(data);
-			}
-		}
-	}
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <script filename>");
+
+	s.diskname = t_arg->argv[0];
+	for (i = 0; i < FS_OPEN_MAX_COUNT; i++)
+		s.fds[i] = -1;
+	script_load(&s, t_arg->argv[1]);
+
+	/* Loop through the script and execute the specified commands */
+	while (pc < s.nlines)
+		pc = script_run(&s, pc);
 
 	/* unmount at the end just to be safe in case there is
 	   no UMOUNT command in script */
-	if (mounted && fs_umount())
+	if (s.mounted && fs_umount())
 		die("Cannot unmount diskname");
 
-	fclose(fd_script);
+	for (i = 0; i < s.nlines; i++) {
+		free(s.lines[i].argv[0]);
+		free(s.lines[i].data);
+	}
+	free(s.lines);
+	free(s.read_buf);
 }
 
 void thread_fs_stat(void *arg)
@@ -319,9 +611,9 @@ void thread_fs_stat(void *arg)
 void thread_fs_cat(void *arg)
 {
 	struct thread_arg *t_arg = arg;
-	char *diskname, *filename, *buf;
+	char *diskname, *filename;
 	int fs_fd;
-	int stat, read;
+	int stat, sent;
 
 	if (t_arg->argc < 2)
 		die("need <diskname> <filename>");
@@ -348,14 +640,12 @@ void thread_fs_cat(void *arg)
 		printf("Empty file\n");
 		return;
 	}
-	buf = malloc(stat);
-	if (!buf) {
-		perror("malloc");
-		fs_umount();
-		die("Cannot malloc");
-	}
 
-	read = fs_read(fs_fd, buf, stat);
+	/* The content is streamed to stdout, after what is buffered there */
+	printf("Read file '%s' (%d/%d bytes)\n", filename, stat, stat);
+	printf("Content of the file:\n");
+	fflush(stdout);
+	sent = fs_sendfile(fs_fd, STDOUT_FILENO, 0, stat);
 
 	if (fs_close(fs_fd)) {
 		fs_umount();
@@ -365,12 +655,8 @@ void thread_fs_cat(void *arg)
 	if (fs_umount())
 		die("cannot unmount diskname");
 
-	printf("Read file '%s' (%d/%d bytes)\n", filename, read, stat);
-	printf("Content of the file:\n");
-	fwrite(buf, 1, stat, stdout);
-	fflush(stdout);
-
-	free(buf);
+	if (sent != stat)
+		die("Cannot read file '%s' (%d/%d bytes)", filename, sent, stat);
 }
 
 void thread_fs_rm(void *arg)
@@ -404,13 +690,14 @@ void thread_fs_add(void *arg)
 	char *diskname, *filename, *buf;
 	int fd, fs_fd;
 	struct stat st;
-	int written;
+	int written, compress;
 
 	if (t_arg->argc < 2)
-		die("Usage: <diskname> <host filename>");
+		die("Usage: <diskname> <host filename> [compress]");
 
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
+	compress = t_arg->argc > 2 && !strcmp(t_arg->argv[2], "compress");
 
 	/* Open file on host computer */
 	fd = open(filename, O_RDONLY);
@@ -438,6 +725,11 @@ void thread_fs_add(void *arg)
 		die("Cannot create file");
 	}
 
+	if (compress && fs_compress(filename, 1)) {
+		fs_umount();
+		die("Cannot compress file");
+	}
+
 	fs_fd = fs_open(filename);
 	if (fs_fd < 0) {
 		fs_umount();
@@ -461,6 +753,326 @@ void thread_fs_add(void *arg)
 	close(fd);
 }
 
+/* Number and size of the buffers between host I/O and image I/O */
+#define PIPE_CHUNKS 8
+#define PIPE_CHUNK_SIZE (256 * 1024)
+
+/* Part of a file, moving between host and image */
+struct chunk {
+	char *buf;
+	size_t len;
+	int file;	/* Index of the file in the transfer list */
+	int first;	/* Chunk starting the file */
+	int last;	/* Chunk ending the file */
+	int error;	/* The file could not be read, drop it */
+};
+
+/*
+ * Ring of chunks filled by one thread and emptied by another, so that host
+ * I/O and image I/O overlap
+ */
+struct pipeline {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct chunk chunks[PIPE_CHUNKS];
+	unsigned long produced;
+	unsigned long consumed;
+};
+
+/* Files of a bulk transfer: host paths and image file names */
+struct transfer {
+	char **paths;
+	char (*names)[FS_FILENAME_LEN];
+	int count;
+	struct pipeline pipe;
+	size_t bytes;
+};
+
+void pipe_init(struct pipeline *pipe)
+{
+	int i;
+
+	memset(pipe, 0, sizeof(*pipe));
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->cond, NULL);
+	for (i = 0; i < PIPE_CHUNKS; i++) {
+		pipe->chunks[i].buf = malloc(PIPE_CHUNK_SIZE);
+		if (!pipe->chunks[i].buf)
+			die("out of memory");
+	}
+}
+
+void pipe_destroy(struct pipeline *pipe)
+{
+	int i;
+
+	for (i = 0; i < PIPE_CHUNKS; i++)
+		free(pipe->chunks[i].buf);
+	pthread_mutex_destroy(&pipe->lock);
+	pthread_cond_destroy(&pipe->cond);
+}
+
+/* Wait for an empty chunk to fill */
+struct chunk *pipe_get_empty(struct pipeline *pipe)
+{
+	pthread_mutex_lock(&pipe->lock);
+	while (pipe->produced - pipe->consumed == PIPE_CHUNKS)
+		pthread_cond_wait(&pipe->cond, &pipe->lock);
+	pthread_mutex_unlock(&pipe->lock);
+	return &pipe->chunks[pipe->produced % PIPE_CHUNKS];
+}
+
+void pipe_push(struct pipeline *pipe)
+{
+	pthread_mutex_lock(&pipe->lock);
+	pipe->produced++;
+	pthread_cond_broadcast(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+/* Wait for a filled chunk to empty */
+struct chunk *pipe_get_full(struct pipeline *pipe)
+{
+	pthread_mutex_lock(&pipe->lock);
+	while (pipe->produced == pipe->consumed)
+		pthread_cond_wait(&pipe->cond, &pipe->lock);
+	pthread_mutex_unlock(&pipe->lock);
+	return &pipe->chunks[pipe->consumed % PIPE_CHUNKS];
+}
+
+void pipe_pop(struct pipeline *pipe)
+{
+	pthread_mutex_lock(&pipe->lock);
+	pipe->consumed++;
+	pthread_cond_broadcast(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+}
+
+double seconds_since(const struct timespec *start)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec - start->tv_sec + (ts.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Add the regular files of a host directory tree to a transfer */
+void walk_dir(struct transfer *t, const char *dirname)
+{
+	struct dirent *ent;
+	struct stat st;
+	char *path;
+	DIR *dir;
+
+	dir = opendir(dirname);
+	if (!dir)
+		die_perror(dirname);
+
+	while ((ent = readdir(dir))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+		path = malloc(strlen(dirname) + strlen(ent->d_name) + 2);
+		if (!path)
+			die("out of memory");
+		sprintf(path, "%s/%s", dirname, ent->d_name);
+		if (lstat(path, &st))
+			die_perror(path);
+
+		if (S_ISDIR(st.st_mode)) {
+			walk_dir(t, path);
+			free(path);
+			continue;
+		}
+		/* The image has a single directory of short names */
+		if (!S_ISREG(st.st_mode) ||
+		    strlen(ent->d_name) >= FS_FILENAME_LEN) {
+			fprintf(stderr, "Skipping '%s': %s\n", path,
+				S_ISREG(st.st_mode) ? "name too long" :
+				"not a regular file");
+			free(path);
+			continue;
+		}
+
+		t->paths = realloc(t->paths, (t->count + 1) * sizeof(*t->paths));
+		t->names = realloc(t->names, (t->count + 1) * sizeof(*t->names));
+		if (!t->paths || !t->names)
+			die("out of memory");
+		t->paths[t->count] = path;
+		strcpy(t->names[t->count], ent->d_name);
+		t->count++;
+	}
+	closedir(dir);
+}
+
+/* Read the host files into the pipeline, in order */
+void *import_reader(void *arg)
+{
+	struct transfer *t = arg;
+	struct chunk *c;
+	ssize_t len;
+	int i, fd;
+
+	for (i = 0; i < t->count; i++) {
+		fd = open(t->paths[i], O_RDONLY);
+		if (fd >= 0)
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+		c = pipe_get_empty(&t->pipe);
+		c->file = i;
+		c->first = 1;
+		do {
+			len = fd < 0 ? -1 : read(fd, c->buf, PIPE_CHUNK_SIZE);
+			c->error = len < 0;
+			c->len = len < 0 ? 0 : len;
+			c->last = len <= 0;
+			pipe_push(&t->pipe);
+			if (c->last)
+				break;
+
+			c = pipe_get_empty(&t->pipe);
+			c->file = i;
+			c->first = 0;
+		} while (1);
+
+		if (fd >= 0)
+			close(fd);
+	}
+	return NULL;
+}
+
+void thread_fs_import(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct transfer t = { 0 };
+	struct timespec start;
+	pthread_t reader;
+	struct chunk *c;
+	int i, fs_fd = -1, imported = 0, created = 0, ok = 0;
+	double seconds;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory>");
+
+	walk_dir(&t, t_arg->argv[1]);
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	pipe_init(&t.pipe);
+	if (pthread_create(&reader, NULL, import_reader, &t))
+		die("Cannot start reader thread");
+
+	/* Write the chunks to the image while the next ones are read */
+	for (i = 0; i < t.count; ) {
+		c = pipe_get_full(&t.pipe);
+		if (c->first) {
+			created = !c->error && !fs_create(t.names[c->file]);
+			fs_fd = created ? fs_open(t.names[c->file]) : -1;
+			ok = fs_fd >= 0;
+		}
+		if (c->error)
+			ok = 0;
+		if (ok && c->len) {
+			if (fs_write(fs_fd, c->buf, c->len) == (int)c->len)
+				t.bytes += c->len;
+			else
+				ok = 0;
+		}
+		if (c->last) {
+			if (fs_fd >= 0)
+				fs_close(fs_fd);
+			if (ok) {
+				imported++;
+			} else {
+				fprintf(stderr, "Skipping '%s': cannot import\n",
+					t.paths[c->file]);
+				if (created)
+					fs_delete(t.names[c->file]);
+			}
+			i++;
+		}
+		pipe_pop(&t.pipe);
+	}
+	pthread_join(reader, NULL);
+
+	/* Metadata is written once, when unmounting */
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	seconds = seconds_since(&start);
+
+	printf("Imported %d/%d files (%zu bytes) in %.3fs, %.1f MB/s\n",
+	       imported, t.count, t.bytes, seconds,
+	       t.bytes / seconds / (1024 * 1024));
+
+	pipe_destroy(&t.pipe);
+	for (i = 0; i < t.count; i++)
+		free(t.paths[i]);
+	free(t.paths);
+	free(t.names);
+}
+
+void thread_fs_export(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_dirent entry;
+	struct timespec start;
+	struct fs_dir dir;
+	char *hostdir, *path;
+	int fd, fs_fd, sent, exported = 0, count = 0;
+	size_t bytes = 0;
+	double seconds;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <host directory>");
+
+	hostdir = t_arg->argv[1];
+	if (mkdir(hostdir, 0755) && errno != EEXIST)
+		die_perror("mkdir");
+	path = malloc(strlen(hostdir) + FS_FILENAME_LEN + 1);
+	if (!path)
+		die("out of memory");
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	/* The kernel copies the content straight from the image, so no host
+	 * buffer is needed whatever the size of the files */
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	fs_opendir(&dir);
+	while (fs_readdir(&dir, &entry) == 1) {
+		count++;
+		sprintf(path, "%s/%s", hostdir, entry.name);
+		fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror(path);
+			continue;
+		}
+		fs_fd = fs_open(entry.name);
+		sent = fs_fd < 0 ? -1 :
+		       fs_sendfile(fs_fd, fd, 0, entry.size);
+		if (sent == (int)entry.size || (!entry.size && !sent)) {
+			bytes += sent;
+			exported++;
+		} else {
+			fprintf(stderr, "Cannot export '%s'\n", entry.name);
+		}
+		if (fs_fd >= 0)
+			fs_close(fs_fd);
+		close(fd);
+	}
+	fs_closedir(&dir);
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+	seconds = seconds_since(&start);
+
+	printf("Exported %d/%d files (%zu bytes) in %.3fs, %.1f MB/s\n",
+	       exported, count, bytes, seconds, bytes / seconds / (1024 * 1024));
+
+	free(path);
+}
+
 void thread_fs_ls(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -480,6 +1092,35 @@ void thread_fs_ls(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_cp(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+	int reflink;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <src> <dst> [reflink]");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+	reflink = t_arg->argc > 3 && !strcmp(t_arg->argv[3], "reflink");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_copy(src, dst, reflink)) {
+		fs_umount();
+		die("Cannot copy file '%s' to '%s'", src, dst);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Copied file '%s' to '%s'%s\n", src, dst,
+	       reflink ? " (reflink)" : "");
+}
+
 void thread_fs_info(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -499,6 +1140,623 @@ void thread_fs_info(void *arg)
 		die("Cannot unmount diskname");
 }
 
+void thread_fs_dedup(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int enable;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <on|off>");
+
+	diskname = t_arg->argv[0];
+	enable = !strcmp(t_arg->argv[1], "on");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_dedup(enable)) {
+		fs_umount();
+		die("Cannot change deduplication setting");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Deduplication %s\n", enable ? "enabled" : "disabled");
+}
+
+void thread_fs_checksum(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname;
+	int enable;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <on|off>");
+
+	diskname = t_arg->argv[0];
+	enable = !strcmp(t_arg->argv[1], "on");
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_checksum(enable)) {
+		fs_umount();
+		die("Cannot change checksum setting");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Checksums %s\n", enable ? "enabled" : "disabled");
+}
+
+void thread_fs_snapshot(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *action, *name;
+
+	if (t_arg->argc < 3)
+		die("Usage: <diskname> <take|rm|ls> <name>");
+
+	diskname = t_arg->argv[0];
+	action = t_arg->argv[1];
+	name = t_arg->argv[2];
+
+	/* Listing mounts the snapshot itself, read-only */
+	if (!strcmp(action, "ls")) {
+		if (fs_mount_snapshot(diskname, name))
+			die("Cannot mount snapshot '%s'", name);
+		fs_ls();
+		if (fs_umount())
+			die("Cannot unmount diskname");
+		return;
+	}
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (!strcmp(action, "take")) {
+		if (fs_snapshot(name)) {
+			fs_umount();
+			die("Cannot take snapshot '%s'", name);
+		}
+	} else if (!strcmp(action, "rm")) {
+		if (fs_snapshot_delete(name)) {
+			fs_umount();
+			die("Cannot delete snapshot '%s'", name);
+		}
+	} else {
+		fs_umount();
+		die("Unknown snapshot action '%s'", action);
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Snapshot '%s' %s\n", name,
+	       !strcmp(action, "take") ? "taken" : "deleted");
+}
+
+/* Size of the file rewritten under the reads of the shared command */
+#define SHARED_SIZE 65536
+/* File rewritten under the reads of the shared command */
+#define SHARED_FILE "shared_test"
+
+struct shared_writer {
+	const char *socket;
+	int stop;
+	long writes;
+};
+
+/* Rewrite the whole file over and over, with a different byte each time */
+void *shared_writer(void *arg)
+{
+	struct shared_writer *w = arg;
+	static char buf[SHARED_SIZE];
+	struct fs_client *c;
+	int fd;
+
+	c = fsc_connect(w->socket);
+	if (!c)
+		die("Cannot connect to '%s'", w->socket);
+	fd = fsc_open(c, SHARED_FILE);
+	if (fd < 0)
+		die("Cannot open file");
+
+	while (!__atomic_load_n(&w->stop, __ATOMIC_RELAXED)) {
+		memset(buf, 2 + w->writes % 250, SHARED_SIZE);
+		if (fsc_pwrite(c, fd, buf, SHARED_SIZE, 0) != SHARED_SIZE)
+			die("Cannot write file");
+		w->writes++;
+	}
+
+	fsc_close(c, fd);
+	fsc_disconnect(c);
+	return NULL;
+}
+
+/*
+ * Pipeline a submitted read with a synchronous stat of the same file while
+ * another connection rewrites it. Reads of a server sharing its disk are
+ * copied from the mapping and sent again when the file changed meanwhile: the
+ * stat must still get its own response, and the read an untorn copy.
+ */
+void thread_fs_shared(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct shared_writer w = { 0 };
+	static char buf[SHARED_SIZE];
+	struct fs_client *c;
+	struct fs_op op, *done;
+	pthread_t writer;
+	long rounds, i;
+	int fd, stat, j;
+
+	if (t_arg->argc < 1)
+		die("Usage: <socket> [<rounds>]");
+
+	w.socket = t_arg->argv[0];
+	rounds = t_arg->argc > 1 ? atol(t_arg->argv[1]) : 10000;
+
+	c = fsc_connect(w.socket);
+	if (!c)
+		die("Cannot connect to '%s'", w.socket);
+	fsc_create(c, SHARED_FILE);
+	fd = fsc_open(c, SHARED_FILE);
+	if (fd < 0)
+		die("Cannot open file");
+	memset(buf, 1, SHARED_SIZE);
+	if (fsc_pwrite(c, fd, buf, SHARED_SIZE, 0) != SHARED_SIZE)
+		die("Cannot write file");
+
+	if (pthread_create(&writer, NULL, shared_writer, &w))
+		die("Cannot start writer");
+
+	for (i = 0; i < rounds; i++) {
+		op = (struct fs_op) {
+			.type = FS_OP_READ,
+			.fd = fd,
+			.buf = buf,
+			.count = SHARED_SIZE,
+		};
+		if (fsc_submit(c, &op))
+			die("Cannot submit read");
+
+		stat = fsc_stat(c, fd);
+		if (stat != SHARED_SIZE)
+			die("Round %ld: stat returned %d", i, stat);
+		if (fsc_wait(c, &done, 1) != 1 || done != &op)
+			die("Round %ld: read not completed", i);
+		if (op.result != SHARED_SIZE)
+			die("Round %ld: read returned %d", i, op.result);
+		for (j = 1; j < SHARED_SIZE; j++)
+			if (buf[j] != buf[0])
+				die("Round %ld: torn read at %d", i, j);
+	}
+
+	__atomic_store_n(&w.stop, 1, __ATOMIC_RELAXED);
+	pthread_join(writer, NULL);
+
+	fsc_close(c, fd);
+	fsc_delete(c, SHARED_FILE);
+	fsc_disconnect(c);
+
+	printf("%ld reads and stats against %ld writes\n", rounds, w.writes);
+}
+
+/* Number of files kept by the crash command: the last ones it created */
+#define CRASH_KEPT 16
+/* Largest number of files the crash command creates between two syncs */
+#define CRASH_BATCH 4
+/* Number of the last files synced that must be found after a crash: any file
+ * the crashed process created after them deletes a file older than them */
+#define CRASH_CHECKED (CRASH_KEPT - 2 * CRASH_BATCH)
+/* Largest file of the crash command */
+#define CRASH_MAX_SIZE 20480
+
+/* Size of file @k of the crash command: inline, with a packed tail, of a whole
+ * block, or of several blocks */
+size_t crash_size(long k)
+{
+	static const size_t sizes[] = { 40, 3000, 4096, 9000, CRASH_MAX_SIZE };
+
+	return sizes[k % ARRAY_SIZE(sizes)] - k % 7;
+}
+
+/*
+ * Create files from number @k on, each filled with the content of its number,
+ * and delete the one falling out of the kept ones. Sync every @batch files,
+ * and report the number of the last one over @pipe_fd once fs_sync() made them
+ * durable. Runs until killed.
+ */
+void crash_child(const char *diskname, int pipe_fd, long k, int batch)
+{
+	static char buf[CRASH_MAX_SIZE];
+	char name[32];
+	size_t size;
+	int fd;
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	for (;; k++) {
+		size = crash_size(k);
+		script_random(buf, size, k);
+		snprintf(name, sizeof(name), "crash%ld", k);
+		/* The previous process may have created it without syncing */
+		fs_delete(name);
+		if (fs_create(name) || (fd = fs_open(name)) < 0 ||
+		    fs_write(fd, buf, size) != (int)size || fs_close(fd))
+			die("Cannot write file '%s'", name);
+		snprintf(name, sizeof(name), "crash%ld", k - CRASH_KEPT);
+		fs_delete(name);
+		if (k % batch)
+			continue;
+		if (fs_sync())
+			die("Cannot sync");
+		if (write(pipe_fd, &k, sizeof(k)) != sizeof(k))
+			die_perror("write");
+	}
+}
+
+/*
+ * Check the files of the crash command once the file system is mounted again
+ * after a crash, @last being the number of the last file reported durable:
+ * files up to @last must be whole, the last CRASH_CHECKED of them there, and
+ * those deleted by then gone. Files past @last may hold any prefix of their
+ * content.
+ */
+void crash_check(long round, long last)
+{
+	static char buf[CRASH_MAX_SIZE], expected[CRASH_MAX_SIZE];
+	struct fs_dirent entry;
+	struct fs_dir dir;
+	long k, found = 0, needed;
+	char *end;
+	int fd;
+
+	fs_opendir(&dir);
+	while (fs_readdir(&dir, &entry) == 1) {
+		if (strncmp(entry.name, "crash", 5))
+			continue;
+		k = strtol(entry.name + 5, &end, 10);
+		if (*end || k < 0)
+			continue;
+		if (k <= last - CRASH_KEPT)
+			die("Round %ld: file '%s' was deleted", round,
+			    entry.name);
+		if (entry.size > crash_size(k) ||
+		    (k <= last && entry.size != crash_size(k)))
+			die("Round %ld: file '%s' has %zu bytes", round,
+			    entry.name, entry.size);
+
+		fd = fs_open(entry.name);
+		if (fd < 0 || fs_read(fd, buf, entry.size) != (int)entry.size)
+			die("Round %ld: cannot read file '%s'", round,
+			    entry.name);
+		fs_close(fd);
+		script_random(expected, crash_size(k), k);
+		if (memcmp(buf, expected, entry.size))
+			die("Round %ld: file '%s' has the wrong content", round,
+			    entry.name);
+		if (k > last - CRASH_CHECKED && k <= last)
+			found++;
+	}
+	fs_closedir(&dir);
+
+	needed = last < CRASH_CHECKED ? last + 1 : CRASH_CHECKED;
+	if (found != needed)
+		die("Round %ld: %ld of the last %ld files synced", round, found,
+		    needed);
+}
+
+/*
+ * Kill a process creating, deleting and syncing files at a random point, then
+ * mount the disk again, which replays its journal, and check that every file
+ * synced is there. Repeated for each round, from where the previous one
+ * stopped, syncing after 1 to CRASH_BATCH files.
+ */
+void thread_fs_crash(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	long rounds, round, k, last = -1, synced = 0;
+	int pipe_fds[2], status;
+	char *diskname;
+	pid_t pid;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<rounds>]");
+
+	diskname = t_arg->argv[0];
+	rounds = t_arg->argc > 1 ? atol(t_arg->argv[1]) : 20;
+	srand(rounds);
+
+	for (round = 0; round < rounds; round++) {
+		if (pipe(pipe_fds))
+			die_perror("pipe");
+		pid = fork();
+		if (pid < 0)
+			die_perror("fork");
+		if (!pid) {
+			close(pipe_fds[0]);
+			crash_child(diskname, pipe_fds[1], last + 1,
+				    1 + round % CRASH_BATCH);
+		}
+		close(pipe_fds[1]);
+
+		usleep(1000 + rand() % 30000);
+		kill(pid, SIGKILL);
+		while (read(pipe_fds[0], &k, sizeof(k)) == sizeof(k)) {
+			synced += k - last;
+			last = k;
+		}
+		close(pipe_fds[0]);
+		if (waitpid(pid, &status, 0) < 0)
+			die_perror("waitpid");
+		if (!WIFSIGNALED(status))
+			die("Round %ld: the child failed", round);
+
+		if (fs_mount(diskname))
+			die("Round %ld: cannot mount diskname", round);
+		crash_check(round, last);
+		if (fs_umount())
+			die("Round %ld: cannot unmount diskname", round);
+	}
+
+	printf("%ld crashes recovered, %ld files synced\n", rounds, synced);
+}
+
+static const char *trace_op_names[FS_TRACE_OP_COUNT] = {
+	[FS_TRACE_MOUNT] = "mount",
+	[FS_TRACE_UMOUNT] = "umount",
+	[FS_TRACE_SYNC] = "sync",
+	[FS_TRACE_CREATE] = "create",
+	[FS_TRACE_DELETE] = "delete",
+	[FS_TRACE_OPEN] = "open",
+	[FS_TRACE_CLOSE] = "close",
+	[FS_TRACE_STAT] = "stat",
+	[FS_TRACE_LSEEK] = "lseek",
+	[FS_TRACE_READ] = "read",
+	[FS_TRACE_WRITE] = "write",
+	[FS_TRACE_PREAD] = "pread",
+	[FS_TRACE_PWRITE] = "pwrite",
+	[FS_TRACE_READV] = "readv",
+	[FS_TRACE_WRITEV] = "writev",
+	[FS_TRACE_COPY] = "copy",
+	[FS_TRACE_COMPRESS] = "compress",
+	[FS_TRACE_DEDUP] = "dedup",
+	[FS_TRACE_CHECKSUM] = "checksum",
+	[FS_TRACE_SNAPSHOT] = "snapshot",
+	[FS_TRACE_SNAPSHOT_DELETE] = "snapshot_delete",
+	[FS_TRACE_MOUNT_SNAPSHOT] = "mount_snapshot",
+	[FS_TRACE_SENDFILE] = "sendfile",
+};
+
+/* Replay state */
+struct replay {
+	char *diskname;
+	int mounted;
+	/* Replayed file descriptor of each traced one, or -1 */
+	int fds[FS_OPEN_MAX_COUNT];
+	char *buf;
+	size_t buf_size;
+	/* Where sent file content goes */
+	int null_fd;
+};
+
+/* Run a traced call again, and return its new return value */
+int replay_call(struct replay *r, const struct fs_trace_record *rec,
+		const char *name, const char *name2)
+{
+	int fd = rec->fd >= 0 && rec->fd < FS_OPEN_MAX_COUNT ?
+		 r->fds[rec->fd] : -1;
+	struct iovec iov;
+	int ret;
+
+	/* Data is not traced, so any content of the right size does */
+	if (rec->count > r->buf_size) {
+		r->buf = realloc(r->buf, rec->count);
+		if (!r->buf)
+			die("out of memory");
+		memset(r->buf + r->buf_size, 0xa5, rec->count - r->buf_size);
+		r->buf_size = rec->count;
+	}
+	iov.iov_base = r->buf;
+	iov.iov_len = rec->count;
+
+	switch (rec->op) {
+	case FS_TRACE_MOUNT:
+		ret = fs_mount(r->diskname);
+		r->mounted |= !ret;
+		return ret;
+	case FS_TRACE_MOUNT_SNAPSHOT:
+		ret = fs_mount_snapshot(r->diskname, name);
+		r->mounted |= !ret;
+		return ret;
+	case FS_TRACE_UMOUNT:
+		ret = fs_umount();
+		r->mounted &= !!ret;
+		return ret;
+	case FS_TRACE_SYNC:
+		return fs_sync();
+	case FS_TRACE_CREATE:
+		return fs_create(name);
+	case FS_TRACE_DELETE:
+		return fs_delete(name);
+	case FS_TRACE_OPEN:
+		ret = fs_open(name);
+		if (ret >= 0 && rec->result >= 0 &&
+		    rec->result < FS_OPEN_MAX_COUNT)
+			r->fds[rec->result] = ret;
+		return ret;
+	case FS_TRACE_CLOSE:
+		ret = fs_close(fd);
+		if (!ret)
+			r->fds[rec->fd] = -1;
+		return ret;
+	case FS_TRACE_STAT:
+		return fs_stat(fd);
+	case FS_TRACE_LSEEK:
+		return fs_lseek(fd, rec->offset);
+	case FS_TRACE_READ:
+		return fs_read(fd, r->buf, rec->count);
+	case FS_TRACE_WRITE:
+		return fs_write(fd, r->buf, rec->count);
+	case FS_TRACE_PREAD:
+		return fs_pread(fd, r->buf, rec->count, rec->offset);
+	case FS_TRACE_PWRITE:
+		return fs_pwrite(fd, r->buf, rec->count, rec->offset);
+	case FS_TRACE_READV:
+		return fs_readv(fd, &iov, 1);
+	case FS_TRACE_WRITEV:
+		return fs_writev(fd, &iov, 1);
+	case FS_TRACE_COPY:
+		return fs_copy(name, name2, rec->count);
+	case FS_TRACE_COMPRESS:
+		return fs_compress(name, rec->count);
+	case FS_TRACE_DEDUP:
+		return fs_dedup(rec->count);
+	case FS_TRACE_CHECKSUM:
+		return fs_checksum(rec->count);
+	case FS_TRACE_SNAPSHOT:
+		return fs_snapshot(name);
+	case FS_TRACE_SNAPSHOT_DELETE:
+		return fs_snapshot_delete(name);
+	case FS_TRACE_SENDFILE:
+		if (r->null_fd < 0 && (r->null_fd = open("/dev/null",
+							 O_WRONLY)) < 0)
+			die_perror("open");
+		return fs_sendfile(fd, r->null_fd, rec->offset, rec->count);
+	}
+	return -1;
+}
+
+void thread_fs_replay(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct {
+		size_t calls;
+		size_t differ;
+		uint64_t traced_ns;
+		uint64_t replayed_ns;
+	} stats[FS_TRACE_OP_COUNT];
+	const struct fs_trace_header *header;
+	struct fs_trace_record rec;
+	char names[2 * FS_FILENAME_LEN + 1], *name, *name2;
+	struct replay r = { 0 };
+	struct timespec ts;
+	uint64_t start, t, traced_end = 0;
+	size_t pos, calls = 0, differ = 0;
+	int fd, timed, ret, i;
+	struct stat st;
+	char *trace;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <trace> [fast|timed]");
+
+	r.diskname = t_arg->argv[0];
+	timed = t_arg->argc > 2 && !strcmp(t_arg->argv[2], "timed");
+	for (i = 0; i < FS_OPEN_MAX_COUNT; i++)
+		r.fds[i] = -1;
+	r.null_fd = -1;
+	memset(stats, 0, sizeof(stats));
+
+	/* Map the trace file */
+	fd = open(t_arg->argv[1], O_RDONLY);
+	if (fd < 0)
+		die_perror("open");
+	if (fstat(fd, &st))
+		die_perror("fstat");
+	if ((size_t)st.st_size < sizeof(*header))
+		die("Not a trace file: %s", t_arg->argv[1]);
+	trace = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (trace == MAP_FAILED)
+		die_perror("mmap");
+
+	header = (const struct fs_trace_header *)trace;
+	if (header->magic != FS_TRACE_MAGIC ||
+	    header->version != FS_TRACE_VERSION ||
+	    header->record_size != sizeof(rec))
+		die("Not a trace file: %s", t_arg->argv[1]);
+
+	/* A trace started on a mounted file system begins with its calls */
+	pos = sizeof(*header);
+	if (pos + sizeof(rec) <= (size_t)st.st_size)
+		memcpy(&rec, trace + pos, sizeof(rec));
+	if (pos + sizeof(rec) <= (size_t)st.st_size &&
+	    rec.op != FS_TRACE_MOUNT && rec.op != FS_TRACE_MOUNT_SNAPSHOT) {
+		if (fs_mount(r.diskname))
+			die("Cannot mount diskname");
+		r.mounted = 1;
+	}
+
+	start = monotonic_ns();
+	while (pos + sizeof(rec) <= (size_t)st.st_size) {
+		/* Names follow the records, which are thus not aligned */
+		memcpy(&rec, trace + pos, sizeof(rec));
+		pos += sizeof(rec) + rec.name_len;
+		if (pos > (size_t)st.st_size || rec.op >= FS_TRACE_OP_COUNT ||
+		    rec.name_len >= sizeof(names))
+			die("Corrupted trace file: %s", t_arg->argv[1]);
+
+		memcpy(names, trace + pos - rec.name_len, rec.name_len);
+		names[rec.name_len] = '\0';
+		name = names;
+		name2 = names + strlen(names);
+		if (name2 < names + rec.name_len)
+			name2++;
+
+		/* Wait until the call's time in the trace */
+		if (timed && monotonic_ns() < start + rec.start) {
+			ts.tv_sec = (start + rec.start) / 1000000000;
+			ts.tv_nsec = (start + rec.start) % 1000000000;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+					NULL);
+		}
+
+		t = monotonic_ns();
+		ret = replay_call(&r, &rec, name, name2);
+		t = monotonic_ns() - t;
+
+		/* File descriptors may differ, only their validity matters */
+		if (rec.op == FS_TRACE_OPEN ? (ret < 0) != (rec.result < 0) :
+		    ret != rec.result) {
+			stats[rec.op].differ++;
+			differ++;
+		}
+		stats[rec.op].calls++;
+		stats[rec.op].traced_ns += rec.duration;
+		stats[rec.op].replayed_ns += t;
+		calls++;
+		if (rec.start + rec.duration > traced_end)
+			traced_end = rec.start + rec.duration;
+	}
+	t = monotonic_ns() - start;
+
+	if (r.mounted && fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Replayed %zu calls in %.3fs (traced: %.3fs), %zu results "
+	       "differ\n", calls, t / 1e9, traced_end / 1e9, differ);
+	for (i = 0; i < FS_TRACE_OP_COUNT; i++) {
+		if (!stats[i].calls)
+			continue;
+		printf("%-16s calls=%zu traced_avg=%.1fus replayed_avg=%.1fus "
+		       "differ=%zu\n", trace_op_names[i], stats[i].calls,
+		       stats[i].traced_ns / 1e3 / stats[i].calls,
+		       stats[i].replayed_ns / 1e3 / stats[i].calls,
+		       stats[i].differ);
+	}
+
+	free(r.buf);
+	if (r.null_fd >= 0)
+		close(r.null_fd);
+	munmap(trace, st.st_size);
+	close(fd);
+}
+
 size_t get_argv(char *argv)
 {
 	long int ret = strtol(argv, NULL, 0);
@@ -514,9 +1772,18 @@ static struct {
 	{ "info",	thread_fs_info },
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
+	{ "import",	thread_fs_import },
+	{ "export",	thread_fs_export },
 	{ "rm",		thread_fs_rm },
+	{ "cp",		thread_fs_cp },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
+	{ "dedup",	thread_fs_dedup },
+	{ "checksum",	thread_fs_checksum },
+	{ "snapshot",	thread_fs_snapshot },
+	{ "shared",	thread_fs_shared },
+	{ "crash",	thread_fs_crash },
+	{ "replay",	thread_fs_replay },
 	{ "script",	thread_fs_script }
 };
 
@@ -0,0 +1,359 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "fs.h"
+
+#define async_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Maximum number of workers */
+#define ASYNC_MAX_WORKERS 64
+
+/* Queue of operations run in order by a single worker */
+struct lane {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct fs_op *head;
+	struct fs_op *tail;
+	pthread_t thread;
+};
+
+/* Worker pool state (not running by default) */
+static struct {
+	int running;
+	int stopping;
+	int nworkers;
+	struct lane lanes[ASYNC_MAX_WORKERS];
+	/* Completion queue */
+	pthread_mutex_t done_lock;
+	pthread_cond_t done_cond;
+	struct fs_op *done_head;
+	struct fs_op *done_tail;
+	/* Operations submitted and not completed yet, under done_lock */
+	int in_flight;
+	int efd;
+} pool = {
+	.done_lock = PTHREAD_MUTEX_INITIALIZER,
+	.done_cond = PTHREAD_COND_INITIALIZER,
+	.efd = -1,
+};
+
+/* Serializes fs_async_start() and fs_async_stop() */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Name of the file open as @fd, or NULL (fs.c) */
+const char *findFileName(int fd);
+
+/* Hash a file name into an ordering key (FNV-1a) */
+static unsigned int name_key(const char *filename)
+{
+	unsigned int key = 2166136261u;
+
+	while (filename && *filename)
+		key = (key ^ (unsigned char)*filename++) * 16777619u;
+	return key;
+}
+
+/*
+ * Operations sharing an ordering key always run on the same worker. The key of
+ * an operation on a descriptor is the name of its file, which cannot change
+ * while the file is open, so that it is ordered with the operations naming the
+ * file, such as a delete submitted after a write.
+ */
+static unsigned int op_key(const struct fs_op *op)
+{
+	const char *filename;
+
+	switch (op->type) {
+	case FS_OP_CREATE:
+	case FS_OP_DELETE:
+	case FS_OP_OPEN:
+		return name_key(op->filename);
+	default:
+		filename = findFileName(op->fd);
+		return filename ? name_key(filename) : (unsigned int)op->fd;
+	}
+}
+
+static void lane_push(struct lane *lane, struct fs_op *op)
+{
+	pthread_mutex_lock(&lane->lock);
+	op->next = NULL;
+	if (lane->tail)
+		lane->tail->next = op;
+	else
+		lane->head = op;
+	lane->tail = op;
+	pthread_cond_signal(&lane->cond);
+	pthread_mutex_unlock(&lane->lock);
+}
+
+static void complete(struct fs_op *op)
+{
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&pool.done_lock);
+	op->next = NULL;
+	if (pool.done_tail)
+		pool.done_tail->next = op;
+	else
+		pool.done_head = op;
+	pool.done_tail = op;
+	pool.in_flight--;
+	pthread_cond_broadcast(&pool.done_cond);
+	pthread_mutex_unlock(&pool.done_lock);
+
+	if (write(pool.efd, &one, sizeof(one)) < 0)
+		perror("write");
+}
+
+static void run_op(struct fs_op *op)
+{
+	switch (op->type) {
+	case FS_OP_READ:
+		op->result = fs_pread(op->fd, op->buf, op->count, op->offset);
+		break;
+	case FS_OP_WRITE:
+		op->result = fs_pwrite(op->fd, op->buf, op->count, op->offset);
+		break;
+	case FS_OP_CREATE:
+		op->result = fs_create(op->filename);
+		break;
+	case FS_OP_DELETE:
+		op->result = fs_delete(op->filename);
+		break;
+	case FS_OP_OPEN:
+		op->result = fs_open(op->filename);
+		break;
+	case FS_OP_CLOSE:
+		op->result = fs_close(op->fd);
+		break;
+	case FS_OP_STAT:
+		op->result = fs_stat(op->fd);
+		break;
+	case FS_OP_SYNC:
+		op->result = fs_sync();
+		break;
+	default:
+		op->result = -1;
+		break;
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct lane *lane = arg;
+	struct fs_op *op;
+
+	for (;;) {
+		pthread_mutex_lock(&lane->lock);
+		while (!lane->head &&
+		       !__atomic_load_n(&pool.stopping, __ATOMIC_ACQUIRE))
+			pthread_cond_wait(&lane->cond, &lane->lock);
+		op = lane->head;
+		if (!op) {
+			pthread_mutex_unlock(&lane->lock);
+			return NULL;
+		}
+		lane->head = op->next;
+		if (!lane->head)
+			lane->tail = NULL;
+		pthread_mutex_unlock(&lane->lock);
+
+		/* A sync is queued on every worker as a marker, and runs on the
+		 * last one to reach it, once everything submitted before it has
+		 * run */
+		if (op->sync) {
+			struct fs_op *marker = op;
+
+			op = marker->sync;
+			free(marker);
+			if (__atomic_sub_fetch(&op->pending, 1,
+					       __ATOMIC_ACQ_REL) > 0)
+				continue;
+		}
+
+		run_op(op);
+		complete(op);
+	}
+}
+
+int fs_async_start(int workers)
+{
+	int i;
+
+	if (workers < 1 || workers > ASYNC_MAX_WORKERS)
+		return -1;
+
+	pthread_mutex_lock(&pool_lock);
+	if (pool.running) {
+		pthread_mutex_unlock(&pool_lock);
+		async_error("worker pool already running");
+		return -1;
+	}
+
+	pool.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (pool.efd < 0) {
+		pthread_mutex_unlock(&pool_lock);
+		perror("eventfd");
+		return -1;
+	}
+
+	pool.stopping = 0;
+	pool.done_head = pool.done_tail = NULL;
+	for (i = 0; i < workers; i++) {
+		struct lane *lane = &pool.lanes[i];
+
+		pthread_mutex_init(&lane->lock, NULL);
+		pthread_cond_init(&lane->cond, NULL);
+		lane->head = lane->tail = NULL;
+		if (pthread_create(&lane->thread, NULL, worker_main, lane)) {
+			async_error("cannot create worker");
+			break;
+		}
+	}
+	pool.nworkers = i;
+
+	/* Without all its workers, the pool is torn down again */
+	if (i < workers) {
+		__atomic_store_n(&pool.stopping, 1, __ATOMIC_RELEASE);
+		for (i = 0; i < pool.nworkers; i++) {
+			pthread_mutex_lock(&pool.lanes[i].lock);
+			pthread_cond_signal(&pool.lanes[i].cond);
+			pthread_mutex_unlock(&pool.lanes[i].lock);
+			pthread_join(pool.lanes[i].thread, NULL);
+		}
+		close(pool.efd);
+		pool.efd = -1;
+		pthread_mutex_unlock(&pool_lock);
+		return -1;
+	}
+
+	pool.running = 1;
+	pthread_mutex_unlock(&pool_lock);
+	return 0;
+}
+
+int fs_async_stop(void)
+{
+	int i;
+
+	pthread_mutex_lock(&pool_lock);
+	if (!pool.running) {
+		pthread_mutex_unlock(&pool_lock);
+		return -1;
+	}
+
+	/* Workers finish their queued operations before exiting */
+	__atomic_store_n(&pool.stopping, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < pool.nworkers; i++) {
+		pthread_mutex_lock(&pool.lanes[i].lock);
+		pthread_cond_signal(&pool.lanes[i].cond);
+		pthread_mutex_unlock(&pool.lanes[i].lock);
+	}
+	for (i = 0; i < pool.nworkers; i++) {
+		pthread_join(pool.lanes[i].thread, NULL);
+		pthread_mutex_destroy(&pool.lanes[i].lock);
+		pthread_cond_destroy(&pool.lanes[i].cond);
+	}
+
+	close(pool.efd);
+	pool.efd = -1;
+	pool.running = 0;
+	pthread_mutex_unlock(&pool_lock);
+
+	/* Wake up fs_wait() callers with nothing left to wait for */
+	pthread_mutex_lock(&pool.done_lock);
+	pthread_cond_broadcast(&pool.done_cond);
+	pthread_mutex_unlock(&pool.done_lock);
+	return 0;
+}
+
+int fs_submit(struct fs_op *op)
+{
+	struct fs_op *markers[ASYNC_MAX_WORKERS];
+	int i;
+
+	if (!op || !pool.running ||
+	    __atomic_load_n(&pool.stopping, __ATOMIC_ACQUIRE))
+		return -1;
+
+	op->sync = NULL;
+	pthread_mutex_lock(&pool.done_lock);
+	pool.in_flight++;
+	pthread_mutex_unlock(&pool.done_lock);
+
+	if (op->type == FS_OP_SYNC) {
+		for (i = 0; i < pool.nworkers; i++) {
+			markers[i] = calloc(1, sizeof(struct fs_op));
+			if (!markers[i]) {
+				while (i--)
+					free(markers[i]);
+				pthread_mutex_lock(&pool.done_lock);
+				pool.in_flight--;
+				pthread_mutex_unlock(&pool.done_lock);
+				return -1;
+			}
+			markers[i]->type = FS_OP_SYNC;
+			markers[i]->sync = op;
+		}
+		op->pending = pool.nworkers;
+		for (i = 0; i < pool.nworkers; i++)
+			lane_push(&pool.lanes[i], markers[i]);
+		return 0;
+	}
+
+	lane_push(&pool.lanes[op_key(op) % pool.nworkers], op);
+	return 0;
+}
+
+static int reap(struct fs_op **ops, int max)
+{
+	int n = 0;
+
+	while (n < max && pool.done_head) {
+		ops[n++] = pool.done_head;
+		pool.done_head = pool.done_head->next;
+	}
+	if (!pool.done_head)
+		pool.done_tail = NULL;
+	return n;
+}
+
+int fs_poll(struct fs_op **ops, int max)
+{
+	int n;
+
+	if (!ops || max < 1)
+		return -1;
+
+	pthread_mutex_lock(&pool.done_lock);
+	n = reap(ops, max);
+	pthread_mutex_unlock(&pool.done_lock);
+	return n;
+}
+
+int fs_wait(struct fs_op **ops, int max)
+{
+	int n;
+
+	if (!ops || max < 1)
+		return -1;
+
+	/* Once stopped, the pool has run everything that was submitted */
+	pthread_mutex_lock(&pool.done_lock);
+	while (!pool.done_head && pool.in_flight > 0)
+		pthread_cond_wait(&pool.done_cond, &pool.done_lock);
+	n = reap(ops, max);
+	pthread_mutex_unlock(&pool.done_lock);
+	return n;
+}
+
+int fs_async_eventfd(void)
+{
+	return pool.running ? pool.efd : -1;
+}
@@ -0,0 +1,899 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "client.h"
+#include "protocol.h"
+
+#define client_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Larger write data is sent from the caller's buffer instead of being copied
+ * along with the buffered requests */
+#define SEND_COPY_MAX 16384
+
+/* Buffered requests are sent once they reach this size */
+#define SEND_BUFFER_MAX 65536
+
+/* Free space kept in the receive buffer before reading from the socket */
+#define RECEIVE_CHUNK 65536
+
+/* Bytes buffered from or for the socket */
+struct buffer {
+	char *data;
+	size_t start;	/* First byte not consumed yet */
+	size_t len;	/* End of the buffered bytes */
+	size_t cap;
+};
+
+struct fs_client {
+	int sock;
+	/* Set once the server is gone or sent an invalid response */
+	int broken;
+	/* Read-only mapping of the virtual disk file, or NULL */
+	const char *map;
+	size_t map_size;
+	/* Read-only mapping of the server's file generations, with @map */
+	const uint64_t *generations;
+	/* Requests not sent yet */
+	struct buffer out;
+	/* Responses received but not consumed yet */
+	struct buffer in;
+	/* Submitted operations waiting for their response, in order */
+	struct fs_op *sent_head;
+	struct fs_op *sent_tail;
+	/* Completed operations not collected yet */
+	struct fs_op *done_head;
+	struct fs_op *done_tail;
+};
+
+/* Make room for @size more bytes at the end of @b */
+static int buffer_reserve(struct buffer *b, size_t size)
+{
+	size_t cap;
+	char *data;
+
+	/* Move the unconsumed bytes to the front first */
+	if (b->start) {
+		memmove(b->data, b->data + b->start, b->len - b->start);
+		b->len -= b->start;
+		b->start = 0;
+	}
+	if (b->cap - b->len >= size)
+		return 0;
+
+	cap = b->cap ? b->cap : RECEIVE_CHUNK;
+	while (cap - b->len < size)
+		cap *= 2;
+	data = realloc(b->data, cap);
+	if (!data)
+		return -1;
+	b->data = data;
+	b->cap = cap;
+
+	return 0;
+}
+
+static int buffer_append(struct buffer *b, const void *data, size_t size)
+{
+	if (buffer_reserve(b, size))
+		return -1;
+	memcpy(b->data + b->len, data, size);
+	b->len += size;
+
+	return 0;
+}
+
+static void set_broken(struct fs_client *c)
+{
+	if (!c->broken)
+		client_error("connection to the server lost");
+	c->broken = 1;
+}
+
+/* Read what the socket has into the receive buffer, waiting for it if @block */
+static int fill(struct fs_client *c, int block)
+{
+	ssize_t ret;
+
+	if (buffer_reserve(&c->in, RECEIVE_CHUNK)) {
+		set_broken(c);
+		return -1;
+	}
+	do {
+		ret = recv(c->sock, c->in.data + c->in.len,
+			   c->in.cap - c->in.len, block ? 0 : MSG_DONTWAIT);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 0 && !block && (errno == EAGAIN || errno == EWOULDBLOCK))
+		return 0;
+	if (ret <= 0) {
+		set_broken(c);
+		return -1;
+	}
+	c->in.len += ret;
+
+	return ret;
+}
+
+/* Send the buffered requests, then @size bytes of @data, while receiving the
+ * responses that would otherwise fill the socket and block the server */
+static int send_all(struct fs_client *c, const void *data, size_t size)
+{
+	struct iovec iov[2];
+	struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+	struct pollfd pfd = { .fd = c->sock, .events = POLLIN | POLLOUT };
+	size_t out_size;
+	ssize_t ret;
+
+	while (!c->broken && (c->out.len > c->out.start || size)) {
+		out_size = c->out.len - c->out.start;
+		iov[0].iov_base = c->out.data + c->out.start;
+		iov[0].iov_len = out_size;
+		iov[1].iov_base = (void *)data;
+		iov[1].iov_len = size;
+		ret = sendmsg(c->sock, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				set_broken(c);
+				break;
+			}
+			if (poll(&pfd, 1, -1) > 0 && (pfd.revents & POLLIN))
+				fill(c, 0);
+			continue;
+		}
+		if ((size_t)ret < out_size) {
+			c->out.start += ret;
+			continue;
+		}
+		c->out.start = c->out.len = 0;
+		data = (const char *)data + (ret - out_size);
+		size -= ret - out_size;
+	}
+
+	return c->broken ? -1 : 0;
+}
+
+/* Consume @size bytes of responses into @dst (or drop them if @dst is NULL) */
+static int take(struct fs_client *c, void *dst, size_t size)
+{
+	char *p = dst;
+	size_t n;
+
+	while (size) {
+		if (c->in.len == c->in.start && fill(c, 1) < 0)
+			return -1;
+		n = c->in.len - c->in.start;
+		if (n > size)
+			n = size;
+		if (p) {
+			memcpy(p, c->in.data + c->in.start, n);
+			p += n;
+		}
+		c->in.start += n;
+		size -= n;
+	}
+
+	return 0;
+}
+
+/* Whether the next response is received whole */
+static int response_ready(struct fs_client *c)
+{
+	struct fs_response resp;
+	size_t avail = c->in.len - c->in.start;
+
+	if (avail < sizeof(resp))
+		return 0;
+	memcpy(&resp, c->in.data + c->in.start, sizeof(resp));
+	return avail - sizeof(resp) >= resp.length;
+}
+
+/*
+ * Copy the extents of a %FS_REQ_PREAD_SHARED response into @buf. Return 1 if
+ * the file changed meanwhile, the copy of its blocks then being unreliable.
+ */
+static int receive_shared(struct fs_client *c, struct fs_response *resp,
+			  void *buf, size_t max)
+{
+	struct fs_view_stamp stamp;
+	struct fs_extent *extents;
+	size_t size, inline_size, done = 0;
+	uint32_t i;
+	int ret = -1;
+
+	/* Data that cannot be viewed (compressed files) comes as it is */
+	if (!resp->extents)
+		return resp->length > max ? -1 : take(c, buf, resp->length);
+
+	size = (size_t)resp->extents * sizeof(*extents);
+	if (sizeof(stamp) + size > resp->length || take(c, &stamp, sizeof(stamp)))
+		return -1;
+	if (stamp.slot >= FS_FILE_MAX_COUNT)
+		return -1;
+	inline_size = resp->length - sizeof(stamp) - size;
+	extents = malloc(size ? size : 1);
+	if (!extents || take(c, extents, size))
+		goto out;
+
+	for (i = 0; i < resp->extents; i++) {
+		if (extents[i].length > max - done)
+			goto out;
+		if (extents[i].offset == FS_EXTENT_INLINE) {
+			if (extents[i].length > inline_size)
+				goto out;
+			if (take(c, (char *)buf + done, extents[i].length))
+				goto out;
+			inline_size -= extents[i].length;
+		} else {
+			if (!c->map || extents[i].offset > c->map_size ||
+			    extents[i].length > c->map_size - extents[i].offset)
+				goto out;
+			memcpy((char *)buf + done, c->map + extents[i].offset,
+			       extents[i].length);
+		}
+		done += extents[i].length;
+	}
+	if (inline_size)
+		goto out;
+
+	/* The server advances the generation before changing anything */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	ret = __atomic_load_n(&c->generations[stamp.slot], __ATOMIC_RELAXED) !=
+	      stamp.generation;
+
+out:
+	free(extents);
+	return ret;
+}
+
+/*
+ * Receive the response of the oldest request sent, of type @op, storing its
+ * data in @buf (@max bytes) and its return value in @result. Return 1 for a
+ * shared read to run again as a %FS_REQ_PREAD, see receive_shared().
+ */
+static int receive(struct fs_client *c, int op, void *buf, size_t max,
+		   int *result)
+{
+	struct fs_response resp;
+	int ret = 0;
+
+	*result = -1;
+	if (c->broken || take(c, &resp, sizeof(resp)))
+		return -1;
+
+	switch (op) {
+	case FS_REQ_READ:
+	case FS_REQ_PREAD:
+		if (resp.extents || resp.length > max ||
+		    take(c, buf, resp.length))
+			goto invalid;
+		break;
+	case FS_REQ_PREAD_SHARED:
+		ret = receive_shared(c, &resp, buf, max);
+		if (ret < 0)
+			goto invalid;
+		break;
+	case FS_REQ_READDIR:
+		if (resp.length && (resp.length != max ||
+				    take(c, buf, resp.length)))
+			goto invalid;
+		break;
+	default:
+		if (resp.length)
+			goto invalid;
+		break;
+	}
+
+	*result = resp.result;
+	return ret;
+
+invalid:
+	if (!c->broken)
+		client_error("invalid response from the server");
+	c->broken = 1;
+	return -1;
+}
+
+/* Queue a request, with its names and data */
+static int send_request(struct fs_client *c, struct fs_request *req,
+			const char *name, const char *name2, const void *data)
+{
+	char names[FS_PROTOCOL_MAX_NAMES];
+	size_t len, len2 = 0;
+
+	if (c->broken)
+		return -1;
+
+	/* Names that do not fit in a directory entry are invalid anyway */
+	req->name_len = 0;
+	if (name) {
+		len = strlen(name) + 1;
+		if (name2)
+			len2 = strlen(name2) + 1;
+		if (len > FS_FILENAME_LEN || len2 > FS_FILENAME_LEN)
+			return -1;
+		memcpy(names, name, len);
+		if (name2)
+			memcpy(names + len, name2, len2);
+		req->name_len = len + len2;
+	}
+
+	if (buffer_append(&c->out, req, sizeof(*req)) ||
+	    buffer_append(&c->out, names, req->name_len))
+		return -1;
+	if (data && req->count > SEND_COPY_MAX)
+		return send_all(c, data, req->count);
+	if (data && buffer_append(&c->out, data, req->count))
+		return -1;
+	if (c->out.len - c->out.start >= SEND_BUFFER_MAX)
+		return send_all(c, NULL, 0);
+
+	return 0;
+}
+
+/* Queue a submitted operation, sending it with request @req */
+static int queue_op(struct fs_client *c, struct fs_op *op,
+		    struct fs_request *req, const char *name, const void *data)
+{
+	if (send_request(c, req, name, NULL, data))
+		return -1;
+
+	/* The request type tells how to receive the response */
+	op->pending = req->op;
+	op->next = NULL;
+	if (c->sent_tail)
+		c->sent_tail->next = op;
+	else
+		c->sent_head = op;
+	c->sent_tail = op;
+
+	return 0;
+}
+
+/*
+ * Receive the response of the oldest submitted operation. A shared read whose
+ * file changed while it was copied is sent again instead, to be copied by the
+ * server.
+ */
+static void complete(struct fs_client *c)
+{
+	struct fs_op *op = c->sent_head;
+	struct fs_request req = {
+		.op = FS_REQ_PREAD,
+		.fd = op->fd,
+		.count = op->count,
+		.offset = op->offset,
+	};
+	int ret;
+
+	c->sent_head = op->next;
+	if (!c->sent_head)
+		c->sent_tail = NULL;
+
+	ret = receive(c, op->pending, op->buf, op->count, &op->result);
+	if (ret > 0 && !queue_op(c, op, &req, NULL, NULL) &&
+	    !send_all(c, NULL, 0))
+		return;
+	if (ret)
+		op->result = -1;
+
+	op->next = NULL;
+	if (c->done_tail)
+		c->done_tail->next = op;
+	else
+		c->done_head = op;
+	c->done_tail = op;
+}
+
+/* Whether request @op may change the blocks that shared reads point to */
+static int changes_blocks(int op)
+{
+	switch (op) {
+	case FS_REQ_READDIR:
+	case FS_REQ_OPEN:
+	case FS_REQ_STAT:
+	case FS_REQ_LSEEK:
+	case FS_REQ_READ:
+	case FS_REQ_PREAD:
+	case FS_REQ_PREAD_SHARED:
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Receive the responses of the submitted operations if shared reads are among
+ * them, including those of the shared reads sent again by complete()
+ */
+static void settle_shared_reads(struct fs_client *c)
+{
+	struct fs_op *sent;
+
+	for (sent = c->sent_head; sent; sent = sent->next)
+		if (sent->pending == FS_REQ_PREAD_SHARED)
+			break;
+	if (!sent || send_all(c, NULL, 0))
+		return;
+	while (c->sent_head)
+		complete(c);
+}
+
+/* Run a request and wait for its response */
+static int call(struct fs_client *c, struct fs_request *req, const char *name,
+		const char *name2, const void *data, void *buf, size_t max)
+{
+	int result;
+
+	struct fs_request retry;
+	int ret;
+
+	if (!c)
+		return -1;
+
+	/*
+	 * Settle shared reads first, whatever the request: their data must not
+	 * reflect requests sent after them, and those sent again would otherwise
+	 * be sent behind this request and take its response
+	 */
+	settle_shared_reads(c);
+	if (send_request(c, req, name, name2, data) || send_all(c, NULL, 0))
+		return -1;
+
+	/* Responses come in order: the submitted operations' come first */
+	while (c->sent_head)
+		complete(c);
+	ret = receive(c, req->op, buf, max, &result);
+	if (ret < 0)
+		return -1;
+
+	/* The file changed while its blocks were copied: let the server copy */
+	if (ret > 0) {
+		retry = *req;
+		retry.op = FS_REQ_PREAD;
+		return call(c, &retry, NULL, NULL, NULL, buf, max);
+	}
+
+	return result;
+}
+
+/* Run a request without names nor data */
+static int call_simple(struct fs_client *c, int op, int fd, size_t count,
+		       size_t offset)
+{
+	struct fs_request req = {
+		.op = op,
+		.fd = fd,
+		.count = count,
+		.offset = offset,
+	};
+
+	return call(c, &req, NULL, NULL, NULL, NULL, 0);
+}
+
+/* Run a request on a name */
+static int call_name(struct fs_client *c, int op, const char *name,
+		     size_t count)
+{
+	struct fs_request req = {
+		.op = op,
+		.fd = -1,
+		.count = count,
+	};
+
+	if (!name)
+		return -1;
+
+	return call(c, &req, name, NULL, NULL, NULL, 0);
+}
+
+/* Transfer @count bytes in requests of at most %FS_PROTOCOL_MAX_DATA bytes,
+ * until one of them is short */
+static int transfer(struct fs_client *c, int op, int fd, void *buf,
+		    size_t count, size_t offset, int write)
+{
+	struct fs_request req = { .op = op, .fd = fd };
+	size_t done = 0, chunk;
+	int ret;
+
+	if (!c || !buf)
+		return -1;
+
+	do {
+		chunk = count - done;
+		if (chunk > FS_PROTOCOL_MAX_DATA)
+			chunk = FS_PROTOCOL_MAX_DATA;
+		req.count = chunk;
+		req.offset = offset + done;
+		if (write)
+			ret = call(c, &req, NULL, NULL, (char *)buf + done,
+				   NULL, 0);
+		else
+			ret = call(c, &req, NULL, NULL, NULL,
+				   (char *)buf + done, chunk);
+		if (ret < 0)
+			return done ? (int)done : -1;
+		done += ret;
+	} while ((size_t)ret == chunk && done < count);
+
+	return done;
+}
+
+struct fs_client *fsc_connect(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct fs_request req = {
+		.op = FS_REQ_HELLO,
+		.fd = -1,
+		.count = FS_PROTOCOL_VERSION,
+		.offset = 1,
+	};
+	int fds[2] = { -1, -1 };
+	char control[CMSG_SPACE(sizeof(fds))];
+	struct fs_response resp;
+	struct iovec iov = { &resp, sizeof(resp) };
+	struct msghdr msg = {
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+		.msg_control = control,
+		.msg_controllen = sizeof(control),
+	};
+	struct cmsghdr *cmsg;
+	struct fs_client *c;
+	size_t len;
+	struct stat st;
+	void *map, *generations;
+	int i;
+
+	if (!path || strlen(path) >= sizeof(addr.sun_path)) {
+		client_error("invalid socket path");
+		return NULL;
+	}
+	strcpy(addr.sun_path, path);
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	c->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (c->sock < 0) {
+		perror("socket");
+		free(c);
+		return NULL;
+	}
+	if (connect(c->sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		perror("connect");
+		goto error;
+	}
+
+	/*
+	 * The response to the greeting carries the virtual disk file and the
+	 * file generation table
+	 */
+	if (send_request(c, &req, NULL, NULL, NULL) || send_all(c, NULL, 0))
+		goto error;
+	if (recvmsg(c->sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) !=
+	    sizeof(resp)) {
+		client_error("no response from the server");
+		goto error;
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+		len = cmsg->cmsg_len - CMSG_LEN(0);
+		memcpy(fds, CMSG_DATA(cmsg),
+		       len < sizeof(fds) ? len : sizeof(fds));
+	}
+	if (resp.result < 0 || resp.length) {
+		client_error("server does not speak protocol version %d",
+			     FS_PROTOCOL_VERSION);
+		goto error;
+	}
+
+	/* Without both mappings, reads just go through the socket */
+	if (fds[0] >= 0 && fds[1] >= 0 && !fstat(fds[0], &st) &&
+	    st.st_size > 0) {
+		generations = mmap(NULL, FS_FILE_MAX_COUNT * sizeof(uint64_t),
+				   PROT_READ, MAP_SHARED, fds[1], 0);
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fds[0], 0);
+		if (generations != MAP_FAILED && map != MAP_FAILED) {
+			c->map = map;
+			c->map_size = st.st_size;
+			c->generations = generations;
+		} else {
+			if (generations != MAP_FAILED)
+				munmap(generations,
+				       FS_FILE_MAX_COUNT * sizeof(uint64_t));
+			if (map != MAP_FAILED)
+				munmap(map, st.st_size);
+		}
+	}
+	for (i = 0; i < 2; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+
+	return c;
+
+error:
+	for (i = 0; i < 2; i++)
+		if (fds[i] >= 0)
+			close(fds[i]);
+	close(c->sock);
+	free(c);
+	return NULL;
+}
+
+int fsc_disconnect(struct fs_client *c)
+{
+	if (!c)
+		return -1;
+
+	/* The server closes the connection's file descriptors */
+	close(c->sock);
+	if (c->map) {
+		munmap((void *)c->map, c->map_size);
+		munmap((void *)c->generations,
+		       FS_FILE_MAX_COUNT * sizeof(uint64_t));
+	}
+	free(c->out.data);
+	free(c->in.data);
+	free(c);
+
+	return 0;
+}
+
+int fsc_sync(struct fs_client *c)
+{
+	return call_simple(c, FS_REQ_SYNC, -1, 0, 0);
+}
+
+int fsc_dedup(struct fs_client *c, int enable)
+{
+	return call_simple(c, FS_REQ_DEDUP, -1, enable, 0);
+}
+
+int fsc_checksum(struct fs_client *c, int enable)
+{
+	return call_simple(c, FS_REQ_CHECKSUM, -1, enable, 0);
+}
+
+int fsc_snapshot(struct fs_client *c, const char *name)
+{
+	return call_name(c, FS_REQ_SNAPSHOT, name, 0);
+}
+
+int fsc_snapshot_delete(struct fs_client *c, const char *name)
+{
+	return call_name(c, FS_REQ_SNAPSHOT_DELETE, name, 0);
+}
+
+int fsc_create(struct fs_client *c, const char *filename)
+{
+	return call_name(c, FS_REQ_CREATE, filename, 0);
+}
+
+int fsc_delete(struct fs_client *c, const char *filename)
+{
+	return call_name(c, FS_REQ_DELETE, filename, 0);
+}
+
+int fsc_copy(struct fs_client *c, const char *src, const char *dst,
+	     int reflink)
+{
+	struct fs_request req = {
+		.op = FS_REQ_COPY,
+		.fd = -1,
+		.count = reflink,
+	};
+
+	if (!src || !dst)
+		return -1;
+
+	return call(c, &req, src, dst, NULL, NULL, 0);
+}
+
+int fsc_compress(struct fs_client *c, const char *filename, int enable)
+{
+	return call_name(c, FS_REQ_COMPRESS, filename, enable);
+}
+
+int fsc_opendir(struct fs_client *c, struct fs_dir *dir)
+{
+	if (!c || !dir)
+		return -1;
+
+	dir->pos = 0;
+	return 0;
+}
+
+int fsc_readdir(struct fs_client *c, struct fs_dir *dir,
+		struct fs_dirent *entry)
+{
+	struct fs_request req = {
+		.op = FS_REQ_READDIR,
+		.fd = -1,
+	};
+	struct fs_wire_dirent wire;
+	int ret;
+
+	if (!dir || !entry)
+		return -1;
+
+	req.offset = dir->pos;
+	ret = call(c, &req, NULL, NULL, NULL, &wire, sizeof(wire));
+	if (ret != 1)
+		return ret;
+
+	memcpy(entry->name, wire.name, FS_FILENAME_LEN);
+	entry->name[FS_FILENAME_LEN - 1] = '\0';
+	entry->size = wire.size;
+	entry->first_block = wire.first_block;
+	entry->extent_count = wire.extent_count;
+	dir->pos = wire.next;
+
+	return 1;
+}
+
+int fsc_closedir(struct fs_client *c, struct fs_dir *dir)
+{
+	if (!dir)
+		return -1;
+
+	return 0;
+}
+
+int fsc_open(struct fs_client *c, const char *filename)
+{
+	return call_name(c, FS_REQ_OPEN, filename, 0);
+}
+
+int fsc_close(struct fs_client *c, int fd)
+{
+	return call_simple(c, FS_REQ_CLOSE, fd, 0, 0);
+}
+
+int fsc_stat(struct fs_client *c, int fd)
+{
+	return call_simple(c, FS_REQ_STAT, fd, 0, 0);
+}
+
+int fsc_lseek(struct fs_client *c, int fd, size_t offset)
+{
+	return call_simple(c, FS_REQ_LSEEK, fd, 0, offset);
+}
+
+int fsc_write(struct fs_client *c, int fd, void *buf, size_t count)
+{
+	return transfer(c, FS_REQ_WRITE, fd, buf, count, 0, 1);
+}
+
+int fsc_read(struct fs_client *c, int fd, void *buf, size_t count)
+{
+	return transfer(c, FS_REQ_READ, fd, buf, count, 0, 0);
+}
+
+int fsc_pwrite(struct fs_client *c, int fd, void *buf, size_t count,
+	       size_t offset)
+{
+	return transfer(c, FS_REQ_PWRITE, fd, buf, count, offset, 1);
+}
+
+int fsc_pread(struct fs_client *c, int fd, void *buf, size_t count,
+	      size_t offset)
+{
+	if (!c)
+		return -1;
+
+	return transfer(c, c->map ? FS_REQ_PREAD_SHARED : FS_REQ_PREAD, fd,
+			buf, count, offset, 0);
+}
+
+int fsc_submit(struct fs_client *c, struct fs_op *op)
+{
+	struct fs_request req = { .fd = -1 };
+	const char *name = NULL;
+	const void *data = NULL;
+
+	if (!c || !op)
+		return -1;
+
+	switch (op->type) {
+	case FS_OP_READ:
+	case FS_OP_WRITE:
+		if (!op->buf || op->count > FS_PROTOCOL_MAX_DATA)
+			return -1;
+		if (op->type == FS_OP_WRITE) {
+			req.op = FS_REQ_PWRITE;
+			data = op->buf;
+		} else {
+			req.op = c->map ? FS_REQ_PREAD_SHARED : FS_REQ_PREAD;
+		}
+		req.fd = op->fd;
+		req.count = op->count;
+		req.offset = op->offset;
+		break;
+	case FS_OP_CREATE:
+	case FS_OP_DELETE:
+	case FS_OP_OPEN:
+		if (!op->filename)
+			return -1;
+		req.op = op->type == FS_OP_CREATE ? FS_REQ_CREATE :
+			 op->type == FS_OP_DELETE ? FS_REQ_DELETE : FS_REQ_OPEN;
+		name = op->filename;
+		break;
+	case FS_OP_CLOSE:
+	case FS_OP_STAT:
+		req.op = op->type == FS_OP_CLOSE ? FS_REQ_CLOSE : FS_REQ_STAT;
+		req.fd = op->fd;
+		break;
+	case FS_OP_SYNC:
+		req.op = FS_REQ_SYNC;
+		break;
+	default:
+		return -1;
+	}
+
+	/* Their data must not reflect requests sent after them */
+	if (changes_blocks(req.op))
+		settle_shared_reads(c);
+	return queue_op(c, op, &req, name, data);
+}
+
+/* Hand back up to @max completed operations */
+static int collect(struct fs_client *c, struct fs_op **ops, int max)
+{
+	int n = 0;
+
+	while (n < max && c->done_head) {
+		ops[n++] = c->done_head;
+		c->done_head = c->done_head->next;
+	}
+	if (!c->done_head)
+		c->done_tail = NULL;
+
+	return n;
+}
+
+int fsc_poll(struct fs_client *c, struct fs_op **ops, int max)
+{
+	if (!c || !ops || max < 1)
+		return -1;
+
+	send_all(c, NULL, 0);
+	while (c->sent_head && fill(c, 0) > 0)
+		;
+	while (c->sent_head && (c->broken || response_ready(c)))
+		complete(c);
+
+	return collect(c, ops, max);
+}
+
+int fsc_wait(struct fs_client *c, struct fs_op **ops, int max)
+{
+	if (!c || !ops || max < 1)
+		return -1;
+	if (!c->done_head && !c->sent_head)
+		return -1;
+
+	/* Wait for one response, and take the others already there */
+	/* Shared reads sent again are waited for as well */
+	send_all(c, NULL, 0);
+	while (!c->done_head && c->sent_head)
+		complete(c);
+	while (c->sent_head && fill(c, 0) > 0)
+		;
+	while (c->sent_head && (c->broken || response_ready(c)))
+		complete(c);
+
+	return collect(c, ops, max);
+}
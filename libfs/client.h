@@ -0,0 +1,239 @@
+#ifndef _CLIENT_H
+#define _CLIENT_H
+
+#include <stddef.h> /* for size_t definition */
+
+#include "fs.h"
+
+/*
+ * Client of a file system server (apps/server_fs.c), which mounts a virtual
+ * disk once for several processes. The functions mirror the ones of fs.h on
+ * the server's file system, with the connection as first argument. File
+ * descriptors belong to the connection that opened them, and are closed when it
+ * is closed. A connection must not be used by several threads at the same
+ * time.
+ */
+
+/** Connection to a file system server */
+struct fs_client;
+
+/**
+ * fsc_connect - Connect to a file system server
+ * @path: Path of the server's Unix domain socket
+ *
+ * Connect to the server listening on @path. If the server allows it, the
+ * virtual disk file is mapped read-only in the calling process, and the data
+ * read by fsc_pread() and %FS_OP_READ operations is copied from the mapping
+ * rather than sent over the socket. Reads of a file that changed while they
+ * were copied are sent again, for the server to copy the data.
+ *
+ * Return: NULL if the server cannot be reached or speaks another protocol
+ * version. Otherwise the connection.
+ */
+struct fs_client *fsc_connect(const char *path);
+
+/**
+ * fsc_disconnect - Close a connection
+ * @c: Connection
+ *
+ * Close the connection, and the file descriptors opened through it. Submitted
+ * operations that did not complete yet are lost.
+ *
+ * Return: -1 if @c is NULL. 0 otherwise.
+ */
+int fsc_disconnect(struct fs_client *c);
+
+/**
+ * fsc_sync - Same as fs_sync()
+ * @c: Connection
+ */
+int fsc_sync(struct fs_client *c);
+
+/**
+ * fsc_dedup - Same as fs_dedup()
+ * @c: Connection
+ * @enable: 1 to enable block deduplication, 0 to disable it
+ */
+int fsc_dedup(struct fs_client *c, int enable);
+
+/**
+ * fsc_checksum - Same as fs_checksum()
+ * @c: Connection
+ * @enable: 1 to enable block checksums, 0 to disable them
+ */
+int fsc_checksum(struct fs_client *c, int enable);
+
+/**
+ * fsc_snapshot - Same as fs_snapshot()
+ * @c: Connection
+ * @name: Snapshot name
+ */
+int fsc_snapshot(struct fs_client *c, const char *name);
+
+/**
+ * fsc_snapshot_delete - Same as fs_snapshot_delete()
+ * @c: Connection
+ * @name: Snapshot name
+ */
+int fsc_snapshot_delete(struct fs_client *c, const char *name);
+
+/**
+ * fsc_create - Same as fs_create()
+ * @c: Connection
+ * @filename: File name
+ */
+int fsc_create(struct fs_client *c, const char *filename);
+
+/**
+ * fsc_delete - Same as fs_delete()
+ * @c: Connection
+ * @filename: File name
+ */
+int fsc_delete(struct fs_client *c, const char *filename);
+
+/**
+ * fsc_copy - Same as fs_copy()
+ * @c: Connection
+ * @src: Name of the file to copy
+ * @dst: Name of the copy
+ * @reflink: 1 to share the blocks of @src, 0 to copy them
+ */
+int fsc_copy(struct fs_client *c, const char *src, const char *dst,
+	     int reflink);
+
+/**
+ * fsc_compress - Same as fs_compress()
+ * @c: Connection
+ * @filename: File name
+ * @enable: 1 to compress the file, 0 to decompress it
+ */
+int fsc_compress(struct fs_client *c, const char *filename, int enable);
+
+/**
+ * fsc_opendir - Same as fs_opendir()
+ * @c: Connection
+ * @dir: Directory stream to initialize
+ */
+int fsc_opendir(struct fs_client *c, struct fs_dir *dir);
+
+/**
+ * fsc_readdir - Same as fs_readdir()
+ * @c: Connection
+ * @dir: Directory stream
+ * @entry: Directory entry to be filled
+ */
+int fsc_readdir(struct fs_client *c, struct fs_dir *dir,
+		struct fs_dirent *entry);
+
+/**
+ * fsc_closedir - Same as fs_closedir()
+ * @c: Connection
+ * @dir: Directory stream
+ */
+int fsc_closedir(struct fs_client *c, struct fs_dir *dir);
+
+/**
+ * fsc_open - Same as fs_open()
+ * @c: Connection
+ * @filename: File name
+ */
+int fsc_open(struct fs_client *c, const char *filename);
+
+/**
+ * fsc_close - Same as fs_close()
+ * @c: Connection
+ * @fd: File descriptor
+ */
+int fsc_close(struct fs_client *c, int fd);
+
+/**
+ * fsc_stat - Same as fs_stat()
+ * @c: Connection
+ * @fd: File descriptor
+ */
+int fsc_stat(struct fs_client *c, int fd);
+
+/**
+ * fsc_lseek - Same as fs_lseek()
+ * @c: Connection
+ * @fd: File descriptor
+ * @offset: File offset
+ */
+int fsc_lseek(struct fs_client *c, int fd, size_t offset);
+
+/**
+ * fsc_write - Same as fs_write()
+ * @c: Connection
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ */
+int fsc_write(struct fs_client *c, int fd, void *buf, size_t count);
+
+/**
+ * fsc_read - Same as fs_read()
+ * @c: Connection
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ */
+int fsc_read(struct fs_client *c, int fd, void *buf, size_t count);
+
+/**
+ * fsc_pwrite - Same as fs_pwrite()
+ * @c: Connection
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset at which to start writing
+ */
+int fsc_pwrite(struct fs_client *c, int fd, void *buf, size_t count,
+	       size_t offset);
+
+/**
+ * fsc_pread - Same as fs_pread()
+ * @c: Connection
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset at which to start reading
+ */
+int fsc_pread(struct fs_client *c, int fd, void *buf, size_t count,
+	      size_t offset);
+
+/**
+ * fsc_submit - Send an operation without waiting for it
+ * @c: Connection
+ * @op: Operation to run
+ *
+ * Same as fs_submit(), except that the operations of a connection are sent to
+ * the server as a batch, when one of them is waited for, and complete in the
+ * order they were submitted. @op->count must not exceed
+ * %FS_PROTOCOL_MAX_DATA (see protocol.h).
+ *
+ * Return: -1 if @c or @op is NULL, if @op is invalid, or if the connection is
+ * broken. 0 otherwise.
+ */
+int fsc_submit(struct fs_client *c, struct fs_op *op);
+
+/**
+ * fsc_poll - Same as fs_poll() for the operations of a connection
+ * @c: Connection
+ * @ops: Array to be filled with completed operations
+ * @max: Size of @ops
+ */
+int fsc_poll(struct fs_client *c, struct fs_op **ops, int max);
+
+/**
+ * fsc_wait - Same as fs_wait() for the operations of a connection
+ * @c: Connection
+ * @ops: Array to be filled with completed operations
+ * @max: Size of @ops
+ *
+ * Return: -1 if @c or @ops is NULL, if @max is smaller than 1, or if no
+ * submitted operation is left to complete. Otherwise return the number of
+ * operations stored in @ops.
+ */
+int fsc_wait(struct fs_client *c, struct fs_op **ops, int max);
+
+#endif /* _CLIENT_H */
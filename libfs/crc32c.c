@@ -0,0 +1,303 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "crc32c.h"
+
+/* CRC-32C polynomial, bit-reflected */
+#define CRC32C_POLY 0x82f63b78
+/* Same, in the usual order, with its x^32 term */
+#define CRC32C_POLY_FULL 0x11edc6f41ull
+/*
+ * The crc32 instruction takes three cycles but can start one per cycle, so
+ * the hardware loop checksums three lanes of CRC32C_LANE bytes at once and
+ * merges them afterwards. Three lanes fit in a 4096-byte block.
+ */
+#define CRC32C_LANE 1360
+/*
+ * Processors with 512-bit carry-less multiplication checksum several times
+ * faster than with the crc32 instruction, from FOLD_MIN bytes on
+ */
+#define FOLD_MIN 256
+
+/* Slicing-by-8 tables of the fallback */
+static uint32_t crc_table[8][256];
+/* Tables advancing a CRC over CRC32C_LANE zero bytes, one per CRC byte */
+static uint32_t lane_shift[4][256];
+/*
+ * Constants folding a 128-bit lane 2048, 512, 384, 256 and 128 bits ahead,
+ * for its low and high 64 bits (see fold_constant())
+ */
+static uint64_t fold_k[5][2];
+static int have_sse42, have_fold;
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static uint64_t read64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t crc32c_byte(uint32_t crc, uint8_t b)
+{
+	return (crc >> 8) ^ crc_table[0][(crc ^ b) & 0xff];
+}
+
+static uint32_t lane_advance(uint32_t crc)
+{
+	return lane_shift[0][crc & 0xff] ^ lane_shift[1][(crc >> 8) & 0xff] ^
+	       lane_shift[2][(crc >> 16) & 0xff] ^ lane_shift[3][crc >> 24];
+}
+
+/*
+ * Constant to carry-less multiply a 64-bit word of data by to move it @bits
+ * bits ahead: x^(@bits + 32) mod P, bit-reflected and shifted left by one for
+ * the 96-bit product to line up with the 128 bits it is added to
+ */
+static uint64_t fold_constant(int bits)
+{
+	uint64_t r = 1, k = 0;
+	int i;
+
+	for (i = 0; i < bits + 32; i++) {
+		r <<= 1;
+		if (r >> 32)
+			r ^= CRC32C_POLY_FULL;
+	}
+	for (i = 0; i < 32; i++)
+		if (r & (1ull << i))
+			k |= 1ull << (31 - i);
+	return k << 1;
+}
+
+static void crc32c_init(void)
+{
+	static const int fold_bits[5] = { 2048, 512, 384, 256, 128 };
+	uint32_t bit_shift[32];
+	int i, j, k;
+
+	for (i = 0; i < 256; i++) {
+		uint32_t crc = i;
+
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+		crc_table[0][i] = crc;
+	}
+	for (k = 1; k < 8; k++)
+		for (i = 0; i < 256; i++)
+			crc_table[k][i] = crc32c_byte(crc_table[k - 1][i], 0);
+
+	/* Running zero bytes through a CRC is linear, so it only needs to be
+	 * done for each bit of the CRC */
+	for (i = 0; i < 32; i++) {
+		uint32_t crc = 1u << i;
+
+		for (j = 0; j < CRC32C_LANE; j++)
+			crc = crc32c_byte(crc, 0);
+		bit_shift[i] = crc;
+	}
+	for (k = 0; k < 4; k++) {
+		for (i = 0; i < 256; i++) {
+			uint32_t crc = 0;
+
+			for (j = 0; j < 8; j++)
+				if (i & (1 << j))
+					crc ^= bit_shift[k * 8 + j];
+			lane_shift[k][i] = crc;
+		}
+	}
+
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	have_sse42 = __builtin_cpu_supports("sse4.2");
+	have_fold = have_sse42 && __builtin_cpu_supports("pclmul") &&
+		    __builtin_cpu_supports("avx512f") &&
+		    __builtin_cpu_supports("vpclmulqdq");
+#endif
+	for (i = 0; i < 5; i++) {
+		fold_k[i][0] = fold_constant(fold_bits[i]);
+		fold_k[i][1] = fold_constant(fold_bits[i] - 64);
+	}
+}
+
+static uint32_t crc32c_table(uint32_t crc, const uint8_t *p, size_t len)
+{
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t v = read64(p) ^ crc;
+
+		crc = crc_table[7][v & 0xff] ^
+		      crc_table[6][(v >> 8) & 0xff] ^
+		      crc_table[5][(v >> 16) & 0xff] ^
+		      crc_table[4][(v >> 24) & 0xff] ^
+		      crc_table[3][(v >> 32) & 0xff] ^
+		      crc_table[2][(v >> 40) & 0xff] ^
+		      crc_table[1][(v >> 48) & 0xff] ^
+		      crc_table[0][v >> 56];
+	}
+	for (; len > 0; p++, len--)
+		crc = crc32c_byte(crc, *p);
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t c0, c1, c2;
+	size_t i;
+
+	for (; len >= 3 * CRC32C_LANE; p += 3 * CRC32C_LANE,
+	     len -= 3 * CRC32C_LANE) {
+		c0 = crc;
+		c1 = 0;
+		c2 = 0;
+		for (i = 0; i < CRC32C_LANE; i += 8) {
+			c0 = __builtin_ia32_crc32di(c0, read64(p + i));
+			c1 = __builtin_ia32_crc32di(c1,
+						    read64(p + CRC32C_LANE + i));
+			c2 = __builtin_ia32_crc32di(c2,
+						    read64(p + 2 * CRC32C_LANE + i));
+		}
+		crc = lane_advance(lane_advance(c0) ^ c1) ^ c2;
+	}
+
+	c0 = crc;
+	for (; len >= 8; p += 8, len -= 8)
+		c0 = __builtin_ia32_crc32di(c0, read64(p));
+	crc = c0;
+	for (; len > 0; p++, len--)
+		crc = __builtin_ia32_crc32qi(crc, *p);
+	return crc;
+}
+
+/* Same target for the helpers, which must be inlined in crc32c_fold() */
+#define FOLD_TARGET __attribute__((target("avx512f,vpclmulqdq,pclmul,sse4.2")))
+
+/* Fold each 128-bit lane of @x into @data, with the constants of @k */
+FOLD_TARGET
+static inline __m512i fold512(__m512i x, __m512i k, __m512i data)
+{
+	return _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(x, k, 0x00),
+					 _mm512_clmulepi64_epi128(x, k, 0x11),
+					 data, 0x96);
+}
+
+FOLD_TARGET
+static inline __m128i fold128(__m128i x, int i, __m128i data)
+{
+	__m128i k = _mm_set_epi64x(fold_k[i][1], fold_k[i][0]);
+
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+					   _mm_clmulepi64_si128(x, k, 0x11)),
+			     data);
+}
+
+/*
+ * Checksum @len bytes, at least FOLD_MIN, by carry-less multiplication: four
+ * 512-bit accumulators are folded ahead over the next 256 bytes each round,
+ * then into a single 128-bit remainder, which the crc32 instruction finishes
+ * along with the tail. The data is stored to @d as well if not NULL, while it
+ * is still in registers.
+ */
+FOLD_TARGET
+static uint32_t crc32c_fold(uint32_t crc, uint8_t *d, const uint8_t *p,
+			    size_t len)
+{
+	__m512i x0, x1, x2, x3, y0, y1, y2, y3, k;
+	__m128i v;
+	uint64_t c;
+
+	x0 = _mm512_loadu_si512(p);
+	x1 = _mm512_loadu_si512(p + 64);
+	x2 = _mm512_loadu_si512(p + 128);
+	x3 = _mm512_loadu_si512(p + 192);
+	if (d) {
+		_mm512_storeu_si512(d, x0);
+		_mm512_storeu_si512(d + 64, x1);
+		_mm512_storeu_si512(d + 128, x2);
+		_mm512_storeu_si512(d + 192, x3);
+		d += 256;
+	}
+	/* The running CRC is the same as that many bits flipped at the start */
+	x0 = _mm512_xor_si512(x0, _mm512_castsi128_si512(
+					  _mm_cvtsi32_si128(crc)));
+	p += 256;
+	len -= 256;
+
+	k = _mm512_broadcast_i32x4(_mm_set_epi64x(fold_k[0][1], fold_k[0][0]));
+	for (; len >= 256; p += 256, len -= 256) {
+		y0 = _mm512_loadu_si512(p);
+		y1 = _mm512_loadu_si512(p + 64);
+		y2 = _mm512_loadu_si512(p + 128);
+		y3 = _mm512_loadu_si512(p + 192);
+		if (d) {
+			_mm512_storeu_si512(d, y0);
+			_mm512_storeu_si512(d + 64, y1);
+			_mm512_storeu_si512(d + 128, y2);
+			_mm512_storeu_si512(d + 192, y3);
+			d += 256;
+		}
+		x0 = fold512(x0, k, y0);
+		x1 = fold512(x1, k, y1);
+		x2 = fold512(x2, k, y2);
+		x3 = fold512(x3, k, y3);
+	}
+
+	k = _mm512_broadcast_i32x4(_mm_set_epi64x(fold_k[1][1], fold_k[1][0]));
+	x1 = fold512(x0, k, x1);
+	x2 = fold512(x1, k, x2);
+	x3 = fold512(x2, k, x3);
+
+	v = _mm512_extracti32x4_epi32(x3, 3);
+	v = fold128(_mm512_extracti32x4_epi32(x3, 0), 2, v);
+	v = fold128(_mm512_extracti32x4_epi32(x3, 1), 3, v);
+	v = fold128(_mm512_extracti32x4_epi32(x3, 2), 4, v);
+
+	c = __builtin_ia32_crc32di(0, _mm_cvtsi128_si64(v));
+	c = __builtin_ia32_crc32di(c, _mm_extract_epi64(v, 1));
+	if (d)
+		memcpy(d, p, len);
+	return crc32c_sse42(c, p, len);
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc_once, crc32c_init);
+
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (have_fold && len >= FOLD_MIN)
+		return ~crc32c_fold(crc, NULL, buf, len);
+	if (have_sse42)
+		return ~crc32c_sse42(crc, buf, len);
+#endif
+	return ~crc32c_table(crc, buf, len);
+}
+
+uint32_t crc32c_copy(uint32_t crc, void *dest, const void *src, size_t len)
+{
+	pthread_once(&crc_once, crc32c_init);
+
+#if defined(__x86_64__)
+	if (have_fold && len >= FOLD_MIN)
+		return ~crc32c_fold(~crc, dest, src, len);
+#endif
+	memcpy(dest, src, len);
+	return crc32c(crc, src, len);
+}
+
+const char *crc32c_impl(void)
+{
+	pthread_once(&crc_once, crc32c_init);
+
+	if (have_fold)
+		return "vpclmulqdq";
+	return have_sse42 ? "sse4.2" : "table";
+}
@@ -0,0 +1,46 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/**
+ * crc32c - Compute the CRC-32C checksum of a buffer
+ * @crc: Checksum of the data preceding @buf, or 0 to start a new checksum
+ * @buf: Data to checksum
+ * @len: Size of @buf (in bytes)
+ *
+ * Compute the CRC-32C (Castagnoli) checksum of @buf, continuing @crc. Buffers
+ * of a few hundred bytes or more are folded with 512-bit carry-less
+ * multiplications (VPCLMULQDQ) when the processor has them; otherwise the
+ * SSE4.2 crc32 instruction is used when the processor has it, and a table
+ * lookup otherwise. All give the same result.
+ *
+ * Return: The checksum of the data preceding @buf followed by @buf.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * crc32c_copy - Copy a buffer and compute its CRC-32C checksum
+ * @crc: Checksum of the data preceding @src, or 0 to start a new checksum
+ * @dest: Buffer to copy @src to, not overlapping it
+ * @src: Data to copy and checksum
+ * @len: Size of @src (in bytes)
+ *
+ * Same as crc32c() on @src, copying it to @dest in the same pass over the
+ * data. With VPCLMULQDQ, this costs little more than the copy alone; otherwise
+ * the data is copied, then checksummed.
+ *
+ * Return: The checksum of the data preceding @src followed by @src.
+ */
+uint32_t crc32c_copy(uint32_t crc, void *dest, const void *src, size_t len);
+
+/**
+ * crc32c_impl - Name the CRC-32C implementation in use
+ *
+ * Return: "vpclmulqdq" if crc32c() folds with carry-less multiplications,
+ * "sse4.2" if it uses the crc32 instruction, "table" otherwise.
+ */
+const char *crc32c_impl(void);
+
+#endif /* _CRC32C_H */
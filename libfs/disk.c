@@ -1,11 +1,18 @@
+#define _GNU_SOURCE
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "disk.h"
+#include "tracepoint.h"
 
 #define block_error(fmt, ...) \
 	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
@@ -13,16 +20,209 @@
 /* Invalid file descriptor */
 #define INVALID_FD -1
 
+/* Number of blocks of a block cache set */
+#define CACHE_WAYS 8
+
+/* Set of the block cache, holding the blocks whose index is congruent to the
+ * set's index modulo the number of sets */
+struct cache_set {
+	pthread_mutex_t lock;
+	/* Cached block index + 1 of each way, 0 if the way is empty */
+	size_t tags[CACHE_WAYS];
+	/* Last use of each way, to evict the least recently used one */
+	uint64_t used[CACHE_WAYS];
+	uint64_t clock;
+	/* Bumped by every write to a block of the set, so that a block read
+	 * from the disk while it was written is not cached */
+	uint64_t generation;
+	/* CACHE_WAYS blocks */
+	char *data;
+};
+
 /* Disk instance description */
 struct disk {
 	/* File descriptor */
 	int fd;
 	/* Block count */
 	size_t bcount;
+	/* Read-only mapping of the whole disk (created on first use) */
+	void *map;
+	/* Protects the creation of the mapping */
+	pthread_mutex_t map_lock;
+	/* Block cache of block_read() and block_write(), or NULL */
+	struct cache_set *sets;
+	size_t set_count;
+	size_t hits;
+	size_t misses;
 };
 
 /* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+static struct disk disk = {
+	.fd = INVALID_FD,
+	.map_lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+/* Size of the block cache of the disks opened next (in blocks) */
+static size_t cache_blocks;
+
+static int cache_create(void)
+{
+	size_t i;
+
+	disk.set_count = (cache_blocks + CACHE_WAYS - 1) / CACHE_WAYS;
+	disk.sets = calloc(disk.set_count, sizeof(*disk.sets));
+	if (!disk.sets)
+		return -1;
+	for (i = 0; i < disk.set_count; i++) {
+		pthread_mutex_init(&disk.sets[i].lock, NULL);
+		disk.sets[i].data = malloc(CACHE_WAYS * BLOCK_SIZE);
+		if (!disk.sets[i].data)
+			return -1;
+	}
+	disk.hits = disk.misses = 0;
+
+	return 0;
+}
+
+static void cache_destroy(void)
+{
+	size_t i;
+
+	if (!disk.sets)
+		return;
+	for (i = 0; i < disk.set_count; i++) {
+		pthread_mutex_destroy(&disk.sets[i].lock);
+		free(disk.sets[i].data);
+	}
+	free(disk.sets);
+	disk.sets = NULL;
+	disk.set_count = 0;
+}
+
+/* Way of @set holding @block, or -1 */
+static int cache_find(struct cache_set *set, size_t block)
+{
+	int i;
+
+	for (i = 0; i < CACHE_WAYS; i++)
+		if (set->tags[i] == block + 1)
+			return i;
+	return -1;
+}
+
+/* Store @block in @set, evicting its least recently used block if needed */
+static void cache_insert(struct cache_set *set, size_t block, const void *buf)
+{
+	int i, way = cache_find(set, block);
+
+	if (way < 0) {
+		way = 0;
+		for (i = 0; i < CACHE_WAYS; i++) {
+			if (!set->tags[i]) {
+				way = i;
+				break;
+			}
+			if (set->used[i] < set->used[way])
+				way = i;
+		}
+		set->tags[way] = block + 1;
+	}
+	memcpy(set->data + way * BLOCK_SIZE, buf, BLOCK_SIZE);
+	set->used[way] = ++set->clock;
+}
+
+/* Read @block from the cache, or from the disk and then into the cache */
+static int cache_read(size_t block, void *buf)
+{
+	struct cache_set *set = &disk.sets[block % disk.set_count];
+	uint64_t generation;
+	int way;
+
+	pthread_mutex_lock(&set->lock);
+	way = cache_find(set, block);
+	if (way >= 0) {
+		memcpy(buf, set->data + way * BLOCK_SIZE, BLOCK_SIZE);
+		set->used[way] = ++set->clock;
+		pthread_mutex_unlock(&set->lock);
+		__atomic_add_fetch(&disk.hits, 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+	generation = set->generation;
+	pthread_mutex_unlock(&set->lock);
+	__atomic_add_fetch(&disk.misses, 1, __ATOMIC_RELAXED);
+
+	/* Read without holding the set, other blocks of which stay usable */
+	if (pread(disk.fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+		perror("pread");
+		return -1;
+	}
+
+	pthread_mutex_lock(&set->lock);
+	if (set->generation == generation)
+		cache_insert(set, block, buf);
+	pthread_mutex_unlock(&set->lock);
+
+	return 0;
+}
+
+/* Write @block to the disk and to the cache, in the same order for both */
+static int cache_write(size_t block, const void *buf)
+{
+	struct cache_set *set = &disk.sets[block % disk.set_count];
+	int way, ret = 0;
+
+	pthread_mutex_lock(&set->lock);
+	set->generation++;
+	if (pwrite(disk.fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+		perror("pwrite");
+		ret = -1;
+		/* The block's content is unknown */
+		way = cache_find(set, block);
+		if (way >= 0)
+			set->tags[way] = 0;
+	} else {
+		cache_insert(set, block, buf);
+	}
+	pthread_mutex_unlock(&set->lock);
+
+	return ret;
+}
+
+/* Drop blocks @block to @block + @count - 1 from the cache */
+static void cache_invalidate(size_t block, size_t count)
+{
+	struct cache_set *set;
+	size_t i;
+	int way;
+
+	for (i = block; i < block + count; i++) {
+		set = &disk.sets[i % disk.set_count];
+		pthread_mutex_lock(&set->lock);
+		set->generation++;
+		way = cache_find(set, i);
+		if (way >= 0)
+			set->tags[way] = 0;
+		pthread_mutex_unlock(&set->lock);
+	}
+}
+
+int block_cache_size(size_t blocks)
+{
+	cache_blocks = blocks;
+
+	return 0;
+}
+
+int block_cache_stats(size_t *hits, size_t *misses)
+{
+	if (!hits || !misses)
+		return -1;
+
+	*hits = __atomic_load_n(&disk.hits, __ATOMIC_RELAXED);
+	*misses = __atomic_load_n(&disk.misses, __ATOMIC_RELAXED);
+
+	return 0;
+}
 
 int block_disk_open(const char *diskname)
 {
@@ -56,6 +256,14 @@ int block_disk_open(const char *diskname)
 		return -1;
 	}
 
+	if (cache_blocks && cache_create()) {
+		cache_destroy();
+		block_error("cannot allocate a block cache of %zu blocks",
+			    cache_blocks);
+		close(fd);
+		return -1;
+	}
+
 	disk.fd = fd;
 	disk.bcount = st.st_size / BLOCK_SIZE;
 
@@ -69,6 +277,12 @@ int block_disk_close(void)
 		return -1;
 	}
 
+	if (disk.map) {
+		munmap(disk.map, disk.bcount * BLOCK_SIZE);
+		disk.map = NULL;
+	}
+
+	cache_destroy();
 	close(disk.fd);
 
 	disk.fd = INVALID_FD;
@@ -88,6 +302,8 @@ int block_disk_count(void)
 
 int block_write(size_t block, const void *buf)
 {
+	TP_DETAIL("io", "block_write", block);
+
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
@@ -99,15 +315,13 @@ int block_write(size_t block, const void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
-		return -1;
-	}
+	if (disk.sets)
+		return cache_write(block, buf);
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	/* Perform the actual write into the disk image at the specified block
+	 * number, without moving a shared file offset */
+	if (pwrite(disk.fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+		perror("pwrite");
 		return -1;
 	}
 
@@ -116,6 +330,8 @@ int block_write(size_t block, const void *buf)
 
 int block_read(size_t block, void *buf)
 {
+	TP_DETAIL("io", "block_read", block);
+
 	if (disk.fd == INVALID_FD) {
 		block_error("no disk currently open");
 		return -1;
@@ -127,18 +343,187 @@ int block_read(size_t block, void *buf)
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	if (disk.sets)
+		return cache_read(block, buf);
+
+	/* Perform the actual read from the disk image at the specified block
+	 * number, without moving a shared file offset */
+	if (pread(disk.fd, buf, BLOCK_SIZE, block * BLOCK_SIZE) < 0) {
+		perror("pread");
 		return -1;
 	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	return 0;
+}
+
+int block_write_many(size_t block, size_t count, const void *buf)
+{
+	const char *data = buf;
+	size_t len = count * BLOCK_SIZE;
+	off_t offset = block * BLOCK_SIZE;
+	ssize_t ret;
+	TP_DETAIL("io", "block_write_many", block);
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block + count > disk.bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block + count, disk.bcount);
+		return -1;
+	}
+
+	/* Perform the actual write into the disk image, resuming after short
+	 * writes */
+	while (len > 0) {
+		ret = pwrite(disk.fd, data, len, offset);
+		if (ret < 0) {
+			perror("pwrite");
+			if (disk.sets)
+				cache_invalidate(block, count);
+			return -1;
+		}
+		data += ret;
+		len -= ret;
+		offset += ret;
+	}
+
+	/* The cached copies are older than the disk's from now on */
+	if (disk.sets)
+		cache_invalidate(block, count);
+
+	return 0;
+}
+
+int block_read_many(size_t block, size_t count, void *buf)
+{
+	char *data = buf;
+	size_t len = count * BLOCK_SIZE;
+	off_t offset = block * BLOCK_SIZE;
+	ssize_t ret;
+	TP_DETAIL("io", "block_read_many", block);
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (block + count > disk.bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block + count, disk.bcount);
 		return -1;
 	}
 
+	/* Perform the actual read from the disk image, resuming after short
+	 * reads */
+	while (len > 0) {
+		ret = pread(disk.fd, data, len, offset);
+		if (ret < 0) {
+			perror("pread");
+			return -1;
+		}
+		if (ret == 0) {
+			block_error("unexpected end of disk");
+			return -1;
+		}
+		data += ret;
+		len -= ret;
+		offset += ret;
+	}
+
 	return 0;
 }
 
+int block_sync(void)
+{
+	TP_DETAIL("io", "block_sync", 0);
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	/* Wait for the written blocks to reach the disk image's storage */
+	if (fdatasync(disk.fd) < 0) {
+		perror("fdatasync");
+		return -1;
+	}
+
+	return 0;
+}
+
+const void *block_view(size_t block)
+{
+	void *map;
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return NULL;
+	}
+
+	if (block >= disk.bcount) {
+		block_error("block index out of bounds (%zu/%zu)",
+			    block, disk.bcount);
+		return NULL;
+	}
+
+	/* Map the whole disk image the first time a view is requested */
+	pthread_mutex_lock(&disk.map_lock);
+	if (!disk.map) {
+		map = mmap(NULL, disk.bcount * BLOCK_SIZE, PROT_READ,
+			   MAP_SHARED, disk.fd, 0);
+		if (map == MAP_FAILED) {
+			pthread_mutex_unlock(&disk.map_lock);
+			perror("mmap");
+			return NULL;
+		}
+		disk.map = map;
+	}
+	map = disk.map;
+	pthread_mutex_unlock(&disk.map_lock);
+
+	return (const char *)map + block * BLOCK_SIZE;
+}
+
+int block_send(size_t block, size_t offset, size_t count, int out_fd)
+{
+	loff_t pos = block * BLOCK_SIZE + offset;
+	size_t sent = 0;
+	ssize_t ret;
+	off_t off;
+	TP_DETAIL("io", "block_send", block);
+
+	if (disk.fd == INVALID_FD) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	if (offset >= BLOCK_SIZE || block >= disk.bcount ||
+	    count > disk.bcount * BLOCK_SIZE - pos) {
+		block_error("range out of bounds (%zu+%zu/%zu)",
+			    block, offset + count, disk.bcount);
+		return -1;
+	}
+
+	/* copy_file_range() may even share the blocks, but only works between
+	 * regular files, so sendfile() takes over for pipes and sockets */
+	while (sent < count) {
+		ret = copy_file_range(disk.fd, &pos, out_fd, NULL, count - sent,
+				      0);
+		if (ret <= 0)
+			break;
+		sent += ret;
+	}
+	while (sent < count) {
+		off = pos;
+		ret = sendfile(out_fd, disk.fd, &off, count - sent);
+		if (ret <= 0)
+			break;
+		pos = off;
+		sent += ret;
+	}
+
+	return sent;
+}
@@ -60,5 +60,104 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_write_many - Write consecutive blocks to disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks
+ *
+ * Write the content of buffer @buf (@count * %BLOCK_SIZE bytes) in the virtual
+ * disk's blocks @block to @block + @count - 1, with as few system calls as
+ * possible.
+ *
+ * Return: -1 if a block is out of bounds or inaccessible or if the writing
+ * operation fails. 0 otherwise.
+ */
+int block_write_many(size_t block, size_t count, const void *buf);
+
+/**
+ * block_read_many - Read consecutive blocks from disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of the blocks
+ *
+ * Read the content of virtual disk's blocks @block to @block + @count - 1
+ * (@count * %BLOCK_SIZE bytes) into buffer @buf, with as few system calls as
+ * possible.
+ *
+ * Return: -1 if a block is out of bounds or inaccessible, or if the reading
+ * operation fails. 0 otherwise.
+ */
+int block_read_many(size_t block, size_t count, void *buf);
+
+/**
+ * block_sync - Flush written blocks to stable storage
+ *
+ * Make sure that all the blocks previously written with block_write() have
+ * reached the underlying storage of the virtual disk file.
+ *
+ * Return: -1 if there was no virtual disk file opened or if the flush operation
+ * fails. 0 otherwise.
+ */
+int block_sync(void);
+
+/**
+ * block_cache_size - Set the size of the block cache
+ * @blocks: Number of blocks to cache, or 0 for no cache
+ *
+ * Set the size of the block cache of the virtual disk files opened next. The
+ * cache keeps the most recently used blocks of block_read() and block_write()
+ * in memory, for all the threads. It is write-through: blocks are written to
+ * the virtual disk file as well, so that the other functions, which bypass the
+ * cache, see the same content. Blocks written with block_write_many() are
+ * dropped from the cache.
+ *
+ * Return: 0
+ */
+int block_cache_size(size_t blocks);
+
+/**
+ * block_cache_stats - Get the block cache's statistics
+ * @hits: Pointer to be set to the number of blocks read from the cache
+ * @misses: Pointer to be set to the number of blocks read from the disk
+ *
+ * The statistics are reset when a virtual disk file is opened.
+ *
+ * Return: -1 if @hits or @misses is NULL. 0 otherwise.
+ */
+int block_cache_stats(size_t *hits, size_t *misses);
+
+/**
+ * block_view - Get a read-only view of a block
+ * @block: Index of the block to view
+ *
+ * Get a pointer to the content of virtual disk's block @block (%BLOCK_SIZE
+ * bytes) in a read-only mapping of the virtual disk file. Consecutive blocks
+ * are consecutive in the mapping. Blocks later written with block_write() are
+ * reflected in the mapping. The pointer stays valid until the virtual disk is
+ * closed.
+ *
+ * Return: NULL if @block is out of bounds, or if the virtual disk file cannot
+ * be mapped. Otherwise a pointer to the content of the block.
+ */
+const void *block_view(size_t block);
+
+/**
+ * block_send - Copy part of the disk to a host file descriptor
+ * @block: Index of the block to copy from
+ * @offset: Offset of the first byte to copy in block @block
+ * @count: Number of bytes to copy, which can span several blocks
+ * @out_fd: Host file descriptor to copy to, at its current file offset
+ *
+ * Copy @count bytes of the virtual disk to @out_fd inside the kernel, without
+ * going through a user-space buffer: with copy_file_range() if @out_fd is a
+ * regular file that supports it, and with sendfile() otherwise.
+ *
+ * Return: -1 if there is no virtual disk file opened or if the range is out of
+ * bounds. Otherwise return the number of bytes copied, which is smaller than
+ * @count if the kernel cannot copy (all of) them to @out_fd.
+ */
+int block_send(size_t block, size_t offset, size_t count, int out_fd);
+
 #endif /* _DISK_H */
 
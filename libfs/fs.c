@@ -1,18 +1,111 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "crc32c.h"
 #include "disk.h"
 #include "fs.h"
+#include "lz.h"
+#include "trace.h"
+#include "tracepoint.h"
 
 #define FAT_EOC 0xFFFF
 #define FAT_FREE 0
 #define FD_MAX 32
 
+/* Chain walks over fewer FAT entries than TP_MIN_WALK take less time than the
+   trace point that would record them, and are not recorded */
+#define TP_MIN_WALK 64
+
+/* Files up to INLINE_MAX bytes are stored in the inline small-file area, which
+   gives every root directory entry its own INLINE_MAX byte slot */
+#define INLINE_MAX 64
+#define INLINE_AREA_BLOCKS ((FS_FILE_MAX_COUNT * INLINE_MAX) / BLOCK_SIZE)
+
+/* File tails of up to TAIL_MAX bytes are packed into FRAGMENT_SIZE units of
+   fragment blocks shared by several files */
+#define FRAGMENT_SIZE 512
+#define FRAGMENTS_PER_BLOCK (BLOCK_SIZE / FRAGMENT_SIZE)
+#define TAIL_MAX (BLOCK_SIZE / 2)
+
+/* Metadata updates are logged as records in a journal of data blocks. They are
+   committed by a committer thread, for fs_sync() and every
+   JOURNAL_COMMIT_INTERVAL-th metadata operation since the last commit to bound
+   what a crash loses, with one commit for all the requests made meanwhile. The
+   committer then checkpoints the journal into the FAT and root directory once
+   it is half full, after answering them. Journals are sized after the data area up to JOURNAL_MAX_BLOCKS
+   blocks, and grow up to JOURNAL_GROWN_MAX_BLOCKS blocks for transactions that
+   do not fit */
+#define JOURNAL_MAGIC 0x4C4E524A
+#define JOURNAL_MIN_BLOCKS 2
+#define JOURNAL_MAX_BLOCKS 64
+#define JOURNAL_GROWN_MAX_BLOCKS 255
+#define JOURNAL_COMMIT_INTERVAL 32
+
+/* Journal record types */
+#define RECORD_SUPER 1
+#define RECORD_FAT 2
+#define RECORD_DIR 3
+#define RECORD_INLINE 4
+#define RECORD_REMAP 5
+#define RECORD_CHECKSUM 6
+
+/* Leading superblock bytes logged by RECORD_SUPER (the journal fields among
+   them are only ever updated by writing the superblock, and are not replayed) */
+#define SUPER_LOGGED_BYTES 64
+
+/* With block deduplication, identical data blocks are shared through a remap
+   table from FAT entries to physical data blocks, and copied on write. The FAT
+   entries past the data area then become usable as well */
+#define PHYS_NONE 0xFFFF
+
+/* A snapshot is a frozen copy of the root directory, inline area, FAT and remap
+   table, listed in the snapshot directory block. The data blocks of its files
+   stay referenced in the deduplication table, so they are copied on write */
+#define SNAPSHOT_MAX (BLOCK_SIZE / sizeof(struct snapshotentry))
+
+/* Superblock feature flags */
+#define FEATURE_DEDUP 0x01
+
+/* Root directory entry flags */
+#define ENTRY_INLINE 0x01
+#define ENTRY_TAIL 0x02
+#define ENTRY_COMPRESSED 0x04
+
+/* Compressed files are split into chunks of CHUNK_BLOCKS blocks, each stored as
+   an extent of as few blocks as its compressed data needs. Their chain starts
+   with a chunk index giving the length of every extent, followed by the extents
+   in file order */
+#define CHUNK_BLOCKS 4
+#define CHUNK_SIZE (CHUNK_BLOCKS * BLOCK_SIZE)
+#define CHUNK_INDEX_ENTRIES (BLOCK_SIZE / sizeof(uint16_t))
+#define CHUNK_STORED 0x8000      // chunk index flag of chunks stored uncompressed
+#define CHUNK_LENGTH_MASK 0x7FFF // chunk index bits of the extent length (in bytes)
+
+/* Locking: each root directory entry has a reader/writer lock over the file's
+   content, size and block chain. The allocator lock covers the FAT, the remap
+   and deduplication tables, the fragment map, the inline area and the journal,
+   as well as any change to a root directory entry, so that journal commits never
+   log half-updated entries. The directory lock covers file names and the file
+   descriptor table. Locks are always taken in the order directory, file,
+   allocator, and several file locks in root directory order. File descriptors
+   are looked up without any lock */
+
+/* Files are copied COPY_BLOCKS data blocks at a time */
+#define COPY_BLOCKS 16
+
+/* Files are sent to host file descriptors SEND_BLOCKS data blocks at a time */
+#define SEND_BLOCKS 256
+
 struct __attribute__((__packed__)) superblock
 {
     char signature[8];            //(8 characters) signature
@@ -21,7 +114,18 @@ struct __attribute__((__packed__)) superblock
     uint16_t dataBlockStartIndex; //(2 bytes) data block start index
     uint16_t numDataBlocks;       // (2 bytes)  amount of data blocks
     uint8_t numBlocksFAT;         //(1 bytes)// number of blocks for FAT
-    uint8_t padding[4079];        //(4079 bytes)// unsused/padding  ASK THIS
+    uint16_t inlineIndex;         //(2 bytes) first FAT index of the inline small-file area (0 = none)
+    uint16_t journalIndex;        //(2 bytes) first FAT index of the metadata journal (0 = none)
+    uint8_t journalBlocks;        //(1 byte) number of blocks of the metadata journal
+    uint32_t journalSequence;     //(4 bytes) sequence number of the first journal transaction to replay
+    uint16_t dedupIndex;          //(2 bytes) first FAT index of the deduplication table (0 = none)
+    uint8_t dedupBlocks;          //(1 byte) number of blocks of the deduplication table
+    uint8_t features;             //(1 byte) feature flags (FEATURE_DEDUP)
+    uint16_t snapshotIndex;       //(2 bytes) FAT index of the snapshot directory block (0 = none)
+    uint16_t checksumIndex;       //(2 bytes) first FAT index of the checksum table (0 = none)
+    uint8_t checksumBlocks;       //(1 byte) number of blocks of the checksum table
+    uint16_t journalMap[JOURNAL_GROWN_MAX_BLOCKS]; //(510 bytes) data blocks of the metadata journal, in order (0 = to be found from the FAT)
+    uint8_t padding[3551];        //(3551 bytes)// unsused/padding
 };
 
 struct __attribute__((__packed__)) FAT
@@ -35,25 +139,104 @@ struct __attribute__((__packed__)) rootdirectory
     char fileName[FS_FILENAME_LEN]; //(16 bytes) Filename
     uint32_t sizeOfFile;            //(4 bytes) Size of the files (in bytes)
     uint16_t firstIndex;            //(2 bytes) Index of the first data block
-    uint8_t padding[10];            //(10 bytes) Unused/Padding
+    uint8_t flags;                  //(1 byte) Entry flags (ENTRY_INLINE, ENTRY_TAIL)
+    uint16_t tailIndex;             //(2 bytes) FAT index of the fragment block holding the packed tail
+    uint8_t tailFragment;           //(1 byte) First fragment of the packed tail in its fragment block
+    uint8_t padding[6];             //(6 bytes) Unused/Padding
+};
+
+struct __attribute__((__packed__)) snapshotentry
+{
+    char name[FS_FILENAME_LEN]; //(16 bytes) Snapshot name
+    uint16_t firstIndex;        //(2 bytes) FAT index of the first block of the snapshot
+    uint16_t blocks;            //(2 bytes) Number of blocks of the snapshot
+    uint8_t padding[12];        //(12 bytes) Unused/Padding
+};
+
+struct __attribute__((__packed__)) journalheader
+{
+    uint32_t magic;    //(4 bytes) JOURNAL_MAGIC
+    uint32_t sequence; //(4 bytes) Sequence number of the transaction
+    uint32_t length;   //(4 bytes) Size of the records following the header (in bytes)
+    uint32_t checksum; //(4 bytes) Checksum of the records
 };
 
-struct __attribute__((__packed__)) fdTable
+struct __attribute__((__packed__)) journalrecord
+{
+    uint8_t type;    //(1 byte) Record type (RECORD_SUPER, RECORD_FAT, ...)
+    uint16_t index;  //(2 bytes) First FAT entry, root directory entry or inline slot
+    uint16_t length; //(2 bytes) Size of the data following the record (in bytes)
+};
+
+struct fdTable
 {
     char fileName[FS_FILENAME_LEN]; //(16 bytes) Filename
     int fd;
     int file_offset;
     int empty; // 0 default empty = 0, full = 1
     int open;  // 0=close, 1 = open
+    int fileLocation; // root directory entry of the open file
+};
+
+struct iocursor
+{
+    const struct iovec *iov; // caller's buffers
+    int iovcnt;              // number of buffers
+    int index;               // current buffer
+    size_t offset;           // position in the current buffer
 };
 
 // creating objects of structs
 struct superblock *superBlock;
 struct FAT *fatArray;
 struct rootdirectory *rootDirectory;
+char *inlineArea;
+uint8_t *fragmentMap; // per data block bitmask of the fragments used by packed tails
+uint8_t *fragmentDirty; // per data block bitmask of the fragments freed since the last commit
+char *journalBuf;          // in-memory copy of the journal blocks
+size_t journalTail;        // end of the last committed transaction in the journal
+uint32_t journalSequence;  // sequence number of the next transaction
+uint8_t *fatDirty;         // per FAT entry flag of entries changed since the last commit
+uint8_t *remapDirty;       // per FAT entry flag of remap entries changed since the last commit
+uint8_t *freedDirty;       // per physical data block flag of blocks whose last reference was dropped since the last commit
+bool dirDirty[FS_FILE_MAX_COUNT];
+bool superDirty;
+int pendingOps;
+int fatEntries;            // number of usable FAT entries
+int maxFatEntries;         // number of FAT entries held by the FAT blocks
+char *dedupTable;          // in-memory copy of the deduplication table
+uint16_t *remapArray;      // per FAT entry physical data block (0 = same index)
+uint64_t *blockHash;       // per physical data block content hash (0 = unknown)
+uint16_t *refCount;        // per physical data block number of FAT entries using it
+int *hashHead;             // hash index buckets of physical data blocks
+int *hashNext;             // next physical data block in the same hash bucket
+size_t hashBuckets;
+int activeViews;           // number of zero-copy read views not released yet
+uint64_t *fileGenerations; // per root directory entry generation, in memory shareable with other processes
+int generationFd = -1;     // memory file holding fileGenerations, or -1
+bool readOnly;             // set when a snapshot is mounted
+uint32_t *checksumArray;   // per physical data block checksum (NULL = no checksums)
+uint8_t *checksumDirty;    // per physical data block flag of checksums changed since the last commit
+int checksumErrors;        // data blocks that failed their checksum since the file system was mounted
+uint64_t compressBytes;    // bytes compressed since the file system was mounted
+uint64_t compressNanos;    // time spent compressing them
+uint64_t decompressBytes;  // bytes decompressed since the file system was mounted
+uint64_t decompressNanos;  // time spent decompressing them
 bool disk_open = false;
-bool file_open = false;
+int openCount[FS_FILE_MAX_COUNT]; // per root directory entry number of open file descriptors
 struct fdTable *fdArray;
+pthread_rwlock_t fileLocks[FS_FILE_MAX_COUNT];
+pthread_mutex_t allocLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t dirLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_t committer;       // thread committing the journal
+bool committerRunning;
+bool committerStop;        // set to stop the committer once it has served every request
+uint64_t commitRequested;  // number of commits requested
+uint64_t commitCompleted;  // number of commit requests served
+uint64_t commitDurable;    // number of commit requests served by a commit that succeeded
+pthread_mutex_t commitLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t commitCond = PTHREAD_COND_INITIALIZER; // signalled on new requests
+pthread_cond_t commitDone = PTHREAD_COND_INITIALIZER; // broadcast when requests are served
 
 /* HELPER FUNCTIONS */
 
@@ -91,6 +274,19 @@ bool checkFileNameValid(const char *filename)
     return validFileName;
 }
 
+/*Finds the root directory entry of the file with the given filename, or -1*/
+int findFileEntry(const char *filename)
+{
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    {
+        if (rootDirectory[i].fileName[0] != '\0' && strcmp(rootDirectory[i].fileName, filename) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
 /*Checks if a file exists with the given filename*/
 bool checkIfFileExists(const char *filename)
 {
@@ -117,23 +313,55 @@ bool checkIfFileExists(const char *filename)
 bool checkFileDescriptorValid(int fd)
 {
     bool fdValid = true;
-    if (fd > FD_MAX || fd < 0 || fdArray[fd].open == 0)
+    if (fd >= FD_MAX || fd < 0 || __atomic_load_n(&fdArray[fd].open, __ATOMIC_ACQUIRE) == 0)
     {
         fdValid = false;
     }
     return fdValid;
 }
 
-/*Finds the next empty FAT block*/
+/*Updates a FAT entry and records it for the next journal commit*/
+void setFATEntry(int fatIndex, uint16_t next)
+{
+    fatArray[fatIndex].next = next;
+    fatDirty[fatIndex] = 1;
+}
+
+/*Records a root directory entry (and its inline slot) for the next journal commit*/
+void markEntryDirty(int fileLocation)
+{
+    dirDirty[fileLocation] = true;
+}
+
+/*Checks if the FAT entry and the data block of the same index are both free*/
+bool identityBlockFree(int fatIndex)
+{
+    return fatArray[fatIndex].next == 0 && (refCount == NULL || refCount[fatIndex] == 0);
+}
+
+/*Checks if a data block and its FAT entry are free in the committed metadata
+    as well as in memory, which a crash before the next commit brings back*/
+bool committedBlockFree(int fatIndex)
+{
+    return identityBlockFree(fatIndex) && !fatDirty[fatIndex] && !remapDirty[fatIndex] &&
+           (freedDirty == NULL || !freedDirty[fatIndex]);
+}
+
+/*Finds the next empty FAT block. Blocks freed since the last commit still hold
+    the data of files a crash would bring back, and are only reused when no
+    other block is free*/
 int emptyFATIndex(void)
 {
     int nextEmptyFAT = 0;
     for (int i = 1; i < superBlock->numDataBlocks; i++)
     {
-        if (fatArray[i].next == 0)
+        if (committedBlockFree(i))
+        {
+            return i;
+        }
+        if (nextEmptyFAT == 0 && identityBlockFree(i))
         {
             nextEmptyFAT = i;
-            break;
         }
     }
     return nextEmptyFAT;
@@ -145,7 +373,7 @@ int totalEmptyFATBlocks(void)
     int totalEmptyFAT = 0;
     for (int i = 0; i < superBlock->numDataBlocks; i++)
     {
-        if (fatArray[i].next == 0)
+        if (identityBlockFree(i))
         {
             totalEmptyFAT++;
         }
@@ -153,9 +381,27 @@ int totalEmptyFATBlocks(void)
     return totalEmptyFAT;
 }
 
+/*Finds the physical data block of a FAT entry*/
+int physicalIndex(int fatIndex)
+{
+    if (remapArray == NULL || remapArray[fatIndex] == 0)
+    {
+        /*FAT entries past the data area have no data block of their own*/
+        return fatIndex < superBlock->numDataBlocks ? fatIndex : PHYS_NONE;
+    }
+    return remapArray[fatIndex];
+}
+
+/*Finds the disk block holding the data of a FAT entry*/
+int dataBlock(int fatIndex)
+{
+    return physicalIndex(fatIndex) + superBlock->dataBlockStartIndex;
+}
+
 /*Finds the current FAT block index*/
 int findCurFatBlockIndex(int fileLocation, int curBlockNum)
 {
+    TP_DETAIL_IF(curBlockNum >= TP_MIN_WALK, "chain", "findCurFatBlockIndex", curBlockNum);
     int curFatBlockIndex;
     curFatBlockIndex = rootDirectory[fileLocation].firstIndex;
     for (int i = 0; i < curBlockNum; i++)
@@ -169,272 +415,3865 @@ int findCurFatBlockIndex(int fileLocation, int curBlockNum)
     return curFatBlockIndex;
 }
 
-/*Finds the file's location*/
-int findFileLocation(int fd)
+/*Takes the write lock of a file, and advances its generation before anything
+    changes, for views of the file to tell whether they may be stale*/
+void lockFileWrite(int fileLocation)
 {
-    int fileLocation = 0;
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    pthread_rwlock_wrlock(&fileLocks[fileLocation]);
+    __atomic_add_fetch(&fileGenerations[fileLocation], 1, __ATOMIC_SEQ_CST);
+}
+
+/*Creates the table of file generations, in a memory file other processes can
+    map when possible. It lasts as long as the process*/
+int createGenerations(void)
+{
+    size_t size = sizeof(uint64_t) * FS_FILE_MAX_COUNT;
+    int fd = memfd_create("fs_generations", MFD_CLOEXEC);
+    if (fd != -1 && ftruncate(fd, size) == 0)
     {
-        if (strncmp(fdArray[fd].fileName, rootDirectory[i].fileName, FS_FILENAME_LEN) == 0)
+        void *table = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (table != MAP_FAILED)
         {
-            fileLocation = i;
-            break;
+            fileGenerations = table;
+            generationFd = fd;
+            return 0;
         }
     }
-    return fileLocation;
+    if (fd != -1)
+    {
+        close(fd);
+    }
+
+    fileGenerations = calloc(FS_FILE_MAX_COUNT, sizeof(uint64_t));
+    return fileGenerations == NULL ? -1 : 0;
 }
 
-/*MAIN FUNCTIONS */
+/*Finds the file's location*/
+int findFileLocation(int fd)
+{
+    return fdArray[fd].fileLocation;
+}
 
-int fs_mount(const char *diskname)
+/*Gets the name of the file open as @fd, or NULL if @fd is not open. The worker
+    pool orders the operations on a descriptor by it, along with those naming
+    the file (see async.c)*/
+const char *findFileName(int fd)
 {
-    // open disk
-    // if virtual file disk cannot be openned return -1;
-    if (block_disk_open(diskname) == -1)
+    if (checkIfFileOpen(superBlock) == 0 || checkFileDescriptorValid(fd) == 0)
     {
-        return -1;
+        return NULL;
     }
-    disk_open = true;
+    return fdArray[fd].fileName;
+}
 
-    // declaring a super block
-    superBlock = malloc(BLOCK_SIZE);
-    if (superBlock == NULL)
+/*Sets the physical data block of a FAT entry*/
+void setRemapEntry(int fatIndex, int physical)
+{
+    uint16_t remap = (physical == fatIndex) ? 0 : physical;
+    if (remapArray[fatIndex] != remap)
     {
-        return -1;
+        remapArray[fatIndex] = remap;
+        remapDirty[fatIndex] = 1;
     }
+}
 
-    if (block_read(0, (void *)superBlock) == -1)
+/*Removes a physical data block from the hash index*/
+void unindexBlock(int physical)
+{
+    int *link = &hashHead[blockHash[physical] & (hashBuckets - 1)];
+    while (*link != 0 && *link != physical)
     {
-        return -1;
+        link = &hashNext[*link];
+    }
+    if (*link == physical)
+    {
+        *link = hashNext[physical];
     }
+    hashNext[physical] = 0;
+    blockHash[physical] = 0;
+}
 
-    // checking signature
-    if (strncmp(superBlock->signature, "ECS150FS", 8) != 0)
+/*Adds a physical data block to the hash index*/
+void indexBlock(int physical, uint64_t hash)
+{
+    int bucket = hash & (hashBuckets - 1);
+    blockHash[physical] = hash;
+    hashNext[physical] = hashHead[bucket];
+    hashHead[bucket] = physical;
+}
+
+/*Drops a reference to a physical data block*/
+void releasePhysical(int physical)
+{
+    if (physical >= superBlock->numDataBlocks || refCount[physical] == 0)
     {
-        return -1;
+        return;
+    }
+    refCount[physical]--;
+    if (refCount[physical] == 0)
+    {
+        freedDirty[physical] = 1;
+    }
+    if (refCount[physical] == 0 && blockHash[physical] != 0)
+    {
+        unindexBlock(physical);
     }
+}
 
-    if (block_disk_count() != superBlock->numBlockVirtualDisk)
+/*Makes a FAT entry use the given physical data block*/
+void mapPhysical(int fatIndex, int physical)
+{
+    releasePhysical(physicalIndex(fatIndex));
+    setRemapEntry(fatIndex, physical);
+    if (physical != PHYS_NONE)
     {
-        return -1;
+        refCount[physical]++;
     }
+}
 
-    // fatArray initialization
-    fatArray = malloc(superBlock->numBlocksFAT * BLOCK_SIZE);
-    for (int i = 0; i < superBlock->numBlocksFAT; i++)
+/*Finds a free physical data block, preferring the ones not freed since the
+    last commit as emptyFATIndex() does*/
+int freePhysicalIndex(void)
+{
+    int physical = -1;
+    for (int i = 1; i < superBlock->numDataBlocks; i++)
     {
-        if (block_read(i + 1, (void *)fatArray + (i * BLOCK_SIZE)) == -1) // ask TA about
+        if (refCount[i] == 0 && !freedDirty[i])
         {
-            return -1;
+            return i;
+        }
+        if (physical == -1 && refCount[i] == 0)
+        {
+            physical = i;
         }
     }
+    return physical;
+}
 
-    // rootDirectory initialization
-    rootDirectory = malloc(sizeof(struct rootdirectory) * FS_FILE_MAX_COUNT);
-    if (block_read(superBlock->numBlocksFAT + 1, (void *)rootDirectory) == -1) // ask TA about
+/*Finds a free FAT entry, including the ones past the data area*/
+int freeFATIndex(void)
+{
+    for (int i = 1; i < fatEntries; i++)
     {
-        return -1;
+        if (fatArray[i].next == 0)
+        {
+            return i;
+        }
     }
+    return -1;
+}
 
-    fdArray = malloc(sizeof(struct fdTable) * FD_MAX);
-
-    return 0;
+/*Allocates a free FAT entry backed by the given physical data block, which
+    gains a reference*/
+int allocateMappedFATBlock(int physical)
+{
+    int newFATBlockIndex = freeFATIndex();
+    if (newFATBlockIndex == -1)
+    {
+        return -1;
+    }
+    /*The entry's own data block may be used by another entry, and keeps its reference*/
+    setFATEntry(newFATBlockIndex, FAT_EOC);
+    setRemapEntry(newFATBlockIndex, physical);
+    refCount[physical]++;
+    return newFATBlockIndex;
 }
 
-int fs_umount(void)
+/*Allocates a free FAT block and marks it as the end of a chain*/
+int allocateFATBlock(void)
 {
-    /*Error: If no disk is opened, return -1 */
-    if (disk_open == false)
+    TP_DETAIL("alloc", "allocateFATBlock", 0);
+    int newFATBlockIndex = emptyFATIndex();
+    if (newFATBlockIndex != 0)
+    {
+        setFATEntry(newFATBlockIndex, FAT_EOC);
+        if (refCount != NULL)
+        {
+            mapPhysical(newFATBlockIndex, newFATBlockIndex);
+        }
+        return newFATBlockIndex;
+    }
+
+    /*With deduplication, any free FAT entry can be backed by any free block*/
+    if (refCount == NULL)
     {
         return -1;
     }
-    /*Error: No FS is currently mounted */
-    if (!superBlock)
+    int physical = freePhysicalIndex();
+    if (physical == -1)
     {
         return -1;
     }
+    return allocateMappedFATBlock(physical);
+}
 
-    // Writing metadata to the disk
-    if (block_write(0, (void *)superBlock) == -1)
+/*Allocates a FAT block not backed by a data block yet, for data that may turn
+    out to be a duplicate of an existing block*/
+int allocateUnbackedFATBlock(void)
+{
+    TP_DETAIL("alloc", "allocateUnbackedFATBlock", 0);
+    if (refCount == NULL || !(superBlock->features & FEATURE_DEDUP))
     {
         return -1;
     }
-
-    // Writing file data to disk
-    for (int i = 0; i < superBlock->numBlocksFAT; i++)
+    int newFATBlockIndex = freeFATIndex();
+    if (newFATBlockIndex == -1)
     {
-        if (block_write(i + 1, (void *)fatArray + (i * BLOCK_SIZE)) == -1)
-        {
-            return -1;
-        }
+        return -1;
     }
+    setFATEntry(newFATBlockIndex, FAT_EOC);
+    setRemapEntry(newFATBlockIndex, PHYS_NONE);
+    return newFATBlockIndex;
+}
 
-    if (block_write(superBlock->numBlocksFAT + 1, (void *)rootDirectory) == -1)
+/*Frees a FAT block, and its data block once no longer shared*/
+void freeFATBlock(int fatIndex)
+{
+    setFATEntry(fatIndex, FAT_FREE);
+    if (refCount != NULL)
     {
-        return -1;
+        releasePhysical(physicalIndex(fatIndex));
+        setRemapEntry(fatIndex, fatIndex);
     }
+}
 
-    /*Error: There are file descriptors still open: STILL NEED TO IMPLEMENT*/
+/*Checks if the file's content is stored inline in the small-file area*/
+bool isInlineFile(int fileLocation)
+{
+    return (rootDirectory[fileLocation].flags & ENTRY_INLINE) != 0;
+}
 
-    free(superBlock);
-    free(fatArray);
-    free(rootDirectory);
-    free(fdArray);
+/*Returns the file's slot in the inline small-file area*/
+char *inlineSlot(int fileLocation)
+{
+    return inlineArea + (fileLocation * INLINE_MAX);
+}
 
-    /*Error: Virtual disk can not be closed */
-    if (block_disk_close() < 0)
+/*Reserves the data blocks backing the inline small-file area, if not done yet*/
+int allocateInlineArea(void)
+{
+    if (superBlock->inlineIndex != 0)
+    {
+        return 0;
+    }
+    if (totalEmptyFATBlocks() < INLINE_AREA_BLOCKS)
     {
         return -1;
     }
 
+    int prevFATBlockIndex = allocateFATBlock();
+    superBlock->inlineIndex = prevFATBlockIndex;
+    superDirty = true;
+    for (int i = 1; i < INLINE_AREA_BLOCKS; i++)
+    {
+        int curFATBlockIndex = allocateFATBlock();
+        setFATEntry(prevFATBlockIndex, curFATBlockIndex);
+        prevFATBlockIndex = curFATBlockIndex;
+    }
     return 0;
 }
 
-int fs_info(void)
+/*Reads or writes the inline small-file area from/to its data blocks*/
+int transferInlineArea(bool write)
 {
-    // Count the number of free spaces in FAT array
-    int fatFreeSpaceCount = 0;
-    for (int i = 0; i < superBlock->numDataBlocks; i++)
+    int curFATBlockIndex = superBlock->inlineIndex;
+    for (int i = 0; i < INLINE_AREA_BLOCKS; i++)
     {
-        if (fatArray[i].next == FAT_FREE)
+        if (curFATBlockIndex == FAT_EOC)
         {
-            fatFreeSpaceCount++;
+            return -1;
         }
-    }
-
-    // count the number of free root directories
-    int freeRootDirectoryCount = 0;
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
-    {
-        if (rootDirectory[i].sizeOfFile == 0)
+        int block = dataBlock(curFATBlockIndex);
+        char *areaBlock = inlineArea + (i * BLOCK_SIZE);
+        if ((write ? block_write(block, areaBlock) : block_read(block, areaBlock)) == -1)
         {
-            freeRootDirectoryCount++;
+            return -1;
         }
+        curFATBlockIndex = fatArray[curFATBlockIndex].next;
     }
-
-    printf("FS Info:\n");
-    printf("total_blk_count=%d\n", superBlock->numBlockVirtualDisk);
-    printf("fat_blk_count=%d\n", superBlock->numBlocksFAT);
-    printf("rdir_blk=%d\n", superBlock->numBlocksFAT + 1);
-    printf("data_blk=%d\n", superBlock->numBlocksFAT + 2);
-    printf("data_blk_count=%d\n", superBlock->numDataBlocks);
-    printf("fat_free_ratio=%d/%d\n", fatFreeSpaceCount, superBlock->numDataBlocks);
-    printf("rdir_free_ratio=%d/%d\n", freeRootDirectoryCount, FS_FILE_MAX_COUNT);
     return 0;
 }
 
-int fs_create(const char *filename)
+/*Computes the content hash of a data block*/
+uint64_t hashBlock(const char *buf)
 {
-
-    /*Error Management: No FS currently mounted, Invalid file name,
-        or file already exists*/
-    if (checkIfFileOpen(superBlock) == 0 || checkFileNameValid(filename) == 0 || checkIfFileExists(filename) == 1)
+    uint64_t hash = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < BLOCK_SIZE; i += sizeof(uint64_t))
     {
-        return -1;
+        uint64_t word;
+        memcpy(&word, buf + i, sizeof(word));
+        hash = (hash ^ word) * 0xFF51AFD7ED558CCDull;
+        hash ^= hash >> 32;
     }
+    /*0 is reserved for blocks whose content hash is unknown*/
+    return hash == 0 ? 1 : hash;
+}
 
-    /*Error: Root directory already contains the max amount of files*/
-    // count the number of free root directories
-    int freeRootDirectoryCount = 0;
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+/*Finds the size of the remap part of the deduplication table (in bytes)*/
+size_t remapTableBytes(void)
+{
+    size_t bytes = maxFatEntries * sizeof(uint16_t);
+    return (bytes + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+}
+
+/*Finds the number of blocks of the deduplication table*/
+int dedupTableBlocks(void)
+{
+    size_t bytes = remapTableBytes() + superBlock->numDataBlocks * sizeof(uint64_t);
+    return (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/*Allocates the in-memory deduplication table and physical block index*/
+int setupDedupTable(void)
+{
+    hashBuckets = 1;
+    while (hashBuckets < superBlock->numDataBlocks)
     {
-        if (rootDirectory[i].fileName[0] == '\0')
-        {
-            freeRootDirectoryCount++;
-        }
+        hashBuckets <<= 1;
     }
-    if (freeRootDirectoryCount == 0)
+
+    dedupTable = calloc(superBlock->dedupBlocks, BLOCK_SIZE);
+    refCount = calloc(superBlock->numDataBlocks, sizeof(uint16_t));
+    freedDirty = calloc(superBlock->numDataBlocks, sizeof(uint8_t));
+    hashNext = calloc(superBlock->numDataBlocks, sizeof(int));
+    hashHead = calloc(hashBuckets, sizeof(int));
+    if (dedupTable == NULL || refCount == NULL || freedDirty == NULL || hashNext == NULL || hashHead == NULL)
     {
         return -1;
     }
+    remapArray = (uint16_t *)dedupTable;
+    blockHash = (uint64_t *)(dedupTable + remapTableBytes());
+    fatEntries = maxFatEntries;
+    return 0;
+}
 
-    /*Go through the root directory and find the entry where everything is NULL*/
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+/*Reads or writes the deduplication table from/to its data blocks*/
+int transferDedupTable(bool write)
+{
+    int curFATBlockIndex = superBlock->dedupIndex;
+    for (int i = 0; i < superBlock->dedupBlocks; i++)
     {
-
-        // find empty spot in root directory
-        if (rootDirectory[i].fileName[0] == '\0')
+        if (curFATBlockIndex == FAT_EOC)
         {
-            strcpy(rootDirectory[i].fileName, filename);
-            rootDirectory[i].sizeOfFile = 0;
-            rootDirectory[i].firstIndex = FAT_EOC;
-
-            return 0;
+            return -1;
+        }
+        int block = dataBlock(curFATBlockIndex);
+        char *tableBlock = dedupTable + (i * BLOCK_SIZE);
+        if ((write ? block_write(block, tableBlock) : block_read(block, tableBlock)) == -1)
+        {
+            return -1;
         }
+        curFATBlockIndex = fatArray[curFATBlockIndex].next;
     }
-    return -1;
+    return 0;
 }
 
-int fs_delete(const char *filename)
+/*Rebuilds the reference counts and hash index of the physical data blocks*/
+void buildDedupIndex(void)
 {
+    memset(refCount, 0, superBlock->numDataBlocks * sizeof(uint16_t));
+    memset(hashNext, 0, superBlock->numDataBlocks * sizeof(int));
+    memset(hashHead, 0, hashBuckets * sizeof(int));
 
-    /*Error Management: No FS currently mounted, Invalid file name,
-        or file does not exist*/
-    if (checkIfFileOpen(superBlock) == 0 || checkFileNameValid(filename) == 0 || checkIfFileExists(filename) == 0)
+    for (int i = 1; i < fatEntries; i++)
     {
-        return -1;
+        int physical = physicalIndex(i);
+        if (fatArray[i].next != FAT_FREE && physical < superBlock->numDataBlocks)
+        {
+            refCount[physical]++;
+        }
     }
-
-    /*Error: file @filename is currently open */
-    if (file_open == true)
+    for (int i = 1; i < superBlock->numDataBlocks; i++)
     {
-        return -1;
+        if (refCount[i] > 0 && blockHash[i] != 0)
+        {
+            indexBlock(i, blockHash[i]);
+        }
+        else
+        {
+            blockHash[i] = 0;
+        }
     }
+}
 
-    /*all the data blocks containing the file’s contents must be freed in the FAT.*/
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+/*Finds a physical data block holding the same content as @buf*/
+int findDuplicate(uint64_t hash, const char *buf)
+{
+    char compareBuf[BLOCK_SIZE];
+    for (int physical = hashHead[hash & (hashBuckets - 1)]; physical != 0; physical = hashNext[physical])
     {
-        if ((strlen(rootDirectory[i].fileName) > 0) && (strcmp(rootDirectory[i].fileName, filename) == 0))
+        /*Hashes are only hints, so a match is confirmed by comparing content*/
+        if (blockHash[physical] == hash &&
+            block_read(physical + superBlock->dataBlockStartIndex, compareBuf) == 0 &&
+            memcmp(compareBuf, buf, BLOCK_SIZE) == 0)
         {
-            rootDirectory[i].fileName[0] = '\0';
-            if (rootDirectory[i].sizeOfFile > 0)
+            return physical;
+        }
+    }
+    return -1;
+}
+
+/*Reads or writes @blocks blocks of @buf from/to the data blocks of a chain*/
+int transferChain(int fatIndex, char *buf, int blocks, bool write)
+{
+    TP_DETAIL("chain", "transferChain", blocks);
+    for (int i = 0; i < blocks; i++)
+    {
+        if (fatIndex == FAT_EOC || fatIndex == FAT_FREE)
+        {
+            return -1;
+        }
+        int block = dataBlock(fatIndex);
+        if ((write ? block_write(block, buf + (i * BLOCK_SIZE)) : block_read(block, buf + (i * BLOCK_SIZE))) == -1)
+        {
+            return -1;
+        }
+        fatIndex = fatArray[fatIndex].next;
+    }
+    return 0;
+}
+
+/*Frees all the FAT blocks of a chain*/
+void freeChain(int fatIndex)
+{
+    TP_DETAIL("chain", "freeChain", fatIndex);
+    while (fatIndex != FAT_EOC && fatIndex != FAT_FREE)
+    {
+        int nextFATBlockIndex = fatArray[fatIndex].next;
+        freeFATBlock(fatIndex);
+        fatIndex = nextFATBlockIndex;
+    }
+}
+
+/*Finds the number of blocks of the checksum table*/
+int checksumTableBlocks(void)
+{
+    size_t bytes = superBlock->numDataBlocks * sizeof(uint32_t);
+    return (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/*Allocates the in-memory checksum table*/
+int setupChecksumTable(void)
+{
+    checksumArray = calloc(superBlock->checksumBlocks, BLOCK_SIZE);
+    checksumDirty = calloc(superBlock->numDataBlocks, sizeof(uint8_t));
+    if (checksumArray == NULL || checksumDirty == NULL)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*Frees the in-memory checksum table*/
+void dropChecksumTable(void)
+{
+    free(checksumArray);
+    free(checksumDirty);
+    checksumArray = NULL;
+    checksumDirty = NULL;
+}
+
+/*Records the checksums of @blocks data blocks of a chain, from @fatIndex, just
+    written from @buf. Called with the allocator lock held*/
+void updateChecksums(int fatIndex, const char *buf, size_t blocks)
+{
+    for (size_t i = 0; i < blocks && checksumArray != NULL; i++)
+    {
+        int physical = physicalIndex(fatIndex);
+        if (physical < superBlock->numDataBlocks)
+        {
+            checksumArray[physical] = crc32c(0, buf + (i * BLOCK_SIZE), BLOCK_SIZE);
+            checksumDirty[physical] = 1;
+        }
+        fatIndex = fatArray[fatIndex].next;
+    }
+}
+
+/*Checks @blocks data blocks of a chain, from @fatIndex, just read into @buf
+    against their checksums, and returns how many of them match before the first
+    one that does not. libfs keeps no copy of the blocks it reads, so every read
+    from the disk is checked*/
+size_t verifyChecksums(int fatIndex, const char *buf, size_t blocks)
+{
+    for (size_t i = 0; i < blocks && checksumArray != NULL; i++)
+    {
+        int physical = physicalIndex(fatIndex);
+        fatIndex = fatArray[fatIndex].next;
+        if (physical >= superBlock->numDataBlocks)
+        {
+            continue;
+        }
+        if (crc32c(0, buf + (i * BLOCK_SIZE), BLOCK_SIZE) != checksumArray[physical])
+        {
+            __atomic_add_fetch(&checksumErrors, 1, __ATOMIC_RELAXED);
+            return i;
+        }
+    }
+    return blocks;
+}
+
+/*Copies @blocks adjacent data blocks of a chain, from @fatIndex, from their
+    view in the disk mapping @view into @buf, checksumming each in the same pass
+    over it. Same return value as verifyChecksums()*/
+size_t copyVerified(int fatIndex, const char *view, char *buf, size_t blocks)
+{
+    for (size_t i = 0; i < blocks; i++)
+    {
+        int physical = physicalIndex(fatIndex);
+        fatIndex = fatArray[fatIndex].next;
+        uint32_t checksum = crc32c_copy(0, buf + (i * BLOCK_SIZE), view + (i * BLOCK_SIZE), BLOCK_SIZE);
+        if (physical < superBlock->numDataBlocks && checksum != checksumArray[physical])
+        {
+            __atomic_add_fetch(&checksumErrors, 1, __ATOMIC_RELAXED);
+            return i;
+        }
+    }
+    return blocks;
+}
+
+/*Reads @blocks data blocks of a file's chain, from @fatIndex, and checks them*/
+int readChain(int fatIndex, char *buf, int blocks)
+{
+    if (transferChain(fatIndex, buf, blocks, false) == -1 || verifyChecksums(fatIndex, buf, blocks) < (size_t)blocks)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*Writes a data block of a file, sharing an identical block when deduplication
+    is enabled and copying the block first if it is shared*/
+int writeDataBlock(int fatIndex, const char *buf)
+{
+    if (refCount == NULL)
+    {
+        if (block_write(dataBlock(fatIndex), buf) == -1)
+        {
+            return -1;
+        }
+        updateChecksums(fatIndex, buf, 1);
+        return 0;
+    }
+
+    uint64_t hash = hashBlock(buf);
+    int physical = physicalIndex(fatIndex);
+    int duplicate = -1;
+    if (superBlock->features & FEATURE_DEDUP)
+    {
+        duplicate = findDuplicate(hash, buf);
+    }
+    if (duplicate != -1)
+    {
+        if (duplicate != physical)
+        {
+            mapPhysical(fatIndex, duplicate);
+        }
+        return 0;
+    }
+
+    /*Copy on write: shared or unbacked entries get a data block of their own*/
+    if (physical == PHYS_NONE || refCount[physical] > 1)
+    {
+        int newPhysical = freePhysicalIndex();
+        if (newPhysical == -1 || block_write(newPhysical + superBlock->dataBlockStartIndex, buf) == -1)
+        {
+            return -1;
+        }
+        mapPhysical(fatIndex, newPhysical);
+        indexBlock(newPhysical, hash);
+        updateChecksums(fatIndex, buf, 1);
+        return 0;
+    }
+
+    if (block_write(dataBlock(fatIndex), buf) == -1)
+    {
+        return -1;
+    }
+    if (blockHash[physical] != 0)
+    {
+        unindexBlock(physical);
+    }
+    indexBlock(physical, hash);
+    updateChecksums(fatIndex, buf, 1);
+    return 0;
+}
+
+/*Moves the content of an inline file into a newly allocated data block*/
+int promoteInlineFile(int fileLocation)
+{
+    char bounceBuf[BLOCK_SIZE];
+    int newFATBlockIndex = allocateFATBlock();
+    if (newFATBlockIndex == -1)
+    {
+        return -1;
+    }
+
+    memset(bounceBuf, 0, BLOCK_SIZE);
+    memcpy(bounceBuf, inlineSlot(fileLocation), rootDirectory[fileLocation].sizeOfFile);
+    if (writeDataBlock(newFATBlockIndex, bounceBuf) == -1)
+    {
+        freeFATBlock(newFATBlockIndex);
+        return -1;
+    }
+
+    rootDirectory[fileLocation].firstIndex = newFATBlockIndex;
+    rootDirectory[fileLocation].flags &= ~ENTRY_INLINE;
+    memset(inlineSlot(fileLocation), 0, INLINE_MAX);
+    markEntryDirty(fileLocation);
+    return 0;
+}
+
+/*Checks if the last partial block of the file is packed into fragments*/
+bool hasPackedTail(int fileLocation)
+{
+    return (rootDirectory[fileLocation].flags & ENTRY_TAIL) != 0;
+}
+
+/*Finds the number of fragments needed by the tail of a file of the given size*/
+int tailFragmentCount(size_t fileSize)
+{
+    return ((fileSize % BLOCK_SIZE) + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE;
+}
+
+/*Finds the fragment mask covering @count fragments from @first*/
+uint8_t fragmentMask(int first, int count)
+{
+    return ((1 << count) - 1) << first;
+}
+
+/*Rebuilds the fragment map from the packed tails of the root directory*/
+void buildFragmentMap(void)
+{
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    {
+        if (rootDirectory[i].fileName[0] != '\0' && hasPackedTail(i))
+        {
+            int count = tailFragmentCount(rootDirectory[i].sizeOfFile);
+            fragmentMap[rootDirectory[i].tailIndex] |= fragmentMask(rootDirectory[i].tailFragment, count);
+        }
+    }
+}
+
+/*Finds @count contiguous free fragments, starting a new fragment block if none
+    of the existing ones has room. Fragments freed since the last commit are
+    left alone, as emptyFATIndex() does with blocks. With checksums, so are the
+    fragment blocks allocated before it: their committed checksum has to match
+    the tails committed in them until the next commit*/
+int allocateFragments(int count, int *fragment, bool *newBlock)
+{
+    TP_DETAIL("alloc", "allocateFragments", count);
+    for (int i = 1; i < fatEntries; i++)
+    {
+        if (fragmentMap[i] == 0 || (checksumArray != NULL && !fatDirty[i]))
+        {
+            continue;
+        }
+        for (int first = 0; first + count <= FRAGMENTS_PER_BLOCK; first++)
+        {
+            if (((fragmentMap[i] | fragmentDirty[i]) & fragmentMask(first, count)) == 0)
+            {
+                fragmentMap[i] |= fragmentMask(first, count);
+                *fragment = first;
+                *newBlock = false;
+                return i;
+            }
+        }
+    }
+
+    int newFATBlockIndex = allocateFATBlock();
+    if (newFATBlockIndex == -1)
+    {
+        return -1;
+    }
+    fragmentMap[newFATBlockIndex] = fragmentMask(0, count);
+    *fragment = 0;
+    *newBlock = true;
+    return newFATBlockIndex;
+}
+
+/*Releases the fragments of a packed tail, and the fragment block once unused*/
+void freeTail(int fileLocation)
+{
+    int tailIndex = rootDirectory[fileLocation].tailIndex;
+    int count = tailFragmentCount(rootDirectory[fileLocation].sizeOfFile);
+
+    fragmentMap[tailIndex] &= ~fragmentMask(rootDirectory[fileLocation].tailFragment, count);
+    fragmentDirty[tailIndex] |= fragmentMask(rootDirectory[fileLocation].tailFragment, count);
+    if (fragmentMap[tailIndex] == 0)
+    {
+        freeFATBlock(tailIndex);
+    }
+    rootDirectory[fileLocation].flags &= ~ENTRY_TAIL;
+    rootDirectory[fileLocation].tailIndex = 0;
+    rootDirectory[fileLocation].tailFragment = 0;
+    markEntryDirty(fileLocation);
+}
+
+/*Stores the last @length bytes of a file in fragments instead of a full block*/
+int packTail(int fileLocation, const char *data, size_t length)
+{
+    char bounceBuf[BLOCK_SIZE];
+    int count = (length + FRAGMENT_SIZE - 1) / FRAGMENT_SIZE;
+    int fragment;
+    bool newBlock;
+
+    int tailIndex = allocateFragments(count, &fragment, &newBlock);
+    if (tailIndex == -1)
+    {
+        return -1;
+    }
+
+    if (newBlock)
+    {
+        memset(bounceBuf, 0, BLOCK_SIZE);
+    }
+    else if (block_read(dataBlock(tailIndex), bounceBuf) == -1 || !verifyChecksums(tailIndex, bounceBuf, 1))
+    {
+        fragmentMap[tailIndex] &= ~fragmentMask(fragment, count);
+        return -1;
+    }
+    memset(bounceBuf + (fragment * FRAGMENT_SIZE), 0, count * FRAGMENT_SIZE);
+    memcpy(bounceBuf + (fragment * FRAGMENT_SIZE), data, length);
+    if (writeDataBlock(tailIndex, bounceBuf) == -1)
+    {
+        fragmentMap[tailIndex] &= ~fragmentMask(fragment, count);
+        if (fragmentMap[tailIndex] == 0)
+        {
+            freeFATBlock(tailIndex);
+        }
+        return -1;
+    }
+
+    rootDirectory[fileLocation].flags |= ENTRY_TAIL;
+    rootDirectory[fileLocation].tailIndex = tailIndex;
+    rootDirectory[fileLocation].tailFragment = fragment;
+    markEntryDirty(fileLocation);
+    return 0;
+}
+
+/*Updates bytes of a packed tail in place, as long as they fit in its fragments*/
+int writeTail(int fileLocation, size_t tailOffset, const char *data, size_t length)
+{
+    char bounceBuf[BLOCK_SIZE];
+    int tailIndex = rootDirectory[fileLocation].tailIndex;
+
+    if (block_read(dataBlock(tailIndex), bounceBuf) == -1 || !verifyChecksums(tailIndex, bounceBuf, 1))
+    {
+        return -1;
+    }
+    memcpy(bounceBuf + (rootDirectory[fileLocation].tailFragment * FRAGMENT_SIZE) + tailOffset, data, length);
+    if (writeDataBlock(tailIndex, bounceBuf) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*Moves a packed tail into a full data block appended to the file's chain*/
+int promoteTail(int fileLocation)
+{
+    char bounceBuf[BLOCK_SIZE];
+    char fragmentBuf[BLOCK_SIZE];
+    size_t fileSize = rootDirectory[fileLocation].sizeOfFile;
+
+    int newFATBlockIndex = allocateFATBlock();
+    if (newFATBlockIndex == -1)
+    {
+        return -1;
+    }
+    int tailIndex = rootDirectory[fileLocation].tailIndex;
+    if (block_read(dataBlock(tailIndex), fragmentBuf) == -1 || !verifyChecksums(tailIndex, fragmentBuf, 1))
+    {
+        freeFATBlock(newFATBlockIndex);
+        return -1;
+    }
+    memset(bounceBuf, 0, BLOCK_SIZE);
+    memcpy(bounceBuf, fragmentBuf + (rootDirectory[fileLocation].tailFragment * FRAGMENT_SIZE), fileSize % BLOCK_SIZE);
+    if (writeDataBlock(newFATBlockIndex, bounceBuf) == -1)
+    {
+        freeFATBlock(newFATBlockIndex);
+        return -1;
+    }
+
+    /*Link the new block at the end of the chain of full blocks*/
+    int lastFATBlockIndex = findCurFatBlockIndex(fileLocation, (fileSize / BLOCK_SIZE) - 1);
+    if (fileSize < BLOCK_SIZE)
+    {
+        rootDirectory[fileLocation].firstIndex = newFATBlockIndex;
+    }
+    else
+    {
+        setFATEntry(lastFATBlockIndex, newFATBlockIndex);
+    }
+    freeTail(fileLocation);
+    return 0;
+}
+
+/*Counts the blocks of a chain, from @fatIndex and up to @maxBlocks, that sit next
+    to each other on disk. If @lastOldIndex is set, the chain is grown with adjacent
+    free blocks and @lastOldIndex receives the last block it had before*/
+size_t contiguousRun(int fatIndex, size_t maxBlocks, int *lastOldIndex)
+{
+    TP_DETAIL_IF(maxBlocks >= TP_MIN_WALK, "chain", "contiguousRun", maxBlocks);
+    size_t runBlocks = 1;
+    int lastFATBlockIndex = fatIndex;
+    while (runBlocks < maxBlocks)
+    {
+        int nextFATBlockIndex = fatArray[lastFATBlockIndex].next;
+        if (nextFATBlockIndex == FAT_EOC)
+        {
+            if (lastOldIndex == NULL)
+            {
+                break;
+            }
+            nextFATBlockIndex = allocateFATBlock();
+            if (nextFATBlockIndex == -1)
+            {
+                break;
+            }
+            if (dataBlock(nextFATBlockIndex) != dataBlock(lastFATBlockIndex) + 1)
+            {
+                freeFATBlock(nextFATBlockIndex);
+                break;
+            }
+            setFATEntry(lastFATBlockIndex, nextFATBlockIndex);
+        }
+        else
+        {
+            if (physicalIndex(nextFATBlockIndex) == PHYS_NONE ||
+                dataBlock(nextFATBlockIndex) != dataBlock(lastFATBlockIndex) + 1)
+            {
+                break;
+            }
+            if (lastOldIndex != NULL)
+            {
+                *lastOldIndex = nextFATBlockIndex;
+            }
+        }
+        runBlocks++;
+        lastFATBlockIndex = nextFATBlockIndex;
+    }
+    return runBlocks;
+}
+
+/*Cuts a file's chain before @fatIndex and frees the blocks from there to its end*/
+void truncateChain(int fileLocation, int prevFATBlockIndex, int fatIndex)
+{
+    TP_DETAIL("chain", "truncateChain", fatIndex);
+    if (prevFATBlockIndex == FAT_EOC)
+    {
+        rootDirectory[fileLocation].firstIndex = FAT_EOC;
+    }
+    else
+    {
+        setFATEntry(prevFATBlockIndex, FAT_EOC);
+    }
+    while (fatIndex != FAT_EOC)
+    {
+        int nextFATBlockIndex = fatArray[fatIndex].next;
+        freeFATBlock(fatIndex);
+        fatIndex = nextFATBlockIndex;
+    }
+}
+
+/*Computes the checksum of a journal transaction's records (FNV-1a)*/
+uint32_t journalChecksum(const char *data, size_t length)
+{
+    uint32_t checksum = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        checksum = (checksum ^ (uint8_t)data[i]) * 16777619u;
+    }
+    return checksum;
+}
+
+/*Appends a record to a transaction, or only counts its size if @dest is NULL*/
+size_t appendRecord(char *dest, int type, int index, const void *data, size_t length)
+{
+    if (dest != NULL)
+    {
+        struct journalrecord record = {.type = type, .index = index, .length = length};
+        memcpy(dest, &record, sizeof(record));
+        memcpy(dest + sizeof(record), data, length);
+    }
+    return sizeof(struct journalrecord) + length;
+}
+
+/*Serializes the metadata changed since the last commit as journal records,
+    or only counts their size if @dest is NULL*/
+size_t serializeRecords(char *dest)
+{
+    size_t length = 0;
+
+    if (superDirty)
+    {
+        length += appendRecord(dest ? dest + length : NULL, RECORD_SUPER, 0, superBlock, SUPER_LOGGED_BYTES);
+    }
+
+    /*Consecutive dirty FAT entries are logged as a single record*/
+    int i = 0;
+    while (i < fatEntries)
+    {
+        if (!fatDirty[i])
+        {
+            i++;
+            continue;
+        }
+        int first = i;
+        while (i < fatEntries && fatDirty[i] && i - first < UINT16_MAX / sizeof(struct FAT))
+        {
+            i++;
+        }
+        length += appendRecord(dest ? dest + length : NULL, RECORD_FAT, first, &fatArray[first], (i - first) * sizeof(struct FAT));
+    }
+
+    /*Remap entries are logged the same way, when blocks are deduplicated*/
+    i = 0;
+    while (remapArray != NULL && i < fatEntries)
+    {
+        if (!remapDirty[i])
+        {
+            i++;
+            continue;
+        }
+        int first = i;
+        while (i < fatEntries && remapDirty[i] && i - first < UINT16_MAX / sizeof(uint16_t))
+        {
+            i++;
+        }
+        length += appendRecord(dest ? dest + length : NULL, RECORD_REMAP, first, &remapArray[first], (i - first) * sizeof(uint16_t));
+    }
+
+    /*And so are the checksums of the data blocks written, when they are kept*/
+    i = 0;
+    while (checksumArray != NULL && i < superBlock->numDataBlocks)
+    {
+        if (!checksumDirty[i])
+        {
+            i++;
+            continue;
+        }
+        int first = i;
+        while (i < superBlock->numDataBlocks && checksumDirty[i] && i - first < UINT16_MAX / sizeof(uint32_t))
+        {
+            i++;
+        }
+        length += appendRecord(dest ? dest + length : NULL, RECORD_CHECKSUM, first, &checksumArray[first], (i - first) * sizeof(uint32_t));
+    }
+
+    for (int j = 0; j < FS_FILE_MAX_COUNT; j++)
+    {
+        if (!dirDirty[j])
+        {
+            continue;
+        }
+        length += appendRecord(dest ? dest + length : NULL, RECORD_DIR, j, &rootDirectory[j], sizeof(struct rootdirectory));
+        if (rootDirectory[j].fileName[0] != '\0' && isInlineFile(j))
+        {
+            length += appendRecord(dest ? dest + length : NULL, RECORD_INLINE, j, inlineSlot(j), rootDirectory[j].sizeOfFile);
+        }
+    }
+    return length;
+}
+
+/*Applies the records of a journal transaction to the in-memory metadata*/
+void applyRecords(const char *records, size_t length)
+{
+    size_t offset = 0;
+    while (offset + sizeof(struct journalrecord) <= length)
+    {
+        struct journalrecord record;
+        memcpy(&record, records + offset, sizeof(record));
+        const char *data = records + offset + sizeof(record);
+        offset += sizeof(record) + record.length;
+        if (offset > length)
+        {
+            break;
+        }
+
+        if (record.type == RECORD_SUPER && record.length == SUPER_LOGGED_BYTES)
+        {
+            struct superblock journalFields = *superBlock;
+            memcpy(superBlock, data, SUPER_LOGGED_BYTES);
+            superBlock->journalIndex = journalFields.journalIndex;
+            superBlock->journalBlocks = journalFields.journalBlocks;
+            superBlock->journalSequence = journalFields.journalSequence;
+            memcpy(superBlock->journalMap, journalFields.journalMap, sizeof(superBlock->journalMap));
+        }
+        else if (record.type == RECORD_FAT && record.index + record.length / sizeof(struct FAT) <= maxFatEntries)
+        {
+            memcpy(&fatArray[record.index], data, record.length);
+        }
+        else if (record.type == RECORD_REMAP && remapArray != NULL && record.index + record.length / sizeof(uint16_t) <= maxFatEntries)
+        {
+            memcpy(&remapArray[record.index], data, record.length);
+        }
+        else if (record.type == RECORD_CHECKSUM && checksumArray != NULL && record.index + record.length / sizeof(uint32_t) <= superBlock->numDataBlocks)
+        {
+            memcpy(&checksumArray[record.index], data, record.length);
+        }
+        else if (record.type == RECORD_DIR && record.index < FS_FILE_MAX_COUNT && record.length == sizeof(struct rootdirectory))
+        {
+            memcpy(&rootDirectory[record.index], data, record.length);
+        }
+        else if (record.type == RECORD_INLINE && record.index < FS_FILE_MAX_COUNT && record.length <= INLINE_MAX)
+        {
+            memset(inlineSlot(record.index), 0, INLINE_MAX);
+            memcpy(inlineSlot(record.index), data, record.length);
+        }
+    }
+}
+
+/*Forgets the metadata changes, once they are committed or checkpointed*/
+void clearDirty(void)
+{
+    memset(fatDirty, 0, maxFatEntries);
+    memset(remapDirty, 0, maxFatEntries);
+    if (checksumDirty != NULL)
+    {
+        memset(checksumDirty, 0, superBlock->numDataBlocks);
+    }
+    if (freedDirty != NULL)
+    {
+        memset(freedDirty, 0, superBlock->numDataBlocks);
+    }
+    if (fragmentDirty != NULL)
+    {
+        memset(fragmentDirty, 0, maxFatEntries);
+    }
+    memset(dirDirty, 0, sizeof(dirDirty));
+    superDirty = false;
+    pendingOps = 0;
+}
+
+/*Writes the FAT, root directory and inline area in place, then the superblock
+    pointing past the journal transactions they now contain. The metadata must
+    hold nothing left to commit: a crash while it is written is only repaired by
+    replaying the journal*/
+int checkpoint(void)
+{
+    for (int i = 0; i < superBlock->numBlocksFAT; i++)
+    {
+        if (block_write(i + 1, (void *)fatArray + (i * BLOCK_SIZE)) == -1)
+        {
+            return -1;
+        }
+    }
+    if (block_write(superBlock->numBlocksFAT + 1, (void *)rootDirectory) == -1)
+    {
+        return -1;
+    }
+    if (superBlock->inlineIndex != 0 && transferInlineArea(true) == -1)
+    {
+        return -1;
+    }
+    if (superBlock->dedupIndex != 0 && transferDedupTable(true) == -1)
+    {
+        return -1;
+    }
+    if (checksumArray != NULL && transferChain(superBlock->checksumIndex, (char *)checksumArray, superBlock->checksumBlocks, true) == -1)
+    {
+        return -1;
+    }
+    if (block_sync() == -1)
+    {
+        return -1;
+    }
+
+    superBlock->journalSequence = journalSequence;
+    if (block_write(0, (void *)superBlock) == -1 || block_sync() == -1)
+    {
+        return -1;
+    }
+    journalTail = 0;
+    clearDirty();
+    return 0;
+}
+
+/*Loads the journal blocks of the superblock's journal into memory*/
+int loadJournal(void)
+{
+    journalBuf = calloc(superBlock->journalBlocks, BLOCK_SIZE);
+    if (journalBuf == NULL)
+    {
+        return -1;
+    }
+
+    /*Journals written before the superblock listed their blocks are found
+        from the FAT, which they were checkpointed into*/
+    bool unmapped = superBlock->journalMap[0] == 0;
+    int curFATBlockIndex = superBlock->journalIndex;
+    for (int i = 0; i < superBlock->journalBlocks; i++)
+    {
+        if (unmapped && curFATBlockIndex != FAT_EOC && curFATBlockIndex < superBlock->numDataBlocks)
+        {
+            superBlock->journalMap[i] = physicalIndex(curFATBlockIndex);
+            curFATBlockIndex = fatArray[curFATBlockIndex].next;
+        }
+        if (superBlock->journalMap[i] == 0 || superBlock->journalMap[i] >= superBlock->numDataBlocks)
+        {
+            free(journalBuf);
+            journalBuf = NULL;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*Finds the number of blocks of a new journal holding @needed bytes, sized after
+    the data area, or 0 if the disk has no room for it*/
+int journalSize(size_t needed)
+{
+    int minBlocks = (needed + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    if (minBlocks < JOURNAL_MIN_BLOCKS)
+    {
+        minBlocks = JOURNAL_MIN_BLOCKS;
+    }
+    if (minBlocks > JOURNAL_GROWN_MAX_BLOCKS)
+    {
+        return 0;
+    }
+
+    /*Room is left for as much again, so that growing is rare*/
+    int journalBlocks = superBlock->numDataBlocks / 32;
+    if (journalBlocks > JOURNAL_MAX_BLOCKS)
+    {
+        journalBlocks = JOURNAL_MAX_BLOCKS;
+    }
+    if (journalBlocks < 2 * minBlocks)
+    {
+        journalBlocks = 2 * minBlocks;
+    }
+    if (journalBlocks > JOURNAL_GROWN_MAX_BLOCKS)
+    {
+        journalBlocks = JOURNAL_GROWN_MAX_BLOCKS;
+    }
+
+    /*The journal should not take up the space needed by the files*/
+    int freeBlocks = 0;
+    for (int i = 1; i < superBlock->numDataBlocks; i++)
+    {
+        if (committedBlockFree(i))
+        {
+            freeBlocks++;
+        }
+    }
+    if (journalBlocks > freeBlocks / 4)
+    {
+        journalBlocks = freeBlocks / 4;
+    }
+    if (journalBlocks < minBlocks)
+    {
+        journalBlocks = freeBlocks >= minBlocks ? minBlocks : 0;
+    }
+    return journalBlocks;
+}
+
+/*Links the blocks of a journal back in the FAT, after moving it failed*/
+void relinkJournal(const uint16_t *fatIndexes, const uint16_t *map, int blocks)
+{
+    for (int i = 0; i < blocks; i++)
+    {
+        setFATEntry(fatIndexes[i], i + 1 < blocks ? fatIndexes[i + 1] : FAT_EOC);
+        if (refCount != NULL)
+        {
+            mapPhysical(fatIndexes[i], map[i]);
+        }
+    }
+}
+
+/*Moves the committed transactions to a new journal of @blocks blocks, and
+    commits the pending updates after them. The new journal's blocks are free in
+    the committed metadata, and the superblock only switches to it once it is
+    written: a crash leaves one of the two journals whole*/
+int relocateJournal(int blocks)
+{
+    char *newBuf = calloc(blocks, BLOCK_SIZE);
+    if (newBuf == NULL)
+    {
+        return -1;
+    }
+
+    int oldBlocks = superBlock->journalIndex != 0 ? superBlock->journalBlocks : 0;
+    uint16_t oldIndexes[JOURNAL_GROWN_MAX_BLOCKS];
+    uint16_t oldMap[JOURNAL_GROWN_MAX_BLOCKS];
+    int curFATBlockIndex = superBlock->journalIndex;
+    for (int i = 0; i < oldBlocks; i++)
+    {
+        oldIndexes[i] = curFATBlockIndex;
+        oldMap[i] = superBlock->journalMap[i];
+        curFATBlockIndex = fatArray[curFATBlockIndex].next;
+    }
+
+    /*The new journal's FAT entries and the old one's release are committed
+        with the pending updates*/
+    uint16_t newIndexes[JOURNAL_GROWN_MAX_BLOCKS];
+    int allocated = 0;
+    for (int i = 1; i < superBlock->numDataBlocks && allocated < blocks; i++)
+    {
+        if (!committedBlockFree(i))
+        {
+            continue;
+        }
+        setFATEntry(i, FAT_EOC);
+        if (refCount != NULL)
+        {
+            mapPhysical(i, i);
+        }
+        if (allocated > 0)
+        {
+            setFATEntry(newIndexes[allocated - 1], i);
+        }
+        newIndexes[allocated++] = i;
+    }
+    if (oldBlocks > 0)
+    {
+        freeChain(superBlock->journalIndex);
+    }
+
+    memcpy(newBuf, journalBuf, journalTail);
+    size_t length = serializeRecords(NULL);
+    size_t transactionLength = sizeof(struct journalheader) + length;
+    bool written = allocated == blocks && journalTail + transactionLength <= (size_t)blocks * BLOCK_SIZE;
+    if (written)
+    {
+        char *records = newBuf + journalTail + sizeof(struct journalheader);
+        serializeRecords(records);
+        struct journalheader header = {
+            .magic = JOURNAL_MAGIC,
+            .sequence = journalSequence,
+            .length = length,
+            .checksum = journalChecksum(records, length)};
+        memcpy(newBuf + journalTail, &header, sizeof(header));
+
+        size_t lastBlock = (journalTail + transactionLength - 1) / BLOCK_SIZE;
+        for (size_t i = 0; i <= lastBlock && written; i++)
+        {
+            written = block_write(newIndexes[i] + superBlock->dataBlockStartIndex, newBuf + (i * BLOCK_SIZE)) == 0;
+        }
+        written = written && block_sync() == 0;
+    }
+
+    /*The superblock's journal fields are not replayed, so they are written
+        right away, into the superblock on the disk: its other fields locate the
+        tables loaded before replaying, and stay as last checkpointed*/
+    struct superblock diskSuper;
+    if (written)
+    {
+        written = block_read(0, (void *)&diskSuper) == 0;
+    }
+    if (written)
+    {
+        diskSuper.journalIndex = newIndexes[0];
+        diskSuper.journalBlocks = blocks;
+        memset(diskSuper.journalMap, 0, sizeof(diskSuper.journalMap));
+        memcpy(diskSuper.journalMap, newIndexes, blocks * sizeof(uint16_t));
+        written = block_write(0, (void *)&diskSuper) == 0;
+    }
+    if (!written)
+    {
+        for (int i = 0; i < allocated; i++)
+        {
+            freeFATBlock(newIndexes[i]);
+        }
+        relinkJournal(oldIndexes, oldMap, oldBlocks);
+        free(newBuf);
+        return -1;
+    }
+
+    superBlock->journalIndex = diskSuper.journalIndex;
+    superBlock->journalBlocks = diskSuper.journalBlocks;
+    memcpy(superBlock->journalMap, diskSuper.journalMap, sizeof(superBlock->journalMap));
+    free(journalBuf);
+    journalBuf = newBuf;
+    journalTail += transactionLength;
+    journalSequence++;
+    clearDirty();
+    return block_sync();
+}
+
+/*Loads the deduplication and checksum tables a replayed transaction created,
+    which are written in place before it is committed, and drops the checksum
+    table it removed*/
+int loadTables(void)
+{
+    if (superBlock->dedupIndex != 0 && dedupTable == NULL &&
+        (setupDedupTable() == -1 || transferDedupTable(false) == -1))
+    {
+        return -1;
+    }
+    if (superBlock->checksumIndex == 0 && checksumArray != NULL)
+    {
+        dropChecksumTable();
+    }
+    if (superBlock->checksumIndex != 0 && checksumArray == NULL &&
+        (setupChecksumTable() == -1 ||
+         transferChain(superBlock->checksumIndex, (char *)checksumArray, superBlock->checksumBlocks, false) == -1))
+    {
+        return -1;
+    }
+    return 0;
+}
+
+/*Replays the committed journal transactions that were not checkpointed yet*/
+int replayJournal(void)
+{
+    for (int i = 0; i < superBlock->journalBlocks; i++)
+    {
+        if (block_read(superBlock->journalMap[i] + superBlock->dataBlockStartIndex, journalBuf + (i * BLOCK_SIZE)) == -1)
+        {
+            return -1;
+        }
+    }
+
+    size_t capacity = superBlock->journalBlocks * BLOCK_SIZE;
+    size_t offset = 0;
+    int replayed = 0;
+    journalSequence = superBlock->journalSequence;
+    while (offset + sizeof(struct journalheader) <= capacity)
+    {
+        struct journalheader header;
+        memcpy(&header, journalBuf + offset, sizeof(header));
+        const char *records = journalBuf + offset + sizeof(header);
+
+        /*Stop at the first transaction that is stale or was torn by a crash*/
+        if (header.magic != JOURNAL_MAGIC || header.sequence != journalSequence ||
+            header.length > capacity - offset - sizeof(header) ||
+            header.checksum != journalChecksum(records, header.length))
+        {
+            break;
+        }
+        applyRecords(records, header.length);
+        if (loadTables() == -1)
+        {
+            return -1;
+        }
+        offset += sizeof(header) + header.length;
+        journalSequence++;
+        replayed++;
+    }
+
+    if (replayed > 0)
+    {
+        return checkpoint();
+    }
+    return 0;
+}
+
+/*Commits the metadata changed since the last commit as one journal
+    transaction, written with a single flush. Called with the allocator lock
+    held, which every metadata update takes*/
+int appendJournal(void)
+{
+    size_t length = serializeRecords(NULL);
+    if (length == 0)
+    {
+        pendingOps = 0;
+        return 0;
+    }
+
+    /*Without a journal, or with one too small for the transaction, the
+        transaction is committed in a new journal. Only a disk too full to hold
+        one has its metadata written in place, as the reference file system
+        always does*/
+    size_t capacity = superBlock->journalBlocks * BLOCK_SIZE;
+    size_t transactionLength = sizeof(struct journalheader) + length;
+    if (superBlock->journalIndex == 0 || journalTail + transactionLength > capacity)
+    {
+        /*Records of the journals' own FAT and remap entries come on top*/
+        size_t journalRecords = 4 * JOURNAL_GROWN_MAX_BLOCKS * (sizeof(struct journalrecord) + sizeof(uint16_t));
+        int blocks = journalSize(journalTail + transactionLength + journalRecords);
+        if (blocks == 0)
+        {
+            return checkpoint();
+        }
+        return relocateJournal(blocks);
+    }
+    else
+    {
+        char *records = journalBuf + journalTail + sizeof(struct journalheader);
+        serializeRecords(records);
+        struct journalheader header = {
+            .magic = JOURNAL_MAGIC,
+            .sequence = journalSequence,
+            .length = length,
+            .checksum = journalChecksum(records, length)};
+        memcpy(journalBuf + journalTail, &header, sizeof(header));
+
+        /*Only the journal blocks holding the new transaction are written*/
+        size_t firstBlock = journalTail / BLOCK_SIZE;
+        size_t lastBlock = (journalTail + transactionLength - 1) / BLOCK_SIZE;
+        for (size_t i = firstBlock; i <= lastBlock; i++)
+        {
+            if (block_write(superBlock->journalMap[i] + superBlock->dataBlockStartIndex, journalBuf + (i * BLOCK_SIZE)) == -1)
+            {
+                return -1;
+            }
+        }
+        if (block_sync() == -1)
+        {
+            return -1;
+        }
+
+        journalTail += transactionLength;
+        journalSequence++;
+        clearDirty();
+    }
+    return 0;
+}
+
+/*Checks if the journal is half full, and due for a checkpoint*/
+bool checkpointDue(void)
+{
+    return journalTail > superBlock->journalBlocks * BLOCK_SIZE / 2;
+}
+
+/*Commits the metadata changed since the last commit, then checkpoints the
+    journal once it is half full. Called with the allocator lock held, so that
+    nothing is left to commit when checkpointing, and replaying never overwrites
+    newer metadata*/
+int commitJournal(void)
+{
+    if (appendJournal() == -1)
+    {
+        return -1;
+    }
+    if (checkpointDue())
+    {
+        return checkpoint();
+    }
+    return 0;
+}
+
+/*Commits the journal for every request made while the previous commit ran, and
+    answers them before checkpointing. A failed commit leaves the metadata to
+    commit, for the next request to retry*/
+void *commitThread(void *arg)
+{
+    pthread_mutex_lock(&commitLock);
+    while (!committerStop || commitCompleted < commitRequested)
+    {
+        if (commitCompleted == commitRequested)
+        {
+            pthread_cond_wait(&commitCond, &commitLock);
+            continue;
+        }
+        uint64_t served = commitRequested;
+        pthread_mutex_unlock(&commitLock);
+
+        pthread_mutex_lock(&allocLock);
+        int result = appendJournal();
+        bool due = result == 0 && checkpointDue();
+        pthread_mutex_unlock(&allocLock);
+
+        pthread_mutex_lock(&commitLock);
+        commitCompleted = served;
+        if (result == 0)
+        {
+            commitDurable = served;
+        }
+        pthread_cond_broadcast(&commitDone);
+        pthread_mutex_unlock(&commitLock);
+
+        /*Updates made since are committed first*/
+        if (due)
+        {
+            pthread_mutex_lock(&allocLock);
+            if (checkpointDue())
+            {
+                commitJournal();
+            }
+            pthread_mutex_unlock(&allocLock);
+        }
+        pthread_mutex_lock(&commitLock);
+    }
+    pthread_mutex_unlock(&commitLock);
+    return arg;
+}
+
+/*Asks the committer for a commit, and returns the request's number*/
+uint64_t requestCommit(void)
+{
+    pthread_mutex_lock(&commitLock);
+    uint64_t request = ++commitRequested;
+    pthread_cond_signal(&commitCond);
+    pthread_mutex_unlock(&commitLock);
+    return request;
+}
+
+/*Starts the committer, once the file system is mounted*/
+int startCommitter(void)
+{
+    committerStop = false;
+    commitRequested = 0;
+    commitCompleted = 0;
+    commitDurable = 0;
+    committerRunning = pthread_create(&committer, NULL, commitThread, NULL) == 0;
+    return committerRunning ? 0 : -1;
+}
+
+/*Stops the committer, once it has served every request*/
+void stopCommitter(void)
+{
+    if (!committerRunning)
+    {
+        return;
+    }
+    pthread_mutex_lock(&commitLock);
+    committerStop = true;
+    pthread_cond_signal(&commitCond);
+    pthread_mutex_unlock(&commitLock);
+    pthread_join(committer, NULL);
+    committerRunning = false;
+}
+
+/*Counts a metadata operation, and has the pending updates committed every
+    JOURNAL_COMMIT_INTERVAL operations without waiting for the commit: only
+    fs_sync() waits for one. Called with the allocator lock held*/
+void journalOperation(void)
+{
+    pendingOps++;
+    if (pendingOps % JOURNAL_COMMIT_INTERVAL == 0)
+    {
+        requestCommit();
+    }
+}
+
+/*Allocates the deduplication table, which also keeps track of the data blocks
+    shared with snapshots. The empty table is written before the transaction
+    allocating it is committed, so that replaying it loads the table*/
+int createDedupTable(void)
+{
+    if (commitJournal() == -1)
+    {
+        return -1;
+    }
+    superBlock->dedupBlocks = dedupTableBlocks();
+    if (totalEmptyFATBlocks() < superBlock->dedupBlocks)
+    {
+        return -1;
+    }
+
+    int prevFATBlockIndex = allocateFATBlock();
+    superBlock->dedupIndex = prevFATBlockIndex;
+    superDirty = true;
+    for (int i = 1; i < superBlock->dedupBlocks; i++)
+    {
+        int curFATBlockIndex = allocateFATBlock();
+        setFATEntry(prevFATBlockIndex, curFATBlockIndex);
+        prevFATBlockIndex = curFATBlockIndex;
+    }
+    if (setupDedupTable() == -1)
+    {
+        return -1;
+    }
+    buildDedupIndex();
+    if (transferDedupTable(true) == -1 || block_sync() == -1)
+    {
+        return -1;
+    }
+    return commitJournal();
+}
+
+/*Allocates the checksum table and computes the checksum of every data block in
+    use, with every other operation stopped. The table is written before the
+    transaction allocating it is committed, so that replaying it loads the table*/
+int createChecksumTable(void)
+{
+    if (commitJournal() == -1)
+    {
+        return -1;
+    }
+    int blocks = checksumTableBlocks();
+    if (totalEmptyFATBlocks() < blocks)
+    {
+        return -1;
+    }
+    superBlock->checksumBlocks = blocks;
+    if (setupChecksumTable() == -1)
+    {
+        dropChecksumTable();
+        superBlock->checksumBlocks = 0;
+        return -1;
+    }
+
+    char bounceBuf[BLOCK_SIZE];
+    for (int physical = 1; physical < superBlock->numDataBlocks; physical++)
+    {
+        bool inUse = refCount != NULL ? refCount[physical] > 0 : fatArray[physical].next != FAT_FREE;
+        if (!inUse)
+        {
+            continue;
+        }
+        if (block_read(physical + superBlock->dataBlockStartIndex, bounceBuf) == -1)
+        {
+            dropChecksumTable();
+            superBlock->checksumBlocks = 0;
+            return -1;
+        }
+        checksumArray[physical] = crc32c(0, bounceBuf, BLOCK_SIZE);
+    }
+
+    int prevFATBlockIndex = allocateFATBlock();
+    superBlock->checksumIndex = prevFATBlockIndex;
+    superDirty = true;
+    for (int i = 1; i < blocks; i++)
+    {
+        int curFATBlockIndex = allocateFATBlock();
+        setFATEntry(prevFATBlockIndex, curFATBlockIndex);
+        prevFATBlockIndex = curFATBlockIndex;
+    }
+    if (transferChain(superBlock->checksumIndex, (char *)checksumArray, blocks, true) == -1 || block_sync() == -1)
+    {
+        return -1;
+    }
+    memset(checksumDirty, 0, superBlock->numDataBlocks);
+    return commitJournal();
+}
+
+/*Finds the number of blocks of a snapshot: root directory, inline area, then
+    the FAT and remap table*/
+int snapshotBlocks(void)
+{
+    size_t bytes = (1 + INLINE_AREA_BLOCKS) * BLOCK_SIZE + 2 * maxFatEntries * sizeof(uint16_t);
+    return (bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/*Returns the FAT copy of a snapshot*/
+uint16_t *snapshotFAT(char *snapshot)
+{
+    return (uint16_t *)(snapshot + (1 + INLINE_AREA_BLOCKS) * BLOCK_SIZE);
+}
+
+/*Returns the remap table copy of a snapshot*/
+uint16_t *snapshotRemap(char *snapshot)
+{
+    return snapshotFAT(snapshot) + maxFatEntries;
+}
+
+/*Reads the snapshot directory, empty if no snapshot was ever taken*/
+int loadSnapshotDir(struct snapshotentry *snapshots)
+{
+    if (superBlock->snapshotIndex == 0)
+    {
+        memset(snapshots, 0, BLOCK_SIZE);
+        return 0;
+    }
+    return block_read(dataBlock(superBlock->snapshotIndex), snapshots);
+}
+
+/*Finds a snapshot in the snapshot directory*/
+int findSnapshot(const struct snapshotentry *snapshots, const char *name)
+{
+    for (size_t i = 0; i < SNAPSHOT_MAX; i++)
+    {
+        if (snapshots[i].name[0] != '\0' && strncmp(snapshots[i].name, name, FS_FILENAME_LEN) == 0)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*Reads the content of a snapshot, to be freed by the caller*/
+char *readSnapshot(const struct snapshotentry *snapshot)
+{
+    char *buf = malloc(snapshot->blocks * BLOCK_SIZE);
+    if (buf == NULL)
+    {
+        return NULL;
+    }
+    if (snapshot->blocks != snapshotBlocks() || transferChain(snapshot->firstIndex, buf, snapshot->blocks, false) == -1)
+    {
+        free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/*Adds or drops a reference to a data block of a snapshot*/
+void pinPhysical(const uint16_t *remap, int fatIndex, int delta)
+{
+    int physical = remap[fatIndex] != 0 ? remap[fatIndex] : fatIndex;
+    if (physical >= superBlock->numDataBlocks)
+    {
+        return;
+    }
+    if (delta > 0)
+    {
+        refCount[physical]++;
+    }
+    else
+    {
+        releasePhysical(physical);
+    }
+}
+
+/*Adds (@delta = 1) or drops (@delta = -1) a reference to every data block used
+    by the files of a snapshot*/
+void pinSnapshot(char *snapshot, int delta)
+{
+    struct rootdirectory *entries = (struct rootdirectory *)snapshot;
+    uint16_t *fat = snapshotFAT(snapshot);
+    uint16_t *remap = snapshotRemap(snapshot);
+
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    {
+        if (entries[i].fileName[0] == '\0' || (entries[i].flags & ENTRY_INLINE))
+        {
+            continue;
+        }
+        int curFATBlockIndex = entries[i].firstIndex;
+        for (int count = 0; curFATBlockIndex != FAT_EOC && curFATBlockIndex != FAT_FREE &&
+                            curFATBlockIndex < maxFatEntries && count < maxFatEntries;
+             count++)
+        {
+            pinPhysical(remap, curFATBlockIndex, delta);
+            curFATBlockIndex = fat[curFATBlockIndex];
+        }
+
+        /*A fragment block is referenced once, however many tails it holds*/
+        if (!(entries[i].flags & ENTRY_TAIL))
+        {
+            continue;
+        }
+        bool shared = false;
+        for (int j = 0; j < i && !shared; j++)
+        {
+            shared = entries[j].fileName[0] != '\0' && (entries[j].flags & ENTRY_TAIL) &&
+                     entries[j].tailIndex == entries[i].tailIndex;
+        }
+        if (!shared)
+        {
+            pinPhysical(remap, entries[i].tailIndex, delta);
+        }
+    }
+}
+
+/*References the data blocks of every snapshot, after the reference counts were
+    rebuilt from the FAT*/
+int pinSnapshots(void)
+{
+    struct snapshotentry snapshots[SNAPSHOT_MAX];
+    if (loadSnapshotDir(snapshots) == -1)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < SNAPSHOT_MAX; i++)
+    {
+        if (snapshots[i].name[0] == '\0')
+        {
+            continue;
+        }
+        char *snapshot = readSnapshot(&snapshots[i]);
+        if (snapshot == NULL)
+        {
+            return -1;
+        }
+        pinSnapshot(snapshot, 1);
+        free(snapshot);
+    }
+    return 0;
+}
+
+/*Stops every other file system operation, to work on a consistent volume*/
+void lockVolume(void)
+{
+    pthread_mutex_lock(&dirLock);
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    {
+        lockFileWrite(i);
+    }
+    pthread_mutex_lock(&allocLock);
+}
+
+/*Resumes the operations stopped by lockVolume()*/
+void unlockVolume(void)
+{
+    pthread_mutex_unlock(&allocLock);
+    for (int i = FS_FILE_MAX_COUNT - 1; i >= 0; i--)
+    {
+        pthread_rwlock_unlock(&fileLocks[i]);
+    }
+    pthread_mutex_unlock(&dirLock);
+}
+
+/*Writes a new snapshot of the volume, with the caller holding lockVolume()*/
+int takeSnapshot(const char *name, char *snapshot)
+{
+    struct snapshotentry snapshots[SNAPSHOT_MAX];
+    int blocks = snapshotBlocks();
+
+    /*The deduplication table keeps track of the blocks pinned by snapshots*/
+    if (superBlock->dedupIndex == 0 && createDedupTable() == -1)
+    {
+        return -1;
+    }
+    if (loadSnapshotDir(snapshots) == -1 || findSnapshot(snapshots, name) != -1)
+    {
+        return -1;
+    }
+    size_t slot = 0;
+    while (slot < SNAPSHOT_MAX && snapshots[slot].name[0] != '\0')
+    {
+        slot++;
+    }
+    if (slot == SNAPSHOT_MAX || totalEmptyFATBlocks() < blocks + (superBlock->snapshotIndex == 0))
+    {
+        return -1;
+    }
+
+    if (superBlock->snapshotIndex == 0)
+    {
+        int dirIndex = allocateFATBlock();
+        if (block_write(dataBlock(dirIndex), snapshots) == -1)
+        {
+            freeFATBlock(dirIndex);
+            return -1;
+        }
+        superBlock->snapshotIndex = dirIndex;
+        superDirty = true;
+    }
+    int firstIndex = allocateFATBlock();
+    int prevFATBlockIndex = firstIndex;
+    for (int i = 1; i < blocks; i++)
+    {
+        int curFATBlockIndex = allocateFATBlock();
+        setFATEntry(prevFATBlockIndex, curFATBlockIndex);
+        prevFATBlockIndex = curFATBlockIndex;
+    }
+
+    /*The snapshot blocks are committed as allocated before being written, and
+        the snapshot only becomes visible once the directory block is written*/
+    memcpy(snapshot, rootDirectory, BLOCK_SIZE);
+    memcpy(snapshot + BLOCK_SIZE, inlineArea, INLINE_AREA_BLOCKS * BLOCK_SIZE);
+    memcpy(snapshotFAT(snapshot), fatArray, maxFatEntries * sizeof(uint16_t));
+    memcpy(snapshotRemap(snapshot), remapArray, maxFatEntries * sizeof(uint16_t));
+    if (commitJournal() == -1 || transferChain(firstIndex, snapshot, blocks, true) == -1 || block_sync() == -1)
+    {
+        freeChain(firstIndex);
+        return -1;
+    }
+    strncpy(snapshots[slot].name, name, FS_FILENAME_LEN);
+    snapshots[slot].firstIndex = firstIndex;
+    snapshots[slot].blocks = blocks;
+    if (block_write(dataBlock(superBlock->snapshotIndex), snapshots) == -1 || block_sync() == -1)
+    {
+        freeChain(firstIndex);
+        return -1;
+    }
+    pinSnapshot(snapshot, 1);
+    return 0;
+}
+
+/*Moves a cursor forward by @length bytes, skipping the empty buffers*/
+void advanceCursor(struct iocursor *cursor, size_t length)
+{
+    cursor->offset += length;
+    while (cursor->index < cursor->iovcnt && cursor->offset >= cursor->iov[cursor->index].iov_len)
+    {
+        cursor->offset -= cursor->iov[cursor->index].iov_len;
+        cursor->index++;
+    }
+}
+
+/*Starts a cursor at the beginning of the caller's buffers, and returns their total size*/
+size_t initCursor(struct iocursor *cursor, const struct iovec *iov, int iovcnt)
+{
+    cursor->iov = iov;
+    cursor->iovcnt = iovcnt;
+    cursor->index = 0;
+    cursor->offset = 0;
+    advanceCursor(cursor, 0);
+
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++)
+    {
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+/*Counts the bytes left in the cursor's current buffer*/
+size_t contiguousBytes(const struct iocursor *cursor)
+{
+    if (cursor->index >= cursor->iovcnt)
+    {
+        return 0;
+    }
+    return cursor->iov[cursor->index].iov_len - cursor->offset;
+}
+
+/*Returns the caller's memory at the cursor*/
+char *cursorPointer(const struct iocursor *cursor)
+{
+    return (char *)cursor->iov[cursor->index].iov_base + cursor->offset;
+}
+
+/*Copies @length bytes at the cursor to @dest, across buffer boundaries*/
+void gatherBytes(const struct iocursor *cursor, char *dest, size_t length)
+{
+    int index = cursor->index;
+    size_t offset = cursor->offset;
+    while (length > 0)
+    {
+        size_t bytes = cursor->iov[index].iov_len - offset;
+        if (bytes > length)
+        {
+            bytes = length;
+        }
+        memcpy(dest, (char *)cursor->iov[index].iov_base + offset, bytes);
+        dest += bytes;
+        length -= bytes;
+        index++;
+        offset = 0;
+    }
+}
+
+/*Copies @length bytes from @src to the buffers at the cursor, across buffer boundaries*/
+void scatterBytes(const struct iocursor *cursor, const char *src, size_t length)
+{
+    int index = cursor->index;
+    size_t offset = cursor->offset;
+    while (length > 0)
+    {
+        size_t bytes = cursor->iov[index].iov_len - offset;
+        if (bytes > length)
+        {
+            bytes = length;
+        }
+        memcpy((char *)cursor->iov[index].iov_base + offset, src, bytes);
+        src += bytes;
+        length -= bytes;
+        index++;
+        offset = 0;
+    }
+}
+
+/*Returns @length bytes at the cursor in one piece: in place when they sit in a
+    single buffer, and gathered into @scratch otherwise*/
+const char *cursorSpan(const struct iocursor *cursor, char *scratch, size_t length)
+{
+    /*The cursor may be past the last buffer, with nothing left to point at*/
+    if (length == 0)
+    {
+        return scratch;
+    }
+    if (contiguousBytes(cursor) >= length)
+    {
+        return cursorPointer(cursor);
+    }
+    gatherBytes(cursor, scratch, length);
+    return scratch;
+}
+
+/*Checks if the file's content is stored in compressed chunks*/
+bool isCompressedFile(int fileLocation)
+{
+    return (rootDirectory[fileLocation].flags & ENTRY_COMPRESSED) != 0;
+}
+
+/*Finds the number of chunks of a compressed file of the given size*/
+size_t chunkCount(size_t fileSize)
+{
+    return (fileSize + CHUNK_SIZE - 1) / CHUNK_SIZE;
+}
+
+/*Finds the number of chunk index blocks of a compressed file of the given size*/
+int chunkIndexBlocks(size_t fileSize)
+{
+    return (chunkCount(fileSize) + CHUNK_INDEX_ENTRIES - 1) / CHUNK_INDEX_ENTRIES;
+}
+
+/*Finds the number of data blocks of a chunk's extent from its index entry*/
+int extentBlocks(uint16_t entry)
+{
+    return ((entry & CHUNK_LENGTH_MASK) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+/*Finds the block following @prevFATBlockIndex in a file's chain, or its first
+    block if @prevFATBlockIndex is -1*/
+int nextBlock(int fileLocation, int prevFATBlockIndex)
+{
+    return prevFATBlockIndex == -1 ? rootDirectory[fileLocation].firstIndex : fatArray[prevFATBlockIndex].next;
+}
+
+/*Links @fatIndex after @prevFATBlockIndex in a file's chain, or at its head if
+    @prevFATBlockIndex is -1*/
+void linkBlock(int fileLocation, int prevFATBlockIndex, int fatIndex)
+{
+    if (prevFATBlockIndex == -1)
+    {
+        rootDirectory[fileLocation].firstIndex = fatIndex;
+    }
+    else
+    {
+        setFATEntry(prevFATBlockIndex, fatIndex);
+    }
+}
+
+/*Resizes the extent of @oldBlocks blocks at @position in a file's chain to
+    @newBlocks blocks. The chain is left unchanged if the new blocks cannot be
+    allocated*/
+int resizeExtent(int fileLocation, int position, int oldBlocks, int newBlocks)
+{
+    int newFATBlockIndex[CHUNK_BLOCKS];
+    int extraBlocks = newBlocks - oldBlocks;
+    if (extraBlocks > CHUNK_BLOCKS)
+    {
+        return -1;
+    }
+    for (int i = 0; i < extraBlocks; i++)
+    {
+        newFATBlockIndex[i] = allocateFATBlock();
+        if (newFATBlockIndex[i] == -1)
+        {
+            while (i-- > 0)
+            {
+                freeFATBlock(newFATBlockIndex[i]);
+            }
+            return -1;
+        }
+    }
+
+    /*Keep the blocks both sizes have, then drop or insert the difference*/
+    int prevFATBlockIndex = position > 0 ? findCurFatBlockIndex(fileLocation, position - 1) : -1;
+    int curFATBlockIndex = nextBlock(fileLocation, prevFATBlockIndex);
+    int keptBlocks = 0;
+    while (keptBlocks < oldBlocks && keptBlocks < newBlocks)
+    {
+        prevFATBlockIndex = curFATBlockIndex;
+        curFATBlockIndex = fatArray[curFATBlockIndex].next;
+        keptBlocks++;
+    }
+    for (int i = keptBlocks; i < oldBlocks; i++)
+    {
+        int nextFATBlockIndex = fatArray[curFATBlockIndex].next;
+        freeFATBlock(curFATBlockIndex);
+        curFATBlockIndex = nextFATBlockIndex;
+    }
+    for (int i = 0; i < extraBlocks; i++)
+    {
+        linkBlock(fileLocation, prevFATBlockIndex, newFATBlockIndex[i]);
+        prevFATBlockIndex = newFATBlockIndex[i];
+    }
+    linkBlock(fileLocation, prevFATBlockIndex, curFATBlockIndex);
+    markEntryDirty(fileLocation);
+    return 0;
+}
+
+/*Writes @blocks blocks of @buf to the extent at @position in a file's chain,
+    with the allocator lock held*/
+int writeExtent(int fileLocation, int position, const char *buf, int blocks)
+{
+    int curFATBlockIndex = findCurFatBlockIndex(fileLocation, position);
+    for (int i = 0; i < blocks; i++)
+    {
+        if (curFATBlockIndex == FAT_EOC || writeDataBlock(curFATBlockIndex, buf + (i * BLOCK_SIZE)) == -1)
+        {
+            return -1;
+        }
+        curFATBlockIndex = fatArray[curFATBlockIndex].next;
+    }
+    return 0;
+}
+
+/*Finds the current time, for the compression statistics*/
+uint64_t nowNanos(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*Compresses @length bytes of a chunk into @packed, and returns the chunk's index
+    entry. Chunks that would not take fewer blocks compressed are stored as is*/
+uint16_t compressChunk(const char *chunk, size_t length, char *packed)
+{
+    int storedBlocks = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    int packedLength = -1;
+    if (storedBlocks > 1)
+    {
+        uint64_t start = nowNanos();
+        packedLength = lz_compress(chunk, length, packed, (storedBlocks - 1) * BLOCK_SIZE);
+        __atomic_add_fetch(&compressNanos, nowNanos() - start, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&compressBytes, length, __ATOMIC_RELAXED);
+    }
+    if (packedLength <= 0)
+    {
+        return CHUNK_STORED | length;
+    }
+    memset(packed + packedLength, 0, extentBlocks(packedLength) * BLOCK_SIZE - packedLength);
+    return packedLength;
+}
+
+/*Finds the FAT index @blocks entries down a chain from @fatIndex*/
+int skipBlocks(int fatIndex, int blocks)
+{
+    for (int i = 0; i < blocks && fatIndex != FAT_EOC; i++)
+    {
+        fatIndex = fatArray[fatIndex].next;
+    }
+    return fatIndex;
+}
+
+/*Reads the chunk of the given index entry from the extent starting at FAT
+    index @firstIndex, and decompresses it into @chunk through @packed*/
+int readChunk(int firstIndex, uint16_t entry, char *chunk, char *packed)
+{
+    if (entry & CHUNK_STORED)
+    {
+        return readChain(firstIndex, chunk, extentBlocks(entry));
+    }
+    if (readChain(firstIndex, packed, extentBlocks(entry)) == -1)
+    {
+        return -1;
+    }
+
+    uint64_t start = nowNanos();
+    int length = lz_decompress(packed, entry & CHUNK_LENGTH_MASK, chunk, CHUNK_SIZE);
+    __atomic_add_fetch(&decompressNanos, nowNanos() - start, __ATOMIC_RELAXED);
+    if (length == -1)
+    {
+        return -1;
+    }
+    __atomic_add_fetch(&decompressBytes, length, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*Writes the chunks of a compressed file covered by a write, each one decompressed,
+    updated and compressed again, then its chunk index*/
+int writeChunks(int fileLocation, struct iocursor *src, size_t count, size_t fileOffset,
+                uint16_t *index, char *chunk, char *packed)
+{
+    size_t fileSize = rootDirectory[fileLocation].sizeOfFile;
+    int oldIndexBlocks = chunkIndexBlocks(fileSize);
+    int indexBlocks = chunkIndexBlocks(fileOffset + count > fileSize ? fileOffset + count : fileSize);
+    if (readChain(rootDirectory[fileLocation].firstIndex, (char *)index, oldIndexBlocks) == -1)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&allocLock);
+    int result = resizeExtent(fileLocation, 0, oldIndexBlocks, indexBlocks);
+    pthread_mutex_unlock(&allocLock);
+    if (result == -1)
+    {
+        return 0;
+    }
+
+    size_t chunkIndex = fileOffset / CHUNK_SIZE;
+    int position = indexBlocks;
+    for (size_t i = 0; i < chunkIndex; i++)
+    {
+        position += extentBlocks(index[i]);
+    }
+
+    size_t written = 0;
+    while (written < count)
+    {
+        size_t chunkStart = chunkIndex * CHUNK_SIZE;
+        size_t offsetInChunk = fileOffset + written - chunkStart;
+        size_t bytes = CHUNK_SIZE - offsetInChunk;
+        if (bytes > count - written)
+        {
+            bytes = count - written;
+        }
+
+        /*The part of the chunk not overwritten comes from its current extent*/
+        int oldBlocks = 0;
+        size_t chunkLength = offsetInChunk + bytes;
+        memset(chunk, 0, CHUNK_SIZE);
+        if (chunkStart < fileSize)
+        {
+            oldBlocks = extentBlocks(index[chunkIndex]);
+            if (readChunk(findCurFatBlockIndex(fileLocation, position), index[chunkIndex], chunk, packed) == -1)
+            {
+                break;
+            }
+            if (fileSize - chunkStart > chunkLength)
+            {
+                chunkLength = fileSize - chunkStart < CHUNK_SIZE ? fileSize - chunkStart : CHUNK_SIZE;
+            }
+        }
+        gatherBytes(src, chunk + offsetInChunk, bytes);
+        uint16_t entry = compressChunk(chunk, chunkLength, packed);
+
+        pthread_mutex_lock(&allocLock);
+        result = resizeExtent(fileLocation, position, oldBlocks, extentBlocks(entry));
+        if (result == 0)
+        {
+            index[chunkIndex] = entry;
+            result = writeExtent(fileLocation, position, (entry & CHUNK_STORED) ? chunk : packed, extentBlocks(entry));
+        }
+        pthread_mutex_unlock(&allocLock);
+        if (result == -1)
+        {
+            break;
+        }
+
+        advanceCursor(src, bytes);
+        written += bytes;
+        position += extentBlocks(entry);
+        chunkIndex++;
+    }
+
+    /*The index is written once the chunks are, without the blocks a short write
+        did not need*/
+    size_t newSize = fileOffset + written > fileSize ? fileOffset + written : fileSize;
+    pthread_mutex_lock(&allocLock);
+    resizeExtent(fileLocation, 0, indexBlocks, chunkIndexBlocks(newSize));
+    if (newSize > 0)
+    {
+        writeExtent(fileLocation, 0, (char *)index, chunkIndexBlocks(newSize));
+    }
+    rootDirectory[fileLocation].sizeOfFile = newSize;
+    markEntryDirty(fileLocation);
+    journalOperation();
+    pthread_mutex_unlock(&allocLock);
+    return written;
+}
+
+/*Writes to a compressed file at @fileOffset, with the file's lock held for writing*/
+int writeCompressed(int fileLocation, struct iocursor *src, size_t count, size_t fileOffset)
+{
+    size_t newSize = fileOffset + count;
+    int indexBlocks = chunkIndexBlocks(newSize > rootDirectory[fileLocation].sizeOfFile ? newSize : rootDirectory[fileLocation].sizeOfFile);
+    uint16_t *index = calloc(indexBlocks, BLOCK_SIZE);
+    char *chunk = malloc(CHUNK_SIZE);
+    char *packed = malloc(CHUNK_SIZE);
+
+    int bytesWritten = 0;
+    if (count > 0 && index != NULL && chunk != NULL && packed != NULL)
+    {
+        bytesWritten = writeChunks(fileLocation, src, count, fileOffset, index, chunk, packed);
+    }
+    free(index);
+    free(chunk);
+    free(packed);
+    return bytesWritten;
+}
+
+/*Reads @count bytes of a compressed file from @fileOffset, decompressing only
+    the chunks they cover, with the file's lock held*/
+int readCompressed(int fileLocation, struct iocursor *dest, size_t count, size_t fileOffset)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    /*Only the index blocks up to the last chunk read are needed*/
+    size_t chunkIndex = fileOffset / CHUNK_SIZE;
+    int indexBlocks = ((fileOffset + count - 1) / CHUNK_SIZE) / CHUNK_INDEX_ENTRIES + 1;
+    uint16_t *index = malloc(indexBlocks * BLOCK_SIZE);
+    char *chunk = malloc(CHUNK_SIZE);
+    char *packed = malloc(CHUNK_SIZE);
+    size_t bytesRead = 0;
+    if (index != NULL && chunk != NULL && packed != NULL &&
+        readChain(rootDirectory[fileLocation].firstIndex, (char *)index, indexBlocks) == 0)
+    {
+        int position = chunkIndexBlocks(rootDirectory[fileLocation].sizeOfFile);
+        for (size_t i = 0; i < chunkIndex; i++)
+        {
+            position += extentBlocks(index[i]);
+        }
+
+        /*The chain is walked once, from one chunk's extent to the next*/
+        int fatIndex = findCurFatBlockIndex(fileLocation, position);
+        while (bytesRead < count)
+        {
+            size_t offsetInChunk = fileOffset + bytesRead - (chunkIndex * CHUNK_SIZE);
+            size_t bytes = CHUNK_SIZE - offsetInChunk;
+            if (bytes > count - bytesRead)
+            {
+                bytes = count - bytesRead;
+            }
+            if (fatIndex == -1 || readChunk(fatIndex, index[chunkIndex], chunk, packed) == -1)
+            {
+                break;
+            }
+            scatterBytes(dest, chunk + offsetInChunk, bytes);
+            advanceCursor(dest, bytes);
+            bytesRead += bytes;
+            fatIndex = skipBlocks(fatIndex, extentBlocks(index[chunkIndex]));
+            chunkIndex++;
+        }
+    }
+    free(index);
+    free(chunk);
+    free(packed);
+    return bytesRead;
+}
+
+/*Writes to a file at @fileOffset, with the file's lock held for writing. Only
+    the steps touching the allocator or the journal take the allocator lock*/
+int writeFile(int fileLocation, struct iocursor *src, size_t count, size_t fileOffset)
+{
+    /*Nothing to write, and no shared fragment block to rewrite for it*/
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    if (isCompressedFile(fileLocation))
+    {
+        return writeCompressed(fileLocation, src, count, fileOffset);
+    }
+
+    /*Find size of the file*/
+    size_t fileSize = rootDirectory[fileLocation].sizeOfFile;
+
+    /*Small files live in their inline slot for as long as they fit in it*/
+    bool fitsInline = count > 0 && fileOffset + count <= INLINE_MAX;
+    bool canInline = isInlineFile(fileLocation) || (fileSize == 0 && rootDirectory[fileLocation].firstIndex == FAT_EOC);
+    pthread_mutex_lock(&allocLock);
+    if (fitsInline && canInline && allocateInlineArea() == 0)
+    {
+        gatherBytes(src, inlineSlot(fileLocation) + fileOffset, count);
+        rootDirectory[fileLocation].flags |= ENTRY_INLINE;
+        if (fileOffset + count > fileSize)
+        {
+            rootDirectory[fileLocation].sizeOfFile = fileOffset + count;
+        }
+        markEntryDirty(fileLocation);
+        journalOperation();
+        pthread_mutex_unlock(&allocLock);
+        return count;
+    }
+
+    /*The file outgrows its inline slot, so move it to a regular data block*/
+    if (isInlineFile(fileLocation) && promoteInlineFile(fileLocation) == -1)
+    {
+        pthread_mutex_unlock(&allocLock);
+        return 0;
+    }
+
+    /*Buffer to temporarily hold data that is going to be written to the file*/
+    char bounceBuf[BLOCK_SIZE];
+
+    /*A packed tail is updated in place while the write fits in its fragments,
+        and is promoted to a full block once it grows past them. Fragment blocks
+        are shared with other files, so this happens under the allocator lock*/
+    if (hasPackedTail(fileLocation))
+    {
+        size_t tailStart = fileSize - (fileSize % BLOCK_SIZE);
+        size_t tailCapacity = tailFragmentCount(fileSize) * FRAGMENT_SIZE;
+        if (fileOffset >= tailStart && fileOffset + count <= tailStart + tailCapacity)
+        {
+            if (writeTail(fileLocation, fileOffset - tailStart, cursorSpan(src, bounceBuf, count), count) == -1)
+            {
+                pthread_mutex_unlock(&allocLock);
+                return 0;
+            }
+            if (fileOffset + count > fileSize)
+            {
+                rootDirectory[fileLocation].sizeOfFile = fileOffset + count;
+                markEntryDirty(fileLocation);
+                journalOperation();
+            }
+            pthread_mutex_unlock(&allocLock);
+            return count;
+        }
+        if (fileOffset + count > tailStart && promoteTail(fileLocation) == -1)
+        {
+            pthread_mutex_unlock(&allocLock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&allocLock);
+
+    /*Walk the chain to the block containing the file's offset*/
+    int prevFATBlockIndex = FAT_EOC;
+    int currentFATBlockIndex = rootDirectory[fileLocation].firstIndex;
+    for (size_t i = 0; i < fileOffset / BLOCK_SIZE && currentFATBlockIndex != FAT_EOC; i++)
+    {
+        prevFATBlockIndex = currentFATBlockIndex;
+        currentFATBlockIndex = fatArray[currentFATBlockIndex].next;
+    }
+
+    /*Write to file block by block*/
+    size_t totalBytesWritten = 0;
+    while (totalBytesWritten < count)
+    {
+        bool newBlock = false;
+        pthread_mutex_lock(&allocLock);
+
+        /*Step to take when there is no more space left on the file, so need to extend it*/
+        if (currentFATBlockIndex == FAT_EOC)
+        {
+            /*A short last block is packed into fragments instead*/
+            size_t bytesLeftToWrite = count - totalBytesWritten;
+            if (bytesLeftToWrite <= TAIL_MAX && packTail(fileLocation, cursorSpan(src, bounceBuf, bytesLeftToWrite), bytesLeftToWrite) == 0)
+            {
+                pthread_mutex_unlock(&allocLock);
+                totalBytesWritten += bytesLeftToWrite;
+                fileOffset += bytesLeftToWrite;
+                break;
+            }
+
+            currentFATBlockIndex = allocateFATBlock();
+            if (currentFATBlockIndex == -1)
+            {
+                currentFATBlockIndex = allocateUnbackedFATBlock();
+            }
+            if (currentFATBlockIndex == -1)
+            {
+                pthread_mutex_unlock(&allocLock);
+                break;
+            }
+            if (prevFATBlockIndex == FAT_EOC)
+            {
+                rootDirectory[fileLocation].firstIndex = currentFATBlockIndex;
+            }
+            else
+            {
+                setFATEntry(prevFATBlockIndex, currentFATBlockIndex);
+            }
+            newBlock = true;
+        }
+
+        size_t bounceBufOffSet = fileOffset % BLOCK_SIZE;
+        size_t bytesToWrite = BLOCK_SIZE - bounceBufOffSet;
+        if (bytesToWrite > count - totalBytesWritten)
+        {
+            bytesToWrite = count - totalBytesWritten;
+        }
+
+        /*Aligned full blocks go straight from the caller's buffer to the disk, in
+            runs of adjacent blocks unless each block may have to be deduplicated.
+            Blocks no other file shares are written without the allocator lock.
+            Only a block straddling two of the caller's buffers is gathered first*/
+        if (bytesToWrite == BLOCK_SIZE)
+        {
+            size_t runBlocks = 1;
+            int lastOldIndex = currentFATBlockIndex;
+            int result;
+            size_t maxBlocks = (count - totalBytesWritten) / BLOCK_SIZE;
+            if (contiguousBytes(src) / BLOCK_SIZE < maxBlocks)
+            {
+                maxBlocks = contiguousBytes(src) / BLOCK_SIZE;
+            }
+            if (refCount == NULL && maxBlocks > 0)
+            {
+                runBlocks = contiguousRun(currentFATBlockIndex, maxBlocks, &lastOldIndex);
+                int firstBlock = dataBlock(currentFATBlockIndex);
+                pthread_mutex_unlock(&allocLock);
+                result = block_write_many(firstBlock, runBlocks, cursorPointer(src));
+                if (result == 0 && checksumArray != NULL)
+                {
+                    pthread_mutex_lock(&allocLock);
+                    updateChecksums(currentFATBlockIndex, cursorPointer(src), runBlocks);
+                    pthread_mutex_unlock(&allocLock);
+                }
+            }
+            else
+            {
+                result = writeDataBlock(currentFATBlockIndex, cursorSpan(src, bounceBuf, BLOCK_SIZE));
+                pthread_mutex_unlock(&allocLock);
+            }
+            if (result == -1)
+            {
+                pthread_mutex_lock(&allocLock);
+                /*Drop the blocks that were just added to the chain but never filled*/
+                if (newBlock)
+                {
+                    truncateChain(fileLocation, prevFATBlockIndex, currentFATBlockIndex);
+                }
+                else
+                {
+                    int runLastIndex = currentFATBlockIndex;
+                    for (size_t i = 1; i < runBlocks; i++)
+                    {
+                        runLastIndex = fatArray[runLastIndex].next;
+                    }
+                    if (runLastIndex != lastOldIndex)
+                    {
+                        truncateChain(fileLocation, lastOldIndex, fatArray[lastOldIndex].next);
+                    }
+                }
+                pthread_mutex_unlock(&allocLock);
+                break;
+            }
+
+            for (size_t i = 0; i < runBlocks; i++)
+            {
+                prevFATBlockIndex = currentFATBlockIndex;
+                currentFATBlockIndex = fatArray[currentFATBlockIndex].next;
+            }
+            advanceCursor(src, runBlocks * BLOCK_SIZE);
+            totalBytesWritten += runBlocks * BLOCK_SIZE;
+            fileOffset += runBlocks * BLOCK_SIZE;
+            continue;
+        }
+
+        /*Partial block writes go through the bounce buffer, keeping the surrounding
+            bytes already in the block*/
+        bool keepsOldData = bounceBufOffSet > 0 || fileOffset + bytesToWrite < fileSize;
+        if (newBlock || !keepsOldData)
+        {
+            memset(bounceBuf, 0, BLOCK_SIZE);
+        }
+        else if (block_read(dataBlock(currentFATBlockIndex), bounceBuf) == -1 ||
+                 !verifyChecksums(currentFATBlockIndex, bounceBuf, 1))
+        {
+            pthread_mutex_unlock(&allocLock);
+            break;
+        }
+        gatherBytes(src, bounceBuf + bounceBufOffSet, bytesToWrite);
+        if (writeDataBlock(currentFATBlockIndex, bounceBuf) == -1)
+        {
+            /*Unlink a block that was just added to the chain but never filled*/
+            if (newBlock)
+            {
+                truncateChain(fileLocation, prevFATBlockIndex, currentFATBlockIndex);
+            }
+            pthread_mutex_unlock(&allocLock);
+            break;
+        }
+        pthread_mutex_unlock(&allocLock);
+
+        advanceCursor(src, bytesToWrite);
+        totalBytesWritten += bytesToWrite;
+        fileOffset += bytesToWrite;
+        prevFATBlockIndex = currentFATBlockIndex;
+        currentFATBlockIndex = fatArray[currentFATBlockIndex].next;
+    }
+
+    if (totalBytesWritten > 0)
+    {
+        pthread_mutex_lock(&allocLock);
+        if (fileOffset > fileSize)
+        {
+            rootDirectory[fileLocation].sizeOfFile = fileOffset;
+        }
+        markEntryDirty(fileLocation);
+        journalOperation();
+        pthread_mutex_unlock(&allocLock);
+    }
+
+    return totalBytesWritten;
+}
+
+/*Reads from a file at @fileOffset, with the file's lock held for reading. The
+    blocks of a file are only ever changed by writers of that file, so no other
+    lock is needed*/
+int readFile(int fileLocation, struct iocursor *dest, size_t count, size_t fileOffset)
+{
+
+    /*Check actually what is the number of bytes to be read because of the file offset position
+        a. Smaller than @count
+        b. Exactly @count
+    */
+    size_t fileSize = rootDirectory[fileLocation].sizeOfFile;
+    size_t countOfBytesToRead = 0;
+    if (fileOffset < fileSize)
+    {
+        countOfBytesToRead = fileSize - fileOffset;
+    }
+    if (countOfBytesToRead > count)
+    {
+        countOfBytesToRead = count;
+    }
+
+    /*Inline files are served straight from the small-file area without any block I/O*/
+    if (isInlineFile(fileLocation))
+    {
+        scatterBytes(dest, inlineSlot(fileLocation) + fileOffset, countOfBytesToRead);
+        return countOfBytesToRead;
+    }
+    if (isCompressedFile(fileLocation))
+    {
+        return readCompressed(fileLocation, dest, countOfBytesToRead, fileOffset);
+    }
+
+    /*Create bounce buffer*/
+    char bounceBuf[BLOCK_SIZE];
+
+    /*Bytes past the file's full blocks come from its packed tail, if any*/
+    size_t tailStart = fileSize - (fileSize % BLOCK_SIZE);
+    if (!hasPackedTail(fileLocation))
+    {
+        tailStart = fileSize;
+    }
+
+    /*Find current FAT block index*/
+    int currentFATBlockIndex = findCurFatBlockIndex(fileLocation, fileOffset / BLOCK_SIZE);
+
+    /*Variable to store the number of bytes actually read*/
+    size_t numBytesRead = 0;
+    while (numBytesRead < countOfBytesToRead)
+    {
+        size_t bounceBufOffSet = fileOffset % BLOCK_SIZE;
+        size_t bytesToRead = BLOCK_SIZE - bounceBufOffSet;
+        if (bytesToRead > countOfBytesToRead - numBytesRead)
+        {
+            bytesToRead = countOfBytesToRead - numBytesRead;
+        }
+
+        /*Aligned full blocks before the tail are read straight into the caller's
+            buffer, in runs of adjacent blocks. Only a block straddling two of the
+            caller's buffers goes through the bounce buffer*/
+        size_t fullBlocks = (countOfBytesToRead - numBytesRead) / BLOCK_SIZE;
+        if (fileOffset < tailStart && (tailStart - fileOffset) / BLOCK_SIZE < fullBlocks)
+        {
+            fullBlocks = (tailStart - fileOffset) / BLOCK_SIZE;
+        }
+        if (contiguousBytes(dest) / BLOCK_SIZE < fullBlocks)
+        {
+            fullBlocks = contiguousBytes(dest) / BLOCK_SIZE;
+        }
+        if (bounceBufOffSet == 0 && fileOffset < tailStart && fullBlocks > 0 &&
+            currentFATBlockIndex != -1 && currentFATBlockIndex != FAT_EOC)
+        {
+            size_t runBlocks = contiguousRun(currentFATBlockIndex, fullBlocks, NULL);
+            /*With checksums, the blocks are checksummed while copied from the disk
+                mapping rather than read and then checksummed, which makes two
+                passes over them. The read stops short before a block not matching
+                its checksum*/
+            const char *view = NULL;
+            if (checksumArray != NULL)
+            {
+                view = block_view(dataBlock(currentFATBlockIndex));
+            }
+            size_t verifiedBlocks;
+            if (view != NULL)
+            {
+                verifiedBlocks = copyVerified(currentFATBlockIndex, view, cursorPointer(dest), runBlocks);
+            }
+            else if (block_read_many(dataBlock(currentFATBlockIndex), runBlocks, cursorPointer(dest)) == -1)
+            {
+                break;
+            }
+            else
+            {
+                verifiedBlocks = verifyChecksums(currentFATBlockIndex, cursorPointer(dest), runBlocks);
+            }
+            for (size_t i = 0; i < verifiedBlocks; i++)
+            {
+                currentFATBlockIndex = fatArray[currentFATBlockIndex].next;
+            }
+            advanceCursor(dest, verifiedBlocks * BLOCK_SIZE);
+            numBytesRead += verifiedBlocks * BLOCK_SIZE;
+            fileOffset += verifiedBlocks * BLOCK_SIZE;
+            if (verifiedBlocks < runBlocks)
+            {
+                break;
+            }
+            continue;
+        }
+
+        int block;
+        if (fileOffset >= tailStart)
+        {
+            block = rootDirectory[fileLocation].tailIndex;
+            bounceBufOffSet += rootDirectory[fileLocation].tailFragment * FRAGMENT_SIZE;
+        }
+        else if (currentFATBlockIndex == -1 || currentFATBlockIndex == FAT_EOC)
+        {
+            break;
+        }
+        else
+        {
+            block = currentFATBlockIndex;
+            currentFATBlockIndex = fatArray[currentFATBlockIndex].next;
+        }
+
+        /*Fragment blocks are shared with other files, whose writers update them
+            and their checksum with the allocator lock held*/
+        bool lockBlock = fileOffset >= tailStart && checksumArray != NULL;
+        if (lockBlock)
+        {
+            pthread_mutex_lock(&allocLock);
+        }
+        bool blockRead = block_read(dataBlock(block), bounceBuf) == 0 && verifyChecksums(block, bounceBuf, 1);
+        if (lockBlock)
+        {
+            pthread_mutex_unlock(&allocLock);
+        }
+        if (!blockRead)
+        {
+            break;
+        }
+        scatterBytes(dest, bounceBuf + bounceBufOffSet, bytesToRead);
+        advanceCursor(dest, bytesToRead);
+
+        numBytesRead += bytesToRead;
+        fileOffset += bytesToRead;
+    }
+
+    return numBytesRead;
+}
+
+/*Creates the deduplication table if the volume has none yet, with every other
+    operation stopped*/
+int requireDedupTable(void)
+{
+    pthread_mutex_lock(&allocLock);
+    bool tableExists = superBlock->dedupIndex != 0;
+    pthread_mutex_unlock(&allocLock);
+    if (tableExists)
+    {
+        return 0;
+    }
+
+    lockVolume();
+    int result = 0;
+    if (superBlock->dedupIndex == 0 && createDedupTable() == -1)
+    {
+        result = -1;
+    }
+    unlockVolume();
+    return result;
+}
+
+/*Copies the content of a file into another, empty file, COPY_BLOCKS blocks at a
+    time, with the caller holding both file locks*/
+int copyFile(int srcLocation, int dstLocation)
+{
+    char *buf = malloc(COPY_BLOCKS * BLOCK_SIZE);
+    if (buf == NULL)
+    {
+        return -1;
+    }
+
+    /*The copy is compressed like the original*/
+    pthread_mutex_lock(&allocLock);
+    rootDirectory[dstLocation].flags |= rootDirectory[srcLocation].flags & ENTRY_COMPRESSED;
+    markEntryDirty(dstLocation);
+    pthread_mutex_unlock(&allocLock);
+
+    size_t fileSize = rootDirectory[srcLocation].sizeOfFile;
+    int result = 0;
+    for (size_t offset = 0; offset < fileSize && result == 0; offset += COPY_BLOCKS * BLOCK_SIZE)
+    {
+        struct iovec iov = {.iov_base = buf, .iov_len = COPY_BLOCKS * BLOCK_SIZE};
+        struct iocursor cursor;
+        initCursor(&cursor, &iov, 1);
+        int bytesRead = readFile(srcLocation, &cursor, iov.iov_len, offset);
+
+        iov.iov_len = bytesRead;
+        initCursor(&cursor, &iov, 1);
+        if (bytesRead <= 0 || writeFile(dstLocation, &cursor, bytesRead, offset) != bytesRead)
+        {
+            result = -1;
+        }
+    }
+    free(buf);
+    return result;
+}
+
+/*Makes an empty file share the data blocks of another file: its chain is backed
+    by the same physical blocks, which are then copied on write. A packed tail is
+    copied into fragments of its own. The caller holds both file locks and the
+    allocator lock*/
+int cloneFile(int srcLocation, int dstLocation)
+{
+    struct rootdirectory *src = &rootDirectory[srcLocation];
+    struct rootdirectory *dst = &rootDirectory[dstLocation];
+
+    if (isInlineFile(srcLocation))
+    {
+        memcpy(inlineSlot(dstLocation), inlineSlot(srcLocation), INLINE_MAX);
+        dst->flags |= ENTRY_INLINE;
+    }
+    else
+    {
+        dst->flags |= src->flags & ENTRY_COMPRESSED;
+        int prevFATBlockIndex = FAT_EOC;
+        for (int fatIndex = src->firstIndex; fatIndex != FAT_EOC; fatIndex = fatArray[fatIndex].next)
+        {
+            int newFATBlockIndex = allocateMappedFATBlock(physicalIndex(fatIndex));
+            if (newFATBlockIndex == -1)
+            {
+                freeChain(dst->firstIndex);
+                dst->firstIndex = FAT_EOC;
+                return -1;
+            }
+            if (prevFATBlockIndex == FAT_EOC)
+            {
+                dst->firstIndex = newFATBlockIndex;
+            }
+            else
+            {
+                setFATEntry(prevFATBlockIndex, newFATBlockIndex);
+            }
+            prevFATBlockIndex = newFATBlockIndex;
+        }
+
+        char fragmentBuf[BLOCK_SIZE];
+        if (hasPackedTail(srcLocation) &&
+            (block_read(dataBlock(src->tailIndex), fragmentBuf) == -1 || !verifyChecksums(src->tailIndex, fragmentBuf, 1) ||
+             packTail(dstLocation, fragmentBuf + (src->tailFragment * FRAGMENT_SIZE), src->sizeOfFile % BLOCK_SIZE) == -1))
+        {
+            freeChain(dst->firstIndex);
+            dst->firstIndex = FAT_EOC;
+            return -1;
+        }
+    }
+
+    dst->sizeOfFile = src->sizeOfFile;
+    markEntryDirty(dstLocation);
+    journalOperation();
+    return 0;
+}
+
+/*Writes the caller's buffers to an open file at @offset, under the file's lock*/
+int writeVector(int fd, const struct iovec *iov, int iovcnt, size_t offset)
+{
+    int fileLocation = findFileLocation(fd);
+    struct iocursor cursor;
+    size_t count = initCursor(&cursor, iov, iovcnt);
+
+    lockFileWrite(fileLocation);
+    int bytesWritten = -1;
+    /*Error: @offset is past the end of the file, or a snapshot is mounted*/
+    if (offset <= rootDirectory[fileLocation].sizeOfFile && !readOnly)
+    {
+        bytesWritten = writeFile(fileLocation, &cursor, count, offset);
+    }
+    pthread_rwlock_unlock(&fileLocks[fileLocation]);
+
+    return bytesWritten;
+}
+
+/*Reads an open file at @offset into the caller's buffers, under the file's lock*/
+int readVector(int fd, const struct iovec *iov, int iovcnt, size_t offset)
+{
+    int fileLocation = findFileLocation(fd);
+    struct iocursor cursor;
+    size_t count = initCursor(&cursor, iov, iovcnt);
+
+    pthread_rwlock_rdlock(&fileLocks[fileLocation]);
+    int bytesRead = readFile(fileLocation, &cursor, count, offset);
+    pthread_rwlock_unlock(&fileLocks[fileLocation]);
+
+    return bytesRead;
+}
+
+/*Gets the offset of an open file for tracing, or 0 if @fd is invalid*/
+size_t fileOffset(int fd)
+{
+    if (checkIfFileOpen(superBlock) == 0 || checkFileDescriptorValid(fd) == 0)
+    {
+        return 0;
+    }
+    return fdArray[fd].file_offset;
+}
+
+/*Counts the bytes of the caller's buffers for tracing, or 0 if @iov is invalid*/
+size_t vectorLength(const struct iovec *iov, int iovcnt)
+{
+    size_t total = 0;
+    for (int i = 0; iov != NULL && i < iovcnt; i++)
+    {
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+/*Writes a buffer to a host file descriptor, returning the number of bytes written*/
+size_t writeHost(int hostFd, const char *buf, size_t count)
+{
+    size_t bytesWritten = 0;
+    while (bytesWritten < count)
+    {
+        ssize_t written = write(hostFd, buf + bytesWritten, count - bytesWritten);
+        if (written <= 0)
+        {
+            break;
+        }
+        bytesWritten += written;
+    }
+    return bytesWritten;
+}
+
+/*Sends a view buffer to a host file descriptor, inside the kernel when it lies in the disk mapping*/
+size_t sendView(const struct iovec *view, int hostFd)
+{
+    const char *diskStart = block_view(0);
+    const char *base = view->iov_base;
+    size_t bytesSent = 0;
+
+    if (diskStart != NULL && base >= diskStart && base < diskStart + (size_t)block_disk_count() * BLOCK_SIZE)
+    {
+        size_t position = base - diskStart;
+        int sent = block_send(position / BLOCK_SIZE, position % BLOCK_SIZE, view->iov_len, hostFd);
+        if (sent > 0)
+        {
+            bytesSent = sent;
+        }
+    }
+
+    /*Inline content, and whatever the kernel could not copy, goes through write()*/
+    return bytesSent + writeHost(hostFd, base + bytesSent, view->iov_len - bytesSent);
+}
+
+/*MAIN FUNCTIONS */
+
+/*Traced functions are wrappers timing their do* counterpart, which main
+    functions call directly so that nested calls are not traced*/
+
+int doMount(const char *diskname)
+{
+    // open disk
+    // if virtual file disk cannot be openned return -1;
+    if (block_disk_open(diskname) == -1)
+    {
+        return -1;
+    }
+    disk_open = true;
+
+    // file generations, advanced as the files are now another volume's
+    if (fileGenerations == NULL && createGenerations() == -1)
+    {
+        return -1;
+    }
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    {
+        __atomic_add_fetch(&fileGenerations[i], 1, __ATOMIC_SEQ_CST);
+    }
+
+    // declaring a super block
+    superBlock = malloc(BLOCK_SIZE);
+    if (superBlock == NULL)
+    {
+        return -1;
+    }
+
+    if (block_read(0, (void *)superBlock) == -1)
+    {
+        return -1;
+    }
+
+    // checking signature
+    if (strncmp(superBlock->signature, "ECS150FS", 8) != 0)
+    {
+        return -1;
+    }
+
+    if (block_disk_count() != superBlock->numBlockVirtualDisk)
+    {
+        return -1;
+    }
+
+    // fatArray initialization
+    fatArray = malloc(superBlock->numBlocksFAT * BLOCK_SIZE);
+    for (int i = 0; i < superBlock->numBlocksFAT; i++)
+    {
+        if (block_read(i + 1, (void *)fatArray + (i * BLOCK_SIZE)) == -1) // ask TA about
+        {
+            return -1;
+        }
+    }
+
+    // rootDirectory initialization
+    rootDirectory = malloc(sizeof(struct rootdirectory) * FS_FILE_MAX_COUNT);
+    if (block_read(superBlock->numBlocksFAT + 1, (void *)rootDirectory) == -1) // ask TA about
+    {
+        return -1;
+    }
+
+    // inline small-file area initialization
+    inlineArea = calloc(INLINE_AREA_BLOCKS, BLOCK_SIZE);
+    if (inlineArea == NULL)
+    {
+        return -1;
+    }
+    if (superBlock->inlineIndex != 0 && transferInlineArea(false) == -1)
+    {
+        return -1;
+    }
+
+    // deduplication table initialization
+    maxFatEntries = superBlock->numBlocksFAT * BLOCK_SIZE / sizeof(struct FAT);
+    if (maxFatEntries > FAT_EOC)
+    {
+        maxFatEntries = FAT_EOC;
+    }
+    fatEntries = superBlock->numDataBlocks;
+    if (superBlock->dedupIndex != 0 && (setupDedupTable() == -1 || transferDedupTable(false) == -1))
+    {
+        return -1;
+    }
+
+    // checksum table initialization
+    checksumErrors = 0;
+    if (superBlock->checksumIndex != 0 &&
+        (setupChecksumTable() == -1 ||
+         transferChain(superBlock->checksumIndex, (char *)checksumArray, superBlock->checksumBlocks, false) == -1))
+    {
+        return -1;
+    }
+
+    // journal initialization and replay of the committed transactions
+    fatDirty = calloc(maxFatEntries, sizeof(uint8_t));
+    remapDirty = calloc(maxFatEntries, sizeof(uint8_t));
+    if (fatDirty == NULL || remapDirty == NULL)
+    {
+        return -1;
+    }
+    clearDirty();
+    journalTail = 0;
+    journalSequence = superBlock->journalSequence;
+    if (superBlock->journalIndex != 0 && (loadJournal() == -1 || replayJournal() == -1))
+    {
+        return -1;
+    }
+
+    if (refCount != NULL)
+    {
+        buildDedupIndex();
+        if (pinSnapshots() == -1)
+        {
+            return -1;
+        }
+    }
+
+    // fragment map initialization
+    fragmentMap = calloc(maxFatEntries, sizeof(uint8_t));
+    fragmentDirty = calloc(maxFatEntries, sizeof(uint8_t));
+    if (fragmentMap == NULL || fragmentDirty == NULL)
+    {
+        return -1;
+    }
+    buildFragmentMap();
+
+    fdArray = calloc(FD_MAX, sizeof(struct fdTable));
+    memset(openCount, 0, sizeof(openCount));
+    compressBytes = 0;
+    compressNanos = 0;
+    decompressBytes = 0;
+    decompressNanos = 0;
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    {
+        pthread_rwlock_init(&fileLocks[i], NULL);
+    }
+
+    // committer thread initialization
+    if (startCommitter() == -1)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+int fs_mount(const char *diskname)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_mount", 0);
+    int result = doMount(diskname);
+    trace_end(traceStart, FS_TRACE_MOUNT, -1, 0, 0, NULL, NULL, result);
+    return result;
+}
+
+int doUmount(void)
+{
+    /*Error: If no disk is opened, return -1 */
+    if (disk_open == false)
+    {
+        return -1;
+    }
+    /*Error: No FS is currently mounted */
+    if (!superBlock)
+    {
+        return -1;
+    }
+
+    /*Error: Zero-copy read views still point into the disk mapping*/
+    if (activeViews > 0)
+    {
+        return -1;
+    }
+
+    // Committing then writing metadata to the disk, which also empties the journal
+    pthread_mutex_lock(&allocLock);
+    int result = readOnly || (commitJournal() == 0 && checkpoint() == 0) ? 0 : -1;
+    pthread_mutex_unlock(&allocLock);
+    if (result == -1)
+    {
+        return -1;
+    }
+    stopCommitter();
+
+    /*Error: There are file descriptors still open: STILL NEED TO IMPLEMENT*/
+
+    free(superBlock);
+    free(fatArray);
+    free(rootDirectory);
+    free(inlineArea);
+    free(fragmentMap);
+    free(fragmentDirty);
+    free(fatDirty);
+    free(remapDirty);
+    free(journalBuf);
+    free(dedupTable);
+    free(refCount);
+    free(freedDirty);
+    free(hashHead);
+    free(hashNext);
+    dropChecksumTable();
+    free(fdArray);
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    {
+        pthread_rwlock_destroy(&fileLocks[i]);
+    }
+    journalBuf = NULL;
+    dedupTable = NULL;
+    remapArray = NULL;
+    blockHash = NULL;
+    refCount = NULL;
+    freedDirty = NULL;
+    hashHead = NULL;
+    hashNext = NULL;
+    superBlock = NULL;
+    readOnly = false;
+
+    /*Error: Virtual disk can not be closed */
+    if (block_disk_close() < 0)
+    {
+        return -1;
+    }
+    disk_open = false;
+
+    return 0;
+}
+
+int fs_umount(void)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_umount", 0);
+    int result = doUmount();
+    trace_end(traceStart, FS_TRACE_UMOUNT, -1, 0, 0, NULL, NULL, result);
+    return result;
+}
+
+int doSync(void)
+{
+    /*Error: No FS currently mounted*/
+    if (checkIfFileOpen(superBlock) == 0)
+    {
+        return -1;
+    }
+
+    /*A mounted snapshot has nothing to commit*/
+    if (readOnly)
+    {
+        return 0;
+    }
+
+    /*Callers syncing while a commit runs share the next one*/
+    uint64_t request = requestCommit();
+    pthread_mutex_lock(&commitLock);
+    while (commitCompleted < request)
+    {
+        pthread_cond_wait(&commitDone, &commitLock);
+    }
+    int result = commitDurable >= request ? 0 : -1;
+    pthread_mutex_unlock(&commitLock);
+    return result;
+}
+
+int fs_sync(void)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_sync", 0);
+    int result = doSync();
+    trace_end(traceStart, FS_TRACE_SYNC, -1, 0, 0, NULL, NULL, result);
+    return result;
+}
+
+int doDedup(int enable)
+{
+    /*Error: No FS currently mounted, or mounted read-only*/
+    if (checkIfFileOpen(superBlock) == 0 || readOnly)
+    {
+        return -1;
+    }
+
+    /*The deduplication table is created the first time deduplication is enabled*/
+    pthread_mutex_lock(&allocLock);
+    if (enable && superBlock->dedupIndex == 0 && createDedupTable() == -1)
+    {
+        pthread_mutex_unlock(&allocLock);
+        return -1;
+    }
+
+    if (enable)
+    {
+        superBlock->features |= FEATURE_DEDUP;
+    }
+    else
+    {
+        superBlock->features &= ~FEATURE_DEDUP;
+    }
+    superDirty = true;
+    int result = commitJournal();
+    pthread_mutex_unlock(&allocLock);
+    return result;
+}
+
+int fs_dedup(int enable)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_dedup", enable);
+    int result = doDedup(enable);
+    trace_end(traceStart, FS_TRACE_DEDUP, -1, 0, enable, NULL, NULL, result);
+    return result;
+}
+
+int doChecksum(int enable)
+{
+    /*Error: No FS currently mounted, or mounted read-only*/
+    if (checkIfFileOpen(superBlock) == 0 || readOnly)
+    {
+        return -1;
+    }
+
+    /*Checksums are computed for the whole volume or dropped with every other
+        operation stopped, since readers check them without the allocator lock*/
+    lockVolume();
+    int result = 0;
+    if (enable && checksumArray == NULL)
+    {
+        result = createChecksumTable();
+    }
+    else if (!enable && checksumArray != NULL)
+    {
+        dropChecksumTable();
+        freeChain(superBlock->checksumIndex);
+        superBlock->checksumIndex = 0;
+        superBlock->checksumBlocks = 0;
+        superDirty = true;
+        result = commitJournal();
+    }
+    unlockVolume();
+    return result;
+}
+
+int fs_checksum(int enable)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_checksum", enable);
+    int result = doChecksum(enable);
+    trace_end(traceStart, FS_TRACE_CHECKSUM, -1, 0, enable, NULL, NULL, result);
+    return result;
+}
+
+int doSnapshot(const char *name)
+{
+    /*Error: No FS currently mounted, mounted read-only, or invalid name*/
+    if (checkIfFileOpen(superBlock) == 0 || readOnly || checkFileNameValid(name) == 0 || name[0] == '\0')
+    {
+        return -1;
+    }
+
+    char *snapshot = calloc(snapshotBlocks(), BLOCK_SIZE);
+    if (snapshot == NULL)
+    {
+        return -1;
+    }
+    lockVolume();
+    int result = takeSnapshot(name, snapshot);
+    unlockVolume();
+    free(snapshot);
+    return result;
+}
+
+int fs_snapshot(const char *name)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_snapshot", 0);
+    int result = doSnapshot(name);
+    trace_end(traceStart, FS_TRACE_SNAPSHOT, -1, 0, 0, name, NULL, result);
+    return result;
+}
+
+int doSnapshotDelete(const char *name)
+{
+    struct snapshotentry snapshots[SNAPSHOT_MAX];
+
+    /*Error: No FS currently mounted, mounted read-only, or invalid name*/
+    if (checkIfFileOpen(superBlock) == 0 || readOnly || checkFileNameValid(name) == 0)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&allocLock);
+    int slot = -1;
+    if (loadSnapshotDir(snapshots) == 0)
+    {
+        slot = findSnapshot(snapshots, name);
+    }
+    char *snapshot = slot != -1 ? readSnapshot(&snapshots[slot]) : NULL;
+    /*Error: the snapshot does not exist or cannot be read*/
+    if (snapshot == NULL)
+    {
+        pthread_mutex_unlock(&allocLock);
+        return -1;
+    }
+
+    /*The snapshot is removed from the directory before its blocks are freed*/
+    int firstIndex = snapshots[slot].firstIndex;
+    memset(&snapshots[slot], 0, sizeof(struct snapshotentry));
+    int result = -1;
+    if (block_write(dataBlock(superBlock->snapshotIndex), snapshots) == 0 && block_sync() == 0)
+    {
+        pinSnapshot(snapshot, -1);
+        freeChain(firstIndex);
+        result = commitJournal();
+    }
+    pthread_mutex_unlock(&allocLock);
+    free(snapshot);
+    return result;
+}
+
+int fs_snapshot_delete(const char *name)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_snapshot_delete", 0);
+    int result = doSnapshotDelete(name);
+    trace_end(traceStart, FS_TRACE_SNAPSHOT_DELETE, -1, 0, 0, name, NULL, result);
+    return result;
+}
+
+int doMountSnapshot(const char *diskname, const char *name)
+{
+    struct snapshotentry snapshots[SNAPSHOT_MAX];
+
+    if (checkFileNameValid(name) == 0 || doMount(diskname) == -1)
+    {
+        return -1;
+    }
+
+    /*The snapshot replaces the volume's metadata in memory only*/
+    int slot = -1;
+    if (loadSnapshotDir(snapshots) == 0)
+    {
+        slot = findSnapshot(snapshots, name);
+    }
+    char *snapshot = slot != -1 ? readSnapshot(&snapshots[slot]) : NULL;
+    /*Error: the snapshot does not exist or cannot be read*/
+    if (snapshot == NULL)
+    {
+        doUmount();
+        return -1;
+    }
+    memcpy(rootDirectory, snapshot, BLOCK_SIZE);
+    memcpy(inlineArea, snapshot + BLOCK_SIZE, INLINE_AREA_BLOCKS * BLOCK_SIZE);
+    memcpy(fatArray, snapshotFAT(snapshot), maxFatEntries * sizeof(uint16_t));
+    memcpy(remapArray, snapshotRemap(snapshot), maxFatEntries * sizeof(uint16_t));
+    free(snapshot);
+
+    memset(fragmentMap, 0, maxFatEntries);
+    buildFragmentMap();
+    readOnly = true;
+    return 0;
+}
+
+int fs_mount_snapshot(const char *diskname, const char *name)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_mount_snapshot", 0);
+    int result = doMountSnapshot(diskname, name);
+    trace_end(traceStart, FS_TRACE_MOUNT_SNAPSHOT, -1, 0, 0, name, NULL, result);
+    return result;
+}
+
+int fs_info(void)
+{
+    pthread_mutex_lock(&allocLock);
+
+    // Count the data blocks still free to allocate; once deduplication has
+    // grown the FAT past the data region, its free entries no longer match them
+    int fatFreeSpaceCount = totalEmptyFATBlocks();
+
+    // count the number of free root directories
+    int freeRootDirectoryCount = 0;
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    {
+        if (rootDirectory[i].sizeOfFile == 0)
+        {
+            freeRootDirectoryCount++;
+        }
+    }
+
+    printf("FS Info:\n");
+    printf("total_blk_count=%d\n", superBlock->numBlockVirtualDisk);
+    printf("fat_blk_count=%d\n", superBlock->numBlocksFAT);
+    printf("rdir_blk=%d\n", superBlock->numBlocksFAT + 1);
+    printf("data_blk=%d\n", superBlock->numBlocksFAT + 2);
+    printf("data_blk_count=%d\n", superBlock->numDataBlocks);
+    printf("fat_free_ratio=%d/%d\n", fatFreeSpaceCount, superBlock->numDataBlocks);
+    printf("rdir_free_ratio=%d/%d\n", freeRootDirectoryCount, FS_FILE_MAX_COUNT);
+
+    // Compare the data blocks of the files to the distinct ones storing them,
+    // leaving out the chains of the file system's own metadata
+    uint8_t *stored = refCount != NULL ? calloc(superBlock->numDataBlocks, sizeof(uint8_t)) : NULL;
+    if (stored != NULL)
+    {
+        int fileBlockCount = 0;
+        int storedBlockCount = 0;
+        for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+        {
+            if (rootDirectory[i].fileName[0] == '\0' || isInlineFile(i))
+            {
+                continue;
+            }
+
+            // The chunk index leading the chain of a compressed file is not file data
+            int indexBlocks = isCompressedFile(i) ? chunkIndexBlocks(rootDirectory[i].sizeOfFile) : 0;
+            int position = 0;
+            for (int fatIndex = rootDirectory[i].firstIndex; fatIndex != FAT_EOC; fatIndex = fatArray[fatIndex].next)
+            {
+                int physical = physicalIndex(fatIndex);
+                if (position++ < indexBlocks || physical == PHYS_NONE)
+                {
+                    continue;
+                }
+                fileBlockCount++;
+                if (refCount[physical] > 0 && !stored[physical])
+                {
+                    stored[physical] = 1;
+                    storedBlockCount++;
+                }
+            }
+        }
+        printf("dedup_ratio=%d/%d\n", fileBlockCount, storedBlockCount);
+        free(stored);
+    }
+
+    // Compare the data blocks of the compressed files to the ones they would use uncompressed
+    int compressedFileCount = 0;
+    int logicalBlockCount = 0;
+    int compressedBlockCount = 0;
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    {
+        if (rootDirectory[i].fileName[0] != '\0' && isCompressedFile(i))
+        {
+            compressedFileCount++;
+            logicalBlockCount += (rootDirectory[i].sizeOfFile + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            for (int fatIndex = rootDirectory[i].firstIndex; fatIndex != FAT_EOC; fatIndex = fatArray[fatIndex].next)
+            {
+                compressedBlockCount++;
+            }
+        }
+    }
+    if (compressedFileCount > 0)
+    {
+        uint64_t nanos = __atomic_load_n(&compressNanos, __ATOMIC_RELAXED);
+        uint64_t bytes = __atomic_load_n(&compressBytes, __ATOMIC_RELAXED);
+        printf("compress_ratio=%d/%d\n", logicalBlockCount, compressedBlockCount);
+        printf("compress_rate=%.1fMB/s\n", nanos > 0 ? bytes * 1e3 / nanos : 0.0);
+        nanos = __atomic_load_n(&decompressNanos, __ATOMIC_RELAXED);
+        bytes = __atomic_load_n(&decompressBytes, __ATOMIC_RELAXED);
+        printf("decompress_rate=%.1fMB/s\n", nanos > 0 ? bytes * 1e3 / nanos : 0.0);
+    }
+
+    // Count the data blocks that did not match their checksum when read
+    if (checksumArray != NULL)
+    {
+        printf("checksum=crc32c(%s)\n", crc32c_impl());
+        printf("checksum_errors=%d\n", __atomic_load_n(&checksumErrors, __ATOMIC_RELAXED));
+    }
+    pthread_mutex_unlock(&allocLock);
+    return 0;
+}
+
+int doCreate(const char *filename)
+{
+
+    /*Error Management: No FS currently mounted, mounted read-only or Invalid file name*/
+    if (checkIfFileOpen(superBlock) == 0 || readOnly || checkFileNameValid(filename) == 0)
+    {
+        return -1;
+    }
+
+    /*Error: file already exists*/
+    pthread_mutex_lock(&dirLock);
+    if (checkIfFileExists(filename) == 1)
+    {
+        pthread_mutex_unlock(&dirLock);
+        return -1;
+    }
+
+    /*Error: Root directory already contains the max amount of files*/
+    // count the number of free root directories
+    int freeRootDirectoryCount = 0;
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    {
+        if (rootDirectory[i].fileName[0] == '\0')
+        {
+            freeRootDirectoryCount++;
+        }
+    }
+    if (freeRootDirectoryCount == 0)
+    {
+        pthread_mutex_unlock(&dirLock);
+        return -1;
+    }
+
+    /*Go through the root directory and find the entry where everything is NULL*/
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    {
+
+        // find empty spot in root directory
+        if (rootDirectory[i].fileName[0] == '\0')
+        {
+            pthread_mutex_lock(&allocLock);
+            strcpy(rootDirectory[i].fileName, filename);
+            rootDirectory[i].sizeOfFile = 0;
+            rootDirectory[i].firstIndex = FAT_EOC;
+            rootDirectory[i].flags = 0;
+            rootDirectory[i].tailIndex = 0;
+            rootDirectory[i].tailFragment = 0;
+            markEntryDirty(i);
+            journalOperation();
+            pthread_mutex_unlock(&allocLock);
+            pthread_mutex_unlock(&dirLock);
+
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&dirLock);
+    return -1;
+}
+
+int fs_create(const char *filename)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_create", 0);
+    int result = doCreate(filename);
+    trace_end(traceStart, FS_TRACE_CREATE, -1, 0, 0, filename, NULL, result);
+    return result;
+}
+
+int doDelete(const char *filename)
+{
+
+    /*Error Management: No FS currently mounted, mounted read-only or Invalid file name*/
+    if (checkIfFileOpen(superBlock) == 0 || readOnly || checkFileNameValid(filename) == 0)
+    {
+        return -1;
+    }
+
+    /*Error: file does not exist*/
+    pthread_mutex_lock(&dirLock);
+    if (checkIfFileExists(filename) == 0)
+    {
+        pthread_mutex_unlock(&dirLock);
+        return -1;
+    }
+
+    /*all the data blocks containing the file’s contents must be freed in the FAT.*/
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    {
+        if ((strlen(rootDirectory[i].fileName) > 0) && (strcmp(rootDirectory[i].fileName, filename) == 0))
+        {
+            /*Error: file @filename is currently open */
+            if (openCount[i] > 0)
             {
+                pthread_mutex_unlock(&dirLock);
+                return -1;
+            }
+
+            /*fs_copy() reads and writes files without opening them, so wait
+                for the ones running on this file to finish*/
+            lockFileWrite(i);
+            pthread_mutex_lock(&allocLock);
+            rootDirectory[i].fileName[0] = '\0';
+            if (isInlineFile(i))
+            {
+                memset(inlineSlot(i), 0, INLINE_MAX);
+                rootDirectory[i].flags &= ~ENTRY_INLINE;
+                rootDirectory[i].sizeOfFile = 0;
+            }
+            else if (rootDirectory[i].sizeOfFile > 0)
+            {
+                if (hasPackedTail(i))
+                {
+                    freeTail(i);
+                }
                 int fatIndex = rootDirectory[i].firstIndex;
                 int nextFat;
                 while (fatIndex != FAT_EOC)
                 {
                     nextFat = fatArray[fatIndex].next;
-                    fatArray[fatIndex].next = 0;
+                    freeFATBlock(fatIndex);
                     fatIndex = nextFat;
 
-                } // end while
-                rootDirectory[i].sizeOfFile = 0;
-                // nextFat = 0;
-            } // end if
-        }     // end if
-    }         // end for
+                } // end while
+                rootDirectory[i].sizeOfFile = 0;
+                // nextFat = 0;
+            } // end if
+            markEntryDirty(i);
+            journalOperation();
+            pthread_mutex_unlock(&allocLock);
+            pthread_rwlock_unlock(&fileLocks[i]);
+        }     // end if
+    }         // end for
+    pthread_mutex_unlock(&dirLock);
+    return 0;
+}
+
+int fs_delete(const char *filename)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_delete", 0);
+    int result = doDelete(filename);
+    trace_end(traceStart, FS_TRACE_DELETE, -1, 0, 0, filename, NULL, result);
+    return result;
+}
+
+int doCopy(const char *src, const char *dst, int reflink)
+{
+    /*Error: No FS currently mounted, mounted read-only, or invalid file names*/
+    if (checkIfFileOpen(superBlock) == 0 || readOnly || checkFileNameValid(src) == 0 || checkFileNameValid(dst) == 0)
+    {
+        return -1;
+    }
+
+    /*Reflinks share blocks through the reference counts of the deduplication table*/
+    if (reflink && requireDedupTable() == -1)
+    {
+        return -1;
+    }
+
+    /*Error: @src does not exist, or @dst cannot be created*/
+    pthread_mutex_lock(&dirLock);
+    bool srcExists = checkIfFileExists(src);
+    pthread_mutex_unlock(&dirLock);
+    if (!srcExists || doCreate(dst) == -1)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&dirLock);
+    int srcLocation = findFileEntry(src);
+    int dstLocation = findFileEntry(dst);
+    if (srcLocation == -1 || dstLocation == -1)
+    {
+        pthread_mutex_unlock(&dirLock);
+        doDelete(dst);
+        return -1;
+    }
+    if (srcLocation < dstLocation)
+    {
+        pthread_rwlock_rdlock(&fileLocks[srcLocation]);
+        lockFileWrite(dstLocation);
+    }
+    else
+    {
+        lockFileWrite(dstLocation);
+        pthread_rwlock_rdlock(&fileLocks[srcLocation]);
+    }
+    pthread_mutex_unlock(&dirLock);
+
+    int result;
+    if (reflink)
+    {
+        pthread_mutex_lock(&allocLock);
+        result = cloneFile(srcLocation, dstLocation);
+        pthread_mutex_unlock(&allocLock);
+    }
+    else
+    {
+        result = copyFile(srcLocation, dstLocation);
+    }
+    pthread_rwlock_unlock(&fileLocks[srcLocation]);
+    pthread_rwlock_unlock(&fileLocks[dstLocation]);
+
+    /*A failed copy leaves no partial file behind*/
+    if (result == -1)
+    {
+        doDelete(dst);
+    }
+    return result;
+}
+
+int fs_copy(const char *src, const char *dst, int reflink)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_copy", 0);
+    int result = doCopy(src, dst, reflink);
+    trace_end(traceStart, FS_TRACE_COPY, -1, 0, reflink, src, dst, result);
+    return result;
+}
+
+int doCompress(const char *filename, int enable)
+{
+    /*Error: No FS currently mounted, mounted read-only, or invalid file name*/
+    if (checkIfFileOpen(superBlock) == 0 || readOnly || checkFileNameValid(filename) == 0)
+    {
+        return -1;
+    }
+
+    /*Error: file does not exist*/
+    pthread_mutex_lock(&dirLock);
+    int fileLocation = findFileEntry(filename);
+    if (fileLocation == -1)
+    {
+        pthread_mutex_unlock(&dirLock);
+        return -1;
+    }
+    lockFileWrite(fileLocation);
+    pthread_mutex_unlock(&dirLock);
+
+    /*Error: the mode of a file can only change while it is empty*/
+    int result = -1;
+    if (rootDirectory[fileLocation].sizeOfFile == 0)
+    {
+        pthread_mutex_lock(&allocLock);
+        if (enable)
+        {
+            rootDirectory[fileLocation].flags |= ENTRY_COMPRESSED;
+        }
+        else
+        {
+            rootDirectory[fileLocation].flags &= ~ENTRY_COMPRESSED;
+        }
+        markEntryDirty(fileLocation);
+        journalOperation();
+        pthread_mutex_unlock(&allocLock);
+        result = 0;
+    }
+    pthread_rwlock_unlock(&fileLocks[fileLocation]);
+    return result;
+}
+
+int fs_compress(const char *filename, int enable)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_compress", enable);
+    int result = doCompress(filename, enable);
+    trace_end(traceStart, FS_TRACE_COMPRESS, -1, 0, enable, filename, NULL, result);
+    return result;
+}
+
+int fs_ls(void)
+{
+    /*Error: No FS currently mounted*/
+    if (checkIfFileOpen(superBlock) == 0)
+    {
+        return -1;
+    }
+
+    pthread_mutex_lock(&dirLock);
+    printf("FS Ls:\n");
+    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    {
+        /* Only prints out the root directories where it is not empty*/
+        if (rootDirectory[i].fileName[0] != '\0')
+        {
+            printf("file: %s, size: %d, data_blk: %d\n",
+                   rootDirectory[i].fileName, rootDirectory[i].sizeOfFile, rootDirectory[i].firstIndex);
+        }
+    }
+    pthread_mutex_unlock(&dirLock);
+
+    return 0;
+}
+
+int fs_opendir(struct fs_dir *dir)
+{
+    /*Error: No FS currently mounted or @dir is NULL*/
+    if (checkIfFileOpen(superBlock) == 0 || dir == NULL)
+    {
+        return -1;
+    }
+
+    dir->pos = 0;
     return 0;
 }
 
-int fs_ls(void)
+int fs_readdir(struct fs_dir *dir, struct fs_dirent *entry)
 {
-    /*Error: No FS currently mounted*/
-    if (checkIfFileOpen(superBlock) == 0)
+    /*Error: No FS currently mounted, @dir or @entry is NULL*/
+    if (checkIfFileOpen(superBlock) == 0 || dir == NULL || entry == NULL)
     {
         return -1;
     }
 
-    printf("FS Ls:\n");
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
+    /*Skip the empty root directory entries*/
+    pthread_mutex_lock(&dirLock);
+    while (dir->pos < FS_FILE_MAX_COUNT && rootDirectory[dir->pos].fileName[0] == '\0')
     {
-        /* Only prints out the root directories where it is not empty*/
-        if (rootDirectory[i].fileName[0] != '\0')
+        dir->pos++;
+    }
+    if (dir->pos >= FS_FILE_MAX_COUNT)
+    {
+        pthread_mutex_unlock(&dirLock);
+        return 0;
+    }
+
+    int fileLocation = dir->pos++;
+    pthread_rwlock_rdlock(&fileLocks[fileLocation]);
+    memcpy(entry->name, rootDirectory[fileLocation].fileName, FS_FILENAME_LEN);
+    entry->name[FS_FILENAME_LEN - 1] = '\0';
+    entry->size = rootDirectory[fileLocation].sizeOfFile;
+    entry->first_block = -1;
+    entry->extent_count = 0;
+
+    /*Count the runs of blocks of the file's chain that sit next to each other
+        on disk, which FAT entries remapped by deduplication, reflinks or
+        snapshots may not*/
+    int fatIndex = rootDirectory[fileLocation].firstIndex;
+    if (!isInlineFile(fileLocation) && fatIndex != FAT_EOC)
+    {
+        /*Report the physical data block, the same space the extents are
+            counted in, and not the FAT entry mapped onto it*/
+        if (physicalIndex(fatIndex) != PHYS_NONE)
         {
-            printf("file: %s, size: %d, data_blk: %d\n",
-                   rootDirectory[i].fileName, rootDirectory[i].sizeOfFile, rootDirectory[i].firstIndex);
+            entry->first_block = physicalIndex(fatIndex);
+        }
+        entry->extent_count = 1;
+        while (fatArray[fatIndex].next != FAT_EOC)
+        {
+            int nextFATBlockIndex = fatArray[fatIndex].next;
+            if (physicalIndex(fatIndex) == PHYS_NONE || physicalIndex(nextFATBlockIndex) == PHYS_NONE ||
+                dataBlock(nextFATBlockIndex) != dataBlock(fatIndex) + 1)
+            {
+                entry->extent_count++;
+            }
+            fatIndex = nextFATBlockIndex;
         }
     }
+    if (hasPackedTail(fileLocation))
+    {
+        entry->extent_count++;
+    }
+    pthread_rwlock_unlock(&fileLocks[fileLocation]);
+    pthread_mutex_unlock(&dirLock);
+    return 1;
+}
+
+int fs_closedir(struct fs_dir *dir)
+{
+    /*Error: @dir is NULL*/
+    if (dir == NULL)
+    {
+        return -1;
+    }
 
+    dir->pos = FS_FILE_MAX_COUNT;
     return 0;
 }
 
-int fs_open(const char *filename)
+int doOpen(const char *filename)
 {
 
-    /*Error Management: No FS currently mounted, Invalid file name,
-        or file does not exist*/
-    if (checkIfFileOpen(superBlock) == 0 || checkFileNameValid(filename) == 0 || checkIfFileExists(filename) == 0)
+    /*Error Management: No FS currently mounted or Invalid file name*/
+    if (checkIfFileOpen(superBlock) == 0 || checkFileNameValid(filename) == 0)
+    {
+        return -1;
+    }
+
+    /*Error: file does not exist*/
+    pthread_mutex_lock(&dirLock);
+    int fileLocation = findFileEntry(filename);
+    if (fileLocation == -1)
     {
+        pthread_mutex_unlock(&dirLock);
         return -1;
     }
 
@@ -449,25 +4288,35 @@ int fs_open(const char *filename)
             fdArray[i].fd = i;
             fdArray[i].file_offset = 0;
             fdArray[i].empty = 1;
-            fdArray[i].open = 1;
+            fdArray[i].fileLocation = fileLocation;
+            openCount[fileLocation]++;
+            /*Set last, since file descriptors are looked up without the lock*/
+            __atomic_store_n(&fdArray[i].open, 1, __ATOMIC_RELEASE);
             fdToReturn = fdArray[i].fd;
-            file_open = true;
-
-            return fdToReturn;
+            break;
         }
     }
-    if (fdToReturn == -1)
-    {
-        return -1;
-    }
-    return -1;
+    pthread_mutex_unlock(&dirLock);
+
+    return fdToReturn;
 }
 
-int fs_close(int fd)
+int fs_open(const char *filename)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_open", 0);
+    int result = doOpen(filename);
+    trace_end(traceStart, FS_TRACE_OPEN, -1, 0, 0, filename, NULL, result);
+    return result;
+}
+
+int doClose(int fd)
 {
     /*Error: No FS currently mounted or file descriptor is invalid*/
+    pthread_mutex_lock(&dirLock);
     if (checkIfFileOpen(superBlock) == 0 || checkFileDescriptorValid(fd) == 0)
     {
+        pthread_mutex_unlock(&dirLock);
         return -1;
     }
 
@@ -480,15 +4329,25 @@ int fs_close(int fd)
     */
     strcpy(fdArray[fd].fileName, "");
     //fdArray[fd].fd = -1;
+    __atomic_store_n(&fdArray[fd].open, 0, __ATOMIC_RELEASE);
     fdArray[fd].file_offset = 0;
-    fdArray[fd].empty = true;
-    file_open = false;
-    fdArray[fd].open = 0;
+    fdArray[fd].empty = 0;
+    openCount[fdArray[fd].fileLocation]--;
+    pthread_mutex_unlock(&dirLock);
 
     return 0;
 }
 
-int fs_stat(int fd)
+int fs_close(int fd)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_close", fd);
+    int result = doClose(fd);
+    trace_end(traceStart, FS_TRACE_CLOSE, fd, 0, 0, NULL, NULL, result);
+    return result;
+}
+
+int doStat(int fd)
 {
     /*Error: No FS currently mounted or file descriptor is invalid*/
     if (checkIfFileOpen(superBlock) == 0 || checkFileDescriptorValid(fd) == 0)
@@ -496,28 +4355,28 @@ int fs_stat(int fd)
         return -1;
     }
 
-    int fdFileSize = -1;
-    for (int i = 0; i < FS_FILE_MAX_COUNT; i++)
-    {
-        if (!strcmp(fdArray[fd].fileName, rootDirectory[i].fileName))
-        {
-            fdFileSize = rootDirectory[i].sizeOfFile;
-            break;
-        }
-    }
-    if (fdFileSize == -1)
-    {
-        return -1;
-    }
+    int fileLocation = findFileLocation(fd);
+    pthread_rwlock_rdlock(&fileLocks[fileLocation]);
+    int fdFileSize = rootDirectory[fileLocation].sizeOfFile;
+    pthread_rwlock_unlock(&fileLocks[fileLocation]);
     return fdFileSize;
 }
 
-int fs_lseek(int fd, size_t offset)
+int fs_stat(int fd)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_stat", fd);
+    int result = doStat(fd);
+    trace_end(traceStart, FS_TRACE_STAT, fd, 0, 0, NULL, NULL, result);
+    return result;
+}
+
+int doLseek(int fd, size_t offset)
 {
 
     /*Error: No FS currently mounted, file descriptor is invalid,
         or offset is larger than current file size*/
-    if (checkIfFileOpen(superBlock) == 0 || checkFileDescriptorValid(fd) == 0 || offset > fs_stat(fd))
+    if (checkIfFileOpen(superBlock) == 0 || checkFileDescriptorValid(fd) == 0 || offset > doStat(fd))
     {
         return -1;
     }
@@ -527,242 +4386,419 @@ int fs_lseek(int fd, size_t offset)
     return 0;
 }
 
+int fs_lseek(int fd, size_t offset)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_lseek", fd);
+    int result = doLseek(fd, offset);
+    trace_end(traceStart, FS_TRACE_LSEEK, fd, offset, 0, NULL, NULL, result);
+    return result;
+}
+
+int doPwrite(int fd, void *buf, size_t count, size_t offset)
+{
+    /*Error: No FS currently mounted, file descriptor is invalid,
+        or @buf is NULL*/
+    if (checkIfFileOpen(superBlock) == 0 || checkFileDescriptorValid(fd) == 0 || buf == NULL)
+    {
+        return -1;
+    }
+
+    struct iovec iov = {.iov_base = buf, .iov_len = count};
+    return writeVector(fd, &iov, 1, offset);
+}
+
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_pwrite", count);
+    int result = doPwrite(fd, buf, count, offset);
+    trace_end(traceStart, FS_TRACE_PWRITE, fd, offset, count, NULL, NULL, result);
+    return result;
+}
+
+int doWrite(int fd, void *buf, size_t count)
+{
+    /*Error: No FS currently mounted, file descriptor is invalid,
+        or @buf is NULL*/
+    if (checkIfFileOpen(superBlock) == 0 || checkFileDescriptorValid(fd) == 0 || buf == NULL)
+    {
+        return -1;
+    }
+
+    int bytesWritten = doPwrite(fd, buf, count, fdArray[fd].file_offset);
+    if (bytesWritten > 0)
+    {
+        fdArray[fd].file_offset += bytesWritten;
+    }
+    return bytesWritten;
+}
+
 int fs_write(int fd, void *buf, size_t count)
 {
-    // /*Error: No FS currently mounted, file descriptor is invalid,
-    // 	or @buf is NULL*/
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_write", count);
+    size_t offset = traceStart ? fileOffset(fd) : 0;
+    int result = doWrite(fd, buf, count);
+    trace_end(traceStart, FS_TRACE_WRITE, fd, offset, count, NULL, NULL, result);
+    return result;
+}
+
+int doPread(int fd, void *buf, size_t count, size_t offset)
+{
+    /*Error: No FS currently mounted, file descriptor is invalid,
+        or @buf is NULL*/
     if (checkIfFileOpen(superBlock) == 0 || checkFileDescriptorValid(fd) == 0 || buf == NULL)
     {
         return -1;
     }
 
-    // /*Find the location of the file in the root directory to access its attributes */
-    int fileLocation = findFileLocation(fd);
+    struct iovec iov = {.iov_base = buf, .iov_len = count};
+    return readVector(fd, &iov, 1, offset);
+}
 
-    /*Buffer to temporarily hold data that is going to be written to the file*/
-    char bounceBuf[BLOCK_SIZE];
-    int bounceBufOffSet = fdArray[fd].file_offset % BLOCK_SIZE;
-    int currBlockNum = fdArray[fd].file_offset / BLOCK_SIZE;
+int fs_pread(int fd, void *buf, size_t count, size_t offset)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_pread", count);
+    int result = doPread(fd, buf, count, offset);
+    trace_end(traceStart, FS_TRACE_PREAD, fd, offset, count, NULL, NULL, result);
+    return result;
+}
+
+int doRead(int fd, void *buf, size_t count)
+{
+    /*Error: No FS currently mounted, file descriptor is invalid,
+        or @buf is NULL*/
+    if (checkIfFileOpen(superBlock) == 0 || checkFileDescriptorValid(fd) == 0 || buf == NULL)
+    {
+        return -1;
+    }
+
+    int bytesRead = doPread(fd, buf, count, fdArray[fd].file_offset);
+    if (bytesRead > 0)
+    {
+        fdArray[fd].file_offset += bytesRead;
+    }
+    return bytesRead;
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_read", count);
+    size_t offset = traceStart ? fileOffset(fd) : 0;
+    int result = doRead(fd, buf, count);
+    trace_end(traceStart, FS_TRACE_READ, fd, offset, count, NULL, NULL, result);
+    return result;
+}
+
+int doWritev(int fd, const struct iovec *iov, int iovcnt)
+{
+    /*Error: No FS currently mounted, file descriptor is invalid,
+        or @iov is invalid*/
+    if (checkIfFileOpen(superBlock) == 0 || checkFileDescriptorValid(fd) == 0 || iovcnt < 0 || (iov == NULL && iovcnt > 0))
+    {
+        return -1;
+    }
+
+    int bytesWritten = writeVector(fd, iov, iovcnt, fdArray[fd].file_offset);
+    if (bytesWritten > 0)
+    {
+        fdArray[fd].file_offset += bytesWritten;
+    }
+    return bytesWritten;
+}
 
-    /*C. curFatBlockIndex*/
-    int currentFATBlockIndex = findCurFatBlockIndex(fileLocation, currBlockNum);
+int fs_writev(int fd, const struct iovec *iov, int iovcnt)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_writev", fd);
+    size_t offset = traceStart ? fileOffset(fd) : 0;
+    int result = doWritev(fd, iov, iovcnt);
+    trace_end(traceStart, FS_TRACE_WRITEV, fd, offset, vectorLength(iov, iovcnt), NULL, NULL, result);
+    return result;
+}
+
+int doReadv(int fd, const struct iovec *iov, int iovcnt)
+{
+    /*Error: No FS currently mounted, file descriptor is invalid,
+        or @iov is invalid*/
+    if (checkIfFileOpen(superBlock) == 0 || checkFileDescriptorValid(fd) == 0 || iovcnt < 0 || (iov == NULL && iovcnt > 0))
+    {
+        return -1;
+    }
 
-    /*Buffer from where we are getting the data to write to the file*/
-    char *writeBuf = (char *)buf;
+    int bytesRead = readVector(fd, iov, iovcnt, fdArray[fd].file_offset);
+    if (bytesRead > 0)
+    {
+        fdArray[fd].file_offset += bytesRead;
+    }
+    return bytesRead;
+}
 
-    /*Find size of the file and the file's offset with @fd*/
-    int fileSize = rootDirectory[fileLocation].sizeOfFile;
-    int fileOffset = fdArray[fd].file_offset;
-    int freeSpaceOnBlock = BLOCK_SIZE - fileSize;
+int fs_readv(int fd, const struct iovec *iov, int iovcnt)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_readv", fd);
+    size_t offset = traceStart ? fileOffset(fd) : 0;
+    int result = doReadv(fd, iov, iovcnt);
+    trace_end(traceStart, FS_TRACE_READV, fd, offset, vectorLength(iov, iovcnt), NULL, NULL, result);
+    return result;
+}
 
-    int totalBytesWritten = 0;
-    int numOfBlocksToWrite = (count / BLOCK_SIZE) + 1; // new data blocks to allocate
-    int bytesToWrite = 0;
-    int bytesLeftToWrite = count;
-    int nextEmptyFatIndex = emptyFATIndex();
-    int spaceOnDisk = totalEmptyFATBlocks(); // total empty FAT blocks
-    int firstFileOffSet = fileOffset;
+/*Points buffers at the file's content in place, with the file's lock held by the
+    caller: nothing keeps the blocks for the file once the lock is dropped*/
+int viewFile(int fileLocation, size_t offset, size_t count, struct iovec **iov, int *iovcnt)
+{
+    /*Error: compressed data cannot be viewed in place*/
+    if (isCompressedFile(fileLocation))
+    {
+        return -1;
+    }
 
-    /*Step to take when there is no more space left on the file, so need to extend it*/
-    if (currentFATBlockIndex == FAT_EOC)
+    size_t fileSize = rootDirectory[fileLocation].sizeOfFile;
+    size_t countOfBytesToView = 0;
+    if (offset < fileSize)
     {
-        /*set the current FAT block index to the next empty FAT index*/
-        currentFATBlockIndex = nextEmptyFatIndex;
-        rootDirectory[fileLocation].firstIndex = nextEmptyFatIndex;
-        if (count == 0)
-        {
-            rootDirectory[fileLocation].firstIndex = FAT_EOC;
-        }
+        countOfBytesToView = fileSize - offset;
+    }
+    if (countOfBytesToView > count)
+    {
+        countOfBytesToView = count;
     }
 
-    /*Makes sure that the number of blocks to write is in boundary of space on the disk*/
-    if (numOfBlocksToWrite > spaceOnDisk)
+    /*At most one buffer per block spanned by the view*/
+    struct iovec *views = malloc(sizeof(struct iovec) * (countOfBytesToView / BLOCK_SIZE + 2));
+    if (views == NULL)
     {
-        numOfBlocksToWrite = spaceOnDisk;
+        return -1;
     }
+    int numViews = 0;
 
-    /*Write to file block by block*/
-    for (int i = 0; i < numOfBlocksToWrite; i++)
+    /*Inline files are viewed directly in the small-file area*/
+    if (isInlineFile(fileLocation) && countOfBytesToView > 0)
     {
-        /*file's offset is not aligned to the beginning of the block*/
-        if ((fileOffset > 0) && (bytesLeftToWrite == count))
-        {
-            bytesToWrite = freeSpaceOnBlock;
-            block_read(currentFATBlockIndex, bounceBuf);
-            memcpy(bounceBuf + bounceBufOffSet, writeBuf, bytesToWrite);
-            block_write(currentFATBlockIndex + superBlock->dataBlockStartIndex, bounceBuf);
+        views[numViews].iov_base = inlineSlot(fileLocation) + offset;
+        views[numViews].iov_len = countOfBytesToView;
+        numViews++;
+    }
 
-            bytesLeftToWrite -= bytesToWrite;
-            totalBytesWritten += bytesToWrite;
-            fileOffset += bytesToWrite;
+    size_t tailStart = fileSize - (fileSize % BLOCK_SIZE);
+    if (!hasPackedTail(fileLocation))
+    {
+        tailStart = fileSize;
+    }
+    int currentFATBlockIndex = findCurFatBlockIndex(fileLocation, offset / BLOCK_SIZE);
 
-            /*Set the current FAT block's next pointer to the next empty FAT block, if there is more bytes left to write*/
-            if (bytesLeftToWrite != 0)
-            {
-                nextEmptyFatIndex = emptyFATIndex();
-                fatArray[currentFATBlockIndex].next = nextEmptyFatIndex;
-                currentFATBlockIndex = fatArray[currentFATBlockIndex].next;
-            }
-            else /*Sets current FAT block's next pointer to EOC*/
-            {
-                nextEmptyFatIndex = FAT_EOC;
-                fatArray[currentFATBlockIndex].next = nextEmptyFatIndex;
-            }
-            break;
+    size_t numBytesViewed = 0;
+    while (!isInlineFile(fileLocation) && numBytesViewed < countOfBytesToView)
+    {
+        size_t blockOffset = offset % BLOCK_SIZE;
+        size_t bytesToView = BLOCK_SIZE - blockOffset;
+        if (bytesToView > countOfBytesToView - numBytesViewed)
+        {
+            bytesToView = countOfBytesToView - numBytesViewed;
         }
 
-        /*In case of the need to write partially to the block, and not in entirety*/
-        if (bytesLeftToWrite < BLOCK_SIZE)
+        int block;
+        if (offset >= tailStart)
+        {
+            block = rootDirectory[fileLocation].tailIndex;
+            blockOffset += rootDirectory[fileLocation].tailFragment * FRAGMENT_SIZE;
+        }
+        else if (currentFATBlockIndex == -1 || currentFATBlockIndex == FAT_EOC)
         {
-            memcpy(bounceBuf, writeBuf, bytesLeftToWrite);
-            block_write(currentFATBlockIndex + superBlock->dataBlockStartIndex, bounceBuf);
-
-            totalBytesWritten += bytesLeftToWrite;
-            fileOffset += bytesLeftToWrite;
-            bytesLeftToWrite -= bytesLeftToWrite;
-
-            nextEmptyFatIndex = FAT_EOC;
-            fatArray[currentFATBlockIndex].next = nextEmptyFatIndex;
             break;
         }
+        else
+        {
+            block = currentFATBlockIndex;
+            currentFATBlockIndex = fatArray[currentFATBlockIndex].next;
+        }
 
-        /*files's offset is aligned perfectly to the beginning of the block
-         AND bytesLeftToWrite is greater than or equal to BLOCK_SIZE*/
-        memcpy(bounceBuf, writeBuf, BLOCK_SIZE);
-        block_write(currentFATBlockIndex + superBlock->dataBlockStartIndex, bounceBuf);
-
-        bytesLeftToWrite -= BLOCK_SIZE;
-        totalBytesWritten += BLOCK_SIZE;
-        fileOffset += BLOCK_SIZE;
+        bool lockBlock = offset >= tailStart && checksumArray != NULL;
+        if (lockBlock)
+        {
+            pthread_mutex_lock(&allocLock);
+        }
+        const char *blockView = block_view(dataBlock(block));
+        bool blockValid = blockView != NULL && verifyChecksums(block, blockView, 1);
+        if (lockBlock)
+        {
+            pthread_mutex_unlock(&allocLock);
+        }
+        if (!blockValid)
+        {
+            free(views);
+            return -1;
+        }
 
-        /*Set the current FAT block's next pointer to the next empty FAT block, if there is more bytes left to write*/
-        if (bytesLeftToWrite != 0)
+        /*Blocks that follow each other on disk extend the previous buffer*/
+        if (numViews > 0 && (char *)views[numViews - 1].iov_base + views[numViews - 1].iov_len == blockView + blockOffset)
         {
-            fatArray[currentFATBlockIndex].next = 1;
-            nextEmptyFatIndex = emptyFATIndex();
-            fatArray[currentFATBlockIndex].next = nextEmptyFatIndex;
-            currentFATBlockIndex = fatArray[currentFATBlockIndex].next;
+            views[numViews - 1].iov_len += bytesToView;
         }
-        else /*Sets current FAT block's next pointer to EOC*/
+        else
         {
-            nextEmptyFatIndex = FAT_EOC;
-            fatArray[currentFATBlockIndex].next = nextEmptyFatIndex;
+            views[numViews].iov_base = (void *)(blockView + blockOffset);
+            views[numViews].iov_len = bytesToView;
+            numViews++;
         }
+
+        numBytesViewed += bytesToView;
+        offset += bytesToView;
+    }
+    if (isInlineFile(fileLocation))
+    {
+        numBytesViewed = countOfBytesToView;
     }
-    currentFATBlockIndex = fatArray[currentFATBlockIndex].next;
-    rootDirectory[fileLocation].sizeOfFile = firstFileOffSet + totalBytesWritten;
 
-    return totalBytesWritten;
+    *iov = views;
+    *iovcnt = numViews;
+    return numBytesViewed;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+int fs_read_view(int fd, size_t offset, size_t count, struct iovec **iov, int *iovcnt, uint64_t *generation)
 {
     /*Error: No FS currently mounted, file descriptor is invalid,
-        or @buf is NULL*/
-    if (checkIfFileOpen(superBlock) == 0 || checkFileDescriptorValid(fd) == 0 || buf == NULL)
+        or @iov, @iovcnt or @generation is NULL*/
+    if (checkIfFileOpen(superBlock) == 0 || checkFileDescriptorValid(fd) == 0 || iov == NULL || iovcnt == NULL ||
+        generation == NULL)
     {
         return -1;
     }
 
-    /*Find the location of the file in the root directory to access its attributes */
+    /*Writers advance the generation with the file locked, so the one read here
+        is the generation of the content the view points at*/
     int fileLocation = findFileLocation(fd);
+    pthread_rwlock_rdlock(&fileLocks[fileLocation]);
+    int numBytesViewed = viewFile(fileLocation, offset, count, iov, iovcnt);
+    *generation = __atomic_load_n(&fileGenerations[fileLocation], __ATOMIC_ACQUIRE);
+    pthread_rwlock_unlock(&fileLocks[fileLocation]);
 
-    /*Check actually what is the number of bytes to be read because of the file offset position
-        a. Smaller than @count
-        b. Exactly @count
-    */
-    int countOfBytesToRead = 0;
-    if (fdArray[fd].file_offset + count > rootDirectory[fileLocation].sizeOfFile)
+    if (numBytesViewed == -1)
     {
-        countOfBytesToRead = abs(rootDirectory[fileLocation].sizeOfFile - fdArray[fd].file_offset);
+        return -1;
     }
-    else
+    __atomic_add_fetch(&activeViews, 1, __ATOMIC_RELAXED);
+    return numBytesViewed;
+}
+
+int fs_release_view(struct iovec *iov)
+{
+    /*Error: @iov is NULL*/
+    if (iov == NULL)
     {
-        countOfBytesToRead = count;
+        return -1;
     }
 
-    /*Create bounce buffer*/
-    char bounceBuf[BLOCK_SIZE];
-    char *readBuf = (char *)buf;
-    int bounceBufOffSet = fdArray[fd].file_offset % BLOCK_SIZE;
-    int currBlockNum = fdArray[fd].file_offset / BLOCK_SIZE;
+    free(iov);
+    __atomic_sub_fetch(&activeViews, 1, __ATOMIC_RELAXED);
+    return 0;
+}
 
-    /*Find current FAT block index*/
-    int currentFATBlockIndex = findCurFatBlockIndex(fileLocation, currBlockNum);
+int fs_generation(int fd, int *slot, uint64_t *generation)
+{
+    /*Error: No FS currently mounted, file descriptor is invalid,
+        or @slot or @generation is NULL*/
+    if (checkIfFileOpen(superBlock) == 0 || checkFileDescriptorValid(fd) == 0 || slot == NULL || generation == NULL)
+    {
+        return -1;
+    }
 
-    /*Variable to store the number of bytes actually read*/
-    int numBytesRead = 0;
-    int numOfBlocksToRead = (countOfBytesToRead / BLOCK_SIZE) + 1;
+    *slot = findFileLocation(fd);
+    *generation = __atomic_load_n(&fileGenerations[*slot], __ATOMIC_ACQUIRE);
+    return 0;
+}
+
+int fs_generation_fd(void)
+{
+    /*Error: No FS currently mounted*/
+    if (checkIfFileOpen(superBlock) == 0)
+    {
+        return -1;
+    }
+    return generationFd;
+}
 
-    if (countOfBytesToRead <= BLOCK_SIZE) // reading from a single block
+int doSendfile(int fd, int hostFd, size_t offset, size_t count)
+{
+    /*Error: No FS currently mounted, file descriptor is invalid,
+        or @hostFd is invalid*/
+    if (checkIfFileOpen(superBlock) == 0 || checkFileDescriptorValid(fd) == 0 || hostFd < 0)
     {
-        block_read(currentFATBlockIndex + superBlock->dataBlockStartIndex, bounceBuf);
-        memcpy(readBuf, bounceBuf + bounceBufOffSet, countOfBytesToRead);
-        numBytesRead += countOfBytesToRead;
-        fdArray[fd].file_offset += countOfBytesToRead;
+        return -1;
     }
-    else if (countOfBytesToRead > BLOCK_SIZE) // reading from multiple blocks
+
+    int fileLocation = findFileLocation(fd);
+    char *bounce = NULL;
+    size_t bytesSent = 0;
+    bool failed = false;
+    while (bytesSent < count && !failed)
     {
-        int firstLoopEntered = 0;
+        size_t bytesToSend = count - bytesSent;
+        if (bytesToSend > SEND_BLOCKS * BLOCK_SIZE)
+        {
+            bytesToSend = SEND_BLOCKS * BLOCK_SIZE;
+        }
+
+        /*The file stays locked while a chunk is sent from its blocks in place,
+            so that writers cannot change or free them under the kernel's copy*/
+        struct iovec *views;
+        int numViews;
+        pthread_rwlock_rdlock(&fileLocks[fileLocation]);
+        int bytesViewed = viewFile(fileLocation, offset + bytesSent, bytesToSend, &views, &numViews);
 
-        /*All blocks are read in entirety except maybe for the last one*/
-        if (fdArray[fd].file_offset == 0)
+        /*Compressed files have no view, they go through a bounce buffer*/
+        if (bytesViewed == -1)
         {
-            firstLoopEntered = 1;
-            for (int i = 0; i < numOfBlocksToRead; i++)
+            pthread_rwlock_unlock(&fileLocks[fileLocation]);
+            if (bounce == NULL && (bounce = malloc(SEND_BLOCKS * BLOCK_SIZE)) == NULL)
             {
-                /*Reads from the last block*/
-                if (countOfBytesToRead < BLOCK_SIZE)
-                {
-                    // printf("Read CP10\n");
-                    char *endBuff[countOfBytesToRead - 1];
-                    block_read(currentFATBlockIndex + superBlock->dataBlockStartIndex, endBuff);
-                    memcpy(readBuf, endBuff, countOfBytesToRead);
-                    numBytesRead += countOfBytesToRead;
-                    fdArray[fd].file_offset += countOfBytesToRead;
-                    break;
-                }
-
-                /*Reads from all blocks except the last*/
-                block_read(currentFATBlockIndex + superBlock->dataBlockStartIndex, readBuf);
-                numBytesRead += BLOCK_SIZE;
-                fdArray[fd].file_offset += BLOCK_SIZE;
-                countOfBytesToRead = abs(countOfBytesToRead - BLOCK_SIZE);  // 9000-4096 = 904
-                currentFATBlockIndex = fatArray[currentFATBlockIndex].next; // block 2
+                break;
+            }
+            int bytesRead = doPread(fd, bounce, bytesToSend, offset + bytesSent);
+            if (bytesRead <= 0)
+            {
+                break;
             }
+            size_t written = writeHost(hostFd, bounce, bytesRead);
+            bytesSent += written;
+            failed = written < (size_t)bytesRead;
+            continue;
         }
 
-        /*First block (and maybe the last block) is read partially */
-        if (fdArray[fd].file_offset > 0 && firstLoopEntered == 0)
+        for (int i = 0; i < numViews && !failed; i++)
         {
-            /*First block read partially*/
-            block_read(currentFATBlockIndex + superBlock->dataBlockStartIndex, bounceBuf);
-            numBytesRead = BLOCK_SIZE - bounceBufOffSet;
-            memcpy(readBuf, bounceBuf + bounceBufOffSet, numBytesRead);
-            currentFATBlockIndex = fatArray[currentFATBlockIndex].next;
-            fdArray[fd].file_offset += numBytesRead;
-            countOfBytesToRead = countOfBytesToRead - numBytesRead;
-
-            /*Rest of the blocks being ready in entirety except maybe for the last one*/
-            for (int i = 0; i < numOfBlocksToRead; i++)
-            {
-                block_read(currentFATBlockIndex + superBlock->dataBlockStartIndex, readBuf);
-                numBytesRead += BLOCK_SIZE;
-                currentFATBlockIndex = fatArray[currentFATBlockIndex].next;
-                fdArray[fd].file_offset += BLOCK_SIZE;
-                countOfBytesToRead = countOfBytesToRead - numBytesRead;
-
-                /*If the last block is not read in entirety*/
-                if (countOfBytesToRead < BLOCK_SIZE)
-                {
-                    block_read(currentFATBlockIndex + superBlock->dataBlockStartIndex, bounceBuf);
-                    memcpy(readBuf, bounceBuf + bounceBufOffSet, countOfBytesToRead);
-                    numBytesRead += countOfBytesToRead;
-                    fdArray[fd].file_offset += countOfBytesToRead;
-                } // end if
+            size_t sent = sendView(&views[i], hostFd);
+            bytesSent += sent;
+            failed = sent < views[i].iov_len;
+        }
+        free(views);
+        pthread_rwlock_unlock(&fileLocks[fileLocation]);
 
-            } // end for
+        /*End of file*/
+        if (bytesViewed < bytesToSend)
+        {
+            break;
         }
     }
-    return numBytesRead;
+    free(bounce);
+
+    /*Error: nothing could be written to @hostFd*/
+    if (failed && bytesSent == 0)
+    {
+        return -1;
+    }
+    return bytesSent;
+}
+
+int fs_sendfile(int fd, int hostFd, size_t offset, size_t count)
+{
+    uint64_t traceStart = trace_begin();
+    TP_SCOPE("op", "fs_sendfile", count);
+    int result = doSendfile(fd, hostFd, offset, count);
+    trace_end(traceStart, FS_TRACE_SENDFILE, fd, offset, count, NULL, NULL, result);
+    return result;
 }
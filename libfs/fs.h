@@ -2,6 +2,8 @@
 #define _FS_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h> /* for uint64_t definition */
+#include <sys/uio.h> /* for struct iovec definition */
 
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
@@ -12,6 +14,47 @@
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** Asynchronous operation types, see fs_submit() */
+enum {
+	FS_OP_READ,	/* fs_pread(fd, buf, count, offset) */
+	FS_OP_WRITE,	/* fs_pwrite(fd, buf, count, offset) */
+	FS_OP_CREATE,	/* fs_create(filename) */
+	FS_OP_DELETE,	/* fs_delete(filename) */
+	FS_OP_OPEN,	/* fs_open(filename) */
+	FS_OP_CLOSE,	/* fs_close(fd) */
+	FS_OP_STAT,	/* fs_stat(fd) */
+	FS_OP_SYNC,	/* fs_sync() */
+};
+
+/** Asynchronous operation, see fs_submit() */
+struct fs_op {
+	int type;		/* Operation type (FS_OP_*) */
+	int fd;			/* File descriptor */
+	const char *filename;	/* File name */
+	void *buf;		/* Data buffer */
+	size_t count;		/* Number of bytes to transfer */
+	size_t offset;		/* File offset of the transfer */
+	void *user_data;	/* Left untouched, for the caller's use */
+	int result;		/* Return value of the operation, once completed */
+	/* Private to the worker pool */
+	struct fs_op *next;
+	struct fs_op *sync;
+	int pending;
+};
+
+/** Directory stream, see fs_opendir() */
+struct fs_dir {
+	int pos;	/* Next root directory entry to look at */
+};
+
+/** Directory entry, see fs_readdir() */
+struct fs_dirent {
+	char name[FS_FILENAME_LEN];	/* NULL-terminated file name */
+	size_t size;			/* File size in bytes */
+	int first_block;		/* First physical data block, or -1 */
+	int extent_count;		/* Number of contiguous data block runs */
+};
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -20,6 +63,10 @@
  * contains. A file system needs to be mounted before files can be read from it
  * with fs_read() or written to it with fs_write().
  *
+ * Once mounted, the file system can be used from several threads at the same
+ * time. fs_mount() and fs_umount() themselves must not run concurrently with
+ * any other call.
+ *
  * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
  * file system can be located. 0 otherwise.
  */
@@ -36,6 +83,107 @@ int fs_mount(const char *diskname);
  */
 int fs_umount(void);
 
+/**
+ * fs_sync - Make metadata updates durable
+ *
+ * Commit all the metadata updates performed since the last commit (file
+ * creations, deletions, and size or block changes caused by writes) to the
+ * metadata journal of the mounted file system, and flush them to the virtual
+ * disk with a single flush operation. Journaled updates are replayed at the
+ * next fs_mount() if the file system was not unmounted cleanly.
+ *
+ * Other calls return before their metadata updates are durable: only fs_sync()
+ * and fs_umount() guarantee it. To bound what a crash loses, every 32nd
+ * metadata operation since the last commit also has the pending updates
+ * committed in the background. Commits are made by a thread of the mounted
+ * file system, which serves all the fs_sync() calls made while it commits with
+ * a single commit, and checkpoints the journal into the FAT and root directory
+ * once it is half full after they return.
+ *
+ * Return: -1 if no FS is currently mounted, or if the updates could not be
+ * written to the virtual disk. 0 otherwise.
+ */
+int fs_sync(void);
+
+/**
+ * fs_dedup - Enable or disable block deduplication
+ * @enable: Whether data blocks written from now on should be deduplicated
+ *
+ * When deduplication is enabled, every data block written to a file is hashed
+ * and shared with an existing block of identical content, if any. Shared blocks
+ * are copied on write when one of the files using them is modified. The setting
+ * is stored in the mounted file system. Disabling deduplication keeps the
+ * blocks already shared, but stops sharing new ones.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is not enough space
+ * left on the disk for the deduplication table. 0 otherwise.
+ */
+int fs_dedup(int enable);
+
+/**
+ * fs_checksum - Enable or disable data block checksums
+ * @enable: Whether the data blocks of the files should be checksummed
+ *
+ * When checksums are enabled, the CRC32C of every data block of the files is
+ * kept in a checksum table, updated whenever the block is written. Every block
+ * read from the disk is checked against its checksum, so that corruption is
+ * caught whenever it happens. Reads stop short before a block that does not
+ * match its checksum, and fs_info() counts such blocks. Checksums are committed
+ * with the rest of the metadata, so after a crash, blocks written since the
+ * last commit may fail their checksum. Enabling checksums reads every data
+ * block in use once, and waits for the operations in progress in other threads
+ * to finish. The setting is stored in the mounted file system.
+ *
+ * Return: -1 if no FS is currently mounted, if it is mounted read-only, or if
+ * there is not enough space left on the disk for the checksum table. 0
+ * otherwise.
+ */
+int fs_checksum(int enable);
+
+/**
+ * fs_snapshot - Take a snapshot of the file system
+ * @name: Snapshot name
+ *
+ * Record the current state of all the files of the mounted file system under
+ * @name. Only the metadata of the file system is copied: the data blocks are
+ * shared with the snapshot, and copied on write when a file using them is
+ * modified afterwards. Taking a snapshot waits for the operations in progress
+ * in other threads to finish. String @name follows the same rules as file
+ * names.
+ *
+ * Return: -1 if no FS is currently mounted, if the FS is a mounted snapshot,
+ * if @name is invalid or already used by a snapshot, or if there is not enough
+ * space left on the disk for the snapshot. 0 otherwise.
+ */
+int fs_snapshot(const char *name);
+
+/**
+ * fs_snapshot_delete - Delete a snapshot
+ * @name: Snapshot name
+ *
+ * Delete the snapshot named @name of the mounted file system, and free the data
+ * blocks no longer used by the files or by another snapshot.
+ *
+ * Return: -1 if no FS is currently mounted, if the FS is a mounted snapshot,
+ * or if there is no snapshot named @name. 0 otherwise.
+ */
+int fs_snapshot_delete(const char *name);
+
+/**
+ * fs_mount_snapshot - Mount a snapshot of a file system
+ * @diskname: Name of the virtual disk file
+ * @name: Snapshot name
+ *
+ * Mount the snapshot named @name of the file system contained in the virtual
+ * disk file @diskname, as it was when the snapshot was taken. The snapshot is
+ * read-only: creating, deleting or writing files fails until it is unmounted
+ * with fs_umount().
+ *
+ * Return: -1 if the virtual disk cannot be mounted, or if it has no snapshot
+ * named @name. 0 otherwise.
+ */
+int fs_mount_snapshot(const char *diskname, const char *name);
+
 /**
  * fs_info - Display information about file system
  *
@@ -73,6 +221,39 @@ int fs_create(const char *filename);
  */
 int fs_delete(const char *filename);
 
+/**
+ * fs_copy - Copy a file
+ * @src: Name of the file to copy
+ * @dst: Name of the new file
+ * @reflink: Whether to share the data blocks of @src instead of copying them
+ *
+ * Create a new file named @dst with the same content as file @src. The content
+ * is copied inside the file system, several blocks at a time. If @reflink is
+ * set, no data is copied at all: the new file shares the data blocks of @src,
+ * and either file gets its own copy of a shared block when it writes to it.
+ *
+ * Return: -1 if no FS is currently mounted, if @src or @dst is invalid, if
+ * there is no file named @src, if a file named @dst already exists, or if there
+ * is not enough space left on the disk for the copy. 0 otherwise.
+ */
+int fs_copy(const char *src, const char *dst, int reflink);
+
+/**
+ * fs_compress - Enable or disable compression of a file
+ * @filename: File name
+ * @enable: Whether the content of the file should be compressed
+ *
+ * Set whether the data written to file @filename is compressed. A compressed
+ * file is split into chunks of a few blocks, each compressed on its own, so that
+ * reading part of the file only decompresses the chunks covering it. Chunks
+ * that do not compress are stored as they are. The setting can only change
+ * while the file is empty, and copies made with fs_copy() inherit it.
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
+ * there is no file named @filename, or if the file is not empty. 0 otherwise.
+ */
+int fs_compress(const char *filename, int enable);
+
 /**
  * fs_ls - List files on file system
  *
@@ -82,6 +263,44 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_opendir - Open the root directory for iteration
+ * @dir: Directory stream to initialize
+ *
+ * Initialize the caller-provided directory stream @dir so that subsequent calls
+ * to fs_readdir() enumerate the files of the root directory. No memory is
+ * allocated by the directory stream functions.
+ *
+ * Return: -1 if no FS is currently mounted, or if @dir is NULL. 0 otherwise.
+ */
+int fs_opendir(struct fs_dir *dir);
+
+/**
+ * fs_readdir - Read the next entry of the root directory
+ * @dir: Directory stream
+ * @entry: Directory entry to be filled
+ *
+ * Fill @entry with the name, size, first data block and extent count of the
+ * next file of directory stream @dir. Files stored without a data block of
+ * their own (e.g., empty or very small files) have a @first_block of -1.
+ * @first_block is the physical index of the block within the data region,
+ * which deduplication, reflinks or snapshots may make differ from the file's
+ * first FAT entry. The extent count is the number of contiguous runs of blocks or fragments holding
+ * the file's content.
+ *
+ * Return: -1 if no FS is currently mounted, or if @dir or @entry is NULL. 0 if
+ * the end of the directory has been reached. 1 otherwise.
+ */
+int fs_readdir(struct fs_dir *dir, struct fs_dirent *entry);
+
+/**
+ * fs_closedir - Close a directory stream
+ * @dir: Directory stream
+ *
+ * Return: -1 if @dir is NULL. 0 otherwise.
+ */
+int fs_closedir(struct fs_dir *dir);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -171,6 +390,9 @@ int fs_write(int fd, void *buf, size_t count);
  * descriptor @fd into buffer pointer by @buf. It is assumed that @buf is large
  * enough to hold at least @count bytes.
  *
+ * Threads sharing a file descriptor should use fs_pread() instead, as the
+ * update of the shared file offset is not atomic.
+ *
  * The number of bytes read can be smaller than @count if there are less than
  * @count bytes until the end of the file (it can even be 0 if the file offset
  * is at the end of the file). The file offset of the file descriptor is
@@ -182,4 +404,291 @@ int fs_write(int fd, void *buf, size_t count);
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/**
+ * fs_pwrite - Write to a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to write in the file
+ * @count: Number of bytes of data to be written
+ * @offset: File offset at which to start writing
+ *
+ * Same as fs_write(), except that the data is written at offset @offset of the
+ * file and that the file offset of the file descriptor is left unchanged.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if
+ * @offset is larger than the current file size. Otherwise return the number of
+ * bytes actually written.
+ */
+int fs_pwrite(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_pread - Read from a file at a given offset
+ * @fd: File descriptor
+ * @buf: Data buffer to be filled with data
+ * @count: Number of bytes of data to be read
+ * @offset: File offset at which to start reading
+ *
+ * Same as fs_read(), except that the data is read from offset @offset of the
+ * file and that the file offset of the file descriptor is left unchanged. The
+ * number of bytes read is 0 if @offset is at or past the end of the file.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
+ * return the number of bytes actually read.
+ */
+int fs_pread(int fd, void *buf, size_t count, size_t offset);
+
+/**
+ * fs_writev - Write to a file from several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers holding the data to write in the file
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_write(), except that the data is taken from the @iovcnt buffers
+ * of @iov one after the other, as if they were a single buffer. Blocks that
+ * span several buffers are written whole rather than updated piece by piece.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iovcnt is negative, or
+ * if @iov is NULL while @iovcnt is not 0. Otherwise return the number of bytes
+ * actually written.
+ */
+int fs_writev(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_readv - Read from a file into several buffers
+ * @fd: File descriptor
+ * @iov: Array of buffers to be filled with data
+ * @iovcnt: Number of buffers in @iov
+ *
+ * Same as fs_read(), except that the data is stored in the @iovcnt buffers of
+ * @iov one after the other, as if they were a single buffer.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iovcnt is negative, or
+ * if @iov is NULL while @iovcnt is not 0. Otherwise return the number of bytes
+ * actually read.
+ */
+int fs_readv(int fd, const struct iovec *iov, int iovcnt);
+
+/**
+ * fs_sendfile - Send file content to a host file descriptor
+ * @fd: File descriptor
+ * @host_fd: Host file descriptor to write to, at its current file offset
+ * @offset: File offset of the first byte to send
+ * @count: Number of bytes to send
+ *
+ * Write up to @count bytes of the file referenced by file descriptor @fd,
+ * starting at @offset, to host file descriptor @host_fd, a bounded chunk at a
+ * time. Contiguous data blocks are copied by the kernel straight from the
+ * virtual disk file (see block_send()); compressed files are decompressed
+ * through a buffer. The file offset of @fd is left unchanged.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @host_fd is negative,
+ * or if nothing could be written to @host_fd. Otherwise return the number of
+ * bytes sent, which can be smaller than @count if the end of the file is
+ * reached or if writing to @host_fd fails.
+ */
+int fs_sendfile(int fd, int host_fd, size_t offset, size_t count);
+
+/**
+ * fs_read_view - Get a zero-copy view of file content
+ * @fd: File descriptor
+ * @offset: File offset of the first byte to view
+ * @count: Number of bytes to view
+ * @iov: Pointer to be set to the view's array of buffers
+ * @iovcnt: Pointer to be set to the number of buffers in @iov
+ * @generation: Pointer to be set to the generation of the viewed content
+ *
+ * Get borrowed pointers to up to @count bytes of the file referenced by file
+ * descriptor @fd, starting at @offset, directly in the mapping of the virtual
+ * disk or in the file system's metadata, without copying them. Contiguous data
+ * blocks are described by a single buffer. The file offset of @fd is left
+ * unchanged. The buffers must not be modified.
+ *
+ * A view pins nothing. As soon as this function returns, writers can change
+ * the buffers, or free the blocks under them and give them to other files, so
+ * what they hold can only be trusted once copied out and checked: the copy is
+ * the file's content if fs_generation() still returns @generation afterwards,
+ * and must be discarded otherwise. The buffers themselves
+ * stay addressable until the view is released with fs_release_view(), which
+ * must happen before the file system is unmounted.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @iov, @iovcnt or
+ * @generation is NULL, or if the file is compressed, or if the view cannot be
+ * created. Otherwise return the number of bytes covered by the view, which can
+ * be smaller than @count if the end of the file is reached.
+ */
+int fs_read_view(int fd, size_t offset, size_t count, struct iovec **iov,
+		 int *iovcnt, uint64_t *generation);
+
+/**
+ * fs_release_view - Release a zero-copy view of file content
+ * @iov: Array of buffers obtained from fs_read_view()
+ *
+ * Free the array of buffers of a view. This keeps nothing alive: the blocks
+ * of the view were never held, see fs_read_view().
+ *
+ * Return: -1 if @iov is NULL. 0 otherwise.
+ */
+int fs_release_view(struct iovec *iov);
+
+/**
+ * fs_generation - Get the generation of an open file
+ * @fd: File descriptor
+ * @slot: Pointer to be set to the index of the file in the generation table
+ * @generation: Pointer to be set to the file's generation
+ *
+ * The generation of a file is advanced before any change to its content or to
+ * the data blocks it uses, and when a file system is mounted. A copy made from
+ * the buffers of fs_read_view() holds the file's content if the generation,
+ * read again after copying, is still the one the view was taken at.
+ *
+ * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
+ * invalid (out of bounds or not currently open), or if @slot or @generation is
+ * NULL. 0 otherwise.
+ */
+int fs_generation(int fd, int *slot, uint64_t *generation);
+
+/**
+ * fs_generation_fd - Get the memory file holding the generation table
+ *
+ * Get a descriptor of the memory file holding the generations of all files
+ * (%FS_FILE_MAX_COUNT 64-bit counters, indexed by the slots of
+ * fs_generation()), for another process reading views of the files through its
+ * own mapping of the virtual disk to map it read-only. The descriptor belongs
+ * to libfs and must not be closed.
+ *
+ * Return: -1 if no FS is currently mounted, or if the table could not be put
+ * in a memory file. Otherwise return the descriptor.
+ */
+int fs_generation_fd(void);
+
+/**
+ * fs_async_start - Start the asynchronous operation workers
+ * @workers: Number of worker threads
+ *
+ * Start a pool of @workers threads running the operations submitted with
+ * fs_submit(). The file system is mounted and unmounted synchronously, before
+ * starting and after stopping the pool.
+ *
+ * Return: -1 if @workers is not between 1 and 64, if the pool is already
+ * running, or if it cannot be started. 0 otherwise.
+ */
+int fs_async_start(int workers);
+
+/**
+ * fs_async_stop - Stop the asynchronous operation workers
+ *
+ * Wait for all the submitted operations to complete, and stop the worker
+ * threads. Completed operations not reaped yet can still be collected with
+ * fs_poll() or fs_wait().
+ *
+ * Return: -1 if the pool is not running. 0 otherwise.
+ */
+int fs_async_stop(void);
+
+/**
+ * fs_submit - Submit an asynchronous operation
+ * @op: Operation to run
+ *
+ * Queue operation @op for a worker, and return without waiting for it. @op and
+ * its buffer belong to the worker pool until @op is handed back by fs_poll() or
+ * fs_wait(), with its return value in @op->result.
+ *
+ * Operations on the same file, whether they name it (%FS_OP_CREATE,
+ * %FS_OP_DELETE and %FS_OP_OPEN) or one of its open file descriptors, run in
+ * the order they were submitted. A %FS_OP_SYNC operation runs once all the
+ * operations submitted before it have run. Other operations may run
+ * concurrently and complete in any order.
+ *
+ * Return: -1 if @op is NULL or if the pool is not running. 0 otherwise.
+ */
+int fs_submit(struct fs_op *op);
+
+/**
+ * fs_poll - Collect completed asynchronous operations
+ * @ops: Array to be filled with completed operations
+ * @max: Size of @ops
+ *
+ * Collect up to @max completed operations, in completion order, without
+ * blocking.
+ *
+ * Return: -1 if @ops is NULL or @max is smaller than 1. Otherwise return the
+ * number of operations stored in @ops, which can be 0.
+ */
+int fs_poll(struct fs_op **ops, int max);
+
+/**
+ * fs_wait - Wait for completed asynchronous operations
+ * @ops: Array to be filled with completed operations
+ * @max: Size of @ops
+ *
+ * Same as fs_poll(), except that it blocks until at least one operation has
+ * completed, if any operation submitted is still running or queued. Stopping
+ * the pool with fs_async_stop() runs all of them first.
+ *
+ * Return: -1 if @ops is NULL or if @max is smaller than 1. Otherwise return the
+ * number of operations stored in @ops, which is 0 only if no operation was left
+ * to wait for.
+ */
+int fs_wait(struct fs_op **ops, int max);
+
+/**
+ * fs_async_eventfd - Get the completion notification descriptor
+ *
+ * Get an eventfd descriptor that becomes readable whenever operations complete,
+ * so that an event loop can wait for completions along with its other
+ * descriptors. Its 8-byte counter should be read to clear it before collecting
+ * the completed operations with fs_poll().
+ *
+ * Return: -1 if the pool is not running. Otherwise return the descriptor.
+ */
+int fs_async_eventfd(void);
+
+/**
+ * fs_trace_start - Start tracing file-system calls
+ * @path: Name of the trace file
+ *
+ * Record every call to fs_mount(), fs_umount(), fs_sync(), the file, snapshot
+ * and setting functions, and the read, write and seek functions, with their
+ * arguments, return value, start time and duration, in the binary trace file
+ * @path (see trace.h). Data is not recorded. Calls run by the asynchronous
+ * workers are recorded too. Setting the FS_TRACE environment variable to a
+ * file name traces a program from its first call until it exits.
+ *
+ * Return: -1 if @path is NULL, if tracing is already on, or if @path cannot be
+ * created. 0 otherwise.
+ */
+int fs_trace_start(const char *path);
+
+/**
+ * fs_trace_stop - Stop tracing file-system calls
+ *
+ * Return: -1 if tracing is off, or if the trace file cannot be written. 0
+ * otherwise.
+ */
+int fs_trace_stop(void);
+
+/**
+ * fs_trace_dump - Write the events recorded by the trace points
+ * @path: Name of the JSON file to write
+ *
+ * When libfs is built with its trace points (`make TP=1`, see tracepoint.h),
+ * every thread records the begin and end of the file-system calls it runs in a
+ * ring buffer keeping its latest events. With `make TP=2`, it also records the
+ * block reads and writes, block allocations and FAT chain walks of these calls,
+ * at a higher cost. Write these events in the Chrome trace
+ * event format, for chrome://tracing or Perfetto to show them on a timeline.
+ * Threads keep recording during the dump. Setting the FS_TRACEPOINTS
+ * environment variable to a file name dumps the events when the program
+ * exits.
+ *
+ * Return: -1 if libfs is built without trace points, if @path is NULL, or if
+ * @path cannot be written. 0 otherwise.
+ */
+int fs_trace_dump(const char *path);
+
 #endif /* _FS_H */
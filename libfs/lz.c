@@ -0,0 +1,175 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/*
+ * Compressed format: a list of sequences, each made of a token byte, literal
+ * bytes, a 2-byte little-endian offset and a match length. The high nibble of
+ * the token is the number of literals and the low nibble the match length
+ * minus LZ_MIN_MATCH; a nibble of 15 is continued by extra bytes added to it,
+ * up to the first one below 255. The last sequence only has literals.
+ */
+
+/* Shortest match worth encoding */
+#define LZ_MIN_MATCH 4
+/* Farthest match the offset can encode */
+#define LZ_MAX_OFFSET 65535
+/* Size of the hash table of recent positions */
+#define LZ_HASH_BITS 12
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static unsigned int lz_hash(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/* Write the extra bytes of a length whose nibble was 15 */
+static uint8_t *put_length(uint8_t *op, uint8_t *oend, size_t len)
+{
+	for (; len >= 255; len -= 255) {
+		if (op == oend)
+			return NULL;
+		*op++ = 255;
+	}
+	if (op == oend)
+		return NULL;
+	*op++ = len;
+	return op;
+}
+
+/* Read the extra bytes of a length whose nibble was 15 */
+static const uint8_t *get_length(const uint8_t *ip, const uint8_t *iend,
+				 size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (ip == iend)
+			return NULL;
+		b = *ip++;
+		*len += b;
+	} while (b == 255);
+	return ip;
+}
+
+/* Write a sequence; @match is 0 for the final, literals-only sequence */
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend,
+			     const uint8_t *lit, size_t nlit,
+			     size_t offset, size_t match)
+{
+	uint8_t *token = op;
+	size_t mcode = match ? match - LZ_MIN_MATCH : 0;
+
+	if (op == oend)
+		return NULL;
+	op++;
+	*token = (nlit < 15 ? nlit : 15) << 4 | (mcode < 15 ? mcode : 15);
+
+	if (nlit >= 15 && !(op = put_length(op, oend, nlit - 15)))
+		return NULL;
+	if ((size_t)(oend - op) < nlit)
+		return NULL;
+	memcpy(op, lit, nlit);
+	op += nlit;
+
+	if (!match)
+		return op;
+	if (oend - op < 2)
+		return NULL;
+	*op++ = offset & 0xff;
+	*op++ = offset >> 8;
+	if (mcode >= 15 && !(op = put_length(op, oend, mcode - 15)))
+		return NULL;
+	return op;
+}
+
+int lz_compress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *base = src;
+	const uint8_t *ip = base, *anchor = base, *iend = base + len;
+	uint8_t *op = dst, *oend = op + cap;
+	uint32_t table[1 << LZ_HASH_BITS];
+
+	memset(table, 0, sizeof(table));
+	while (iend - ip >= LZ_MIN_MATCH) {
+		uint32_t seq = read32(ip);
+		unsigned int h = lz_hash(seq);
+		const uint8_t *ref = base + table[h];
+		const uint8_t *mp;
+
+		table[h] = ip - base;
+		if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != seq) {
+			ip++;
+			continue;
+		}
+
+		mp = ip + LZ_MIN_MATCH;
+		while (mp < iend && *mp == ref[mp - ip])
+			mp++;
+
+		op = put_sequence(op, oend, anchor, ip - anchor, ip - ref,
+				  mp - ip);
+		if (!op)
+			return -1;
+		ip = anchor = mp;
+	}
+
+	op = put_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	if (!op)
+		return -1;
+	return op - (uint8_t *)dst;
+}
+
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap)
+{
+	const uint8_t *ip = src, *iend = ip + len;
+	uint8_t *base = dst, *op = base, *oend = base + cap;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t nlit = token >> 4;
+		size_t match = token & 15;
+		size_t offset;
+
+		if (nlit == 15 && !(ip = get_length(ip, iend, &nlit)))
+			return -1;
+		if ((size_t)(iend - ip) < nlit || (size_t)(oend - op) < nlit)
+			return -1;
+		memcpy(op, ip, nlit);
+		op += nlit;
+		ip += nlit;
+
+		/* The last sequence ends with its literals */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (match == 15 && !(ip = get_length(ip, iend, &match)))
+			return -1;
+		match += LZ_MIN_MATCH;
+		if (offset == 0 || offset > (size_t)(op - base) ||
+		    match > (size_t)(oend - op))
+			return -1;
+
+		/* Byte by byte when the match overlaps its own output */
+		if (offset >= match) {
+			memcpy(op, op - offset, match);
+			op += match;
+		} else {
+			for (; match > 0; match--, op++)
+				*op = op[-offset];
+		}
+	}
+	return op - base;
+}
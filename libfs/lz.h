@@ -0,0 +1,33 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h> /* for size_t definition */
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @len: Size of @src (in bytes)
+ * @dst: Buffer receiving the compressed data
+ * @cap: Size of @dst (in bytes)
+ *
+ * Compress @len bytes of @src into @dst with a byte-oriented LZ77 codec: a
+ * sequence of literal runs, each followed by a copy of earlier data.
+ *
+ * Return: -1 if the compressed data does not fit in @cap bytes. Otherwise
+ * return the size of the compressed data.
+ */
+int lz_compress(const void *src, size_t len, void *dst, size_t cap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Data compressed with lz_compress()
+ * @len: Size of @src (in bytes)
+ * @dst: Buffer receiving the decompressed data
+ * @cap: Size of @dst (in bytes)
+ *
+ * Return: -1 if @src is corrupted, or if the decompressed data does not fit in
+ * @cap bytes. Otherwise return the size of the decompressed data.
+ */
+int lz_decompress(const void *src, size_t len, void *dst, size_t cap);
+
+#endif /* _LZ_H */
@@ -0,0 +1,112 @@
+#ifndef _PROTOCOL_H
+#define _PROTOCOL_H
+
+#include <stdint.h>
+
+#include "fs.h"
+
+/*
+ * File system server protocol, over a Unix domain stream socket (see client.h
+ * and apps/server_fs.c). A client sends requests, each a struct fs_request
+ * followed by @name_len bytes of names and, for writes, @count bytes of data.
+ * The server answers every request, in the order they were sent, with a struct
+ * fs_response followed by @length bytes of data. A client can send several
+ * requests before reading their responses, and the server runs the requests
+ * that arrive together as a batch, replying to all of them at once. Integers
+ * are in host byte order.
+ *
+ * The first request must be %FS_REQ_HELLO. If the client asks for it, the
+ * server attaches read-only descriptors of the virtual disk file and of the
+ * file generation table (see fs_generation_fd()) to the response (SCM_RIGHTS),
+ * for the client to map them: the data of %FS_REQ_PREAD_SHARED responses is
+ * then made of a struct fs_view_stamp and extents of the mapping instead of
+ * copies of the file content, except for files that cannot be viewed, whose
+ * responses have no extents. The blocks of the extents may be reused once the
+ * response is sent: a client copying them must check the generation of the
+ * stamp afterwards, and read the data again with %FS_REQ_PREAD if it changed.
+ */
+
+/** Protocol version */
+#define FS_PROTOCOL_VERSION 2
+
+/** Largest number of bytes read or written by a request */
+#define FS_PROTOCOL_MAX_DATA (1024 * 1024)
+
+/** Largest size of the names of a request */
+#define FS_PROTOCOL_MAX_NAMES (2 * FS_FILENAME_LEN)
+
+/** Requests */
+enum {
+	FS_REQ_HELLO,		/* version = count, shared mapping = offset */
+	FS_REQ_SYNC,		/* fs_sync() */
+	FS_REQ_DEDUP,		/* fs_dedup(enable = count) */
+	FS_REQ_CHECKSUM,	/* fs_checksum(enable = count) */
+	FS_REQ_SNAPSHOT,	/* fs_snapshot(name) */
+	FS_REQ_SNAPSHOT_DELETE,	/* fs_snapshot_delete(name) */
+	FS_REQ_CREATE,		/* fs_create(name) */
+	FS_REQ_DELETE,		/* fs_delete(name) */
+	FS_REQ_COPY,		/* fs_copy(name, name, reflink = count) */
+	FS_REQ_COMPRESS,	/* fs_compress(name, enable = count) */
+	FS_REQ_READDIR,		/* fs_readdir() from position = offset */
+	FS_REQ_OPEN,		/* fs_open(name) */
+	FS_REQ_CLOSE,		/* fs_close(fd) */
+	FS_REQ_STAT,		/* fs_stat(fd) */
+	FS_REQ_LSEEK,		/* fs_lseek(fd, offset) */
+	FS_REQ_READ,		/* fs_read(fd, count) */
+	FS_REQ_WRITE,		/* fs_write(fd, count) */
+	FS_REQ_PREAD,		/* fs_pread(fd, count, offset) */
+	FS_REQ_PWRITE,		/* fs_pwrite(fd, count, offset) */
+	FS_REQ_PREAD_SHARED,	/* fs_pread(fd, count, offset), as extents */
+	FS_REQ_COUNT,
+};
+
+/** Request */
+struct fs_request {
+	uint64_t offset;	/* File offset, or argument */
+	uint32_t count;		/* Number of bytes, or flag argument */
+	int32_t fd;		/* File descriptor, or -1 */
+	uint8_t op;		/* Request (FS_REQ_*) */
+	uint8_t name_len;	/* Size of the names following the request: a
+				 * single NULL-terminated one, or the source and
+				 * destination of fs_copy() */
+	uint16_t reserved;
+	uint32_t reserved2;
+};
+
+/** Response */
+struct fs_response {
+	int32_t result;		/* Return value of the call */
+	uint32_t length;	/* Number of data bytes following the response */
+	uint32_t extents;	/* Number of struct fs_extent after the struct
+				 * fs_view_stamp at the start of the data, for
+				 * %FS_REQ_PREAD_SHARED */
+	uint32_t reserved;
+};
+
+/** Start of the data of a %FS_REQ_PREAD_SHARED response with extents */
+struct fs_view_stamp {
+	uint64_t generation;	/* Generation of the file before it was viewed */
+	uint32_t slot;		/* Index of the file's generation in the table */
+	uint32_t reserved;
+};
+
+/** Extent value of data sent inline, after the extents */
+#define FS_EXTENT_INLINE UINT64_MAX
+
+/** Part of the data of a %FS_REQ_PREAD_SHARED response */
+struct fs_extent {
+	uint64_t offset;	/* Offset in the virtual disk file, or
+				 * FS_EXTENT_INLINE */
+	uint64_t length;	/* Number of bytes */
+};
+
+/** Data of a %FS_REQ_READDIR response with a result of 1 */
+struct fs_wire_dirent {
+	char name[FS_FILENAME_LEN];
+	uint64_t size;
+	int32_t first_block;
+	int32_t extent_count;
+	uint64_t next;		/* Position of the next entry */
+};
+
+#endif /* _PROTOCOL_H */
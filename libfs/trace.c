@@ -0,0 +1,168 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fs.h"
+#include "trace.h"
+
+#define trace_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Size of the stdio buffer of the trace file */
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+/* Trace state (not tracing by default) */
+static struct {
+	int on;
+	FILE *file;
+	char *buffer;
+	uint64_t start;
+} trace;
+
+/* Serializes the records, and fs_trace_start() and fs_trace_stop() */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t env_once = PTHREAD_ONCE_INIT;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void stop_at_exit(void)
+{
+	fs_trace_stop();
+}
+
+/* Start tracing to the file named by FS_TRACE, until the program exits */
+static void trace_env(void)
+{
+	const char *path = getenv("FS_TRACE");
+
+	if (!path || !*path)
+		return;
+	if (fs_trace_start(path)) {
+		trace_error("cannot trace to '%s'", path);
+		return;
+	}
+	atexit(stop_at_exit);
+}
+
+int fs_trace_start(const char *path)
+{
+	struct fs_trace_header header = {
+		.magic = FS_TRACE_MAGIC,
+		.version = FS_TRACE_VERSION,
+		.record_size = sizeof(struct fs_trace_record),
+	};
+	int ret = -1;
+
+	if (!path)
+		return -1;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace.file)
+		goto out;
+
+	trace.file = fopen(path, "w");
+	if (!trace.file)
+		goto out;
+	trace.buffer = malloc(TRACE_BUFFER_SIZE);
+	if (trace.buffer)
+		setvbuf(trace.file, trace.buffer, _IOFBF, TRACE_BUFFER_SIZE);
+
+	header.start_time = clock_ns(CLOCK_REALTIME);
+	if (fwrite(&header, sizeof(header), 1, trace.file) != 1) {
+		fclose(trace.file);
+		free(trace.buffer);
+		trace.file = NULL;
+		goto out;
+	}
+
+	trace.start = clock_ns(CLOCK_MONOTONIC);
+	__atomic_store_n(&trace.on, 1, __ATOMIC_RELEASE);
+	ret = 0;
+out:
+	pthread_mutex_unlock(&trace_lock);
+	return ret;
+}
+
+int fs_trace_stop(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&trace_lock);
+	if (!trace.file) {
+		pthread_mutex_unlock(&trace_lock);
+		return -1;
+	}
+
+	__atomic_store_n(&trace.on, 0, __ATOMIC_RELEASE);
+	if (fclose(trace.file))
+		ret = -1;
+	free(trace.buffer);
+	trace.file = NULL;
+	trace.buffer = NULL;
+	pthread_mutex_unlock(&trace_lock);
+
+	return ret;
+}
+
+uint64_t trace_begin(void)
+{
+	pthread_once(&env_once, trace_env);
+
+	if (!__atomic_load_n(&trace.on, __ATOMIC_ACQUIRE))
+		return 0;
+	return clock_ns(CLOCK_MONOTONIC);
+}
+
+void trace_end(uint64_t start, int op, int fd, size_t offset, size_t count,
+	       const char *name, const char *name2, int result)
+{
+	struct fs_trace_record rec;
+	size_t len = 0, len2 = 0;
+	uint64_t end;
+
+	if (!start)
+		return;
+	end = clock_ns(CLOCK_MONOTONIC);
+
+	/* Names too long to be valid are cut, the call failed anyway */
+	if (name)
+		len = strnlen(name, FS_FILENAME_LEN);
+	if (name2)
+		len2 = strnlen(name2, FS_FILENAME_LEN) + 1;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.duration = end - start > UINT32_MAX ? UINT32_MAX : end - start;
+	rec.result = result;
+	rec.offset = offset;
+	rec.count = count > UINT32_MAX ? UINT32_MAX : count;
+	rec.fd = fd;
+	rec.op = op;
+	rec.name_len = len + len2;
+
+	pthread_mutex_lock(&trace_lock);
+	/* Tracing may have stopped, or restarted, during the call */
+	if (trace.file && start >= trace.start) {
+		rec.start = start - trace.start;
+		fwrite(&rec, sizeof(rec), 1, trace.file);
+		if (len)
+			fwrite(name, 1, len, trace.file);
+		if (len2) {
+			fputc('\0', trace.file);
+			fwrite(name2, 1, len2 - 1, trace.file);
+		}
+		/* Flush on unmount, so that a program exiting without stopping
+		 * the trace loses at most its last mount */
+		if (op == FS_TRACE_UMOUNT)
+			fflush(trace.file);
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
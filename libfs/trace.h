@@ -0,0 +1,96 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/*
+ * Trace file format: a struct fs_trace_header, then one struct
+ * fs_trace_record per call in the order the calls returned, each followed by
+ * @name_len bytes of file names. Integers are in host byte order.
+ */
+
+/** Trace file magic number ("FSTR") */
+#define FS_TRACE_MAGIC 0x52545346
+
+/** Trace file format version */
+#define FS_TRACE_VERSION 1
+
+/** Traced calls */
+enum {
+	FS_TRACE_MOUNT,			/* fs_mount() */
+	FS_TRACE_UMOUNT,		/* fs_umount() */
+	FS_TRACE_SYNC,			/* fs_sync() */
+	FS_TRACE_CREATE,		/* fs_create(name) */
+	FS_TRACE_DELETE,		/* fs_delete(name) */
+	FS_TRACE_OPEN,			/* fs_open(name) */
+	FS_TRACE_CLOSE,			/* fs_close(fd) */
+	FS_TRACE_STAT,			/* fs_stat(fd) */
+	FS_TRACE_LSEEK,			/* fs_lseek(fd, offset) */
+	FS_TRACE_READ,			/* fs_read(fd, count) at offset */
+	FS_TRACE_WRITE,			/* fs_write(fd, count) at offset */
+	FS_TRACE_PREAD,			/* fs_pread(fd, count, offset) */
+	FS_TRACE_PWRITE,		/* fs_pwrite(fd, count, offset) */
+	FS_TRACE_READV,			/* fs_readv(fd, count) at offset */
+	FS_TRACE_WRITEV,		/* fs_writev(fd, count) at offset */
+	FS_TRACE_COPY,			/* fs_copy(name, reflink = count) */
+	FS_TRACE_COMPRESS,		/* fs_compress(name, enable = count) */
+	FS_TRACE_DEDUP,			/* fs_dedup(enable = count) */
+	FS_TRACE_CHECKSUM,		/* fs_checksum(enable = count) */
+	FS_TRACE_SNAPSHOT,		/* fs_snapshot(name) */
+	FS_TRACE_SNAPSHOT_DELETE,	/* fs_snapshot_delete(name) */
+	FS_TRACE_MOUNT_SNAPSHOT,	/* fs_mount_snapshot(name) */
+	FS_TRACE_SENDFILE,		/* fs_sendfile(fd, count, offset) */
+	FS_TRACE_OP_COUNT,
+};
+
+/** Trace file header */
+struct fs_trace_header {
+	uint32_t magic;		/* FS_TRACE_MAGIC */
+	uint16_t version;	/* FS_TRACE_VERSION */
+	uint16_t record_size;	/* sizeof(struct fs_trace_record) */
+	uint64_t start_time;	/* Start of the trace (ns since the Epoch) */
+};
+
+/** Traced call */
+struct fs_trace_record {
+	uint64_t start;		/* Call time (ns since the start of the trace) */
+	uint32_t duration;	/* Call duration (ns) */
+	int32_t result;		/* Return value */
+	uint64_t offset;	/* File offset, if any */
+	uint32_t count;		/* Number of bytes, or flag argument */
+	int16_t fd;		/* File descriptor, or -1 */
+	uint8_t op;		/* Traced call (FS_TRACE_*) */
+	uint8_t name_len;	/* Size of the names following the record: a
+				 * single one, or the source and destination
+				 * of fs_copy() separated by a NULL character */
+};
+
+/**
+ * trace_begin - Start timing a call
+ *
+ * Tracing starts on the first call if the FS_TRACE environment variable names
+ * a trace file.
+ *
+ * Return: The start time of the call to give to trace_end(), or 0 if tracing
+ * is off.
+ */
+uint64_t trace_begin(void);
+
+/**
+ * trace_end - Record a call
+ * @start: Return value of trace_begin() for the call
+ * @op: Traced call (FS_TRACE_*)
+ * @fd: File descriptor, or -1
+ * @offset: File offset
+ * @count: Number of bytes, or flag argument
+ * @name: File or snapshot name, or NULL
+ * @name2: Second file name, or NULL
+ * @result: Return value of the call
+ *
+ * Do nothing if @start is 0.
+ */
+void trace_end(uint64_t start, int op, int fd, size_t offset, size_t count,
+	       const char *name, const char *name2, int result);
+
+#endif /* _TRACE_H */
@@ -0,0 +1,302 @@
+#include "fs.h"
+#include "tracepoint.h"
+
+#ifndef FS_TRACEPOINTS
+
+int fs_trace_dump(const char *path)
+{
+	return -1;
+}
+
+#else
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define tp_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+#if TP_RING_EVENTS & (TP_RING_EVENTS - 1)
+#error "TP_RING_EVENTS must be a power of two"
+#endif
+
+/*
+ * Event, written by its thread while fs_trace_dump() may be copying it: every
+ * field is accessed atomically, and the copies of the events overwritten
+ * meanwhile are dropped (see ring_copy())
+ */
+struct tp_event {
+	uint64_t time;		/* ticks() */
+	const struct tp_point *point;
+	int64_t arg;
+	uint64_t phase;
+};
+
+/*
+ * Ring buffer of a thread. Rings are never freed: the ring of a thread that
+ * exits is taken over by the next thread to record an event, its older events
+ * remaining under the previous thread id until overwritten.
+ */
+struct tp_ring {
+	struct tp_ring *next;
+	int used;
+	int tid;
+	uint64_t head;		/* Number of events ever recorded */
+	uint64_t start;		/* Value of @head when the ring was taken */
+	struct tp_event events[TP_RING_EVENTS];
+};
+
+/* All rings, pushed without a lock and never removed */
+static struct tp_ring *rings;
+static __thread struct tp_ring *ring;
+
+static pthread_once_t tp_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+
+/* Clock and tick counter when the first ring was taken */
+static uint64_t start_ns, start_ticks;
+
+static uint64_t clock_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Event timestamp. On x86, the time stamp counter is read directly, which costs
+ * about half of clock_gettime(), and converted to nanoseconds when dumping. It
+ * runs at a constant rate, synchronized across cores, on any recent processor.
+ */
+static uint64_t ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return clock_ns();
+#endif
+}
+
+static void ring_put(void *arg)
+{
+	struct tp_ring *r = arg;
+
+	__atomic_store_n(&r->used, 0, __ATOMIC_RELEASE);
+}
+
+static void dump_at_exit(void)
+{
+	const char *path = getenv("FS_TRACEPOINTS");
+
+	if (fs_trace_dump(path))
+		tp_error("cannot dump to '%s'", path);
+}
+
+/* Dump to the file named by FS_TRACEPOINTS when the program exits */
+static void tp_init(void)
+{
+	const char *path = getenv("FS_TRACEPOINTS");
+
+	start_ns = clock_ns();
+	start_ticks = ticks();
+	pthread_key_create(&ring_key, ring_put);
+	if (path && *path)
+		atexit(dump_at_exit);
+}
+
+static struct tp_ring *ring_get(void)
+{
+	struct tp_ring *r;
+	int unused;
+
+	pthread_once(&tp_once, tp_init);
+
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+		unused = 0;
+		if (__atomic_compare_exchange_n(&r->used, &unused, 1, 0,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			break;
+	}
+
+	if (!r) {
+		r = calloc(1, sizeof(*r));
+		if (!r)
+			return NULL;
+		r->used = 1;
+		r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&rings, &r->next, r, 1,
+						    __ATOMIC_RELEASE,
+						    __ATOMIC_RELAXED))
+			;
+	}
+
+	__atomic_store_n(&r->tid, (int)syscall(SYS_gettid), __ATOMIC_RELAXED);
+	__atomic_store_n(&r->start, __atomic_load_n(&r->head, __ATOMIC_RELAXED),
+			 __ATOMIC_RELEASE);
+	pthread_setspecific(ring_key, r);
+	return r;
+}
+
+void tp_record(const struct tp_point *point, int phase, int64_t arg)
+{
+	struct tp_ring *r = ring;
+	struct tp_event *e;
+	uint64_t head;
+
+	if (!r) {
+		r = ring = ring_get();
+		if (!r)
+			return;
+	}
+
+	/* Only this thread writes @head */
+	head = __atomic_load_n(&r->head, __ATOMIC_RELAXED);
+	e = &r->events[head & (TP_RING_EVENTS - 1)];
+	__atomic_store_n(&e->time, ticks(), __ATOMIC_RELAXED);
+	__atomic_store_n(&e->point, point, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->arg, arg, __ATOMIC_RELAXED);
+	__atomic_store_n(&e->phase, phase, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+}
+
+const struct tp_point *tp_scope_begin(const struct tp_point *point,
+				      int64_t arg)
+{
+	tp_record(point, 'B', arg);
+	return point;
+}
+
+void tp_scope_end(const struct tp_point *const *scope)
+{
+	if (*scope)
+		tp_record(*scope, 'E', 0);
+}
+
+/*
+ * Copy the events of @r into @events, oldest first, and return their number.
+ * The thread of @r keeps recording meanwhile: after the copy, the events that
+ * it may have overwritten, up to the one it may be writing, are dropped.
+ */
+static size_t ring_copy(struct tp_ring *r, struct tp_event *events, int *tid)
+{
+	uint64_t head, first, start, i;
+	struct tp_event *e;
+
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	start = __atomic_load_n(&r->start, __ATOMIC_ACQUIRE);
+	*tid = __atomic_load_n(&r->tid, __ATOMIC_RELAXED);
+	first = head > TP_RING_EVENTS ? head - TP_RING_EVENTS : 0;
+	if (first < start)
+		first = start;
+
+	for (i = first; i < head; i++) {
+		e = &r->events[i & (TP_RING_EVENTS - 1)];
+		events[i - first].time = __atomic_load_n(&e->time,
+							 __ATOMIC_RELAXED);
+		events[i - first].point = __atomic_load_n(&e->point,
+							  __ATOMIC_RELAXED);
+		events[i - first].arg = __atomic_load_n(&e->arg,
+							__ATOMIC_RELAXED);
+		events[i - first].phase = __atomic_load_n(&e->phase,
+							  __ATOMIC_RELAXED);
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	i = __atomic_load_n(&r->head, __ATOMIC_RELAXED) + 1;
+	if (i > first + TP_RING_EVENTS) {
+		i -= TP_RING_EVENTS;
+		if (i >= head)
+			return 0;
+		memmove(events, events + (i - first),
+			(head - i) * sizeof(*events));
+		first = i;
+	}
+	return head - first;
+}
+
+static int ring_dump(FILE *file, struct tp_event *events, size_t count,
+		     int tid, double ns_per_tick, int *comma)
+{
+	struct tp_event *e;
+	size_t depth = 0;
+	uint64_t time;
+
+	for (e = events; e < events + count; e++) {
+		/* Spans begun before the oldest event kept have no begin */
+		if (e->phase == 'E') {
+			if (!depth)
+				continue;
+			depth--;
+		} else if (e->phase == 'B') {
+			depth++;
+		}
+
+		time = e->time > start_ticks ?
+		       (e->time - start_ticks) * ns_per_tick : 0;
+		fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"%s\","
+			"\"ph\":\"%c\",\"ts\":%lu.%03lu,\"pid\":%d,\"tid\":%d",
+			*comma ? "," : "", e->point->name, e->point->category,
+			(int)e->phase, (unsigned long)(time / 1000),
+			(unsigned long)(time % 1000), (int)getpid(), tid);
+		if (e->phase == 'B')
+			fprintf(file, ",\"args\":{\"arg\":%lld}",
+				(long long)e->arg);
+		fputc('}', file);
+		*comma = 1;
+	}
+
+	return ferror(file) ? -1 : 0;
+}
+
+int fs_trace_dump(const char *path)
+{
+	struct tp_event *events;
+	struct tp_ring *r;
+	double ns_per_tick = 1;
+	uint64_t now_ticks;
+	FILE *file;
+	size_t count;
+	int comma = 0, tid, ret = 0;
+
+	if (!path)
+		return -1;
+
+	events = malloc(TP_RING_EVENTS * sizeof(*events));
+	if (!events)
+		return -1;
+	file = fopen(path, "w");
+	if (!file) {
+		free(events);
+		return -1;
+	}
+
+	/* Rings, and the start of the clock with them, may not exist yet */
+	r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	now_ticks = ticks();
+	if (r && now_ticks > start_ticks)
+		ns_per_tick = (double)(clock_ns() - start_ns) /
+			      (now_ticks - start_ticks);
+
+	fputs("{\"displayTimeUnit\":\"ns\",\"traceEvents\":[", file);
+	for (; r; r = r->next) {
+		count = ring_copy(r, events, &tid);
+		if (ring_dump(file, events, count, tid, ns_per_tick, &comma))
+			ret = -1;
+	}
+	fputs("\n]}\n", file);
+
+	if (fclose(file))
+		ret = -1;
+	free(events);
+	return ret;
+}
+
+#endif /* FS_TRACEPOINTS */
@@ -0,0 +1,88 @@
+#ifndef _TRACEPOINT_H
+#define _TRACEPOINT_H
+
+#include <stddef.h> /* for NULL definition */
+#include <stdint.h>
+
+/*
+ * Trace points: spans of work of libfs (file system calls, block I/O,
+ * allocations and chain walks) recorded as begin and end events in a ring
+ * buffer per thread, for fs_trace_dump() to write them in the Chrome trace
+ * event format. Unlike the call tracing of trace.h, which is always built in,
+ * they are only compiled in with -DFS_TRACEPOINTS (`make TP=1`), and cost
+ * nothing otherwise. That level only records the file system calls; the spans
+ * inside them, several per call, are also compiled in with
+ * -DFS_TRACEPOINTS_DETAIL (`make TP=2`).
+ */
+
+/** Number of events kept per thread, the oldest ones being overwritten */
+#ifndef TP_RING_EVENTS
+#define TP_RING_EVENTS 16384
+#endif
+
+/** Trace point, a static descriptor shared by all its events */
+struct tp_point {
+	const char *category;	/* "op", "io", "alloc" or "chain" */
+	const char *name;
+};
+
+/**
+ * tp_record - Record an event in the calling thread's ring buffer
+ * @point: Trace point
+ * @phase: 'B' for the begin of a span, 'E' for its end
+ * @arg: Argument shown with the event
+ */
+void tp_record(const struct tp_point *point, int phase, int64_t arg);
+
+/**
+ * tp_scope_begin - Record the begin of a span
+ * @point: Trace point
+ * @arg: Argument shown with the span
+ *
+ * Return: @point, for tp_scope_end().
+ */
+const struct tp_point *tp_scope_begin(const struct tp_point *point,
+				      int64_t arg);
+
+/**
+ * tp_scope_end - Record the end of a span
+ * @scope: Pointer to the trace point returned by tp_scope_begin(), or to NULL
+ * to record nothing
+ */
+void tp_scope_end(const struct tp_point *const *scope);
+
+#ifdef FS_TRACEPOINTS
+/*
+ * Record a span from here to the end of the enclosing block, whichever way the
+ * block is left. At most one per block.
+ */
+#define TP_SCOPE(category, name, arg)					\
+	TP_SCOPE_IF(1, category, name, arg)
+
+/* Same as TP_SCOPE(), if @cond is true, for spans that are mostly trivial */
+#define TP_SCOPE_IF(cond, category, name, arg)				\
+	static const struct tp_point tp_point__ = { category, name };	\
+	const struct tp_point *const tp_scope__				\
+	__attribute__((cleanup(tp_scope_end), unused)) =		\
+	(cond) ? tp_scope_begin(&tp_point__, arg) : NULL
+#else
+#define TP_SCOPE(category, name, arg)					\
+	do { } while (0)
+#define TP_SCOPE_IF(cond, category, name, arg)				\
+	do { } while (0)
+#endif
+
+#if defined(FS_TRACEPOINTS) && defined(FS_TRACEPOINTS_DETAIL)
+/* Same as TP_SCOPE() and TP_SCOPE_IF(), for spans inside file system calls */
+#define TP_DETAIL(category, name, arg)					\
+	TP_SCOPE(category, name, arg)
+#define TP_DETAIL_IF(cond, category, name, arg)				\
+	TP_SCOPE_IF(cond, category, name, arg)
+#else
+#define TP_DETAIL(category, name, arg)					\
+	do { } while (0)
+#define TP_DETAIL_IF(cond, category, name, arg)				\
+	do { } while (0)
+#endif
+
+#endif /* _TRACEPOINT_H */